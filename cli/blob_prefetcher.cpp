@@ -0,0 +1,196 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "blob_prefetcher.hpp"
+#include <assert.h>
+#include <utility>
+
+namespace Fossilize
+{
+BlobPrefetcher::BlobPrefetcher(DatabaseInterface *db_)
+	: db(db_)
+{
+}
+
+BlobPrefetcher::~BlobPrefetcher()
+{
+	stop();
+}
+
+bool BlobPrefetcher::start(unsigned num_threads, unsigned look_ahead_,
+                           void (*on_thread)(void *), void *on_thread_userdata)
+{
+	if (num_threads == 0 || !threads.empty())
+		return false;
+
+	look_ahead = look_ahead_ ? look_ahead_ : 1;
+	stopping = false;
+
+	for (unsigned i = 0; i < num_threads; i++)
+		threads.emplace_back(&BlobPrefetcher::thread_main, this, on_thread, on_thread_userdata);
+	return true;
+}
+
+void BlobPrefetcher::stop()
+{
+	{
+		std::lock_guard<std::mutex> holder(lock);
+		stopping = true;
+		decode_cond.notify_all();
+	}
+
+	for (auto &thread : threads)
+		if (thread.joinable())
+			thread.join();
+	threads.clear();
+}
+
+uint64_t BlobPrefetcher::submit(ResourceTag tag, Hash hash)
+{
+	std::lock_guard<std::mutex> holder(lock);
+	slots.push_back({ tag, hash, SlotState::Queued, {} });
+	decode_cond.notify_one();
+	return base_ticket + slots.size() - 1;
+}
+
+bool BlobPrefetcher::read_blob(ResourceTag tag, Hash hash, std::vector<uint8_t> &blob) const
+{
+	size_t size = 0;
+	if (!db->read_entry(tag, hash, &size, nullptr, PAYLOAD_READ_CONCURRENT_BIT))
+		return false;
+	blob.resize(size);
+	return db->read_entry(tag, hash, &size, blob.data(), PAYLOAD_READ_CONCURRENT_BIT);
+}
+
+void BlobPrefetcher::release_front_slots()
+{
+	while (!slots.empty() && slots.front().state == SlotState::Acquired)
+	{
+		slots.pop_front();
+		base_ticket++;
+	}
+
+	// Consumers may have taken blobs the prefetch threads never got to.
+	if (next_decode_ticket < base_ticket)
+		next_decode_ticket = base_ticket;
+}
+
+bool BlobPrefetcher::acquire(uint64_t ticket, std::vector<uint8_t> &blob)
+{
+	std::unique_lock<std::mutex> holder(lock);
+	assert(ticket >= base_ticket && ticket - base_ticket < slots.size());
+
+	auto &slot = slots[ticket - base_ticket];
+	if (slot.state == SlotState::Queued)
+	{
+		ResourceTag tag = slot.tag;
+		Hash hash = slot.hash;
+		slot.state = SlotState::Acquired;
+		release_front_slots();
+		holder.unlock();
+
+		missed_count.fetch_add(1, std::memory_order_relaxed);
+		return read_blob(tag, hash, blob);
+	}
+
+	if (slot.state == SlotState::Decoding)
+	{
+		waited_count.fetch_add(1, std::memory_order_relaxed);
+		ready_cond.wait(holder, [&]() -> bool {
+			auto state = slots[ticket - base_ticket].state;
+			return state == SlotState::Ready || state == SlotState::Failed;
+		});
+	}
+	else
+		prefetched_count.fetch_add(1, std::memory_order_relaxed);
+
+	// The deque may have grown while waiting.
+	auto &ready_slot = slots[ticket - base_ticket];
+	bool ret = ready_slot.state == SlotState::Ready;
+
+	std::swap(blob, ready_slot.blob);
+	if (ready_slot.blob.capacity() != 0 && free_buffers.size() < look_ahead)
+	{
+		ready_slot.blob.clear();
+		free_buffers.push_back(std::move(ready_slot.blob));
+	}
+
+	ready_slot.state = SlotState::Acquired;
+	in_flight--;
+	release_front_slots();
+	decode_cond.notify_one();
+	return ret;
+}
+
+void BlobPrefetcher::thread_main(void (*on_thread)(void *), void *on_thread_userdata)
+{
+	if (on_thread)
+		on_thread(on_thread_userdata);
+
+	std::unique_lock<std::mutex> holder(lock);
+	for (;;)
+	{
+		decode_cond.wait(holder, [&]() -> bool {
+			return stopping || (in_flight < look_ahead && next_decode_ticket - base_ticket < slots.size());
+		});
+
+		if (stopping)
+			break;
+
+		uint64_t ticket = next_decode_ticket++;
+		auto &slot = slots[ticket - base_ticket];
+		if (slot.state != SlotState::Queued)
+			continue;
+
+		slot.state = SlotState::Decoding;
+		in_flight++;
+		ResourceTag tag = slot.tag;
+		Hash hash = slot.hash;
+
+		std::vector<uint8_t> blob;
+		if (!free_buffers.empty())
+		{
+			blob = std::move(free_buffers.back());
+			free_buffers.pop_back();
+		}
+
+		holder.unlock();
+		bool ret = read_blob(tag, hash, blob);
+		holder.lock();
+
+		// Slots which are not acquired yet are never released, so the ticket is still valid.
+		auto &decoded_slot = slots[ticket - base_ticket];
+		decoded_slot.blob = std::move(blob);
+		decoded_slot.state = ret ? SlotState::Ready : SlotState::Failed;
+		ready_cond.notify_all();
+	}
+}
+
+BlobPrefetcher::Statistics BlobPrefetcher::get_statistics() const
+{
+	Statistics stats;
+	stats.prefetched = prefetched_count.load(std::memory_order_relaxed);
+	stats.waited = waited_count.load(std::memory_order_relaxed);
+	stats.missed = missed_count.load(std::memory_order_relaxed);
+	return stats;
+}
+}
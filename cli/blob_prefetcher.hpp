@@ -0,0 +1,115 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "fossilize_db.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Fossilize
+{
+// Reads and inflates blobs on a few dedicated threads, ahead of the threads which parse them.
+// Blobs are decoded in the order they are submitted, and at most look_ahead decoded blobs are held at any time.
+class BlobPrefetcher
+{
+public:
+	struct Statistics
+	{
+		// Blobs which were decoded by the prefetch threads in time.
+		uint64_t prefetched;
+		// Blobs which the consumer had to wait for while a prefetch thread was decoding them.
+		uint64_t waited;
+		// Blobs which no prefetch thread had reached yet, so the consumer decoded them itself.
+		uint64_t missed;
+	};
+
+	// The database must support PAYLOAD_READ_CONCURRENT_BIT and outlive the prefetcher.
+	explicit BlobPrefetcher(DatabaseInterface *db);
+	~BlobPrefetcher();
+	BlobPrefetcher(const BlobPrefetcher &) = delete;
+	void operator=(const BlobPrefetcher &) = delete;
+
+	// on_thread is called at the start of every prefetch thread if not nullptr.
+	// Without any prefetch threads, every blob is decoded by the consumer.
+	bool start(unsigned num_threads, unsigned look_ahead,
+	           void (*on_thread)(void *) = nullptr, void *on_thread_userdata = nullptr);
+	void stop();
+
+	// Returns a ticket which must be passed to acquire() exactly once.
+	uint64_t submit(ResourceTag tag, Hash hash);
+
+	// Swaps the decoded blob into blob. The previous contents of blob are recycled for later prefetches.
+	// If no prefetch thread has picked up the blob yet, it is read and inflated on the calling thread,
+	// rather than waiting for the prefetch threads to catch up.
+	bool acquire(uint64_t ticket, std::vector<uint8_t> &blob);
+
+	Statistics get_statistics() const;
+
+private:
+	enum class SlotState
+	{
+		Queued,
+		Decoding,
+		Ready,
+		Failed,
+		Acquired
+	};
+
+	struct Slot
+	{
+		ResourceTag tag;
+		Hash hash;
+		SlotState state;
+		std::vector<uint8_t> blob;
+	};
+
+	DatabaseInterface *db;
+	unsigned look_ahead = 0;
+	std::vector<std::thread> threads;
+
+	// Slot for ticket N lives at slots[N - base_ticket]. Acquired slots are popped from the front.
+	std::deque<Slot> slots;
+	uint64_t base_ticket = 0;
+	uint64_t next_decode_ticket = 0;
+	unsigned in_flight = 0;
+	bool stopping = false;
+
+	std::vector<std::vector<uint8_t>> free_buffers;
+
+	std::mutex lock;
+	std::condition_variable decode_cond;
+	std::condition_variable ready_cond;
+
+	std::atomic<uint64_t> prefetched_count{0};
+	std::atomic<uint64_t> waited_count{0};
+	std::atomic<uint64_t> missed_count{0};
+
+	void thread_main(void (*on_thread)(void *), void *on_thread_userdata);
+	bool read_blob(ResourceTag tag, Hash hash, std::vector<uint8_t> &blob) const;
+	void release_front_slots();
+};
+}
@@ -0,0 +1,65 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "concurrent_read_database.hpp"
+
+namespace Fossilize
+{
+ConcurrentReadDatabase::ConcurrentReadDatabase(DatabaseInterface &db_)
+	: DatabaseInterface(DatabaseMode::ReadOnly), db(db_)
+{
+}
+
+bool ConcurrentReadDatabase::prepare()
+{
+	return true;
+}
+
+bool ConcurrentReadDatabase::read_entry(ResourceTag tag, Hash hash, size_t *size, void *buffer, PayloadReadFlags flags)
+{
+	return db.read_entry(tag, hash, size, buffer, flags | PAYLOAD_READ_CONCURRENT_BIT);
+}
+
+bool ConcurrentReadDatabase::write_entry(ResourceTag, Hash, const void *, size_t, PayloadWriteFlags)
+{
+	return false;
+}
+
+bool ConcurrentReadDatabase::has_entry(ResourceTag tag, Hash hash)
+{
+	return db.has_entry(tag, hash);
+}
+
+bool ConcurrentReadDatabase::get_hash_list_for_resource_tag(ResourceTag tag, size_t *num_hashes, Hash *hashes)
+{
+	return db.get_hash_list_for_resource_tag(tag, num_hashes, hashes);
+}
+
+void ConcurrentReadDatabase::flush()
+{
+}
+
+const char *ConcurrentReadDatabase::get_db_path_for_hash(ResourceTag tag, Hash hash)
+{
+	return db.get_db_path_for_hash(tag, hash);
+}
+}
@@ -0,0 +1,305 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "cpu_topology.hpp"
+#include <algorithm>
+#include <unordered_map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+namespace Fossilize
+{
+bool parse_thread_placement(const char *str, ThreadPlacement *placement)
+{
+	if (strcmp(str, "none") == 0)
+		*placement = ThreadPlacement::None;
+	else if (strcmp(str, "core") == 0)
+		*placement = ThreadPlacement::Core;
+	else if (strcmp(str, "l3") == 0)
+		*placement = ThreadPlacement::L3;
+	else if (strcmp(str, "node") == 0)
+		*placement = ThreadPlacement::Node;
+	else
+		return false;
+
+	return true;
+}
+
+bool parse_cpu_list(const char *str, std::vector<unsigned> *cpus)
+{
+	cpus->clear();
+
+	while (*str != '\0' && *str != '\n')
+	{
+		char *end;
+		unsigned first = unsigned(strtoul(str, &end, 10));
+		if (end == str)
+			return false;
+
+		unsigned last = first;
+		if (*end == '-')
+		{
+			str = end + 1;
+			last = unsigned(strtoul(str, &end, 10));
+			if (end == str || last < first)
+				return false;
+		}
+
+		for (unsigned cpu = first; cpu <= last; cpu++)
+			cpus->push_back(cpu);
+
+		str = end;
+		if (*str == ',')
+			str++;
+		else if (*str != '\0' && *str != '\n')
+			return false;
+	}
+
+	return true;
+}
+
+#ifdef __linux__
+static bool read_line(const std::string &path, std::string *line)
+{
+	FILE *file = fopen(path.c_str(), "r");
+	if (!file)
+		return false;
+
+	char buffer[4096];
+	bool ret = fgets(buffer, sizeof(buffer), file) != nullptr;
+	fclose(file);
+
+	if (ret)
+		*line = buffer;
+	return ret;
+}
+
+static bool read_cpu_list(const std::string &path, std::vector<unsigned> *cpus)
+{
+	std::string line;
+	return read_line(path, &line) && parse_cpu_list(line.c_str(), cpus);
+}
+
+// Identifies a group of CPUs by the first CPU in it.
+static bool read_group_key(const std::string &path, unsigned *key)
+{
+	std::vector<unsigned> cpus;
+	if (!read_cpu_list(path, &cpus) || cpus.empty())
+		return false;
+	*key = cpus.front();
+	return true;
+}
+#endif
+
+// Remaps group keys to dense indices in order of first appearance.
+static void compact_topology(CPUTopology *topology)
+{
+	std::unordered_map<unsigned, unsigned> cores, l3_domains, nodes;
+	const auto remap = [](std::unordered_map<unsigned, unsigned> &map, unsigned &key) {
+		auto itr = map.find(key);
+		if (itr == map.end())
+			itr = map.insert({ key, unsigned(map.size()) }).first;
+		key = itr->second;
+	};
+
+	for (auto &cpu : topology->cpus)
+	{
+		remap(cores, cpu.core);
+		remap(l3_domains, cpu.l3_domain);
+		remap(nodes, cpu.node);
+	}
+
+	topology->num_cores = unsigned(cores.size());
+	topology->num_l3_domains = unsigned(l3_domains.size());
+	topology->num_nodes = unsigned(nodes.size());
+}
+
+bool query_cpu_topology(CPUTopology *topology, const std::string &sysfs_root)
+{
+#ifdef __linux__
+	std::string cpu_root = sysfs_root + "/cpu";
+	std::vector<unsigned> online;
+	if (!read_cpu_list(cpu_root + "/online", &online) || online.empty())
+		return false;
+
+	topology->cpus.clear();
+	for (unsigned index : online)
+	{
+		std::string cpu_path = cpu_root + "/cpu" + std::to_string(index);
+		CPUTopology::LogicalCPU cpu = { index, index, index, 0 };
+
+		read_group_key(cpu_path + "/topology/thread_siblings_list", &cpu.core);
+
+		// Fall back to the whole package if there is no L3 cache.
+		bool has_l3 = false;
+		for (unsigned cache = 0; !has_l3; cache++)
+		{
+			std::string cache_path = cpu_path + "/cache/index" + std::to_string(cache);
+			std::string level;
+			if (!read_line(cache_path + "/level", &level))
+				break;
+			if (atoi(level.c_str()) == 3)
+				has_l3 = read_group_key(cache_path + "/shared_cpu_list", &cpu.l3_domain);
+		}
+
+		if (!has_l3)
+			read_group_key(cpu_path + "/topology/core_siblings_list", &cpu.l3_domain);
+
+		topology->cpus.push_back(cpu);
+	}
+
+	// Machines without NUMA support have no node directory, which means a single node.
+	std::vector<unsigned> nodes;
+	if (read_cpu_list(sysfs_root + "/node/online", &nodes))
+	{
+		for (unsigned node : nodes)
+		{
+			std::vector<unsigned> node_cpus;
+			if (!read_cpu_list(sysfs_root + "/node/node" + std::to_string(node) + "/cpulist", &node_cpus))
+				continue;
+
+			for (auto &cpu : topology->cpus)
+				if (std::find(node_cpus.begin(), node_cpus.end(), cpu.index) != node_cpus.end())
+					cpu.node = node;
+		}
+	}
+
+	compact_topology(topology);
+	return true;
+#else
+	(void)topology;
+	(void)sysfs_root;
+	return false;
+#endif
+}
+
+void restrict_cpu_topology_to_affinity(CPUTopology *topology)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) < 0)
+		return;
+
+	auto itr = std::remove_if(topology->cpus.begin(), topology->cpus.end(), [&](const CPUTopology::LogicalCPU &cpu) {
+		return cpu.index >= CPU_SETSIZE || !CPU_ISSET(cpu.index, &set);
+	});
+	topology->cpus.erase(itr, topology->cpus.end());
+	compact_topology(topology);
+#else
+	(void)topology;
+#endif
+}
+
+std::vector<unsigned> get_placement_cpus(const CPUTopology &topology, ThreadPlacement placement, unsigned slot)
+{
+	std::vector<unsigned> cpus;
+	if (topology.cpus.empty())
+		return cpus;
+
+	switch (placement)
+	{
+	case ThreadPlacement::Core:
+	{
+		// Logical CPUs of every core, and the cores of every L3 domain.
+		std::vector<std::vector<unsigned>> core_cpus(topology.num_cores);
+		std::vector<std::vector<unsigned>> domain_cores(topology.num_l3_domains);
+		for (auto &cpu : topology.cpus)
+		{
+			if (core_cpus[cpu.core].empty())
+				domain_cores[cpu.l3_domain].push_back(cpu.core);
+			core_cpus[cpu.core].push_back(cpu.index);
+		}
+
+		// Take the first SMT thread of every core before any second thread,
+		// and go round-robin over L3 domains, so neighboring slots do not share caches.
+		std::vector<unsigned> order;
+		for (unsigned smt = 0; order.size() < topology.cpus.size(); smt++)
+		{
+			size_t max_cores = 0;
+			for (auto &cores : domain_cores)
+				max_cores = std::max(max_cores, cores.size());
+
+			for (size_t i = 0; i < max_cores; i++)
+				for (auto &cores : domain_cores)
+					if (i < cores.size() && smt < core_cpus[cores[i]].size())
+						order.push_back(core_cpus[cores[i]][smt]);
+		}
+
+		cpus.push_back(order[slot % order.size()]);
+		break;
+	}
+
+	case ThreadPlacement::L3:
+		for (auto &cpu : topology.cpus)
+			if (cpu.l3_domain == slot % topology.num_l3_domains)
+				cpus.push_back(cpu.index);
+		break;
+
+	case ThreadPlacement::Node:
+		for (auto &cpu : topology.cpus)
+			if (cpu.node == slot % topology.num_nodes)
+				cpus.push_back(cpu.index);
+		break;
+
+	default:
+		break;
+	}
+
+	return cpus;
+}
+
+bool pin_current_thread(const std::vector<unsigned> &cpus)
+{
+#ifdef __linux__
+	if (cpus.empty())
+		return false;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (unsigned cpu : cpus)
+		if (cpu < CPU_SETSIZE)
+			CPU_SET(cpu, &set);
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		return false;
+
+	// Memory is allocated on first touch, so with MPOL_LOCAL from linux/mempolicy.h, buffers which the thread
+	// allocates from now on stay on its node, even if the process was started with an interleaving policy.
+	// Kernels without NUMA support fail this, which is fine.
+	const int mpol_local = 4;
+	syscall(SYS_set_mempolicy, mpol_local, nullptr, 0);
+	return true;
+#else
+	(void)cpus;
+	return false;
+#endif
+}
+}
@@ -0,0 +1,77 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <vector>
+#include <string>
+
+namespace Fossilize
+{
+struct CPUTopology
+{
+	struct LogicalCPU
+	{
+		unsigned index;
+		// Dense indices, CPUs which share a physical core, L3 cache or NUMA node have the same index.
+		unsigned core;
+		unsigned l3_domain;
+		unsigned node;
+	};
+
+	// Sorted by index.
+	std::vector<LogicalCPU> cpus;
+	unsigned num_cores = 0;
+	unsigned num_l3_domains = 0;
+	unsigned num_nodes = 0;
+};
+
+enum class ThreadPlacement
+{
+	None,
+	// One logical CPU per slot. Physical cores are used before SMT siblings, spread across L3 domains.
+	Core,
+	// All CPUs sharing an L3 cache, round-robin over L3 domains.
+	L3,
+	// All CPUs of a NUMA node, round-robin over nodes.
+	Node
+};
+
+bool parse_thread_placement(const char *str, ThreadPlacement *placement);
+
+// Parses kernel CPU lists, e.g. "0-3,8,10-11".
+bool parse_cpu_list(const char *str, std::vector<unsigned> *cpus);
+
+// Reads the topology of the online CPUs from sysfs. Linux only.
+// sysfs_root is normally /sys/devices/system, and can be overridden for testing.
+bool query_cpu_topology(CPUTopology *topology, const std::string &sysfs_root = "/sys/devices/system");
+
+// Removes CPUs the calling thread is not allowed to run on, e.g. due to taskset or cgroups.
+void restrict_cpu_topology_to_affinity(CPUTopology *topology);
+
+// CPUs placement slot "slot" may run on. Slots beyond the topology wrap around.
+std::vector<unsigned> get_placement_cpus(const CPUTopology &topology, ThreadPlacement placement, unsigned slot);
+
+// Pins the calling thread, and prefers allocating its memory from the NUMA node it runs on.
+// Since threads inherit this, it can also be used to place a process before it spawns threads.
+bool pin_current_thread(const std::vector<unsigned> &cpus);
+}
@@ -22,55 +22,149 @@
 
 #include "fossilize.hpp"
 #include "fossilize_db.hpp"
-#include "layer/utils.hpp"
+#include "varint.hpp"
+#include "cli_parser.hpp"
+#include "logging.hpp"
+#include "file.hpp"
+#include "util/object_pool.hpp"
+#include "util/object_cache.hpp"
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <random>
+#include <string>
+#include <thread>
 #include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include "fossilize_inttypes.h"
 
+#define RAPIDJSON_HAS_STDSTRING 1
+#include "rapidjson/document.h"
+#include "rapidjson/prettywriter.h"
+#include "rapidjson/stringbuffer.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 using namespace Fossilize;
+using namespace std;
 
-static void bench_recorder(const char *path, bool compressed, bool checksum)
+template <typename T>
+static inline T fake_handle(uint64_t v)
 {
-	remove(path);
-	auto iface = std::unique_ptr<DatabaseInterface>(create_database(path, DatabaseMode::OverWrite));
-	StateRecorder recorder;
-	recorder.set_database_enable_checksum(checksum);
-	recorder.set_database_enable_compression(compressed);
-	recorder.init_recording_thread(iface.get());
+	return (T)v;
+}
+
+// Pipelines reference other objects by index, so the workload has to be at least this large.
+static const unsigned MIN_OBJECT_COUNT = 64;
+
+struct GraphicsPipelineStorage
+{
+	VkGraphicsPipelineCreateInfo info;
+	VkPipelineShaderStageCreateInfo stages[2];
+	VkPipelineColorBlendStateCreateInfo cb;
+	VkPipelineVertexInputStateCreateInfo vi;
+	VkPipelineDepthStencilStateCreateInfo ds;
+	VkPipelineDynamicStateCreateInfo dyn;
+	VkPipelineInputAssemblyStateCreateInfo ia;
+	VkPipelineRasterizationStateCreateInfo rs;
+	VkPipelineMultisampleStateCreateInfo ms;
+	VkPipelineViewportStateCreateInfo vp;
+};
+
+static unsigned get_pipeline_layout_count(unsigned object_count)
+{
+	return object_count - object_count / 10;
+}
 
-	std::mt19937 rnd(1);
-	std::uniform_int_distribution<int> dist(1, 500);
+static void build_graphics_pipeline(GraphicsPipelineStorage &storage, unsigned index, unsigned object_count)
+{
+	auto &info = storage.info;
+	info = { VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
+	info.layout = fake_handle<VkPipelineLayout>((index % get_pipeline_layout_count(object_count)) + 1);
+	info.renderPass = fake_handle<VkRenderPass>((index % object_count) + 1);
+	info.stageCount = 2;
+
+	auto *stages = storage.stages;
+	stages[0] = { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO };
+	stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+	stages[0].pName = "main";
+	stages[0].module = fake_handle<VkShaderModule>((index % object_count) + 1);
+	stages[1] = { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO };
+	stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+	stages[1].pName = "main";
+	stages[1].module = fake_handle<VkShaderModule>(((3 * index) % object_count) + 1);
+	info.pStages = stages;
 
-	// Create 10000 random SPIR-V modules with reasonable ID distribution.
-	std::vector<uint32_t> dummy_spirv(4096);
-	for (auto &d : dummy_spirv)
+	storage.cb = { VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO };
+	info.pColorBlendState = &storage.cb;
+	storage.vi = { VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
+	info.pVertexInputState = &storage.vi;
+	storage.ds = { VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO };
+	info.pDepthStencilState = &storage.ds;
+	storage.dyn = { VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO };
+	info.pDynamicState = &storage.dyn;
+	storage.ia = { VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO };
+	info.pInputAssemblyState = &storage.ia;
+	storage.rs = { VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO };
+	info.pRasterizationState = &storage.rs;
+	storage.ms = { VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO };
+	info.pMultisampleState = &storage.ms;
+	storage.vp = { VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO };
+	info.pViewportState = &storage.vp;
+}
+
+// SPIR-V sized random modules with reasonable ID distribution.
+static void build_dummy_spirv(vector<uint32_t> &spirv, unsigned index, mt19937 &rnd)
+{
+	uniform_int_distribution<int> dist(1, 500);
+	spirv.resize(4096);
+	for (auto &d : spirv)
 		d = dist(rnd);
+	spirv[0] = index;
+}
+
+// Records object_count of each object type and ten times as many pipelines.
+// Returns the number of objects recorded, or 0 on failure.
+static uint64_t record_workload(StateRecorder &recorder, unsigned object_count)
+{
+	mt19937 rnd(1);
+	vector<uint32_t> dummy_spirv;
+	build_dummy_spirv(dummy_spirv, 0, rnd);
+	uint64_t recorded = 0;
 
-	for (unsigned i = 0; i < 10000; i++)
+	for (unsigned i = 0; i < object_count; i++)
 	{
 		dummy_spirv[0] = i;
 
 		VkShaderModuleCreateInfo info = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
 		info.codeSize = dummy_spirv.size() * sizeof(uint32_t);
 		info.pCode = dummy_spirv.data();
-		if (!recorder.record_shader_module((VkShaderModule)uint64_t(i + 1), info))
-			abort();
+		if (!recorder.record_shader_module(fake_handle<VkShaderModule>(i + 1), info))
+			return 0;
+		recorded++;
 	}
 
-	for (unsigned i = 0; i < 10000; i++)
+	for (unsigned i = 0; i < object_count; i++)
 	{
 		VkSamplerCreateInfo sampler = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
 		sampler.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
 		sampler.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
 		sampler.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
 		sampler.minLod = float(i);
-		if (!recorder.record_sampler((VkSampler)uint64_t(i + 1), sampler))
-			abort();
+		if (!recorder.record_sampler(fake_handle<VkSampler>(i + 1), sampler))
+			return 0;
+		recorded++;
 	}
 
-	for (unsigned i = 0; i < 10000; i++)
+	for (unsigned i = 0; i < object_count; i++)
 	{
 		VkDescriptorSetLayoutCreateInfo info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
 		info.bindingCount = 16;
@@ -83,28 +177,31 @@ static void bench_recorder(const char *path, bool compressed, bool checksum)
 			bindings[j].stageFlags = VK_SHADER_STAGE_ALL;
 		}
 		info.pBindings = bindings;
-		if (!recorder.record_descriptor_set_layout((VkDescriptorSetLayout)uint64_t(i + 1), info))
-			abort();
+		if (!recorder.record_descriptor_set_layout(fake_handle<VkDescriptorSetLayout>(i + 1), info))
+			return 0;
+		recorded++;
 	}
 
-	for (unsigned i = 0; i < 9000; i++)
+	unsigned pipeline_layout_count = get_pipeline_layout_count(object_count);
+	for (unsigned i = 0; i < pipeline_layout_count; i++)
 	{
 		VkPipelineLayoutCreateInfo info = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
 		VkDescriptorSetLayout set_layouts[4] = {
-			(VkDescriptorSetLayout)uint64_t(i + 1),
-			(VkDescriptorSetLayout)uint64_t(i + 2),
-			(VkDescriptorSetLayout)uint64_t(i + 3),
-			(VkDescriptorSetLayout)uint64_t(i + 4),
+			fake_handle<VkDescriptorSetLayout>(i + 1),
+			fake_handle<VkDescriptorSetLayout>(i + 2),
+			fake_handle<VkDescriptorSetLayout>(i + 3),
+			fake_handle<VkDescriptorSetLayout>(i + 4),
 		};
 		info.pSetLayouts = set_layouts;
 		info.setLayoutCount = 4;
-		if (!recorder.record_pipeline_layout((VkPipelineLayout)uint64_t(i + 1), info))
-			abort();
+		if (!recorder.record_pipeline_layout(fake_handle<VkPipelineLayout>(i + 1), info))
+			return 0;
+		recorded++;
 	}
 
-	std::uniform_int_distribution<int> format_dist(0, 15);
+	uniform_int_distribution<int> format_dist(0, 15);
 
-	for (unsigned i = 0; i < 10000; i++)
+	for (unsigned i = 0; i < object_count; i++)
 	{
 		VkRenderPassCreateInfo info = { VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO };
 		info.attachmentCount = 4;
@@ -142,199 +239,1048 @@ static void bench_recorder(const char *path, bool compressed, bool checksum)
 		subpass.pColorAttachments = colors;
 		info.pSubpasses = &subpass;
 
-		if (!recorder.record_render_pass((VkRenderPass)uint64_t(i + 1), info))
-			abort();
+		if (!recorder.record_render_pass(fake_handle<VkRenderPass>(i + 1), info))
+			return 0;
+		recorded++;
 	}
 
-	for (unsigned i = 0; i < 100000; i++)
+	GraphicsPipelineStorage storage;
+	for (unsigned i = 0; i < 10 * object_count; i++)
 	{
-		VkGraphicsPipelineCreateInfo info = { VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
-		info.layout = (VkPipelineLayout)uint64_t((i % 9000) + 1);
-		info.renderPass = (VkRenderPass)uint64_t((i % 10000) + 1);
-		info.stageCount = 2;
-		VkPipelineShaderStageCreateInfo stages[2] = {};
-		stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
-		stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-		stages[0].pName = "main";
-		stages[0].module = (VkShaderModule)uint64_t((i % 10000) + 1);
-		stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-		stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-		stages[1].pName = "main";
-		stages[1].module = (VkShaderModule)uint64_t(((3 * i) % 10000) + 1);
-		info.pStages = stages;
-
-		VkPipelineColorBlendStateCreateInfo cb = { VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO };
-		info.pColorBlendState = &cb;
-
-		VkPipelineVertexInputStateCreateInfo vi = { VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
-		info.pVertexInputState = &vi;
-
-		VkPipelineDepthStencilStateCreateInfo ds = { VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO };
-		info.pDepthStencilState = &ds;
-
-		VkPipelineDynamicStateCreateInfo dyn = { VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO };
-		info.pDynamicState = &dyn;
-
-		VkPipelineInputAssemblyStateCreateInfo ia = { VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO };
-		info.pInputAssemblyState = &ia;
-
-		VkPipelineRasterizationStateCreateInfo rs = { VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO };
-		info.pRasterizationState = &rs;
+		build_graphics_pipeline(storage, i, object_count);
+		if (!recorder.record_graphics_pipeline(fake_handle<VkPipeline>(i + 1), storage.info, nullptr, 0))
+			return 0;
+		recorded++;
+	}
 
-		VkPipelineMultisampleStateCreateInfo ms = { VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO };
-		info.pMultisampleState = &ms;
+	return recorded;
+}
 
-		VkPipelineViewportStateCreateInfo vp = { VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO };
-		info.pViewportState = &vp;
+static uint64_t bench_recorder(const char *path, unsigned object_count, bool compressed, bool checksum)
+{
+	remove(path);
+	auto iface = unique_ptr<DatabaseInterface>(create_database(path, DatabaseMode::OverWrite));
+	if (!iface)
+		return 0;
 
-		if (!recorder.record_graphics_pipeline((VkPipeline)uint64_t(i + 1), info, nullptr, 0))
-			abort();
-	}
+	// Recorder must be flushed before the database goes away.
+	StateRecorder recorder;
+	recorder.set_database_enable_checksum(checksum);
+	recorder.set_database_enable_compression(compressed);
+	recorder.init_recording_thread(iface.get());
+	return record_workload(recorder, object_count);
 }
 
 struct ReplayInterface : StateCreatorInterface
 {
-	bool enqueue_create_sampler(Hash, const VkSamplerCreateInfo *, VkSampler *) override
+	bool enqueue_create_sampler(Hash hash, const VkSamplerCreateInfo *, VkSampler *sampler) override
 	{
+		*sampler = fake_handle<VkSampler>(hash);
 		return true;
 	}
 
-	bool enqueue_create_descriptor_set_layout(Hash, const VkDescriptorSetLayoutCreateInfo *, VkDescriptorSetLayout *) override
+	bool enqueue_create_descriptor_set_layout(Hash hash, const VkDescriptorSetLayoutCreateInfo *, VkDescriptorSetLayout *layout) override
 	{
+		*layout = fake_handle<VkDescriptorSetLayout>(hash);
 		return true;
 	}
 
-	bool enqueue_create_pipeline_layout(Hash, const VkPipelineLayoutCreateInfo *, VkPipelineLayout *) override
+	bool enqueue_create_pipeline_layout(Hash hash, const VkPipelineLayoutCreateInfo *, VkPipelineLayout *layout) override
 	{
+		*layout = fake_handle<VkPipelineLayout>(hash);
 		return true;
 	}
 
-	bool enqueue_create_shader_module(Hash, const VkShaderModuleCreateInfo *, VkShaderModule *) override
+	bool enqueue_create_shader_module(Hash hash, const VkShaderModuleCreateInfo *, VkShaderModule *module) override
 	{
+		*module = fake_handle<VkShaderModule>(hash);
 		return true;
 	}
 
-	bool enqueue_create_render_pass(Hash, const VkRenderPassCreateInfo *, VkRenderPass *) override
+	bool enqueue_create_render_pass(Hash hash, const VkRenderPassCreateInfo *, VkRenderPass *render_pass) override
 	{
+		*render_pass = fake_handle<VkRenderPass>(hash);
 		return true;
 	}
 
-	bool enqueue_create_compute_pipeline(Hash, const VkComputePipelineCreateInfo *, VkPipeline *) override
+	bool enqueue_create_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo *, VkPipeline *pipeline) override
 	{
+		*pipeline = fake_handle<VkPipeline>(hash);
 		return true;
 	}
 
-	bool enqueue_create_graphics_pipeline(Hash, const VkGraphicsPipelineCreateInfo *, VkPipeline *) override
+	bool enqueue_create_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo *, VkPipeline *pipeline) override
 	{
+		*pipeline = fake_handle<VkPipeline>(hash);
 		return true;
 	}
 };
 
-static bool dummy_replay_archive(const char *path)
+static const ResourceTag playback_order[] = {
+	RESOURCE_APPLICATION_INFO,
+	RESOURCE_SHADER_MODULE,
+	RESOURCE_SAMPLER,
+	RESOURCE_DESCRIPTOR_SET_LAYOUT,
+	RESOURCE_PIPELINE_LAYOUT,
+	RESOURCE_RENDER_PASS,
+	RESOURCE_GRAPHICS_PIPELINE,
+	RESOURCE_COMPUTE_PIPELINE,
+};
+
+static const char *tag_names[RESOURCE_COUNT] = {
+	"application_info",
+	"sampler",
+	"descriptor_set_layout",
+	"pipeline_layout",
+	"shader_module",
+	"render_pass",
+	"graphics_pipeline",
+	"compute_pipeline",
+	"application_blob_link",
+};
+
+struct EntryRef
+{
+	ResourceTag tag;
+	Hash hash;
+};
+
+static bool get_entries(DatabaseInterface &db, vector<EntryRef> &entries)
+{
+	entries.clear();
+	vector<Hash> hashes;
+	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+	{
+		auto tag = static_cast<ResourceTag>(i);
+		size_t hash_count = 0;
+		if (!db.get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
+			return false;
+		hashes.resize(hash_count);
+		if (!db.get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
+			return false;
+
+		db.sort_hashes_by_read_order(tag, hashes.data(), hashes.size());
+		for (auto hash : hashes)
+			entries.push_back({ tag, hash });
+	}
+
+	return true;
+}
+
+static bool read_entry(DatabaseInterface &db, const EntryRef &entry, vector<uint8_t> &blob, PayloadReadFlags flags)
+{
+	size_t blob_size = 0;
+	if (!db.read_entry(entry.tag, entry.hash, &blob_size, nullptr, flags))
+		return false;
+	blob.resize(blob_size);
+	return db.read_entry(entry.tag, entry.hash, &blob_size, blob.data(), flags);
+}
+
+// Drops the file from the page cache, so the next open has to go to storage.
+static bool drop_file_cache(const char *path)
+{
+#ifdef __linux__
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	// Dirty pages cannot be dropped.
+	fdatasync(fd);
+	bool ret = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+	close(fd);
+	return ret;
+#else
+	(void)path;
+	return false;
+#endif
+}
+
+struct BenchOptions
+{
+	unsigned object_count = 10000;
+	unsigned repetitions = 5;
+	unsigned warmup = 1;
+	unsigned num_threads = 1;
+	string work_dir = ".";
+	string filter;
+};
+
+// Shared state for all cases. Archives are recorded once up front.
+struct BenchFixture
+{
+	string uncompressed_path;
+	string compressed_path;
+	vector<string> temp_paths;
+
+	vector<EntryRef> entries;
+	uint64_t entry_bytes = 0;
+
+	// Blobs of the uncompressed archive by tag, for parse cases.
+	vector<vector<uint8_t>> blobs[RESOURCE_COUNT];
+
+	vector<vector<uint32_t>> modules;
+	vector<vector<uint8_t>> encoded_modules;
+	uint64_t module_bytes = 0;
+
+	// Recorder without a database, which keeps all state around for hashing and serialization.
+	unique_ptr<StateRecorder> inline_recorder;
+	unsigned inline_object_count = 0;
+
+	~BenchFixture()
+	{
+		for (auto &path : temp_paths)
+			remove(path.c_str());
+	}
+
+	string get_temp_path(const BenchOptions &options, const char *name)
+	{
+		string path = options.work_dir + "/.fossilize-bench." + name;
+		temp_paths.push_back(path);
+		return path;
+	}
+};
+
+static bool init_fixture(BenchFixture &fixture, const BenchOptions &options)
 {
-	auto iface = std::unique_ptr<DatabaseInterface>(create_database(path, DatabaseMode::ReadOnly));
-	if (!iface->prepare())
+	fixture.uncompressed_path = fixture.get_temp_path(options, "fixture.foz");
+	fixture.compressed_path = fixture.get_temp_path(options, "fixture.compressed.foz");
+
+	LOGI("Recording fixture archives ...\n");
+	if (!bench_recorder(fixture.uncompressed_path.c_str(), options.object_count, false, false) ||
+	    !bench_recorder(fixture.compressed_path.c_str(), options.object_count, true, true))
+	{
+		LOGE("Failed to record fixture archives.\n");
+		return false;
+	}
+
+	auto db = unique_ptr<DatabaseInterface>(create_database(fixture.uncompressed_path.c_str(), DatabaseMode::ReadOnly));
+	if (!db || !db->prepare() || !get_entries(*db, fixture.entries))
+	{
+		LOGE("Failed to open fixture archive.\n");
+		return false;
+	}
+
+	for (auto &entry : fixture.entries)
+	{
+		vector<uint8_t> blob;
+		if (!read_entry(*db, entry, blob, PAYLOAD_READ_NO_FLAGS))
+			return false;
+		fixture.entry_bytes += blob.size();
+		fixture.blobs[entry.tag].push_back(move(blob));
+	}
+
+	mt19937 rnd(2);
+	unsigned module_count = max(options.object_count / 10, 1u);
+	fixture.modules.resize(module_count);
+	fixture.encoded_modules.resize(module_count);
+	for (unsigned i = 0; i < module_count; i++)
+	{
+		auto &module = fixture.modules[i];
+		build_dummy_spirv(module, i, rnd);
+		fixture.module_bytes += module.size() * sizeof(uint32_t);
+
+		auto &encoded = fixture.encoded_modules[i];
+		encoded.resize(compute_size_varint(module.data(), module.size()));
+		encode_varint(encoded.data(), module.data(), module.size());
+	}
+
+	fixture.inline_object_count = max(options.object_count / 10, MIN_OBJECT_COUNT);
+	fixture.inline_recorder.reset(new StateRecorder);
+	if (!record_workload(*fixture.inline_recorder, fixture.inline_object_count))
+	{
+		LOGE("Failed to record inline workload.\n");
 		return false;
-	StateReplayer state_replayer;
-	ReplayInterface replayer;
-
-	std::vector<Hash> resource_hashes;
-	std::vector<uint8_t> state_json;
-
-	static const ResourceTag playback_order[] = {
-		RESOURCE_APPLICATION_INFO, // This will create the device, etc.
-		RESOURCE_SHADER_MODULE, // Kick off shader modules first since it can be done in a thread while we deal with trivial objects.
-		RESOURCE_SAMPLER, // Trivial, run in main thread.
-		RESOURCE_DESCRIPTOR_SET_LAYOUT, // Trivial, run in main thread
-		RESOURCE_PIPELINE_LAYOUT, // Trivial, run in main thread
-		RESOURCE_RENDER_PASS, // Trivial, run in main thread
-		RESOURCE_GRAPHICS_PIPELINE, // Multi-threaded
-		RESOURCE_COMPUTE_PIPELINE, // Multi-threaded
+	}
+
+	return true;
+}
+
+struct BenchCase
+{
+	string name;
+	// What the work count of a repetition measures, used to report throughput.
+	string unit;
+	// Untimed, runs before every repetition. Optional.
+	function<bool ()> prepare;
+	// One timed repetition, reports the amount of work done.
+	function<bool (uint64_t &work)> run;
+};
+
+static void add_recorder_cases(vector<BenchCase> &cases, BenchFixture &fixture, const BenchOptions &options)
+{
+	struct Variant
+	{
+		const char *name;
+		const char *extension;
+		bool compressed;
+		bool checksum;
 	};
 
-	for (auto &tag : playback_order)
+	static const Variant variants[] = {
+		{ "recorder.foz", "foz", false, false },
+		{ "recorder.foz.checksum", "foz", false, true },
+		{ "recorder.foz.compressed", "foz", true, false },
+		{ "recorder.foz.compressed_checksum", "foz", true, true },
+		{ "recorder.zip.compressed", "zip", true, false },
+	};
+
+	for (auto &variant : variants)
 	{
-		size_t resource_hash_count = 0;
-		if (!iface->get_hash_list_for_resource_tag(tag, &resource_hash_count, nullptr))
+		string path = fixture.get_temp_path(options, (string(variant.name) + "." + variant.extension).c_str());
+		Variant v = variant;
+		unsigned object_count = options.object_count;
+		cases.push_back({ variant.name, "objects", {}, [=](uint64_t &work) -> bool {
+			work = bench_recorder(path.c_str(), object_count, v.compressed, v.checksum);
+			return work != 0;
+		}});
+	}
+}
+
+static void add_prepare_cases(vector<BenchCase> &cases, BenchFixture &fixture)
+{
+	const auto run = [&fixture](uint64_t &work) -> bool {
+		auto db = unique_ptr<DatabaseInterface>(create_database(fixture.compressed_path.c_str(), DatabaseMode::ReadOnly));
+		if (!db || !db->prepare())
+			return false;
+		work = fixture.entries.size();
+		return true;
+	};
+
+	cases.push_back({ "prepare.warm", "entries", {}, run });
+
+#ifdef __linux__
+	cases.push_back({ "prepare.cold", "entries", [&fixture]() -> bool {
+		return drop_file_cache(fixture.compressed_path.c_str());
+	}, run });
+#endif
+}
+
+static void add_read_cases(vector<BenchCase> &cases, BenchFixture &fixture, const BenchOptions &options)
+{
+	// Read cases share one prepared database. It is opened lazily so filtered runs don't pay for it.
+	auto db = make_shared<unique_ptr<DatabaseInterface>>();
+	auto random_entries = make_shared<vector<EntryRef>>();
+
+	const auto get_db = [&fixture, db, random_entries]() -> DatabaseInterface * {
+		if (!*db)
+		{
+			db->reset(create_database(fixture.compressed_path.c_str(), DatabaseMode::ReadOnly));
+			if (!*db || !(*db)->prepare())
+			{
+				db->reset();
+				return nullptr;
+			}
+
+			*random_entries = fixture.entries;
+			shuffle(begin(*random_entries), end(*random_entries), mt19937(3));
+		}
+		return db->get();
+	};
+
+	const auto read_all = [](DatabaseInterface &iface, const vector<EntryRef> &entries, uint64_t &work) -> bool {
+		vector<uint8_t> blob;
+		work = 0;
+		for (auto &entry : entries)
 		{
-			LOGE("Failed to get list of resource hashes.\n");
+			if (!read_entry(iface, entry, blob, PAYLOAD_READ_NO_FLAGS))
+				return false;
+			work += blob.size();
+		}
+		return true;
+	};
+
+	cases.push_back({ "read_entry.sequential", "bytes", {}, [&fixture, get_db, read_all](uint64_t &work) -> bool {
+		auto *iface = get_db();
+		return iface && read_all(*iface, fixture.entries, work);
+	}});
+
+	cases.push_back({ "read_entry.random", "bytes", {}, [get_db, random_entries, read_all](uint64_t &work) -> bool {
+		auto *iface = get_db();
+		return iface && read_all(*iface, *random_entries, work);
+	}});
+
+	unsigned num_threads = options.num_threads;
+	cases.push_back({ "read_entry.concurrent." + to_string(num_threads), "bytes", {},
+	                  [&fixture, get_db, num_threads](uint64_t &work) -> bool {
+		auto *iface = get_db();
+		if (!iface)
 			return false;
+
+		atomic<size_t> next_index(0);
+		atomic<uint64_t> total_bytes(0);
+		atomic<bool> failed(false);
+		vector<thread> threads;
+
+		for (unsigned i = 0; i < num_threads; i++)
+		{
+			threads.emplace_back([&]() {
+				vector<uint8_t> blob;
+				uint64_t bytes = 0;
+				size_t index;
+				while ((index = next_index.fetch_add(1, memory_order_relaxed)) < fixture.entries.size() && !failed)
+				{
+					if (!read_entry(*iface, fixture.entries[index], blob, PAYLOAD_READ_CONCURRENT_BIT))
+						failed = true;
+					bytes += blob.size();
+				}
+				total_bytes += bytes;
+			});
+		}
+
+		for (auto &t : threads)
+			t.join();
+
+		work = total_bytes;
+		return !failed;
+	}});
+}
+
+static void add_varint_cases(vector<BenchCase> &cases, BenchFixture &fixture)
+{
+	cases.push_back({ "varint.encode", "bytes", {}, [&fixture](uint64_t &work) -> bool {
+		vector<uint8_t> buffer;
+		for (auto &module : fixture.modules)
+		{
+			buffer.resize(compute_size_varint(module.data(), module.size()));
+			encode_varint(buffer.data(), module.data(), module.size());
+		}
+		work = fixture.module_bytes;
+		return true;
+	}});
+
+	cases.push_back({ "varint.decode", "bytes", {}, [&fixture](uint64_t &work) -> bool {
+		vector<uint32_t> words;
+		for (size_t i = 0; i < fixture.modules.size(); i++)
+		{
+			auto &encoded = fixture.encoded_modules[i];
+			words.resize(fixture.modules[i].size());
+			if (!decode_varint(words.data(), words.size(), encoded.data(), encoded.size()))
+				return false;
 		}
+		work = fixture.module_bytes;
+		return true;
+	}});
+}
 
-		resource_hashes.resize(resource_hash_count);
+static void add_hash_cases(vector<BenchCase> &cases, BenchFixture &fixture)
+{
+	cases.push_back({ "hash.shader_module", "bytes", {}, [&fixture](uint64_t &work) -> bool {
+		for (auto &module : fixture.modules)
+		{
+			VkShaderModuleCreateInfo info = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+			info.codeSize = module.size() * sizeof(uint32_t);
+			info.pCode = module.data();
+			Hash hash;
+			if (!Hashing::compute_hash_shader_module(info, &hash))
+				return false;
+		}
+		work = fixture.module_bytes;
+		return true;
+	}});
 
-		if (!iface->get_hash_list_for_resource_tag(tag, &resource_hash_count, resource_hashes.data()))
+	cases.push_back({ "hash.graphics_pipeline", "objects", {}, [&fixture](uint64_t &work) -> bool {
+		GraphicsPipelineStorage storage;
+		unsigned count = 10 * fixture.inline_object_count;
+		for (unsigned i = 0; i < count; i++)
 		{
-			LOGE("Failed to get list of resource hashes.\n");
+			build_graphics_pipeline(storage, i, fixture.inline_object_count);
+			Hash hash;
+			if (!Hashing::compute_hash_graphics_pipeline(*fixture.inline_recorder, storage.info, &hash))
+				return false;
+		}
+		work = count;
+		return true;
+	}});
+}
+
+static void add_serialize_cases(vector<BenchCase> &cases, BenchFixture &fixture)
+{
+	cases.push_back({ "json.serialize", "bytes", {}, [&fixture](uint64_t &work) -> bool {
+		uint8_t *serialized = nullptr;
+		size_t serialized_size = 0;
+		if (!fixture.inline_recorder->serialize(&serialized, &serialized_size))
+			return false;
+		StateRecorder::free_serialized(serialized);
+		work = serialized_size;
+		return true;
+	}});
+}
+
+static void add_parse_cases(vector<BenchCase> &cases, BenchFixture &fixture)
+{
+	for (unsigned i = 0; i < sizeof(playback_order) / sizeof(playback_order[0]); i++)
+	{
+		ResourceTag tag = playback_order[i];
+		if (fixture.blobs[tag].empty())
+			continue;
+
+		// Dependencies are parsed untimed up front, so only the tag itself is measured.
+		auto replayer = make_shared<unique_ptr<StateReplayer>>();
+		auto iface = make_shared<ReplayInterface>();
+
+		const auto prepare = [&fixture, replayer, iface, i]() -> bool {
+			replayer->reset(new StateReplayer);
+			for (unsigned j = 0; j < i; j++)
+				for (auto &blob : fixture.blobs[playback_order[j]])
+					if (!(*replayer)->parse(*iface, nullptr, blob.data(), blob.size()))
+						return false;
+			return true;
+		};
+
+		const auto run = [&fixture, replayer, iface, tag](uint64_t &work) -> bool {
+			for (auto &blob : fixture.blobs[tag])
+				if (!(*replayer)->parse(*iface, nullptr, blob.data(), blob.size()))
+					return false;
+			work = fixture.blobs[tag].size();
+			return true;
+		};
+
+		cases.push_back({ string("parse.") + tag_names[tag], "objects", prepare, run });
+	}
+}
+
+static void add_merge_convert_cases(vector<BenchCase> &cases, BenchFixture &fixture, const BenchOptions &options)
+{
+	static const unsigned shard_count = 4;
+	auto shard_paths = make_shared<vector<string>>();
+	for (unsigned i = 0; i < shard_count; i++)
+		shard_paths->push_back(fixture.get_temp_path(options, ("shard." + to_string(i) + ".foz").c_str()));
+	string merge_path = fixture.get_temp_path(options, "merged.foz");
+	auto shards_written = make_shared<bool>(false);
+
+	// Splits the compressed fixture into shards as-is, the way several processes would have written them.
+	const auto write_shards = [&fixture, shard_paths, shards_written]() -> bool {
+		if (*shards_written)
+			return true;
+
+		auto src = unique_ptr<DatabaseInterface>(create_database(fixture.compressed_path.c_str(), DatabaseMode::ReadOnly));
+		if (!src || !src->prepare())
 			return false;
+
+		vector<unique_ptr<DatabaseInterface>> shards;
+		for (auto &path : *shard_paths)
+		{
+			remove(path.c_str());
+			shards.emplace_back(create_database(path.c_str(), DatabaseMode::OverWrite));
+			if (!shards.back() || !shards.back()->prepare())
+				return false;
 		}
 
-		for (auto &hash : resource_hashes)
+		vector<uint8_t> blob;
+		for (size_t i = 0; i < fixture.entries.size(); i++)
 		{
-			size_t state_json_size = 0;
-			if (!iface->read_entry(tag, hash, &state_json_size, nullptr, 0))
+			auto &entry = fixture.entries[i];
+			if (!read_entry(*src, entry, blob, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+				return false;
+			if (!shards[i % shard_count]->write_entry(entry.tag, entry.hash, blob.data(), blob.size(),
+			                                          PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT))
+				return false;
+		}
+
+		*shards_written = true;
+		return true;
+	};
+
+	cases.push_back({ "merge", "entries", [write_shards, merge_path]() -> bool {
+		remove(merge_path.c_str());
+		return write_shards();
+	}, [&fixture, shard_paths, merge_path](uint64_t &work) -> bool {
+		vector<const char *> paths;
+		for (auto &path : *shard_paths)
+			paths.push_back(path.c_str());
+		work = fixture.entries.size();
+		return merge_concurrent_databases(merge_path.c_str(), paths.data(), paths.size());
+	}});
+
+	// Same as fossilize-convert-db.
+	static const char *extensions[] = { "foz", "zip" };
+	for (auto *extension : extensions)
+	{
+		string path = fixture.get_temp_path(options, (string("converted.") + extension).c_str());
+		cases.push_back({ string("convert.") + extension, "entries", [path]() -> bool {
+			remove(path.c_str());
+			return true;
+		}, [&fixture, path](uint64_t &work) -> bool {
+			auto src = unique_ptr<DatabaseInterface>(create_database(fixture.compressed_path.c_str(), DatabaseMode::ReadOnly));
+			auto dst = unique_ptr<DatabaseInterface>(create_database(path.c_str(), DatabaseMode::OverWrite));
+			if (!src || !src->prepare() || !dst || !dst->prepare())
+				return false;
+
+			vector<uint8_t> blob;
+			for (auto &entry : fixture.entries)
 			{
-				LOGE("Failed to load blob from cache.\n");
+				if (!read_entry(*src, entry, blob, PAYLOAD_READ_NO_FLAGS))
+					return false;
+				if (!dst->write_entry(entry.tag, entry.hash, blob.data(), blob.size(),
+				                      PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT |
+				                      PAYLOAD_WRITE_COMPRESS_BIT |
+				                      PAYLOAD_WRITE_BEST_COMPRESSION_BIT))
+				{
+					return false;
+				}
+			}
+			work = fixture.entries.size();
+			return true;
+		}});
+	}
+}
+
+// Roughly the size of a shader module cache entry.
+struct PoolObject
+{
+	uint64_t payload[6];
+};
+
+static void add_object_pool_cases(vector<BenchCase> &cases, const BenchOptions &options)
+{
+	unsigned object_count = 100 * options.object_count;
+
+	cases.push_back({ "object_pool.churn", "objects", {}, [object_count](uint64_t &work) -> bool {
+		ObjectPool<PoolObject> pool;
+		vector<PoolObject *> objects(object_count);
+		for (auto &object : objects)
+			if (!(object = pool.allocate()))
+				return false;
+		for (auto *object : objects)
+			pool.free(object);
+		for (auto &object : objects)
+			if (!(object = pool.allocate()))
+				return false;
+		work = 2 * uint64_t(object_count);
+		return true;
+	}});
+
+	// Each thread churns its own objects, but frees into the same pool from the other side of the array,
+	// so objects regularly migrate between magazines.
+	unsigned num_threads = options.num_threads;
+	for (unsigned hugepages = 0; hugepages < 2; hugepages++)
+	{
+		cases.push_back({ string("concurrent_object_pool.") + (hugepages ? "hugepages." : "") + "churn." + to_string(num_threads),
+		                  "objects", {}, [object_count, num_threads, hugepages](uint64_t &work) -> bool {
+			ConcurrentObjectPool<PoolObject> pool(hugepages != 0);
+			vector<PoolObject *> objects(object_count);
+			atomic<bool> failed(false);
+
+			const auto run_threaded = [&](const function<void (size_t)> &func) {
+				vector<thread> threads;
+				for (unsigned i = 0; i < num_threads; i++)
+				{
+					threads.emplace_back([&, i]() {
+						for (size_t index = i; index < objects.size(); index += num_threads)
+							func(index);
+					});
+				}
+				for (auto &t : threads)
+					t.join();
+			};
+
+			run_threaded([&](size_t index) {
+				if (!(objects[index] = pool.allocate()))
+					failed = true;
+			});
+			run_threaded([&](size_t index) {
+				pool.free(objects[objects.size() - 1 - index]);
+			});
+			run_threaded([&](size_t index) {
+				if (!(objects[index] = pool.allocate()))
+					failed = true;
+			});
+
+			work = 2 * uint64_t(object_count);
+			return !failed;
+		}});
+	}
+
+	// Frees a random 90% of the objects. ObjectPool holds on to its peak, ConcurrentObjectPool gives back
+	// whatever slabs end up empty. Reports how much memory stays reserved per live byte.
+	cases.push_back({ "concurrent_object_pool.fragmentation", "objects", {}, [object_count](uint64_t &work) -> bool {
+		ConcurrentObjectPool<PoolObject> pool;
+		vector<PoolObject *> objects(object_count);
+		for (auto &object : objects)
+			if (!(object = pool.allocate()))
 				return false;
+
+		size_t peak_size = pool.get_reserved_size();
+		mt19937 rnd(3);
+		shuffle(begin(objects), end(objects), rnd);
+		size_t live_count = objects.size() / 10;
+		for (size_t i = live_count; i < objects.size(); i++)
+			pool.free(objects[i]);
+		pool.trim();
+
+		size_t live_size = live_count * sizeof(PoolObject);
+		LOGI("  Reserved %.1f MiB at peak, %.1f MiB for %.1f MiB live after freeing 90%%.\n",
+		     peak_size / (1024.0 * 1024.0), pool.get_reserved_size() / (1024.0 * 1024.0),
+		     live_size / (1024.0 * 1024.0));
+
+		work = object_count;
+		return true;
+	}});
+}
+
+// Every thread inserts its own objects and looks up recent ones, like replayer threads sharing the shader module cache.
+// Compares ObjectCache behind a single lock with the sharded ConcurrentObjectCache.
+static void add_object_cache_cases(vector<BenchCase> &cases, const BenchOptions &options)
+{
+	unsigned num_threads = options.num_threads;
+	unsigned objects_per_thread = max(5 * options.object_count / num_threads, 1u);
+	const unsigned lookups_per_object = 4;
+
+	const auto run_threaded = [num_threads](const function<void (unsigned)> &func) {
+		vector<thread> threads;
+		for (unsigned i = 0; i < num_threads; i++)
+			threads.emplace_back(func, i);
+		for (auto &t : threads)
+			t.join();
+	};
+
+	cases.push_back({ "object_cache.mutex.insert_find." + to_string(num_threads), "ops", {},
+	                  [=](uint64_t &work) -> bool {
+		ObjectCache<int> cache;
+		mutex lock;
+		run_threaded([&](unsigned t) {
+			for (unsigned i = 0; i < objects_per_thread; i++)
+			{
+				Hash hash = Hash(t) * objects_per_thread + i + 1;
+				{
+					lock_guard<mutex> holder{lock};
+					cache.insert_object(hash, int(i), 1);
+				}
+
+				for (unsigned j = 0; j < lookups_per_object; j++)
+				{
+					lock_guard<mutex> holder{lock};
+					cache.find_object(hash - j * 7);
+				}
+			}
+		});
+
+		cache.delete_cache([](Hash, int) {});
+		work = uint64_t(num_threads) * objects_per_thread * (1 + lookups_per_object);
+		return true;
+	}});
+
+	cases.push_back({ "concurrent_object_cache.insert_find." + to_string(num_threads), "ops", {},
+	                  [=](uint64_t &work) -> bool {
+		ConcurrentObjectCache<int> cache;
+		run_threaded([&](unsigned t) {
+			for (unsigned i = 0; i < objects_per_thread; i++)
+			{
+				Hash hash = Hash(t) * objects_per_thread + i + 1;
+				cache.insert_object(hash, int(i), 1);
+				for (unsigned j = 0; j < lookups_per_object; j++)
+					cache.find_object(hash - j * 7);
 			}
+		});
+
+		cache.delete_cache([](Hash, int) {});
+		work = uint64_t(num_threads) * objects_per_thread * (1 + lookups_per_object);
+		return true;
+	}});
+}
+
+struct BenchResult
+{
+	string name;
+	string unit;
+	uint64_t work = 0;
+	vector<double> seconds;
+	double mean = 0.0;
+	double median = 0.0;
+	double min = 0.0;
+	double stddev = 0.0;
+	// Half-width of the 95% confidence interval of the mean.
+	double ci95 = 0.0;
+};
+
+// Two-sided 95% critical values of Student's t-distribution, indexed by degrees of freedom - 1.
+static double get_t_critical_value(size_t degrees_of_freedom)
+{
+	static const double values[] = {
+		12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+		2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+		2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+	};
+
+	if (degrees_of_freedom == 0)
+		return 0.0;
+	else if (degrees_of_freedom <= sizeof(values) / sizeof(values[0]))
+		return values[degrees_of_freedom - 1];
+	else
+		return 1.96;
+}
+
+static void compute_statistics(BenchResult &result)
+{
+	auto sorted = result.seconds;
+	sort(begin(sorted), end(sorted));
+	size_t n = sorted.size();
+	if (!n)
+		return;
+
+	double sum = 0.0;
+	for (auto s : sorted)
+		sum += s;
+	result.mean = sum / double(n);
+	result.min = sorted.front();
+	result.median = (n & 1) ? sorted[n / 2] : 0.5 * (sorted[n / 2 - 1] + sorted[n / 2]);
+
+	if (n > 1)
+	{
+		double sq = 0.0;
+		for (auto s : sorted)
+			sq += (s - result.mean) * (s - result.mean);
+		result.stddev = sqrt(sq / double(n - 1));
+		result.ci95 = get_t_critical_value(n - 1) * result.stddev / sqrt(double(n));
+	}
+}
+
+static bool run_case(const BenchCase &bench_case, const BenchOptions &options, BenchResult &result)
+{
+	result.name = bench_case.name;
+	result.unit = bench_case.unit;
+
+	for (unsigned i = 0; i < options.warmup + options.repetitions; i++)
+	{
+		if (bench_case.prepare && !bench_case.prepare())
+			return false;
+
+		uint64_t work = 0;
+		auto begin_time = chrono::steady_clock::now();
+		if (!bench_case.run(work))
+			return false;
+		auto end_time = chrono::steady_clock::now();
+
+		if (i >= options.warmup)
+		{
+			result.work = work;
+			result.seconds.push_back(chrono::duration<double>(end_time - begin_time).count());
+		}
+	}
+
+	compute_statistics(result);
+	return true;
+}
+
+static string results_to_json(const vector<BenchResult> &results, const BenchOptions &options)
+{
+	rapidjson::Document doc;
+	doc.SetObject();
+	auto &alloc = doc.GetAllocator();
+
+	doc.AddMember("version", 1, alloc);
+	doc.AddMember("object_count", options.object_count, alloc);
+	doc.AddMember("repetitions", options.repetitions, alloc);
+
+	rapidjson::Value cases(rapidjson::kArrayType);
+	for (auto &result : results)
+	{
+		rapidjson::Value value(rapidjson::kObjectType);
+		value.AddMember("name", result.name, alloc);
+		value.AddMember("unit", result.unit, alloc);
+		value.AddMember("work", uint64_t(result.work), alloc);
+		value.AddMember("mean_seconds", result.mean, alloc);
+		value.AddMember("median_seconds", result.median, alloc);
+		value.AddMember("min_seconds", result.min, alloc);
+		value.AddMember("stddev_seconds", result.stddev, alloc);
+		value.AddMember("ci95_seconds", result.ci95, alloc);
+		value.AddMember("throughput", result.mean > 0.0 ? double(result.work) / result.mean : 0.0, alloc);
+
+		rapidjson::Value samples(rapidjson::kArrayType);
+		for (auto s : result.seconds)
+			samples.PushBack(s, alloc);
+		value.AddMember("seconds", samples, alloc);
+		cases.PushBack(value, alloc);
+	}
+	doc.AddMember("cases", cases, alloc);
+
+	rapidjson::StringBuffer buffer;
+	rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(buffer);
+	doc.Accept(writer);
+	return string(buffer.GetString(), buffer.GetLength()) + "\n";
+}
+
+// Compares time per unit of work, so baselines with a different object count can still be compared.
+// A case regresses if it is slower than the threshold and the confidence intervals do not overlap.
+static bool compare_baseline(const char *path, const vector<BenchResult> &results, double threshold_percent,
+                             unsigned *regression_count)
+{
+	auto buffer = load_buffer_from_file(path);
+	if (buffer.empty())
+	{
+		LOGE("Failed to load baseline: %s\n", path);
+		return false;
+	}
+
+	rapidjson::Document doc;
+	doc.Parse(reinterpret_cast<const char *>(buffer.data()), buffer.size());
+	if (doc.HasParseError() || !doc.IsObject() || !doc.HasMember("cases") || !doc["cases"].IsArray())
+	{
+		LOGE("Invalid baseline: %s\n", path);
+		return false;
+	}
 
-			state_json.resize(state_json_size);
+	*regression_count = 0;
+	auto &cases = doc["cases"];
+	printf("%-40s %14s %14s %9s\n", "case", "baseline/unit", "current/unit", "delta");
 
-			if (!iface->read_entry(tag, hash, &state_json_size, state_json.data(), 0))
+	for (auto &result : results)
+	{
+		const rapidjson::Value *base = nullptr;
+		for (auto itr = cases.Begin(); itr != cases.End(); ++itr)
+		{
+			if (itr->IsObject() && itr->HasMember("name") && (*itr)["name"].IsString() &&
+			    result.name == (*itr)["name"].GetString())
 			{
-				LOGE("Failed to load blob from cache.\n");
-				return EXIT_FAILURE;
+				base = &*itr;
+				break;
 			}
+		}
 
-			if (!state_replayer.parse(replayer, nullptr, state_json.data(), state_json.size()))
-				LOGE("Failed to parse blob (tag: %d, hash: 0x%" PRIx64 ").\n", tag, hash);
+		if (!base || !base->HasMember("work") || !(*base)["work"].IsNumber() ||
+		    !base->HasMember("mean_seconds") || !(*base)["mean_seconds"].IsNumber() ||
+		    !base->HasMember("ci95_seconds") || !(*base)["ci95_seconds"].IsNumber())
+		{
+			printf("%-40s %14s\n", result.name.c_str(), "(new)");
+			continue;
 		}
+
+		double base_work = (*base)["work"].GetDouble();
+		if (base_work <= 0.0 || result.work == 0)
+			continue;
+
+		double base_mean = (*base)["mean_seconds"].GetDouble() / base_work;
+		double base_ci = (*base)["ci95_seconds"].GetDouble() / base_work;
+		double mean = result.mean / double(result.work);
+		double ci = result.ci95 / double(result.work);
+		double delta = base_mean > 0.0 ? 100.0 * (mean - base_mean) / base_mean : 0.0;
+
+		bool regression = delta > threshold_percent && (mean - ci) > (base_mean + base_ci);
+		if (regression)
+			(*regression_count)++;
+
+		printf("%-40s %14.4g %14.4g %+8.2f%%%s\n", result.name.c_str(), base_mean, mean, delta,
+		       regression ? " REGRESSION" : "");
 	}
 
 	return true;
 }
 
-int main()
-{
-	for (unsigned i = 0; i < 2; i++)
-	{
-		const char *path_compressed = i ? ".test.compressed.zip" : ".test.compressed.foz";
-		const char *path_uncompressed = i ? ".test.uncompressed.zip" : ".test.uncompressed.foz";
-
-		if (i)
-			LOGI("=== Testing ZIP (miniz) ===\n");
-		else
-			LOGI("=== Testing Fossilize DB ===\n");
-
-		const auto run = [&](bool compressed, bool checksum) {
-			const char *path = compressed ? path_compressed : path_uncompressed;
-			auto begin_time = std::chrono::steady_clock::now();
-			bench_recorder(path, compressed, checksum);
-			auto end_time = std::chrono::steady_clock::now();
-			auto len = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - begin_time).count();
-
-			if (compressed && checksum)
-				LOGI("[WRITE] Compressed & checksum: %.3f ms\n", len * 1e-6);
-			else if (compressed)
-				LOGI("[WRITE] Compressed: %.3f ms\n", len * 1e-6);
-			else if (checksum)
-				LOGI("[WRITE] Uncompressed & checksum: %.3f ms\n", len * 1e-6);
-			else
-				LOGI("[WRITE] Uncompressed: %.3f ms\n", len * 1e-6);
-
-			begin_time = std::chrono::steady_clock::now();
-			if (!dummy_replay_archive(path))
-				LOGE("Failed to replay archive.\n");
-			remove(path);
-			end_time = std::chrono::steady_clock::now();
-			len = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - begin_time).count();
-			LOGI("[READ]: %.3f ms\n", len * 1e-6);
-		};
+static void print_help()
+{
+	LOGI("fossilize-bench\n"
+	     "\t[--help]\n"
+	     "\t[--list]\n"
+	     "\t[--filter <substring>]\n"
+	     "\t[--objects <count>]\n"
+	     "\t[--repetitions <count>]\n"
+	     "\t[--warmup <count>]\n"
+	     "\t[--num-threads <count>]\n"
+	     "\t[--work-dir <path>]\n"
+	     "\t[--output <path.json>]\n"
+	     "\t[--baseline <path.json>]\n"
+	     "\t[--regression-threshold <percent>]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	BenchOptions options;
+	options.num_threads = thread::hardware_concurrency();
+	string output_path;
+	string baseline_path;
+	double regression_threshold = 5.0;
+	bool list = false;
+
+	CLICallbacks cbs;
+	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
+	cbs.add("--list", [&](CLIParser &) { list = true; });
+	cbs.add("--filter", [&](CLIParser &parser) { options.filter = parser.next_string(); });
+	cbs.add("--objects", [&](CLIParser &parser) { options.object_count = parser.next_uint(); });
+	cbs.add("--repetitions", [&](CLIParser &parser) { options.repetitions = parser.next_uint(); });
+	cbs.add("--warmup", [&](CLIParser &parser) { options.warmup = parser.next_uint(); });
+	cbs.add("--num-threads", [&](CLIParser &parser) { options.num_threads = parser.next_uint(); });
+	cbs.add("--work-dir", [&](CLIParser &parser) { options.work_dir = parser.next_string(); });
+	cbs.add("--output", [&](CLIParser &parser) { output_path = parser.next_string(); });
+	cbs.add("--baseline", [&](CLIParser &parser) { baseline_path = parser.next_string(); });
+	cbs.add("--regression-threshold", [&](CLIParser &parser) { regression_threshold = parser.next_double(); });
+	cbs.error_handler = [] { print_help(); };
+
+	CLIParser parser(move(cbs), argc - 1, argv + 1);
+	if (!parser.parse())
+		return EXIT_FAILURE;
+	if (parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+	options.object_count = max(options.object_count, MIN_OBJECT_COUNT);
+	options.repetitions = max(options.repetitions, 1u);
+	options.num_threads = max(options.num_threads, 1u);
+
+	BenchFixture fixture;
+	vector<BenchCase> cases;
+	add_recorder_cases(cases, fixture, options);
+	add_prepare_cases(cases, fixture);
+	add_read_cases(cases, fixture, options);
+	add_varint_cases(cases, fixture);
+	add_hash_cases(cases, fixture);
+	add_serialize_cases(cases, fixture);
+	add_merge_convert_cases(cases, fixture, options);
+	add_object_pool_cases(cases, options);
+	add_object_cache_cases(cases, options);
+
+	// Parse cases depend on fixture contents, so the fixture has to exist before listing them.
+	if (!init_fixture(fixture, options))
+		return EXIT_FAILURE;
+	add_parse_cases(cases, fixture);
 
-		run(false, false);
-		run(false, true);
-		run(true, false);
-		run(true, true);
-		LOGI("===================\n\n");
+	if (list)
+	{
+		for (auto &bench_case : cases)
+			printf("%s\n", bench_case.name.c_str());
+		return EXIT_SUCCESS;
+	}
+
+	vector<BenchResult> results;
+	for (auto &bench_case : cases)
+	{
+		if (!options.filter.empty() && bench_case.name.find(options.filter) == string::npos)
+			continue;
+
+		LOGI("Running %s ...\n", bench_case.name.c_str());
+		BenchResult result;
+		if (!run_case(bench_case, options, result))
+		{
+			LOGE("Case %s failed.\n", bench_case.name.c_str());
+			return EXIT_FAILURE;
+		}
+
+		LOGI("  %s: %.3f ms +/- %.3f ms (%.4g %s/s)\n", result.name.c_str(), result.mean * 1e3, result.ci95 * 1e3,
+		     result.mean > 0.0 ? double(result.work) / result.mean : 0.0, result.unit.c_str());
+		results.push_back(move(result));
+	}
+
+	if (!output_path.empty())
+	{
+		auto json = results_to_json(results, options);
+		if (output_path == "-")
+			fputs(json.c_str(), stdout);
+		else if (!write_string_to_file(output_path.c_str(), json.c_str()))
+		{
+			LOGE("Failed to write results to %s.\n", output_path.c_str());
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!baseline_path.empty())
+	{
+		unsigned regression_count = 0;
+		if (!compare_baseline(baseline_path.c_str(), results, regression_threshold, &regression_count))
+			return EXIT_FAILURE;
+
+		if (regression_count)
+		{
+			LOGE("%u case(s) regressed compared to baseline.\n", regression_count);
+			return EXIT_FAILURE;
+		}
 	}
+
+	return EXIT_SUCCESS;
 }
@@ -0,0 +1,73 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "fossilize_application_filter.hpp"
+#include "cli_parser.hpp"
+#include "logging.hpp"
+#include <string>
+#include <stdlib.h>
+
+using namespace Fossilize;
+using namespace std;
+
+static void print_help()
+{
+	LOGI("Usage: fossilize-compile-filter\n"
+	     "\t[--output <path>]\n"
+	     "\tfilter.json\n"
+	     "\tCompiles an application info filter for the layer. By default, the output is written to filter.json.compiled,\n"
+	     "\twhich is where the layer looks for it when FOSSILIZE_APPLICATION_INFO_FILTER_PATH=filter.json.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	string json_path;
+	string output_path;
+
+	CLICallbacks cbs;
+	cbs.default_handler = [&](const char *arg) { json_path = arg; };
+	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
+	cbs.add("--output", [&](CLIParser &parser) { output_path = parser.next_string(); });
+	cbs.error_handler = [] { print_help(); };
+
+	CLIParser parser(move(cbs), argc - 1, argv + 1);
+	if (!parser.parse())
+		return EXIT_FAILURE;
+	if (parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+	if (json_path.empty())
+	{
+		LOGE("No filter provided.\n");
+		print_help();
+		return EXIT_FAILURE;
+	}
+
+	if (output_path.empty())
+		output_path = ApplicationInfoFilter::get_compiled_path(json_path.c_str());
+
+	if (!ApplicationInfoFilter::compile(json_path.c_str(), output_path.c_str()))
+		return EXIT_FAILURE;
+
+	LOGI("Wrote compiled filter to %s.\n", output_path.c_str());
+	return EXIT_SUCCESS;
+}
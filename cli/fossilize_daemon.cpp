@@ -0,0 +1,274 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "fossilize_db.hpp"
+#include "fossilize_remote_db.hpp"
+#include "cli_parser.hpp"
+#include "layer/utils.hpp"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+using namespace Fossilize;
+using namespace std;
+
+static void print_help()
+{
+	LOGI("fossilize-daemon\n"
+	     "\t[--help]\n"
+	     "\t[--socket <path>]\n");
+}
+
+struct SharedDatabase
+{
+	mutex lock;
+	unique_ptr<DatabaseInterface> db;
+	bool prepared = false;
+};
+
+struct DaemonState
+{
+	mutex lock;
+	unordered_map<string, unique_ptr<SharedDatabase>> databases;
+
+	SharedDatabase *open_database(const string &base_path, const string &extra_paths)
+	{
+		string key = base_path;
+		key += '\0';
+		key += extra_paths;
+
+		SharedDatabase *shared;
+		{
+			lock_guard<mutex> holder(lock);
+			auto &entry = databases[key];
+			if (!entry)
+			{
+				entry.reset(new SharedDatabase);
+				entry->db.reset(create_concurrent_database_with_encoded_extra_paths(
+						base_path.c_str(), DatabaseMode::Append, extra_paths.empty() ? nullptr : extra_paths.c_str()));
+			}
+			shared = entry.get();
+		}
+
+		// Priming can take a while, only block clients of the same database.
+		lock_guard<mutex> holder(shared->lock);
+		if (!shared->prepared)
+		{
+			if (!shared->db->prepare())
+			{
+				LOGE("Failed to prepare database: %s\n", base_path.c_str());
+				return nullptr;
+			}
+			LOGI("Opened database: %s\n", base_path.c_str());
+			shared->prepared = true;
+		}
+
+		return shared;
+	}
+};
+
+static bool handle_command(DaemonState &state, SharedDatabase *&shared,
+                           const RemoteDatabaseMessage &msg, const vector<uint8_t> &payload)
+{
+	if (msg.command == REMOTE_DATABASE_COMMAND_OPEN)
+	{
+		if (shared)
+			return false;
+
+		auto *str = reinterpret_cast<const char *>(payload.data());
+		size_t base_len = strnlen(str, payload.size());
+		if (base_len + 1 >= payload.size())
+			return false;
+		size_t extra_len = strnlen(str + base_len + 1, payload.size() - base_len - 1);
+		if (base_len + extra_len + 2 != payload.size())
+			return false;
+
+		shared = state.open_database(string(str, base_len), string(str + base_len + 1, extra_len));
+		return shared != nullptr;
+	}
+
+	if (!shared || msg.tag >= RESOURCE_COUNT)
+		return false;
+
+	auto tag = static_cast<ResourceTag>(msg.tag);
+	lock_guard<mutex> holder(shared->lock);
+
+	switch (msg.command)
+	{
+	case REMOTE_DATABASE_COMMAND_HAS_ENTRY:
+		return shared->db->has_entry(tag, msg.hash);
+
+	case REMOTE_DATABASE_COMMAND_WRITE_ENTRY:
+		return shared->db->write_entry(tag, msg.hash, payload.data(), payload.size(), msg.flags);
+
+	case REMOTE_DATABASE_COMMAND_FLUSH:
+		shared->db->flush();
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static void serve_client(DaemonState &state, int fd)
+{
+	SharedDatabase *shared = nullptr;
+	vector<uint8_t> payload;
+
+	for (;;)
+	{
+		RemoteDatabaseMessage msg = {};
+		if (!remote_database_recv_all(fd, &msg, sizeof(msg)))
+			break;
+
+		if (msg.payload_size > RemoteDatabaseMaxPayloadSize)
+		{
+			LOGE("Client sent too large payload, disconnecting.\n");
+			break;
+		}
+
+		payload.resize(msg.payload_size);
+		if (msg.payload_size && !remote_database_recv_all(fd, payload.data(), payload.size()))
+			break;
+
+		uint32_t status = handle_command(state, shared, msg, payload) ? 1 : 0;
+		if (!remote_database_send_all(fd, &status, sizeof(status)))
+			break;
+	}
+
+	if (shared)
+	{
+		lock_guard<mutex> holder(shared->lock);
+		shared->db->flush();
+	}
+
+	close(fd);
+}
+
+static bool daemon_is_running(const string &socket_path)
+{
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return false;
+	bool ret = connect(fd, reinterpret_cast<const struct sockaddr *>(&addr), sizeof(addr)) == 0;
+	close(fd);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	CLICallbacks cbs;
+	string socket_path = get_default_remote_database_socket_path();
+
+	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
+	cbs.add("--socket", [&](CLIParser &parser) { socket_path = parser.next_string(); });
+	cbs.error_handler = [] { print_help(); };
+
+	CLIParser parser(move(cbs), argc - 1, argv + 1);
+	if (!parser.parse())
+		return EXIT_FAILURE;
+	if (parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (socket_path.empty() || socket_path.size() >= sizeof(addr.sun_path))
+	{
+		LOGE("Invalid socket path: \"%s\".\n", socket_path.c_str());
+		return EXIT_FAILURE;
+	}
+	memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+	if (daemon_is_running(socket_path))
+	{
+		LOGE("A recording daemon is already listening on %s.\n", socket_path.c_str());
+		return EXIT_FAILURE;
+	}
+
+	// Clean up a stale socket from a previous instance.
+	unlink(socket_path.c_str());
+
+	// Writes to clients which went away should not kill us.
+	signal(SIGPIPE, SIG_IGN);
+
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0)
+	{
+		LOGE("Failed to create socket.\n");
+		return EXIT_FAILURE;
+	}
+
+	// Only the current user should be able to record through us.
+	mode_t old_umask = umask(0077);
+	if (bind(listen_fd, reinterpret_cast<const struct sockaddr *>(&addr), sizeof(addr)) < 0)
+	{
+		LOGE("Failed to bind socket to %s.\n", socket_path.c_str());
+		umask(old_umask);
+		close(listen_fd);
+		return EXIT_FAILURE;
+	}
+	umask(old_umask);
+
+	if (listen(listen_fd, 64) < 0)
+	{
+		LOGE("Failed to listen on %s.\n", socket_path.c_str());
+		close(listen_fd);
+		unlink(socket_path.c_str());
+		return EXIT_FAILURE;
+	}
+
+	LOGI("Listening for recording clients on %s.\n", socket_path.c_str());
+
+	DaemonState state;
+	for (;;)
+	{
+		int client_fd = accept(listen_fd, nullptr, nullptr);
+		if (client_fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			LOGE("Failed to accept client.\n");
+			break;
+		}
+
+		thread(serve_client, ref(state), client_fd).detach();
+	}
+
+	close(listen_fd);
+	unlink(socket_path.c_str());
+	return EXIT_FAILURE;
+}
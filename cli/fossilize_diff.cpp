@@ -0,0 +1,293 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "fossilize_db.hpp"
+#include "cli_parser.hpp"
+#include "logging.hpp"
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include "fossilize_inttypes.h"
+
+using namespace Fossilize;
+using namespace std;
+
+static const char *tag_names[RESOURCE_COUNT] = {
+	"AppInfo",
+	"Sampler",
+	"Descriptor Set Layout",
+	"Pipeline Layout",
+	"Shader Module",
+	"Render Pass",
+	"Graphics Pipeline",
+	"Compute Pipeline",
+	"Application Blob Link",
+};
+
+static void print_help()
+{
+	LOGI("Usage:\n"
+	     "\tfossilize-diff [--output delta.foz] [--tombstones removed.foz] old.foz [old2.foz ...] new.foz\n"
+	     "\t\tCompares archives by index only. Entries in new.foz which are missing from all old archives\n"
+	     "\t\tare copied to delta.foz. Entries missing from new.foz are written as empty entries to removed.foz.\n"
+	     "\tfossilize-diff --apply --output merged.foz [--tombstones removed.foz] base.foz delta.foz [delta2.foz ...]\n"
+	     "\t\tOverlays deltas on top of base, drops entries found in removed.foz, and writes the result to merged.foz.\n");
+}
+
+static bool get_sorted_hashes(DatabaseInterface &db, ResourceTag tag, vector<Hash> &hashes)
+{
+	size_t hash_count = 0;
+	if (!db.get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
+		return false;
+	hashes.resize(hash_count);
+	if (!db.get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
+		return false;
+
+	// Stream archives already return sorted hashes, so this is cheap.
+	sort(begin(hashes), end(hashes));
+	return true;
+}
+
+// Copies entries without decoding or recompressing when the source is a stream archive.
+static bool copy_entries(DatabaseInterface &src, DatabaseInterface &dst, ResourceTag tag, vector<Hash> &hashes)
+{
+	// Read in file order, which is much faster than hash order on large archives.
+	src.sort_hashes_by_read_order(tag, hashes.data(), hashes.size());
+
+	vector<uint8_t> blob;
+	for (auto hash : hashes)
+	{
+		PayloadReadFlags read_flags = PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT;
+		PayloadWriteFlags write_flags = PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT;
+
+		size_t blob_size = 0;
+		if (!src.read_entry(tag, hash, &blob_size, nullptr, read_flags))
+		{
+			read_flags = PAYLOAD_READ_NO_FLAGS;
+			write_flags = PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT;
+			if (!src.read_entry(tag, hash, &blob_size, nullptr, read_flags))
+			{
+				LOGE("Failed to read entry (tag: %d, hash: 0x%016" PRIx64 ").\n", tag, hash);
+				return false;
+			}
+		}
+
+		blob.resize(blob_size);
+		if (!src.read_entry(tag, hash, &blob_size, blob.data(), read_flags))
+		{
+			LOGE("Failed to read entry (tag: %d, hash: 0x%016" PRIx64 ").\n", tag, hash);
+			return false;
+		}
+
+		if (!dst.write_entry(tag, hash, blob.data(), blob.size(), write_flags))
+		{
+			LOGE("Failed to write entry (tag: %d, hash: 0x%016" PRIx64 ").\n", tag, hash);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static unique_ptr<DatabaseInterface> open_output(const string &path)
+{
+	if (path.empty())
+		return {};
+
+	auto db = unique_ptr<DatabaseInterface>(create_stream_archive_database(path.c_str(), DatabaseMode::OverWrite));
+	if (!db || !db->prepare())
+	{
+		LOGE("Failed to open database for writing: %s\n", path.c_str());
+		return {};
+	}
+	return db;
+}
+
+static int run_diff(const vector<string> &inputs, const string &output_path, const string &tombstone_path)
+{
+	vector<unique_ptr<DatabaseInterface>> old_dbs;
+	for (size_t i = 0; i + 1 < inputs.size(); i++)
+	{
+		old_dbs.emplace_back(create_database(inputs[i].c_str(), DatabaseMode::ReadOnly));
+		if (!old_dbs.back() || !old_dbs.back()->prepare())
+		{
+			LOGE("Failed to open database: %s\n", inputs[i].c_str());
+			return EXIT_FAILURE;
+		}
+	}
+
+	auto new_db = unique_ptr<DatabaseInterface>(create_database(inputs.back().c_str(), DatabaseMode::ReadOnly));
+	if (!new_db || !new_db->prepare())
+	{
+		LOGE("Failed to open database: %s\n", inputs.back().c_str());
+		return EXIT_FAILURE;
+	}
+
+	unique_ptr<DatabaseInterface> output_db, tombstone_db;
+	if (!output_path.empty() && !(output_db = open_output(output_path)))
+		return EXIT_FAILURE;
+	if (!tombstone_path.empty() && !(tombstone_db = open_output(tombstone_path)))
+		return EXIT_FAILURE;
+
+	printf("%-24s %12s %12s %12s %12s\n", "tag", "old", "new", "added", "removed");
+
+	vector<Hash> old_hashes, new_hashes, hashes, merged, added, removed;
+	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+	{
+		auto tag = static_cast<ResourceTag>(i);
+
+		// Union of all old archives.
+		old_hashes.clear();
+		for (auto &db : old_dbs)
+		{
+			if (!get_sorted_hashes(*db, tag, hashes))
+			{
+				LOGE("Failed to get hashes.\n");
+				return EXIT_FAILURE;
+			}
+
+			merged.clear();
+			set_union(begin(old_hashes), end(old_hashes), begin(hashes), end(hashes), back_inserter(merged));
+			swap(old_hashes, merged);
+		}
+
+		if (!get_sorted_hashes(*new_db, tag, new_hashes))
+		{
+			LOGE("Failed to get hashes.\n");
+			return EXIT_FAILURE;
+		}
+
+		added.clear();
+		removed.clear();
+		set_difference(begin(new_hashes), end(new_hashes), begin(old_hashes), end(old_hashes), back_inserter(added));
+		set_difference(begin(old_hashes), end(old_hashes), begin(new_hashes), end(new_hashes), back_inserter(removed));
+
+		printf("%-24s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 "\n", tag_names[tag],
+		       uint64_t(old_hashes.size()), uint64_t(new_hashes.size()),
+		       uint64_t(added.size()), uint64_t(removed.size()));
+
+		if (output_db && !copy_entries(*new_db, *output_db, tag, added))
+			return EXIT_FAILURE;
+
+		// Same format as whitelists and blacklists, so it can be passed to load_blacklist_database() directly.
+		if (tombstone_db)
+		{
+			for (auto hash : removed)
+			{
+				if (!tombstone_db->write_entry(tag, hash, nullptr, 0, PAYLOAD_WRITE_NO_FLAGS))
+				{
+					LOGE("Failed to write tombstone.\n");
+					return EXIT_FAILURE;
+				}
+			}
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int run_apply(const vector<string> &inputs, const string &output_path, const string &tombstone_path)
+{
+	if (output_path.empty())
+	{
+		LOGE("Need an output path to apply deltas.\n");
+		return EXIT_FAILURE;
+	}
+
+	vector<const char *> paths;
+	for (auto &input : inputs)
+		paths.push_back(input.c_str());
+
+	// Overlaying is exactly what the read-only side of a concurrent database does.
+	auto db = unique_ptr<DatabaseInterface>(create_concurrent_database(nullptr, DatabaseMode::ReadOnly,
+	                                                                   paths.data(), paths.size()));
+	if (!tombstone_path.empty() && !db->load_blacklist_database(tombstone_path.c_str()))
+	{
+		LOGE("Failed to load tombstones: %s\n", tombstone_path.c_str());
+		return EXIT_FAILURE;
+	}
+
+	if (!db->prepare())
+	{
+		LOGE("Failed to open databases.\n");
+		return EXIT_FAILURE;
+	}
+
+	auto output_db = open_output(output_path);
+	if (!output_db)
+		return EXIT_FAILURE;
+
+	vector<Hash> hashes;
+	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+	{
+		auto tag = static_cast<ResourceTag>(i);
+		if (!get_sorted_hashes(*db, tag, hashes))
+		{
+			LOGE("Failed to get hashes.\n");
+			return EXIT_FAILURE;
+		}
+
+		LOGI("Writing %" PRIu64 " entries for tag: %s\n", uint64_t(hashes.size()), tag_names[tag]);
+		if (!copy_entries(*db, *output_db, tag, hashes))
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+	vector<string> inputs;
+	string output_path;
+	string tombstone_path;
+	bool apply = false;
+
+	CLICallbacks cbs;
+	cbs.default_handler = [&](const char *arg) { inputs.push_back(arg); };
+	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
+	cbs.add("--output", [&](CLIParser &parser) { output_path = parser.next_string(); });
+	cbs.add("--tombstones", [&](CLIParser &parser) { tombstone_path = parser.next_string(); });
+	cbs.add("--apply", [&](CLIParser &) { apply = true; });
+	cbs.error_handler = [] { print_help(); };
+
+	CLIParser parser(move(cbs), argc - 1, argv + 1);
+	if (!parser.parse())
+		return EXIT_FAILURE;
+	if (parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+	if (inputs.size() < (apply ? 1u : 2u))
+	{
+		LOGE("Not enough archives.\n");
+		print_help();
+		return EXIT_FAILURE;
+	}
+
+	if (apply)
+		return run_apply(inputs, output_path, tombstone_path);
+	else
+		return run_diff(inputs, output_path, tombstone_path);
+}
@@ -31,6 +31,9 @@
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <thread>
+#include <atomic>
+#include <functional>
 #include <stdlib.h>
 #include <string.h>
 #include "fossilize_inttypes.h"
@@ -192,11 +195,18 @@ struct DisasmReplayer : StateCreatorInterface
 
 	bool enqueue_create_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override
 	{
-		if (device)
-		{
-			if (device->has_pipeline_stats())
-				const_cast<VkComputePipelineCreateInfo *>(create_info)->flags |= VK_PIPELINE_CREATE_CAPTURE_INTERNAL_REPRESENTATIONS_BIT_KHR;
+		bool deferred = false;
+		if (device && device->has_pipeline_stats())
+			const_cast<VkComputePipelineCreateInfo *>(create_info)->flags |= VK_PIPELINE_CREATE_CAPTURE_INTERNAL_REPRESENTATIONS_BIT_KHR;
 
+		if (device && can_defer_pipeline(create_info->flags))
+		{
+			// Compiled later on a disassembly worker thread.
+			*pipeline = fake_handle<VkPipeline>(hash);
+			deferred = true;
+		}
+		else if (device)
+		{
 			LOGI("Creating compute pipeline %0" PRIX64 "\n", hash);
 			if (vkCreateComputePipelines(device->get_device(), pipeline_cache, 1, create_info, nullptr, pipeline) !=
 			    VK_SUCCESS)
@@ -209,7 +219,7 @@ struct DisasmReplayer : StateCreatorInterface
 		else
 			*pipeline = fake_handle<VkPipeline>(hash);
 
-		compute_pipelines.push_back(*pipeline);
+		compute_pipelines.push_back(deferred ? VK_NULL_HANDLE : *pipeline);
 		compute_infos.push_back(create_info);
 		compute_hashes.push_back(hash);
 		return true;
@@ -217,11 +227,18 @@ struct DisasmReplayer : StateCreatorInterface
 
 	bool enqueue_create_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo *create_info, VkPipeline *pipeline) override
 	{
-		if (device)
-		{
-			if (device->has_pipeline_stats())
-				const_cast<VkGraphicsPipelineCreateInfo *>(create_info)->flags |= VK_PIPELINE_CREATE_CAPTURE_INTERNAL_REPRESENTATIONS_BIT_KHR;
+		bool deferred = false;
+		if (device && device->has_pipeline_stats())
+			const_cast<VkGraphicsPipelineCreateInfo *>(create_info)->flags |= VK_PIPELINE_CREATE_CAPTURE_INTERNAL_REPRESENTATIONS_BIT_KHR;
 
+		if (device && can_defer_pipeline(create_info->flags))
+		{
+			// Compiled later on a disassembly worker thread.
+			*pipeline = fake_handle<VkPipeline>(hash);
+			deferred = true;
+		}
+		else if (device)
+		{
 			LOGI("Creating graphics pipeline %0" PRIX64 "\n", hash);
 			if (vkCreateGraphicsPipelines(device->get_device(), pipeline_cache, 1, create_info, nullptr, pipeline) !=
 			    VK_SUCCESS)
@@ -234,12 +251,19 @@ struct DisasmReplayer : StateCreatorInterface
 		else
 			*pipeline = fake_handle<VkPipeline>(hash);
 
-		graphics_pipelines.push_back(*pipeline);
+		graphics_pipelines.push_back(deferred ? VK_NULL_HANDLE : *pipeline);
 		graphics_infos.push_back(create_info);
 		graphics_hashes.push_back(hash);
 		return true;
 	}
 
+	// Pipelines which take part in a derivative chain must exist while parsing,
+	// everything else can be compiled in parallel once all state has been replayed.
+	static bool can_defer_pipeline(VkPipelineCreateFlags flags)
+	{
+		return (flags & (VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT | VK_PIPELINE_CREATE_DERIVATIVE_BIT)) == 0;
+	}
+
 	const VulkanDevice *device;
 
 	vector<const VkSamplerCreateInfo *> sampler_infos;
@@ -522,6 +546,7 @@ static void print_help()
 	     "\t[--output <path>]\n"
 	     "\t[--target asm/glsl/isa]\n"
 	     "\t[--module-only]\n"
+	     "\t[--num-threads <count>]\n"
 	     "state.json\n");
 }
 
@@ -553,6 +578,122 @@ static string stage_to_string(VkShaderStageFlagBits stage)
 	}
 }
 
+// Runs func for every index in [0, count) on num_threads threads. Stops early on first failure.
+static bool run_threaded(size_t count, unsigned num_threads, const function<bool (size_t)> &func)
+{
+	atomic<size_t> next_index(0);
+	atomic<bool> failed(false);
+	vector<thread> threads;
+
+	for (unsigned i = 0; i < num_threads; i++)
+	{
+		threads.emplace_back([&]() {
+			while (!failed.load())
+			{
+				size_t index = next_index.fetch_add(1);
+				if (index >= count)
+					break;
+				if (!func(index))
+					failed = true;
+			}
+		});
+	}
+
+	for (auto &t : threads)
+		t.join();
+	return !failed.load();
+}
+
+static bool write_disassembly(const string &path, const string &disassembled)
+{
+	LOGI("Dumping disassembly to: %s\n", path.c_str());
+	if (!write_string_to_file(path.c_str(), disassembled.c_str()))
+	{
+		LOGE("Failed to write disassembly to file: %s\n", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+static bool disassemble_pipeline_stage(const VulkanDevice &device, const DisasmReplayer &replayer, DisasmMethod method,
+                                       const string &output, VkPipeline pipeline, Hash pipeline_hash,
+                                       const VkPipelineShaderStageCreateInfo &stage)
+{
+	auto itr = replayer.module_to_index.find(stage.module);
+	if (itr == end(replayer.module_to_index))
+	{
+		LOGE("Pipeline %016" PRIx64 " refers to unknown shader module.\n", pipeline_hash);
+		return false;
+	}
+
+	unsigned index = itr->second;
+	string disassembled = disassemble_spirv(device, pipeline, method, stage.stage,
+	                                        replayer.shader_module_infos[index], stage.pName);
+
+	string path = output + "/" + uint64_string(replayer.module_hashes[index]) + "." +
+	              stage.pName + "." +
+	              uint64_string(pipeline_hash) +
+	              "." + stage_to_string(stage.stage);
+
+	return write_disassembly(path, disassembled);
+}
+
+static bool disassemble_graphics_pipeline(const VulkanDevice &device, const DisasmReplayer &replayer, DisasmMethod method,
+                                          const string &output, size_t index)
+{
+	auto *info = replayer.graphics_infos[index];
+	Hash hash = replayer.graphics_hashes[index];
+	VkPipeline pipeline = replayer.graphics_pipelines[index];
+	bool deferred = false;
+
+	if (device.get_device() && pipeline == VK_NULL_HANDLE)
+	{
+		LOGI("Creating graphics pipeline %016" PRIX64 "\n", hash);
+		if (vkCreateGraphicsPipelines(device.get_device(), replayer.pipeline_cache, 1, info, nullptr, &pipeline) != VK_SUCCESS)
+		{
+			// Same as failing to replay the pipeline, skip it.
+			LOGE(" ... Failed!\n");
+			return true;
+		}
+		deferred = true;
+	}
+
+	bool ret = true;
+	for (uint32_t i = 0; ret && i < info->stageCount; i++)
+		ret = disassemble_pipeline_stage(device, replayer, method, output, pipeline, hash, info->pStages[i]);
+
+	// Nothing else refers to deferred pipelines, so don't keep compiled ISA for the whole archive around.
+	if (deferred)
+		vkDestroyPipeline(device.get_device(), pipeline, nullptr);
+	return ret;
+}
+
+static bool disassemble_compute_pipeline(const VulkanDevice &device, const DisasmReplayer &replayer, DisasmMethod method,
+                                         const string &output, size_t index)
+{
+	auto *info = replayer.compute_infos[index];
+	Hash hash = replayer.compute_hashes[index];
+	VkPipeline pipeline = replayer.compute_pipelines[index];
+	bool deferred = false;
+
+	if (device.get_device() && pipeline == VK_NULL_HANDLE)
+	{
+		LOGI("Creating compute pipeline %016" PRIX64 "\n", hash);
+		if (vkCreateComputePipelines(device.get_device(), replayer.pipeline_cache, 1, info, nullptr, &pipeline) != VK_SUCCESS)
+		{
+			LOGE(" ... Failed!\n");
+			return true;
+		}
+		deferred = true;
+	}
+
+	bool ret = disassemble_pipeline_stage(device, replayer, method, output, pipeline, hash, info->stage);
+
+	if (deferred)
+		vkDestroyPipeline(device.get_device(), pipeline, nullptr);
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	string json_path;
@@ -560,6 +701,7 @@ int main(int argc, char *argv[])
 	VulkanDevice::Options opts;
 	DisasmMethod method = DisasmMethod::Asm;
 	bool module_only = false;
+	unsigned num_threads = thread::hardware_concurrency();
 
 	CLICallbacks cbs;
 	cbs.default_handler = [&](const char *arg) { json_path = arg; };
@@ -571,6 +713,7 @@ int main(int argc, char *argv[])
 		method = method_from_string(parser.next_string());
 	});
 	cbs.add("--module-only", [&](CLIParser &) { module_only = true; });
+	cbs.add("--num-threads", [&](CLIParser &parser) { num_threads = parser.next_uint(); });
 	cbs.error_handler = [] { print_help(); };
 
 	CLIParser parser(move(cbs), argc - 1, argv + 1);
@@ -586,6 +729,9 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	if (num_threads < 1)
+		num_threads = 1;
+
 	VulkanDevice device;
 	if (method == DisasmMethod::ISA)
 	{
@@ -688,87 +834,38 @@ int main(int argc, char *argv[])
 		LOGI("Replayed tag: %s\n", tag_names[tag]);
 	}
 
-	unordered_set<VkShaderModule> unique_shader_modules;
-
 	if (module_only)
 	{
-		string disassembled;
-		size_t module_count = replayer.shader_module_infos.size();
-		for (size_t i = 0; i < module_count; i++)
-		{
-			auto *module_info = replayer.shader_module_infos[i];
-			disassembled = disassemble_spirv(device, VK_NULL_HANDLE, method, VK_SHADER_STAGE_ALL,
-			                                 module_info, nullptr);
+		bool success = run_threaded(replayer.shader_module_infos.size(), num_threads, [&](size_t i) -> bool {
+			string disassembled = disassemble_spirv(device, VK_NULL_HANDLE, method, VK_SHADER_STAGE_ALL,
+			                                        replayer.shader_module_infos[i], nullptr);
+			return write_disassembly(output + "/" + uint64_string(replayer.module_hashes[i]), disassembled);
+		});
 
-			auto module_hash = replayer.module_hashes[i];
-			string path = output + "/" + uint64_string(module_hash);
-
-			LOGI("Dumping disassembly to: %s\n", path.c_str());
-			if (!write_string_to_file(path.c_str(), disassembled.c_str()))
-			{
-				LOGE("Failed to write disassembly to file: %s\n", output.c_str());
-				return EXIT_FAILURE;
-			}
-		}
+		if (!success)
+			return EXIT_FAILURE;
 	}
 	else
 	{
-		string disassembled;
-		size_t graphics_pipeline_count = replayer.graphics_infos.size();
-		for (size_t i = 0; i < graphics_pipeline_count; i++)
-		{
-			auto *info = replayer.graphics_infos[i];
-			for (uint32_t j = 0; j < info->stageCount; j++)
-			{
-				VkShaderModule module = info->pStages[j].module;
-				unique_shader_modules.insert(module);
-				unsigned index = replayer.module_to_index[module];
-				auto *module_info = replayer.shader_module_infos[index];
-				disassembled = disassemble_spirv(device, replayer.graphics_pipelines[i], method, info->pStages[j].stage,
-				                                 module_info, info->pStages[j].pName);
-
-				Hash module_hash = replayer.module_hashes[index];
-
-				string path = output + "/" + uint64_string(module_hash) + "." +
-				              info->pStages[j].pName + "." +
-				              uint64_string(replayer.graphics_hashes[i]) +
-				              "." + stage_to_string(info->pStages[j].stage);
-
-				LOGI("Dumping disassembly to: %s\n", path.c_str());
-				if (!write_string_to_file(path.c_str(), disassembled.c_str()))
-				{
-					LOGE("Failed to write disassembly to file: %s\n", output.c_str());
-					return EXIT_FAILURE;
-				}
-			}
-		}
+		unordered_set<VkShaderModule> unique_shader_modules;
+		for (auto *info : replayer.graphics_infos)
+			for (uint32_t i = 0; i < info->stageCount; i++)
+				unique_shader_modules.insert(info->pStages[i].module);
+		for (auto *info : replayer.compute_infos)
+			unique_shader_modules.insert(info->stage.module);
 
+		size_t graphics_pipeline_count = replayer.graphics_infos.size();
 		size_t compute_pipeline_count = replayer.compute_infos.size();
-		for (size_t i = 0; i < compute_pipeline_count; i++)
-		{
-			auto *info = replayer.compute_infos[i];
-			VkShaderModule module = info->stage.module;
-			unique_shader_modules.insert(module);
-
-			unsigned index = replayer.module_to_index[module];
-			auto *module_info = replayer.shader_module_infos[index];
-			disassembled = disassemble_spirv(device, replayer.compute_pipelines[i], method, info->stage.stage,
-			                                 module_info, info->stage.pName);
-
-			Hash module_hash = replayer.module_hashes[index];
 
-			string path = output + "/" + uint64_string(module_hash) + "." +
-			              info->stage.pName + "." +
-			              uint64_string(replayer.compute_hashes[i]) +
-			              "." + stage_to_string(info->stage.stage);
+		bool success = run_threaded(graphics_pipeline_count + compute_pipeline_count, num_threads, [&](size_t i) -> bool {
+			if (i < graphics_pipeline_count)
+				return disassemble_graphics_pipeline(device, replayer, method, output, i);
+			else
+				return disassemble_compute_pipeline(device, replayer, method, output, i - graphics_pipeline_count);
+		});
 
-			LOGI("Dumping disassembly to: %s\n", path.c_str());
-			if (!write_string_to_file(path.c_str(), disassembled.c_str()))
-			{
-				LOGE("Failed to write disassembly to file: %s\n", output.c_str());
-				return EXIT_FAILURE;
-			}
-		}
+		if (!success)
+			return EXIT_FAILURE;
 
 		LOGI("Shader modules used: %u, shader modules in database: %u\n",
 		     unsigned(unique_shader_modules.size()), unsigned(replayer.shader_module_infos.size()));
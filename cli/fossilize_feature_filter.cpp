@@ -27,6 +27,8 @@
 #include <string.h>
 #include <unordered_set>
 #include <string>
+#include <vector>
+#include <algorithm>
 
 namespace Fossilize
 {
@@ -139,8 +141,10 @@ struct FeatureFilter::Impl
 	VulkanFeatures features = {};
 	VulkanProperties props = {};
 	bool supports_scalar_block_layout = false;
+	Hash fingerprint = 0;
 
 	void init_features(const void *pNext);
+	void init_fingerprint();
 	void init_properties(const void *pNext);
 	bool pnext_chain_is_supported(const void *pNext) const;
 	bool validate_module_capabilities(const uint32_t *data, size_t size) const;
@@ -269,10 +273,38 @@ bool FeatureFilter::Impl::init(uint32_t api_version_, const char **device_exts,
 
 	init_features(enabled_features->pNext);
 	init_properties(properties->pNext);
+	init_fingerprint();
 
 	return true;
 }
 
+// FNV-1a over the raw structs. pNext pointers are cleared on copy, so only
+// padding could make two identical devices hash differently, which is harmless.
+static void hash_bytes(Hash &h, const void *data, size_t size)
+{
+	auto *bytes = static_cast<const uint8_t *>(data);
+	for (size_t i = 0; i < size; i++)
+		h = (h ^ bytes[i]) * 0x100000001b3ull;
+}
+
+void FeatureFilter::Impl::init_fingerprint()
+{
+	Hash h = 0xcbf29ce484222325ull;
+	hash_bytes(h, &api_version, sizeof(api_version));
+
+	// Extension order is irrelevant to the filter.
+	std::vector<std::string> exts(enabled_extensions.begin(), enabled_extensions.end());
+	std::sort(exts.begin(), exts.end());
+	for (auto &ext : exts)
+		hash_bytes(h, ext.c_str(), ext.size() + 1);
+
+	hash_bytes(h, &features2.features, sizeof(features2.features));
+	hash_bytes(h, &props2.properties, sizeof(props2.properties));
+	hash_bytes(h, &features, sizeof(features));
+	hash_bytes(h, &props, sizeof(props));
+	fingerprint = h;
+}
+
 bool FeatureFilter::init(uint32_t api_version, const char **device_exts, unsigned count,
                          const VkPhysicalDeviceFeatures2 *enabled_features, const VkPhysicalDeviceProperties2 *props)
 {
@@ -921,4 +953,9 @@ bool FeatureFilter::supports_scalar_block_layout() const
 {
 	return impl->supports_scalar_block_layout;
 }
+
+Hash FeatureFilter::get_fingerprint() const
+{
+	return impl->fingerprint;
+}
 }
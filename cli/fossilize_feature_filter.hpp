@@ -26,6 +26,8 @@
 #error "Must include Vulkan headers before including fossilize_feature_filter.hpp"
 #endif
 
+#include "fossilize_types.hpp"
+
 namespace Fossilize
 {
 struct VulkanFeatures
@@ -99,6 +101,10 @@ public:
 
 	bool supports_scalar_block_layout() const;
 
+	// Identifies the API version, extensions, features and properties the filter was initialized with.
+	// Verdicts for an object can be reused as long as the fingerprint does not change.
+	Hash get_fingerprint() const;
+
 private:
 	struct Impl;
 	Impl *impl;
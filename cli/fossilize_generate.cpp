@@ -0,0 +1,1335 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "fossilize.hpp"
+#include "fossilize_db.hpp"
+#include "cli_parser.hpp"
+#include "logging.hpp"
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "fossilize_inttypes.h"
+
+using namespace Fossilize;
+using namespace std;
+
+template <typename T>
+static inline T fake_handle(uint64_t v)
+{
+	return (T)v;
+}
+
+// Sampler indices are encoded in minLod and maxLod, which must stay exact in a float.
+static const uint64_t MaxSamplers = 1ull << 32;
+// SPIR-V IDs are limited to 22 bits in practice, and every padding word group uses one.
+static const size_t MaxModuleWords = 4 * 1024 * 1024;
+
+// Describes the shape of an archive. Defaults are loosely modelled after a typical large title.
+struct GeneratorProfile
+{
+	uint64_t graphics_pipelines = 100000;
+	uint64_t compute_pipelines = 5000;
+	uint64_t shader_modules = 20000;
+	uint64_t samplers = 64;
+	uint64_t set_layouts = 500;
+	uint64_t pipeline_layouts = 1000;
+	uint64_t render_passes = 200;
+
+	// SPIR-V sizes in bytes follow a log-normal distribution, exp(9.0) is ~8 KiB.
+	double module_size_log_mean = 9.0;
+	double module_size_log_sigma = 1.0;
+
+	// Modules are picked for pipeline stages with a Zipf distribution.
+	// 0 means every module is equally likely, larger values concentrate references on fewer modules.
+	double module_zipf_exponent = 1.0;
+
+	// Fraction of pipelines which are derived from an earlier pipeline.
+	double derivative_ratio = 0.0;
+	// Fraction of pipeline stages which have specialization constants.
+	double spec_constant_ratio = 0.1;
+	// Fraction of graphics pipelines with tessellation and geometry stages.
+	double tessellation_ratio = 0.02;
+	double geometry_ratio = 0.02;
+};
+
+// splitmix64. Unlike the standard library distributions, the output is fully specified.
+// Module sizes and Zipf tables still go through libm, so a seed is only guaranteed
+// to produce the same archive with the same build.
+class Random
+{
+public:
+	explicit Random(uint64_t seed)
+		: state(seed)
+	{
+	}
+
+	uint64_t next()
+	{
+		uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return z ^ (z >> 31);
+	}
+
+	// [0, 1)
+	double next_double()
+	{
+		return double(next() >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	// [0, count)
+	uint32_t next_range(uint32_t count)
+	{
+		return count ? uint32_t((next() >> 32) % count) : 0;
+	}
+
+	bool next_bool(double probability)
+	{
+		return next_double() < probability;
+	}
+
+	double next_normal()
+	{
+		double u = 1.0 - next_double();
+		double v = next_double();
+		return sqrt(-2.0 * log(u)) * cos(6.283185307179586 * v);
+	}
+
+private:
+	uint64_t state;
+};
+
+class ZipfTable
+{
+public:
+	ZipfTable(uint64_t count, double exponent)
+	{
+		cdf.resize(count);
+		double total = 0.0;
+		for (uint64_t i = 0; i < count; i++)
+		{
+			total += 1.0 / pow(double(i + 1), exponent);
+			cdf[i] = total;
+		}
+
+		for (auto &c : cdf)
+			c /= total;
+	}
+
+	uint64_t sample(Random &rnd) const
+	{
+		if (cdf.empty())
+			return 0;
+		auto itr = upper_bound(begin(cdf), end(cdf), rnd.next_double());
+		if (itr == end(cdf))
+			return cdf.size() - 1;
+		return uint64_t(itr - begin(cdf));
+	}
+
+private:
+	vector<double> cdf;
+};
+
+enum ModulePool
+{
+	POOL_VERTEX = 0,
+	POOL_FRAGMENT,
+	POOL_TESSELLATION_CONTROL,
+	POOL_TESSELLATION_EVALUATION,
+	POOL_GEOMETRY,
+	POOL_COMPUTE,
+	POOL_COUNT
+};
+
+struct RenderPassShape
+{
+	uint32_t color_attachments;
+	bool depth_attachment;
+};
+
+class ArchiveGenerator
+{
+public:
+	ArchiveGenerator(const GeneratorProfile &profile_, uint64_t seed)
+		: profile(profile_), rnd(seed)
+	{
+	}
+
+	bool generate(StateRecorder &recorder);
+
+private:
+	const GeneratorProfile &profile;
+	Random rnd;
+
+	uint64_t pool_offset[POOL_COUNT] = {};
+	uint64_t pool_count[POOL_COUNT] = {};
+	vector<unique_ptr<ZipfTable>> pool_tables;
+	vector<RenderPassShape> render_pass_shapes;
+	vector<VkPipeline> graphics_parents;
+	vector<VkPipeline> compute_parents;
+
+	bool generate_samplers(StateRecorder &recorder);
+	bool generate_set_layouts(StateRecorder &recorder);
+	bool generate_pipeline_layouts(StateRecorder &recorder);
+	bool generate_render_passes(StateRecorder &recorder);
+	bool generate_shader_modules(StateRecorder &recorder);
+	bool generate_graphics_pipelines(StateRecorder &recorder);
+	bool generate_compute_pipelines(StateRecorder &recorder);
+
+	void setup_module_pools();
+	VkShaderModule pick_module(ModulePool pool);
+	void fill_stage(VkPipelineShaderStageCreateInfo &stage, VkShaderStageFlagBits stage_bit, ModulePool pool,
+	                VkSpecializationInfo &spec_info, VkSpecializationMapEntry *map_entries, uint32_t *spec_data);
+	VkPipelineCreateFlags pick_derivative(vector<VkPipeline> &parents, VkPipeline pipeline, VkPipeline *base_pipeline);
+};
+
+bool ArchiveGenerator::generate_samplers(StateRecorder &recorder)
+{
+	if (profile.samplers > MaxSamplers)
+	{
+		LOGE("Cannot generate more than %" PRIu64 " unique samplers.\n", MaxSamplers);
+		return false;
+	}
+
+	static const VkSamplerAddressMode address_modes[] = {
+		VK_SAMPLER_ADDRESS_MODE_REPEAT,
+		VK_SAMPLER_ADDRESS_MODE_MIRRORED_REPEAT,
+		VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+		VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
+	};
+
+	for (uint64_t i = 0; i < profile.samplers; i++)
+	{
+		VkSamplerCreateInfo info = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+		info.magFilter = rnd.next_bool(0.8) ? VK_FILTER_LINEAR : VK_FILTER_NEAREST;
+		info.minFilter = rnd.next_bool(0.8) ? VK_FILTER_LINEAR : VK_FILTER_NEAREST;
+		info.mipmapMode = rnd.next_bool(0.8) ? VK_SAMPLER_MIPMAP_MODE_LINEAR : VK_SAMPLER_MIPMAP_MODE_NEAREST;
+		info.addressModeU = address_modes[rnd.next_range(4)];
+		info.addressModeV = address_modes[rnd.next_range(4)];
+		info.addressModeW = address_modes[rnd.next_range(4)];
+		info.anisotropyEnable = rnd.next_bool(0.3) ? VK_TRUE : VK_FALSE;
+		info.maxAnisotropy = info.anisotropyEnable ? float(1u << (1 + rnd.next_range(4))) : 1.0f;
+		info.compareEnable = rnd.next_bool(0.1) ? VK_TRUE : VK_FALSE;
+		info.compareOp = info.compareEnable ? VK_COMPARE_OP_LESS_OR_EQUAL : VK_COMPARE_OP_NEVER;
+		info.borderColor = VK_BORDER_COLOR_FLOAT_TRANSPARENT_BLACK;
+		info.mipLodBias = float(rnd.next_range(5)) * 0.25f - 0.5f;
+		// Makes sure every sampler is unique even if the random state collides.
+		// Both values are small enough integers to be exact in a float.
+		info.minLod = float(i >> 12);
+		info.maxLod = info.minLod + float(i & 4095) + 1.0f;
+
+		if (!recorder.record_sampler(fake_handle<VkSampler>(i + 1), info))
+			return false;
+	}
+
+	return true;
+}
+
+bool ArchiveGenerator::generate_set_layouts(StateRecorder &recorder)
+{
+	static const VkDescriptorType descriptor_types[] = {
+		VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+		VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+		VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
+		VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
+		VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+		VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+		VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+		VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+		VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+		VK_DESCRIPTOR_TYPE_SAMPLER,
+	};
+
+	VkDescriptorSetLayoutBinding bindings[16];
+	VkSampler immutable_samplers[16][4];
+
+	for (uint64_t i = 0; i < profile.set_layouts; i++)
+	{
+		VkDescriptorSetLayoutCreateInfo info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
+		info.bindingCount = 1 + rnd.next_range(16);
+		VkShaderStageFlags stages = rnd.next_bool(0.1) ? VK_SHADER_STAGE_COMPUTE_BIT : VK_SHADER_STAGE_ALL_GRAPHICS;
+
+		for (uint32_t j = 0; j < info.bindingCount; j++)
+		{
+			auto &binding = bindings[j];
+			binding = {};
+			binding.binding = j;
+			binding.descriptorType = descriptor_types[rnd.next_range(sizeof(descriptor_types) / sizeof(descriptor_types[0]))];
+			binding.descriptorCount = rnd.next_bool(0.1) ? 1 + rnd.next_range(4) : 1;
+			binding.stageFlags = stages;
+
+			bool can_use_immutable = binding.descriptorType == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER ||
+			                         binding.descriptorType == VK_DESCRIPTOR_TYPE_SAMPLER;
+			if (profile.samplers && can_use_immutable && rnd.next_bool(0.2))
+			{
+				for (uint32_t k = 0; k < binding.descriptorCount; k++)
+					immutable_samplers[j][k] = fake_handle<VkSampler>(1 + rnd.next_range(uint32_t(profile.samplers)));
+				binding.pImmutableSamplers = immutable_samplers[j];
+			}
+		}
+
+		// Binding count alone doesn't give enough variety, the first binding number makes every layout unique.
+		bindings[0].binding = uint32_t(i) * 16;
+		for (uint32_t j = 1; j < info.bindingCount; j++)
+			bindings[j].binding = bindings[0].binding + j;
+
+		info.pBindings = bindings;
+		if (!recorder.record_descriptor_set_layout(fake_handle<VkDescriptorSetLayout>(i + 1), info))
+			return false;
+	}
+
+	return true;
+}
+
+bool ArchiveGenerator::generate_pipeline_layouts(StateRecorder &recorder)
+{
+	ZipfTable set_layout_table(profile.set_layouts, 1.0);
+	VkDescriptorSetLayout set_layouts[4];
+
+	for (uint64_t i = 0; i < profile.pipeline_layouts; i++)
+	{
+		VkPipelineLayoutCreateInfo info = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+		info.setLayoutCount = profile.set_layouts ? 1 + rnd.next_range(4) : 0;
+		for (uint32_t j = 0; j < info.setLayoutCount; j++)
+			set_layouts[j] = fake_handle<VkDescriptorSetLayout>(set_layout_table.sample(rnd) + 1);
+		info.pSetLayouts = set_layouts;
+
+		VkPushConstantRange range = {};
+		range.stageFlags = VK_SHADER_STAGE_ALL;
+		range.size = 4 * (1 + rnd.next_range(32));
+		info.pushConstantRangeCount = rnd.next_bool(0.5) ? 1 : 0;
+		info.pPushConstantRanges = &range;
+
+		if (!recorder.record_pipeline_layout(fake_handle<VkPipelineLayout>(i + 1), info))
+			return false;
+	}
+
+	return true;
+}
+
+bool ArchiveGenerator::generate_render_passes(StateRecorder &recorder)
+{
+	static const VkFormat color_formats[] = {
+		VK_FORMAT_R8G8B8A8_UNORM, VK_FORMAT_R8G8B8A8_SRGB, VK_FORMAT_B8G8R8A8_UNORM, VK_FORMAT_B8G8R8A8_SRGB,
+		VK_FORMAT_R16G16B16A16_SFLOAT, VK_FORMAT_B10G11R11_UFLOAT_PACK32, VK_FORMAT_A2B10G10R10_UNORM_PACK32,
+		VK_FORMAT_R16G16_SFLOAT, VK_FORMAT_R32_SFLOAT, VK_FORMAT_R8_UNORM,
+	};
+
+	static const VkFormat depth_formats[] = {
+		VK_FORMAT_D32_SFLOAT, VK_FORMAT_D24_UNORM_S8_UINT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D16_UNORM,
+	};
+
+	static const VkAttachmentLoadOp load_ops[] = {
+		VK_ATTACHMENT_LOAD_OP_LOAD, VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+	};
+
+	static const VkAttachmentStoreOp store_ops[] = {
+		VK_ATTACHMENT_STORE_OP_STORE, VK_ATTACHMENT_STORE_OP_DONT_CARE,
+	};
+
+	render_pass_shapes.reserve(profile.render_passes);
+
+	for (uint64_t i = 0; i < profile.render_passes; i++)
+	{
+		RenderPassShape shape;
+		shape.color_attachments = rnd.next_bool(0.1) ? 0 : 1 + rnd.next_range(4);
+		shape.depth_attachment = shape.color_attachments == 0 || rnd.next_bool(0.6);
+
+		VkAttachmentDescription attachments[5] = {};
+		VkAttachmentReference color_refs[4] = {};
+		VkAttachmentReference depth_ref = {};
+		uint32_t attachment_count = 0;
+
+		for (uint32_t j = 0; j < shape.color_attachments; j++)
+		{
+			auto &att = attachments[attachment_count];
+			att.format = color_formats[rnd.next_range(sizeof(color_formats) / sizeof(color_formats[0]))];
+			att.samples = VK_SAMPLE_COUNT_1_BIT;
+			att.loadOp = load_ops[rnd.next_range(3)];
+			att.storeOp = store_ops[rnd.next_range(2)];
+			att.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+			att.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+			att.initialLayout = att.loadOp == VK_ATTACHMENT_LOAD_OP_LOAD ?
+			                    VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED;
+			att.finalLayout = rnd.next_bool(0.5) ?
+			                  VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+			color_refs[j].attachment = attachment_count;
+			color_refs[j].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+			attachment_count++;
+		}
+
+		if (shape.depth_attachment)
+		{
+			auto &att = attachments[attachment_count];
+			att.format = depth_formats[rnd.next_range(sizeof(depth_formats) / sizeof(depth_formats[0]))];
+			att.samples = VK_SAMPLE_COUNT_1_BIT;
+			att.loadOp = load_ops[rnd.next_range(3)];
+			att.storeOp = store_ops[rnd.next_range(2)];
+			att.stencilLoadOp = load_ops[rnd.next_range(3)];
+			att.stencilStoreOp = store_ops[rnd.next_range(2)];
+			att.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+			att.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+			depth_ref.attachment = attachment_count;
+			depth_ref.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+			attachment_count++;
+		}
+
+		VkSubpassDescription subpass = {};
+		subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+		subpass.colorAttachmentCount = shape.color_attachments;
+		subpass.pColorAttachments = color_refs;
+		subpass.pDepthStencilAttachment = shape.depth_attachment ? &depth_ref : nullptr;
+
+		VkRenderPassCreateInfo info = { VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO };
+		info.attachmentCount = attachment_count;
+		info.pAttachments = attachments;
+		info.subpassCount = 1;
+		info.pSubpasses = &subpass;
+
+		if (!recorder.record_render_pass(fake_handle<VkRenderPass>(i + 1), info))
+			return false;
+
+		render_pass_shapes.push_back(shape);
+	}
+
+	return true;
+}
+
+void ArchiveGenerator::setup_module_pools()
+{
+	// Modules are stage specific, so split them into pools roughly proportional to how often each stage is used.
+	uint64_t total_pipelines = profile.graphics_pipelines + profile.compute_pipelines;
+	double weights[POOL_COUNT] = {};
+	if (total_pipelines)
+	{
+		double graphics = double(profile.graphics_pipelines) / double(total_pipelines);
+		weights[POOL_VERTEX] = graphics;
+		weights[POOL_FRAGMENT] = graphics * 1.2;
+		weights[POOL_TESSELLATION_CONTROL] = graphics * profile.tessellation_ratio;
+		weights[POOL_TESSELLATION_EVALUATION] = graphics * profile.tessellation_ratio;
+		weights[POOL_GEOMETRY] = graphics * profile.geometry_ratio;
+		weights[POOL_COMPUTE] = double(profile.compute_pipelines) / double(total_pipelines);
+	}
+
+	double total_weight = 0.0;
+	for (auto &w : weights)
+		total_weight += w;
+
+	uint64_t offset = 0;
+	for (unsigned i = 0; i < POOL_COUNT; i++)
+	{
+		uint64_t count = 0;
+		if (weights[i] > 0.0)
+			count = max<uint64_t>(1, uint64_t(double(profile.shader_modules) * weights[i] / total_weight));
+		pool_offset[i] = offset;
+		pool_count[i] = count;
+		offset += count;
+		pool_tables.emplace_back(new ZipfTable(count, profile.module_zipf_exponent));
+	}
+}
+
+static inline void emit_op(vector<uint32_t> &code, uint32_t op, uint32_t word_count)
+{
+	code.push_back((word_count << 16) | op);
+}
+
+// Emits a minimal valid shader for the pool's stage, with an empty main().
+// The index is stored in two constants so every module is unique, and the module is padded to roughly
+// word_count with constants whose values mimic the distribution of real modules, which are mostly
+// small IDs and literals, so compression ratios are somewhat realistic.
+static void build_shader_module(vector<uint32_t> &code, ModulePool pool, uint64_t index, size_t word_count, Random &rnd)
+{
+	enum
+	{
+		OpMemoryModel = 14, OpEntryPoint = 15, OpExecutionMode = 16, OpCapability = 17,
+		OpTypeVoid = 19, OpTypeInt = 21, OpTypeFunction = 33, OpConstant = 43,
+		OpFunction = 54, OpFunctionEnd = 56, OpLabel = 248, OpReturn = 253
+	};
+
+	enum
+	{
+		IdVoid = 1, IdFunctionType, IdUint, IdMain, IdLabel, IdIndexLo, IdIndexHi, IdFirstPadding
+	};
+
+	static const uint32_t execution_models[POOL_COUNT] = { 0, 4, 1, 2, 3, 5 };
+
+	code.clear();
+	code.push_back(0x07230203u);
+	code.push_back(0x00010000u);
+	code.push_back(0);
+	code.push_back(0); // Bound, patched below.
+	code.push_back(0);
+
+	emit_op(code, OpCapability, 2);
+	code.push_back(1); // Shader
+	if (pool == POOL_TESSELLATION_CONTROL || pool == POOL_TESSELLATION_EVALUATION)
+	{
+		emit_op(code, OpCapability, 2);
+		code.push_back(3); // Tessellation
+	}
+	else if (pool == POOL_GEOMETRY)
+	{
+		emit_op(code, OpCapability, 2);
+		code.push_back(2); // Geometry
+	}
+
+	emit_op(code, OpMemoryModel, 3);
+	code.push_back(0); // Logical
+	code.push_back(1); // GLSL450
+
+	emit_op(code, OpEntryPoint, 5);
+	code.push_back(execution_models[pool]);
+	code.push_back(IdMain);
+	code.push_back(0x6e69616du); // "main"
+	code.push_back(0);
+
+	auto execution_mode = [&](uint32_t mode, initializer_list<uint32_t> literals) {
+		emit_op(code, OpExecutionMode, 3 + uint32_t(literals.size()));
+		code.push_back(IdMain);
+		code.push_back(mode);
+		code.insert(code.end(), literals.begin(), literals.end());
+	};
+
+	switch (pool)
+	{
+	case POOL_FRAGMENT:
+		execution_mode(7, {}); // OriginUpperLeft
+		break;
+	case POOL_TESSELLATION_CONTROL:
+		execution_mode(26, { 3 }); // OutputVertices
+		break;
+	case POOL_TESSELLATION_EVALUATION:
+		execution_mode(22, {}); // Triangles
+		execution_mode(1, {}); // SpacingEqual
+		execution_mode(4, {}); // VertexOrderCw
+		break;
+	case POOL_GEOMETRY:
+		execution_mode(22, {}); // Triangles
+		execution_mode(0, { 1 }); // Invocations
+		execution_mode(29, {}); // OutputTriangleStrip
+		execution_mode(26, { 3 }); // OutputVertices
+		break;
+	case POOL_COMPUTE:
+		execution_mode(17, { 1, 1, 1 }); // LocalSize
+		break;
+	default:
+		break;
+	}
+
+	emit_op(code, OpTypeVoid, 2);
+	code.push_back(IdVoid);
+	emit_op(code, OpTypeFunction, 3);
+	code.push_back(IdFunctionType);
+	code.push_back(IdVoid);
+	emit_op(code, OpTypeInt, 4);
+	code.push_back(IdUint);
+	code.push_back(32);
+	code.push_back(0);
+
+	emit_op(code, OpConstant, 4);
+	code.push_back(IdUint);
+	code.push_back(IdIndexLo);
+	code.push_back(uint32_t(index));
+	emit_op(code, OpConstant, 4);
+	code.push_back(IdUint);
+	code.push_back(IdIndexHi);
+	code.push_back(uint32_t(index >> 32));
+
+	// The function takes 7 words.
+	uint32_t id = IdFirstPadding;
+	while (code.size() + 7 + 4 <= word_count)
+	{
+		uint32_t r = rnd.next_range(100);
+		uint32_t value;
+		if (r < 60)
+			value = 1 + rnd.next_range(id);
+		else if (r < 90)
+			value = rnd.next_range(400);
+		else
+			value = uint32_t(rnd.next());
+
+		emit_op(code, OpConstant, 4);
+		code.push_back(IdUint);
+		code.push_back(id++);
+		code.push_back(value);
+	}
+
+	emit_op(code, OpFunction, 5);
+	code.push_back(IdVoid);
+	code.push_back(IdMain);
+	code.push_back(0); // None
+	code.push_back(IdFunctionType);
+	emit_op(code, OpLabel, 2);
+	code.push_back(IdLabel);
+	emit_op(code, OpReturn, 1);
+	emit_op(code, OpFunctionEnd, 1);
+
+	code[3] = id;
+}
+
+// Geometry modules from build_shader_module() declare Triangles input, which must match the input assembly.
+static bool is_valid_geometry_input(VkPrimitiveTopology topology, bool tessellation)
+{
+	// With tessellation, geometry shaders consume the triangles emitted by tessellation evaluation modules.
+	if (tessellation)
+		return topology == VK_PRIMITIVE_TOPOLOGY_PATCH_LIST;
+
+	return topology == VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST ||
+	       topology == VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP ||
+	       topology == VK_PRIMITIVE_TOPOLOGY_TRIANGLE_FAN;
+}
+
+bool ArchiveGenerator::generate_shader_modules(StateRecorder &recorder)
+{
+	vector<uint32_t> code;
+
+	for (unsigned pool = 0; pool < POOL_COUNT; pool++)
+	{
+		for (uint64_t i = pool_offset[pool]; i < pool_offset[pool] + pool_count[pool]; i++)
+		{
+			double size = exp(profile.module_size_log_mean + profile.module_size_log_sigma * rnd.next_normal());
+			size_t word_count = min<size_t>(size_t(min(size, 1e12)) / sizeof(uint32_t), MaxModuleWords);
+			build_shader_module(code, ModulePool(pool), i, word_count, rnd);
+
+			VkShaderModuleCreateInfo info = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+			info.codeSize = code.size() * sizeof(uint32_t);
+			info.pCode = code.data();
+			if (!recorder.record_shader_module(fake_handle<VkShaderModule>(i + 1), info))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+VkShaderModule ArchiveGenerator::pick_module(ModulePool pool)
+{
+	uint64_t index = pool_offset[pool] + pool_tables[pool]->sample(rnd);
+	return fake_handle<VkShaderModule>(index + 1);
+}
+
+void ArchiveGenerator::fill_stage(VkPipelineShaderStageCreateInfo &stage, VkShaderStageFlagBits stage_bit, ModulePool pool,
+                                  VkSpecializationInfo &spec_info, VkSpecializationMapEntry *map_entries,
+                                  uint32_t *spec_data)
+{
+	stage = { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO };
+	stage.stage = stage_bit;
+	stage.module = pick_module(pool);
+	stage.pName = "main";
+
+	if (rnd.next_bool(profile.spec_constant_ratio))
+	{
+		spec_info = {};
+		spec_info.mapEntryCount = 1 + rnd.next_range(8);
+		for (uint32_t i = 0; i < spec_info.mapEntryCount; i++)
+		{
+			map_entries[i].constantID = i;
+			map_entries[i].offset = i * sizeof(uint32_t);
+			map_entries[i].size = sizeof(uint32_t);
+			spec_data[i] = rnd.next_range(16);
+		}
+		spec_info.pMapEntries = map_entries;
+		spec_info.dataSize = spec_info.mapEntryCount * sizeof(uint32_t);
+		spec_info.pData = spec_data;
+		stage.pSpecializationInfo = &spec_info;
+	}
+}
+
+VkPipelineCreateFlags ArchiveGenerator::pick_derivative(vector<VkPipeline> &parents, VkPipeline pipeline,
+                                                        VkPipeline *base_pipeline)
+{
+	*base_pipeline = VK_NULL_HANDLE;
+	if (profile.derivative_ratio <= 0.0)
+		return 0;
+
+	if (!parents.empty() && rnd.next_bool(profile.derivative_ratio))
+	{
+		// Derivatives tend to be created close to their parent.
+		size_t window = min<size_t>(parents.size(), 64);
+		*base_pipeline = parents[parents.size() - 1 - rnd.next_range(uint32_t(window))];
+		return VK_PIPELINE_CREATE_DERIVATIVE_BIT;
+	}
+	else if (rnd.next_bool(profile.derivative_ratio))
+	{
+		parents.push_back(pipeline);
+		return VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT;
+	}
+	else
+		return 0;
+}
+
+bool ArchiveGenerator::generate_graphics_pipelines(StateRecorder &recorder)
+{
+	if (profile.graphics_pipelines && (!profile.pipeline_layouts || !profile.render_passes))
+	{
+		LOGE("Graphics pipelines need at least one pipeline layout and render pass.\n");
+		return false;
+	}
+
+	static const VkDynamicState dynamic_states[] = {
+		VK_DYNAMIC_STATE_VIEWPORT,
+		VK_DYNAMIC_STATE_SCISSOR,
+		VK_DYNAMIC_STATE_DEPTH_BIAS,
+		VK_DYNAMIC_STATE_BLEND_CONSTANTS,
+		VK_DYNAMIC_STATE_STENCIL_REFERENCE,
+		VK_DYNAMIC_STATE_STENCIL_COMPARE_MASK,
+		VK_DYNAMIC_STATE_STENCIL_WRITE_MASK,
+	};
+
+	static const VkFormat attribute_formats[] = {
+		VK_FORMAT_R32G32B32_SFLOAT, VK_FORMAT_R32G32_SFLOAT, VK_FORMAT_R32G32B32A32_SFLOAT,
+		VK_FORMAT_R8G8B8A8_UNORM, VK_FORMAT_R16G16_SFLOAT, VK_FORMAT_R8G8B8A8_UINT,
+	};
+
+	static const VkCullModeFlags cull_modes[] = {
+		VK_CULL_MODE_NONE, VK_CULL_MODE_BACK_BIT, VK_CULL_MODE_BACK_BIT, VK_CULL_MODE_FRONT_BIT,
+	};
+
+	static const VkCompareOp depth_compare_ops[] = {
+		VK_COMPARE_OP_LESS, VK_COMPARE_OP_LESS_OR_EQUAL, VK_COMPARE_OP_GREATER,
+		VK_COMPARE_OP_GREATER_OR_EQUAL, VK_COMPARE_OP_EQUAL, VK_COMPARE_OP_ALWAYS,
+	};
+
+	ZipfTable layout_table(profile.pipeline_layouts, 1.0);
+	ZipfTable render_pass_table(profile.render_passes, 1.0);
+
+	VkPipelineShaderStageCreateInfo stages[5];
+	VkSpecializationInfo spec_infos[5];
+	VkSpecializationMapEntry map_entries[5][8];
+	uint32_t spec_data[5][8];
+	VkVertexInputAttributeDescription attributes[8];
+	VkVertexInputBindingDescription bindings[2];
+	VkPipelineColorBlendAttachmentState blend_attachments[4];
+
+	for (uint64_t i = 0; i < profile.graphics_pipelines; i++)
+	{
+		auto pipeline = fake_handle<VkPipeline>(i + 1);
+		VkGraphicsPipelineCreateInfo info = { VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
+		info.flags = pick_derivative(graphics_parents, pipeline, &info.basePipelineHandle);
+		info.basePipelineIndex = -1;
+		info.layout = fake_handle<VkPipelineLayout>(layout_table.sample(rnd) + 1);
+		uint64_t render_pass_index = render_pass_table.sample(rnd);
+		info.renderPass = fake_handle<VkRenderPass>(render_pass_index + 1);
+		auto &shape = render_pass_shapes[render_pass_index];
+
+		bool tessellation = rnd.next_bool(profile.tessellation_ratio);
+		bool geometry = rnd.next_bool(profile.geometry_ratio);
+
+		info.stageCount = 0;
+		const auto add_stage = [&](VkShaderStageFlagBits stage_bit, ModulePool pool) {
+			uint32_t index = info.stageCount++;
+			fill_stage(stages[index], stage_bit, pool, spec_infos[index], map_entries[index], spec_data[index]);
+		};
+
+		add_stage(VK_SHADER_STAGE_VERTEX_BIT, POOL_VERTEX);
+		if (tessellation)
+		{
+			add_stage(VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT, POOL_TESSELLATION_CONTROL);
+			add_stage(VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT, POOL_TESSELLATION_EVALUATION);
+		}
+		if (geometry)
+			add_stage(VK_SHADER_STAGE_GEOMETRY_BIT, POOL_GEOMETRY);
+		// Depth-only passes frequently skip the fragment shader.
+		if (shape.color_attachments || rnd.next_bool(0.5))
+			add_stage(VK_SHADER_STAGE_FRAGMENT_BIT, POOL_FRAGMENT);
+		info.pStages = stages;
+
+		VkPipelineVertexInputStateCreateInfo vi = { VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
+		vi.vertexBindingDescriptionCount = rnd.next_range(3);
+		vi.vertexAttributeDescriptionCount = vi.vertexBindingDescriptionCount ? 1 + rnd.next_range(8) : 0;
+		for (uint32_t j = 0; j < vi.vertexBindingDescriptionCount; j++)
+		{
+			bindings[j].binding = j;
+			bindings[j].inputRate = j ? VK_VERTEX_INPUT_RATE_INSTANCE : VK_VERTEX_INPUT_RATE_VERTEX;
+			bindings[j].stride = 4 * (1 + rnd.next_range(16));
+		}
+		for (uint32_t j = 0; j < vi.vertexAttributeDescriptionCount; j++)
+		{
+			attributes[j].location = j;
+			attributes[j].binding = rnd.next_range(vi.vertexBindingDescriptionCount);
+			attributes[j].format = attribute_formats[rnd.next_range(sizeof(attribute_formats) / sizeof(attribute_formats[0]))];
+			attributes[j].offset = 4 * rnd.next_range(8);
+		}
+		vi.pVertexBindingDescriptions = bindings;
+		vi.pVertexAttributeDescriptions = attributes;
+		info.pVertexInputState = &vi;
+
+		VkPipelineInputAssemblyStateCreateInfo ia = { VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO };
+		if (tessellation)
+			ia.topology = VK_PRIMITIVE_TOPOLOGY_PATCH_LIST;
+		else if (rnd.next_bool(0.9))
+			ia.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+		else if (rnd.next_bool(0.5) || geometry)
+			ia.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP;
+		else
+			ia.topology = VK_PRIMITIVE_TOPOLOGY_LINE_LIST;
+		info.pInputAssemblyState = &ia;
+
+		if (geometry && !is_valid_geometry_input(ia.topology, tessellation))
+		{
+			LOGE("Topology %d does not match the input of geometry shaders.\n", int(ia.topology));
+			return false;
+		}
+
+		VkPipelineTessellationStateCreateInfo tess = { VK_STRUCTURE_TYPE_PIPELINE_TESSELLATION_STATE_CREATE_INFO };
+		tess.patchControlPoints = 3 + rnd.next_range(2);
+		info.pTessellationState = tessellation ? &tess : nullptr;
+
+		VkPipelineViewportStateCreateInfo vp = { VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO };
+		vp.viewportCount = 1;
+		vp.scissorCount = 1;
+		info.pViewportState = &vp;
+
+		VkPipelineRasterizationStateCreateInfo rs = { VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO };
+		rs.polygonMode = rnd.next_bool(0.98) ? VK_POLYGON_MODE_FILL : VK_POLYGON_MODE_LINE;
+		rs.cullMode = cull_modes[rnd.next_range(4)];
+		rs.frontFace = rnd.next_bool(0.5) ? VK_FRONT_FACE_COUNTER_CLOCKWISE : VK_FRONT_FACE_CLOCKWISE;
+		rs.depthBiasEnable = rnd.next_bool(0.1) ? VK_TRUE : VK_FALSE;
+		rs.lineWidth = 1.0f;
+		info.pRasterizationState = &rs;
+
+		VkPipelineMultisampleStateCreateInfo ms = { VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO };
+		ms.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+		info.pMultisampleState = &ms;
+
+		VkPipelineDepthStencilStateCreateInfo ds = { VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO };
+		if (shape.depth_attachment)
+		{
+			ds.depthTestEnable = rnd.next_bool(0.9) ? VK_TRUE : VK_FALSE;
+			ds.depthWriteEnable = rnd.next_bool(0.6) ? VK_TRUE : VK_FALSE;
+			ds.depthCompareOp = depth_compare_ops[rnd.next_range(sizeof(depth_compare_ops) / sizeof(depth_compare_ops[0]))];
+			ds.stencilTestEnable = rnd.next_bool(0.1) ? VK_TRUE : VK_FALSE;
+			ds.front.compareOp = VK_COMPARE_OP_ALWAYS;
+			ds.front.passOp = VK_STENCIL_OP_REPLACE;
+			ds.front.compareMask = 0xff;
+			ds.front.writeMask = 0xff;
+			ds.back = ds.front;
+			ds.maxDepthBounds = 1.0f;
+			info.pDepthStencilState = &ds;
+		}
+
+		VkPipelineColorBlendStateCreateInfo cb = { VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO };
+		cb.attachmentCount = shape.color_attachments;
+		for (uint32_t j = 0; j < cb.attachmentCount; j++)
+		{
+			auto &att = blend_attachments[j];
+			att = {};
+			att.colorWriteMask = rnd.next_bool(0.9) ? 0xf : rnd.next_range(16);
+			if (rnd.next_bool(0.3))
+			{
+				att.blendEnable = VK_TRUE;
+				att.srcColorBlendFactor = rnd.next_bool(0.5) ? VK_BLEND_FACTOR_SRC_ALPHA : VK_BLEND_FACTOR_ONE;
+				att.dstColorBlendFactor = rnd.next_bool(0.5) ? VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA : VK_BLEND_FACTOR_ONE;
+				att.colorBlendOp = VK_BLEND_OP_ADD;
+				att.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+				att.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+				att.alphaBlendOp = VK_BLEND_OP_ADD;
+			}
+		}
+		cb.pAttachments = blend_attachments;
+		info.pColorBlendState = shape.color_attachments ? &cb : nullptr;
+
+		VkPipelineDynamicStateCreateInfo dyn = { VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO };
+		dyn.dynamicStateCount = 2 + rnd.next_range(sizeof(dynamic_states) / sizeof(dynamic_states[0]) - 1);
+		dyn.pDynamicStates = dynamic_states;
+		info.pDynamicState = &dyn;
+
+		if (!recorder.record_graphics_pipeline(pipeline, info, nullptr, 0))
+			return false;
+	}
+
+	return true;
+}
+
+bool ArchiveGenerator::generate_compute_pipelines(StateRecorder &recorder)
+{
+	if (profile.compute_pipelines && !profile.pipeline_layouts)
+	{
+		LOGE("Compute pipelines need at least one pipeline layout.\n");
+		return false;
+	}
+
+	ZipfTable layout_table(profile.pipeline_layouts, 1.0);
+	VkSpecializationInfo spec_info;
+	VkSpecializationMapEntry map_entries[8];
+	uint32_t spec_data[8];
+
+	for (uint64_t i = 0; i < profile.compute_pipelines; i++)
+	{
+		auto pipeline = fake_handle<VkPipeline>(profile.graphics_pipelines + i + 1);
+		VkComputePipelineCreateInfo info = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+		info.flags = pick_derivative(compute_parents, pipeline, &info.basePipelineHandle);
+		info.basePipelineIndex = -1;
+		info.layout = fake_handle<VkPipelineLayout>(layout_table.sample(rnd) + 1);
+		fill_stage(info.stage, VK_SHADER_STAGE_COMPUTE_BIT, POOL_COMPUTE, spec_info, map_entries, spec_data);
+
+		if (!recorder.record_compute_pipeline(pipeline, info, nullptr, 0))
+			return false;
+	}
+
+	return true;
+}
+
+bool ArchiveGenerator::generate(StateRecorder &recorder)
+{
+	VkApplicationInfo app = { VK_STRUCTURE_TYPE_APPLICATION_INFO };
+	app.pApplicationName = "fossilize-generate";
+	app.pEngineName = "fossilize-generate";
+	app.apiVersion = VK_API_VERSION_1_1;
+	if (!recorder.record_application_info(app))
+		return false;
+
+	setup_module_pools();
+
+	LOGI("Generating %" PRIu64 " samplers.\n", profile.samplers);
+	if (!generate_samplers(recorder))
+		return false;
+	LOGI("Generating %" PRIu64 " descriptor set layouts.\n", profile.set_layouts);
+	if (!generate_set_layouts(recorder))
+		return false;
+	LOGI("Generating %" PRIu64 " pipeline layouts.\n", profile.pipeline_layouts);
+	if (!generate_pipeline_layouts(recorder))
+		return false;
+	LOGI("Generating %" PRIu64 " render passes.\n", profile.render_passes);
+	if (!generate_render_passes(recorder))
+		return false;
+	LOGI("Generating %" PRIu64 " shader modules.\n", pool_offset[POOL_COUNT - 1] + pool_count[POOL_COUNT - 1]);
+	if (!generate_shader_modules(recorder))
+		return false;
+	LOGI("Generating %" PRIu64 " graphics pipelines.\n", profile.graphics_pipelines);
+	if (!generate_graphics_pipelines(recorder))
+		return false;
+	LOGI("Generating %" PRIu64 " compute pipelines.\n", profile.compute_pipelines);
+	if (!generate_compute_pipelines(recorder))
+		return false;
+
+	return true;
+}
+
+// Gathers what is needed to fit a profile. Handles are not resolved, so modules and base pipelines show up as hashes.
+struct FitReplayer : StateCreatorInterface
+{
+	vector<uint64_t> module_sizes;
+	unordered_map<Hash, uint64_t> module_references;
+	uint64_t pipelines = 0;
+	uint64_t derivative_pipelines = 0;
+	uint64_t stages = 0;
+	uint64_t spec_constant_stages = 0;
+	uint64_t tessellation_pipelines = 0;
+	uint64_t geometry_pipelines = 0;
+
+	bool enqueue_create_sampler(Hash hash, const VkSamplerCreateInfo *, VkSampler *sampler) override
+	{
+		*sampler = fake_handle<VkSampler>(hash);
+		return true;
+	}
+
+	bool enqueue_create_descriptor_set_layout(Hash hash, const VkDescriptorSetLayoutCreateInfo *, VkDescriptorSetLayout *layout) override
+	{
+		*layout = fake_handle<VkDescriptorSetLayout>(hash);
+		return true;
+	}
+
+	bool enqueue_create_pipeline_layout(Hash hash, const VkPipelineLayoutCreateInfo *, VkPipelineLayout *layout) override
+	{
+		*layout = fake_handle<VkPipelineLayout>(hash);
+		return true;
+	}
+
+	bool enqueue_create_shader_module(Hash hash, const VkShaderModuleCreateInfo *create_info, VkShaderModule *module) override
+	{
+		*module = fake_handle<VkShaderModule>(hash);
+		module_sizes.push_back(create_info->codeSize);
+		return true;
+	}
+
+	bool enqueue_create_render_pass(Hash hash, const VkRenderPassCreateInfo *, VkRenderPass *render_pass) override
+	{
+		*render_pass = fake_handle<VkRenderPass>(hash);
+		return true;
+	}
+
+	void add_stage(const VkPipelineShaderStageCreateInfo &stage)
+	{
+		stages++;
+		if (stage.pSpecializationInfo)
+			spec_constant_stages++;
+		module_references[(Hash)stage.module]++;
+	}
+
+	bool enqueue_create_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(hash);
+		pipelines++;
+		if (create_info->flags & VK_PIPELINE_CREATE_DERIVATIVE_BIT)
+			derivative_pipelines++;
+		add_stage(create_info->stage);
+		return true;
+	}
+
+	bool enqueue_create_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(hash);
+		pipelines++;
+		if (create_info->flags & VK_PIPELINE_CREATE_DERIVATIVE_BIT)
+			derivative_pipelines++;
+
+		bool tessellation = false;
+		bool geometry = false;
+		for (uint32_t i = 0; i < create_info->stageCount; i++)
+		{
+			add_stage(create_info->pStages[i]);
+			if (create_info->pStages[i].stage == VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT)
+				tessellation = true;
+			else if (create_info->pStages[i].stage == VK_SHADER_STAGE_GEOMETRY_BIT)
+				geometry = true;
+		}
+
+		if (tessellation)
+			tessellation_pipelines++;
+		if (geometry)
+			geometry_pipelines++;
+		return true;
+	}
+};
+
+static bool get_hashes(DatabaseInterface &db, ResourceTag tag, vector<Hash> &hashes)
+{
+	size_t hash_count = 0;
+	if (!db.get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
+		return false;
+	hashes.resize(hash_count);
+	return db.get_hash_list_for_resource_tag(tag, &hash_count, hashes.data());
+}
+
+static bool parse_tag(DatabaseInterface &db, StateReplayer &replayer, FitReplayer &fit, ResourceTag tag)
+{
+	vector<Hash> hashes;
+	if (!get_hashes(db, tag, hashes))
+		return false;
+
+	vector<uint8_t> blob;
+	for (auto hash : hashes)
+	{
+		size_t blob_size = 0;
+		if (!db.read_entry(tag, hash, &blob_size, nullptr, PAYLOAD_READ_NO_FLAGS))
+			return false;
+		blob.resize(blob_size);
+		if (!db.read_entry(tag, hash, &blob_size, blob.data(), PAYLOAD_READ_NO_FLAGS))
+			return false;
+
+		if (!replayer.parse(fit, &db, blob.data(), blob.size()))
+			LOGE("Failed to parse blob (tag: %d, hash: 0x%016" PRIx64 ").\n", tag, hash);
+	}
+
+	return true;
+}
+
+// Least-squares fit of log(references) against log(rank), the slope of which is the Zipf exponent.
+static double fit_zipf_exponent(const unordered_map<Hash, uint64_t> &references)
+{
+	vector<uint64_t> counts;
+	counts.reserve(references.size());
+	for (auto &ref : references)
+		counts.push_back(ref.second);
+	sort(begin(counts), end(counts), greater<uint64_t>());
+
+	if (counts.size() < 2)
+		return 0.0;
+
+	double sum_x = 0.0, sum_y = 0.0, sum_xx = 0.0, sum_xy = 0.0;
+	for (size_t i = 0; i < counts.size(); i++)
+	{
+		double x = log(double(i + 1));
+		double y = log(double(counts[i]));
+		sum_x += x;
+		sum_y += y;
+		sum_xx += x * x;
+		sum_xy += x * y;
+	}
+
+	double n = double(counts.size());
+	double denom = n * sum_xx - sum_x * sum_x;
+	if (denom <= 0.0)
+		return 0.0;
+
+	double slope = (n * sum_xy - sum_x * sum_y) / denom;
+	return max(0.0, min(-slope, 3.0));
+}
+
+static bool fit_profile(const char *path, GeneratorProfile &profile)
+{
+	auto db = unique_ptr<DatabaseInterface>(create_database(path, DatabaseMode::ReadOnly));
+	if (!db || !db->prepare())
+	{
+		LOGE("Failed to open database: %s\n", path);
+		return false;
+	}
+
+	vector<Hash> hashes;
+	const auto count_tag = [&](ResourceTag tag, uint64_t &count) -> bool {
+		if (!get_hashes(*db, tag, hashes))
+			return false;
+		count = hashes.size();
+		return true;
+	};
+
+	if (!count_tag(RESOURCE_SAMPLER, profile.samplers) ||
+	    !count_tag(RESOURCE_DESCRIPTOR_SET_LAYOUT, profile.set_layouts) ||
+	    !count_tag(RESOURCE_PIPELINE_LAYOUT, profile.pipeline_layouts) ||
+	    !count_tag(RESOURCE_RENDER_PASS, profile.render_passes) ||
+	    !count_tag(RESOURCE_SHADER_MODULE, profile.shader_modules) ||
+	    !count_tag(RESOURCE_GRAPHICS_PIPELINE, profile.graphics_pipelines) ||
+	    !count_tag(RESOURCE_COMPUTE_PIPELINE, profile.compute_pipelines))
+	{
+		LOGE("Failed to get hashes from database.\n");
+		return false;
+	}
+
+	FitReplayer fit;
+	StateReplayer replayer;
+	replayer.set_resolve_shader_module_handles(false);
+	replayer.set_resolve_derivative_pipeline_handles(false);
+
+	if (!parse_tag(*db, replayer, fit, RESOURCE_SHADER_MODULE) ||
+	    !parse_tag(*db, replayer, fit, RESOURCE_GRAPHICS_PIPELINE) ||
+	    !parse_tag(*db, replayer, fit, RESOURCE_COMPUTE_PIPELINE))
+	{
+		LOGE("Failed to load blob from database.\n");
+		return false;
+	}
+
+	if (!fit.module_sizes.empty())
+	{
+		double sum = 0.0, sum_sq = 0.0;
+		for (auto size : fit.module_sizes)
+		{
+			double l = log(double(max<uint64_t>(size, 1)));
+			sum += l;
+			sum_sq += l * l;
+		}
+		double n = double(fit.module_sizes.size());
+		profile.module_size_log_mean = sum / n;
+		profile.module_size_log_sigma = sqrt(max(0.0, sum_sq / n - profile.module_size_log_mean * profile.module_size_log_mean));
+	}
+
+	profile.module_zipf_exponent = fit_zipf_exponent(fit.module_references);
+
+	if (fit.pipelines)
+		profile.derivative_ratio = double(fit.derivative_pipelines) / double(fit.pipelines);
+	if (fit.stages)
+		profile.spec_constant_ratio = double(fit.spec_constant_stages) / double(fit.stages);
+	if (profile.graphics_pipelines)
+	{
+		profile.tessellation_ratio = double(fit.tessellation_pipelines) / double(profile.graphics_pipelines);
+		profile.geometry_ratio = double(fit.geometry_pipelines) / double(profile.graphics_pipelines);
+	}
+
+	return true;
+}
+
+static void scale_profile(GeneratorProfile &profile, uint64_t pipeline_count)
+{
+	uint64_t current = profile.graphics_pipelines + profile.compute_pipelines;
+	if (!current)
+	{
+		profile.graphics_pipelines = pipeline_count;
+		return;
+	}
+
+	double factor = double(pipeline_count) / double(current);
+	const auto scale = [&](uint64_t &count) {
+		if (count)
+			count = max<uint64_t>(1, uint64_t(double(count) * factor + 0.5));
+	};
+
+	scale(profile.compute_pipelines);
+	profile.graphics_pipelines = pipeline_count > profile.compute_pipelines ? pipeline_count - profile.compute_pipelines : 0;
+	scale(profile.shader_modules);
+	scale(profile.samplers);
+	scale(profile.set_layouts);
+	scale(profile.pipeline_layouts);
+	scale(profile.render_passes);
+}
+
+// Printed as command line arguments, so a profile fitted to a private archive can be shared and reused.
+static void print_profile(const GeneratorProfile &profile)
+{
+	printf("--graphics-pipelines %" PRIu64 " --compute-pipelines %" PRIu64 " --shader-modules %" PRIu64
+	       " --samplers %" PRIu64 " --set-layouts %" PRIu64 " --pipeline-layouts %" PRIu64 " --render-passes %" PRIu64
+	       " --module-size-log-mean %.4f --module-size-log-sigma %.4f --module-zipf-exponent %.4f"
+	       " --derivative-ratio %.4f --spec-constant-ratio %.4f --tessellation-ratio %.4f --geometry-ratio %.4f\n",
+	       profile.graphics_pipelines, profile.compute_pipelines, profile.shader_modules,
+	       profile.samplers, profile.set_layouts, profile.pipeline_layouts, profile.render_passes,
+	       profile.module_size_log_mean, profile.module_size_log_sigma, profile.module_zipf_exponent,
+	       profile.derivative_ratio, profile.spec_constant_ratio, profile.tessellation_ratio, profile.geometry_ratio);
+}
+
+static void print_help()
+{
+	LOGI("fossilize-generate\n"
+	     "\t[--help]\n"
+	     "\t[--output <path>]\n"
+	     "\t[--seed <seed>]\n"
+	     "\t[--fit <archive>]\n"
+	     "\t[--pipelines <count>]\n"
+	     "\t[--graphics-pipelines <count>]\n"
+	     "\t[--compute-pipelines <count>]\n"
+	     "\t[--shader-modules <count>]\n"
+	     "\t[--samplers <count>]\n"
+	     "\t[--set-layouts <count>]\n"
+	     "\t[--pipeline-layouts <count>]\n"
+	     "\t[--render-passes <count>]\n"
+	     "\t[--module-size-log-mean <value>]\n"
+	     "\t[--module-size-log-sigma <value>]\n"
+	     "\t[--module-zipf-exponent <value>]\n"
+	     "\t[--derivative-ratio <ratio>]\n"
+	     "\t[--spec-constant-ratio <ratio>]\n"
+	     "\t[--tessellation-ratio <ratio>]\n"
+	     "\t[--geometry-ratio <ratio>]\n"
+	     "\t[--compress]\n"
+	     "\t[--checksum]\n"
+	     "\t[--print-profile]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	string output_path;
+	string fit_path;
+	unsigned seed = 0;
+	unsigned pipeline_count = 0;
+	bool compress = false;
+	bool checksum = false;
+	bool print = false;
+	vector<function<void (GeneratorProfile &)>> overrides;
+
+	CLICallbacks cbs;
+	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
+	cbs.add("--output", [&](CLIParser &parser) { output_path = parser.next_string(); });
+	cbs.add("--seed", [&](CLIParser &parser) { seed = parser.next_uint(); });
+	cbs.add("--fit", [&](CLIParser &parser) { fit_path = parser.next_string(); });
+	cbs.add("--pipelines", [&](CLIParser &parser) { pipeline_count = parser.next_uint(); });
+	cbs.add("--compress", [&](CLIParser &) { compress = true; });
+	cbs.add("--checksum", [&](CLIParser &) { checksum = true; });
+	cbs.add("--print-profile", [&](CLIParser &) { print = true; });
+
+	// Explicit parameters are applied on top of a fitted profile.
+#define COUNT_OPTION(opt, member) \
+	cbs.add(opt, [&](CLIParser &parser) { \
+		uint64_t value = parser.next_uint(); \
+		overrides.push_back([value](GeneratorProfile &profile) { profile.member = value; }); \
+	})
+#define DOUBLE_OPTION(opt, member) \
+	cbs.add(opt, [&](CLIParser &parser) { \
+		double value = parser.next_double(); \
+		overrides.push_back([value](GeneratorProfile &profile) { profile.member = value; }); \
+	})
+	COUNT_OPTION("--graphics-pipelines", graphics_pipelines);
+	COUNT_OPTION("--compute-pipelines", compute_pipelines);
+	COUNT_OPTION("--shader-modules", shader_modules);
+	COUNT_OPTION("--samplers", samplers);
+	COUNT_OPTION("--set-layouts", set_layouts);
+	COUNT_OPTION("--pipeline-layouts", pipeline_layouts);
+	COUNT_OPTION("--render-passes", render_passes);
+	DOUBLE_OPTION("--module-size-log-mean", module_size_log_mean);
+	DOUBLE_OPTION("--module-size-log-sigma", module_size_log_sigma);
+	DOUBLE_OPTION("--module-zipf-exponent", module_zipf_exponent);
+	DOUBLE_OPTION("--derivative-ratio", derivative_ratio);
+	DOUBLE_OPTION("--spec-constant-ratio", spec_constant_ratio);
+	DOUBLE_OPTION("--tessellation-ratio", tessellation_ratio);
+	DOUBLE_OPTION("--geometry-ratio", geometry_ratio);
+#undef COUNT_OPTION
+#undef DOUBLE_OPTION
+
+	cbs.error_handler = [] { print_help(); };
+
+	CLIParser parser(move(cbs), argc - 1, argv + 1);
+	if (!parser.parse())
+		return EXIT_FAILURE;
+	if (parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+	if (output_path.empty() && !print)
+	{
+		LOGE("Need an output path or --print-profile.\n");
+		print_help();
+		return EXIT_FAILURE;
+	}
+
+	GeneratorProfile profile;
+	if (!fit_path.empty())
+	{
+		LOGI("Fitting profile to %s.\n", fit_path.c_str());
+		if (!fit_profile(fit_path.c_str(), profile))
+			return EXIT_FAILURE;
+	}
+
+	for (auto &override_profile : overrides)
+		override_profile(profile);
+
+	if (pipeline_count)
+		scale_profile(profile, pipeline_count);
+
+	if (print)
+		print_profile(profile);
+
+	if (output_path.empty())
+		return EXIT_SUCCESS;
+
+	remove(output_path.c_str());
+	auto db = unique_ptr<DatabaseInterface>(create_database(output_path.c_str(), DatabaseMode::OverWrite));
+	if (!db)
+	{
+		LOGE("Failed to create database: %s\n", output_path.c_str());
+		return EXIT_FAILURE;
+	}
+
+	bool success;
+	{
+		StateRecorder recorder;
+		recorder.set_database_enable_compression(compress);
+		recorder.set_database_enable_checksum(checksum);
+		recorder.init_recording_thread(db.get());
+
+		ArchiveGenerator generator(profile, seed);
+		success = generator.generate(recorder);
+		// The recorder flushes everything to the database when it goes out of scope.
+	}
+
+	if (!success)
+	{
+		LOGE("Failed to generate archive.\n");
+		return EXIT_FAILURE;
+	}
+
+	LOGI("Wrote %s.\n", output_path.c_str());
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,770 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "fossilize.hpp"
+#include "fossilize_db.hpp"
+#include "cli_parser.hpp"
+#include "logging.hpp"
+#include "concurrent_read_database.hpp"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include "fossilize_inttypes.h"
+
+using namespace Fossilize;
+using namespace std;
+
+static void print_help()
+{
+	LOGI("Usage: fossilize-graph\n"
+	     "\t[--help]\n"
+	     "\t[--num-threads <count>]\n"
+	     "\t[--top <count>]\n"
+	     "\t[--partitions <count>]\n"
+	     "\t[--partition-slack <percent>]\n"
+	     "\t[--partition-output <path>]\n"
+	     "\tdatabase.foz [database2.foz ...]\n");
+}
+
+template <typename T>
+static inline T fake_handle(uint64_t v)
+{
+	return (T)v;
+}
+
+struct PipelineNode
+{
+	Hash hash = 0;
+	Hash layout = 0;
+	Hash render_pass = 0;
+	vector<Hash> module_hashes;
+	vector<uint32_t> modules;
+};
+
+struct ModuleNode
+{
+	Hash hash = 0;
+	uint64_t size = 0;
+	uint32_t pipeline_count = 0;
+	bool present = false;
+};
+
+struct GraphReplayer : StateCreatorInterface
+{
+	// Points to the node of the blob currently being parsed.
+	PipelineNode *current_pipeline = nullptr;
+	uint64_t *current_module_size = nullptr;
+
+	bool enqueue_create_sampler(Hash hash, const VkSamplerCreateInfo *, VkSampler *sampler) override
+	{
+		*sampler = fake_handle<VkSampler>(hash);
+		return true;
+	}
+
+	bool enqueue_create_descriptor_set_layout(Hash hash, const VkDescriptorSetLayoutCreateInfo *, VkDescriptorSetLayout *layout) override
+	{
+		*layout = fake_handle<VkDescriptorSetLayout>(hash);
+		return true;
+	}
+
+	bool enqueue_create_pipeline_layout(Hash hash, const VkPipelineLayoutCreateInfo *, VkPipelineLayout *layout) override
+	{
+		*layout = fake_handle<VkPipelineLayout>(hash);
+		return true;
+	}
+
+	bool enqueue_create_shader_module(Hash hash, const VkShaderModuleCreateInfo *create_info, VkShaderModule *module) override
+	{
+		*module = fake_handle<VkShaderModule>(hash);
+		if (current_module_size)
+			*current_module_size = create_info->codeSize;
+		return true;
+	}
+
+	bool enqueue_create_render_pass(Hash hash, const VkRenderPassCreateInfo *, VkRenderPass *render_pass) override
+	{
+		*render_pass = fake_handle<VkRenderPass>(hash);
+		return true;
+	}
+
+	bool enqueue_create_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(hash);
+		if (current_pipeline && current_pipeline->hash == hash)
+		{
+			current_pipeline->layout = (Hash)create_info->layout;
+			current_pipeline->module_hashes.push_back((Hash)create_info->stage.module);
+		}
+		return true;
+	}
+
+	bool enqueue_create_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(hash);
+		if (current_pipeline && current_pipeline->hash == hash)
+		{
+			current_pipeline->layout = (Hash)create_info->layout;
+			current_pipeline->render_pass = (Hash)create_info->renderPass;
+			for (uint32_t i = 0; i < create_info->stageCount; i++)
+				current_pipeline->module_hashes.push_back((Hash)create_info->pStages[i].module);
+		}
+		return true;
+	}
+};
+
+struct GraphWorker
+{
+	StateReplayer replayer;
+	GraphReplayer graph_replayer;
+	vector<uint8_t> state_json;
+};
+
+static void run_threaded(size_t count, unsigned num_threads, const function<void (unsigned, size_t)> &func)
+{
+	atomic<size_t> next_index(0);
+	vector<thread> threads;
+
+	for (unsigned i = 0; i < num_threads; i++)
+	{
+		threads.emplace_back([&, i]() {
+			size_t index;
+			while ((index = next_index.fetch_add(1, memory_order_relaxed)) < count)
+				func(i, index);
+		});
+	}
+
+	for (auto &t : threads)
+		t.join();
+}
+
+static bool get_hashes(DatabaseInterface &db, ResourceTag tag, vector<Hash> &hashes)
+{
+	size_t hash_count = 0;
+	if (!db.get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
+		return false;
+	hashes.resize(hash_count);
+	return db.get_hash_list_for_resource_tag(tag, &hash_count, hashes.data());
+}
+
+static bool parse_blob(DatabaseInterface &db, DatabaseInterface &resolver, GraphWorker &worker,
+                       ResourceTag tag, Hash hash, PayloadReadFlags flags)
+{
+	size_t state_json_size = 0;
+	if (!db.read_entry(tag, hash, &state_json_size, nullptr, flags))
+		return false;
+	worker.state_json.resize(state_json_size);
+	if (!db.read_entry(tag, hash, &state_json_size, worker.state_json.data(), flags))
+		return false;
+
+	bool ret = worker.replayer.parse(worker.graph_replayer, &resolver, worker.state_json.data(), worker.state_json.size());
+
+	// Nothing parsed here is referenced by later blobs, so the scratch memory can be recycled right away.
+	if (tag == RESOURCE_SHADER_MODULE || tag == RESOURCE_GRAPHICS_PIPELINE || tag == RESOURCE_COMPUTE_PIPELINE)
+		worker.replayer.get_allocator().reset();
+	return ret;
+}
+
+struct Graph
+{
+	vector<ModuleNode> modules;
+	// Graphics pipelines followed by compute pipelines, in the order fossilize-replay compiles them.
+	vector<PipelineNode> pipelines;
+	size_t num_graphics_pipelines = 0;
+	size_t missing_modules = 0;
+};
+
+static bool build_graph(DatabaseInterface &db, unsigned num_threads, Graph &graph)
+{
+	// The state objects pipelines refer to are few and cheap, parse them up front.
+	static const ResourceTag state_tags[] = {
+		RESOURCE_SAMPLER,
+		RESOURCE_DESCRIPTOR_SET_LAYOUT,
+		RESOURCE_PIPELINE_LAYOUT,
+		RESOURCE_RENDER_PASS,
+	};
+
+	GraphWorker base;
+	base.replayer.set_resolve_shader_module_handles(false);
+	vector<Hash> hashes;
+
+	for (auto tag : state_tags)
+	{
+		if (!get_hashes(db, tag, hashes))
+		{
+			LOGE("Failed to get hashes.\n");
+			return false;
+		}
+
+		for (auto hash : hashes)
+		{
+			if (!parse_blob(db, db, base, tag, hash, PAYLOAD_READ_NO_FLAGS))
+				LOGE("Failed to parse blob (tag: %d, hash: 0x%016" PRIx64 ").\n", tag, hash);
+		}
+	}
+
+	ConcurrentReadDatabase resolver(db);
+	vector<unique_ptr<GraphWorker>> workers;
+	for (unsigned i = 0; i < num_threads; i++)
+	{
+		auto *worker = new GraphWorker;
+		workers.emplace_back(worker);
+		worker->replayer.copy_handle_references(base.replayer);
+		worker->replayer.set_resolve_shader_module_handles(false);
+		worker->replayer.set_resolve_derivative_pipeline_handles(false);
+	}
+
+	// Module sizes are what the replayer's shader module cache is budgeted by.
+	if (!get_hashes(db, RESOURCE_SHADER_MODULE, hashes))
+	{
+		LOGE("Failed to get hashes.\n");
+		return false;
+	}
+
+	graph.modules.resize(hashes.size());
+	run_threaded(hashes.size(), num_threads, [&](unsigned thread_index, size_t index) {
+		auto &worker = *workers[thread_index];
+		auto &module = graph.modules[index];
+		module.hash = hashes[index];
+		module.present = true;
+		worker.graph_replayer.current_module_size = &module.size;
+		if (!parse_blob(db, resolver, worker, RESOURCE_SHADER_MODULE, module.hash, PAYLOAD_READ_CONCURRENT_BIT))
+			LOGE("Failed to parse shader module 0x%016" PRIx64 ".\n", module.hash);
+		worker.graph_replayer.current_module_size = nullptr;
+	});
+
+	vector<Hash> graphics_hashes, compute_hashes;
+	if (!get_hashes(db, RESOURCE_GRAPHICS_PIPELINE, graphics_hashes) ||
+	    !get_hashes(db, RESOURCE_COMPUTE_PIPELINE, compute_hashes))
+	{
+		LOGE("Failed to get hashes.\n");
+		return false;
+	}
+
+	graph.num_graphics_pipelines = graphics_hashes.size();
+	graph.pipelines.resize(graphics_hashes.size() + compute_hashes.size());
+
+	// Every pipeline writes only to its own node, so the edges come out in the same order regardless of thread count.
+	run_threaded(graph.pipelines.size(), num_threads, [&](unsigned thread_index, size_t index) {
+		auto &worker = *workers[thread_index];
+		auto &node = graph.pipelines[index];
+		bool is_graphics = index < graph.num_graphics_pipelines;
+		auto tag = is_graphics ? RESOURCE_GRAPHICS_PIPELINE : RESOURCE_COMPUTE_PIPELINE;
+		node.hash = is_graphics ? graphics_hashes[index] : compute_hashes[index - graph.num_graphics_pipelines];
+
+		worker.graph_replayer.current_pipeline = &node;
+		if (!parse_blob(db, resolver, worker, tag, node.hash, PAYLOAD_READ_CONCURRENT_BIT))
+			LOGE("Failed to parse blob (tag: %d, hash: 0x%016" PRIx64 ").\n", tag, node.hash);
+		worker.graph_replayer.current_pipeline = nullptr;
+	});
+
+	// Resolve module hashes to indices. Modules referenced but not present in the archive get a zero-sized node.
+	unordered_map<Hash, uint32_t> module_indices;
+	module_indices.reserve(graph.modules.size());
+	for (size_t i = 0; i < graph.modules.size(); i++)
+		module_indices[graph.modules[i].hash] = uint32_t(i);
+
+	for (auto &node : graph.pipelines)
+	{
+		for (auto hash : node.module_hashes)
+		{
+			auto itr = module_indices.find(hash);
+			uint32_t index;
+			if (itr == end(module_indices))
+			{
+				index = uint32_t(graph.modules.size());
+				module_indices[hash] = index;
+				ModuleNode module;
+				module.hash = hash;
+				graph.modules.push_back(module);
+				graph.missing_modules++;
+			}
+			else
+				index = itr->second;
+
+			// A pipeline may use the same module for several stages, it is still a single edge.
+			if (find(begin(node.modules), end(node.modules), index) == end(node.modules))
+			{
+				node.modules.push_back(index);
+				graph.modules[index].pipeline_count++;
+			}
+		}
+
+		node.module_hashes.clear();
+		node.module_hashes.shrink_to_fit();
+	}
+
+	return true;
+}
+
+struct DisjointSet
+{
+	explicit DisjointSet(size_t count)
+		: parents(count)
+	{
+		for (size_t i = 0; i < count; i++)
+			parents[i] = uint32_t(i);
+	}
+
+	uint32_t find(uint32_t index)
+	{
+		while (parents[index] != index)
+		{
+			parents[index] = parents[parents[index]];
+			index = parents[index];
+		}
+		return index;
+	}
+
+	void merge(uint32_t a, uint32_t b)
+	{
+		a = find(a);
+		b = find(b);
+		if (a != b)
+			parents[max(a, b)] = min(a, b);
+	}
+
+	vector<uint32_t> parents;
+};
+
+struct Cluster
+{
+	size_t pipelines = 0;
+	size_t modules = 0;
+	uint64_t module_size = 0;
+	Hash representative = 0;
+};
+
+static double size_in_mib(uint64_t size)
+{
+	return double(size) / (1024.0 * 1024.0);
+}
+
+static void report_clusters(const Graph &graph, unsigned top)
+{
+	DisjointSet sets(graph.modules.size());
+	for (auto &node : graph.pipelines)
+		for (size_t i = 1; i < node.modules.size(); i++)
+			sets.merge(node.modules[0], node.modules[i]);
+
+	unordered_map<uint32_t, Cluster> clusters;
+	for (size_t i = 0; i < graph.modules.size(); i++)
+	{
+		auto &module = graph.modules[i];
+		if (module.pipeline_count == 0)
+			continue;
+
+		auto &cluster = clusters[sets.find(uint32_t(i))];
+		if (cluster.modules == 0)
+			cluster.representative = module.hash;
+		cluster.modules++;
+		cluster.module_size += module.size;
+	}
+
+	for (auto &node : graph.pipelines)
+		if (!node.modules.empty())
+			clusters[sets.find(node.modules.front())].pipelines++;
+
+	vector<Cluster> sorted_clusters;
+	sorted_clusters.reserve(clusters.size());
+	size_t singleton_clusters = 0;
+	for (auto &cluster : clusters)
+	{
+		if (cluster.second.pipelines == 1)
+			singleton_clusters++;
+		sorted_clusters.push_back(cluster.second);
+	}
+
+	sort(begin(sorted_clusters), end(sorted_clusters), [](const Cluster &a, const Cluster &b) {
+		if (a.pipelines != b.pipelines)
+			return a.pipelines > b.pipelines;
+		return a.representative < b.representative;
+	});
+
+	size_t unreferenced_modules = 0;
+	vector<uint32_t> fan_in;
+	fan_in.reserve(graph.modules.size());
+	for (auto &module : graph.modules)
+	{
+		if (module.pipeline_count == 0)
+			unreferenced_modules++;
+		else
+			fan_in.push_back(module.pipeline_count);
+	}
+	sort(begin(fan_in), end(fan_in));
+
+	const auto percentile = [&](double p) -> uint32_t {
+		if (fan_in.empty())
+			return 0;
+		return fan_in[min(fan_in.size() - 1, size_t(p * double(fan_in.size())))];
+	};
+
+	unordered_map<Hash, size_t> layout_users, render_pass_users;
+	for (auto &node : graph.pipelines)
+	{
+		layout_users[node.layout]++;
+		if (node.render_pass)
+			render_pass_users[node.render_pass]++;
+	}
+
+	const auto max_users = [](const unordered_map<Hash, size_t> &users) -> size_t {
+		size_t ret = 0;
+		for (auto &user : users)
+			ret = max(ret, user.second);
+		return ret;
+	};
+
+	printf("=== Reference graph ===\n");
+	printf("  Graphics pipelines: %" PRIu64 "\n", uint64_t(graph.num_graphics_pipelines));
+	printf("  Compute pipelines: %" PRIu64 "\n", uint64_t(graph.pipelines.size() - graph.num_graphics_pipelines));
+	printf("  Shader modules: %" PRIu64 " (%" PRIu64 " unreferenced, %" PRIu64 " missing from archive)\n",
+	       uint64_t(graph.modules.size()), uint64_t(unreferenced_modules), uint64_t(graph.missing_modules));
+	printf("  Pipelines per module: median %u, p90 %u, p99 %u, max %u\n",
+	       percentile(0.5), percentile(0.9), percentile(0.99), fan_in.empty() ? 0u : fan_in.back());
+	printf("  Pipeline layouts in use: %" PRIu64 " (most shared: %" PRIu64 " pipelines)\n",
+	       uint64_t(layout_users.size()), uint64_t(max_users(layout_users)));
+	printf("  Render passes in use: %" PRIu64 " (most shared: %" PRIu64 " pipelines)\n",
+	       uint64_t(render_pass_users.size()), uint64_t(max_users(render_pass_users)));
+
+	printf("=== Clusters (pipelines connected through shared modules) ===\n");
+	printf("  Clusters: %" PRIu64 " (%" PRIu64 " with a single pipeline)\n",
+	       uint64_t(sorted_clusters.size()), uint64_t(singleton_clusters));
+	for (size_t i = 0; i < sorted_clusters.size() && i < top; i++)
+	{
+		auto &cluster = sorted_clusters[i];
+		printf("  #%" PRIu64 ": %" PRIu64 " pipelines, %" PRIu64 " modules, %.3f MiB of SPIR-V (module %016" PRIx64 ")\n",
+		       uint64_t(i), uint64_t(cluster.pipelines), uint64_t(cluster.modules),
+		       size_in_mib(cluster.module_size), cluster.representative);
+	}
+}
+
+struct FenwickTree
+{
+	explicit FenwickTree(size_t count)
+		: values(count + 1)
+	{
+	}
+
+	void add(size_t index, int64_t value)
+	{
+		for (index++; index < values.size(); index += index & (~index + 1))
+			values[index] += value;
+	}
+
+	// Sum of [0, index).
+	int64_t prefix_sum(size_t index) const
+	{
+		int64_t sum = 0;
+		for (; index > 0; index -= index & (~index + 1))
+			sum += values[index];
+		return sum;
+	}
+
+	vector<int64_t> values;
+};
+
+struct CacheRequirement
+{
+	// Size where every module referenced by the range stays resident.
+	uint64_t working_set_size = 0;
+	// Smallest LRU cache size where no module is evicted before its last use.
+	uint64_t no_reload_size = 0;
+	size_t pipelines = 0;
+};
+
+// For an LRU cache, a module is still resident at its next use iff the modules used since its last use,
+// including itself, fit in the cache. That is its reuse distance, weighted by module size.
+// The maximum reuse distance over the range is the smallest cache size which never needs to reload a module.
+static CacheRequirement compute_cache_requirement(const Graph &graph, size_t graphics_begin, size_t graphics_end,
+                                                  size_t compute_begin, size_t compute_end)
+{
+	CacheRequirement req;
+	vector<const PipelineNode *> order;
+	for (size_t i = graphics_begin; i < graphics_end; i++)
+		order.push_back(&graph.pipelines[i]);
+	for (size_t i = compute_begin; i < compute_end; i++)
+		order.push_back(&graph.pipelines[graph.num_graphics_pipelines + i]);
+	req.pipelines = order.size();
+
+	size_t num_accesses = 0;
+	for (auto *node : order)
+		num_accesses += node->modules.size();
+
+	FenwickTree tree(num_accesses);
+	unordered_map<uint32_t, size_t> last_access;
+	size_t position = 0;
+
+	for (auto *node : order)
+	{
+		for (auto index : node->modules)
+		{
+			auto size = int64_t(graph.modules[index].size);
+			auto itr = last_access.find(index);
+			if (itr != end(last_access))
+			{
+				auto distance = uint64_t(tree.prefix_sum(position) - tree.prefix_sum(itr->second));
+				req.no_reload_size = max(req.no_reload_size, distance);
+				tree.add(itr->second, -size);
+				itr->second = position;
+			}
+			else
+			{
+				last_access[index] = position;
+				req.working_set_size += uint64_t(size);
+			}
+
+			tree.add(position, size);
+			position++;
+		}
+	}
+
+	return req;
+}
+
+struct Partition
+{
+	size_t graphics_begin = 0, graphics_end = 0;
+	size_t compute_begin = 0, compute_end = 0;
+	CacheRequirement cache;
+};
+
+// Splits a range of the replay order into contiguous ranges of roughly equal size, since pipeline ranges are
+// all fossilize-replay can take. Within the allowed slack, each cut is moved to where the fewest module bytes are
+// used on both sides of it, as those modules have to be compiled by both processes.
+static vector<size_t> choose_cuts(const Graph &graph, size_t first_pipeline, size_t num_pipelines,
+                                  unsigned count, unsigned slack_percent)
+{
+	unordered_map<uint32_t, pair<size_t, size_t>> first_last;
+	for (size_t i = 0; i < num_pipelines; i++)
+	{
+		for (auto index : graph.pipelines[first_pipeline + i].modules)
+		{
+			auto itr = first_last.find(index);
+			if (itr == end(first_last))
+				first_last[index] = { i, i };
+			else
+				itr->second.second = i;
+		}
+	}
+
+	// crossing[c] is the size of modules used by pipelines both before and at or after cut c.
+	vector<int64_t> crossing(num_pipelines + 1);
+	for (auto &range : first_last)
+	{
+		auto size = int64_t(graph.modules[range.first].size);
+		crossing[range.second.first + 1] += size;
+		crossing[range.second.second + 1] -= size;
+	}
+	for (size_t i = 1; i <= num_pipelines; i++)
+		crossing[i] += crossing[i - 1];
+
+	const auto distance = [](size_t a, size_t b) { return a > b ? a - b : b - a; };
+
+	vector<size_t> cuts = { 0 };
+	size_t window = (num_pipelines * slack_percent) / (100 * size_t(count));
+	for (unsigned k = 1; k < count; k++)
+	{
+		size_t target = (k * num_pipelines) / count;
+		size_t lo = max(cuts.back(), target > window ? target - window : 0);
+		size_t hi = min(num_pipelines, target + window);
+		size_t best = max(lo, min(hi, target));
+
+		for (size_t c = lo; c <= hi; c++)
+		{
+			if (crossing[c] < crossing[best] ||
+			    (crossing[c] == crossing[best] && distance(c, target) < distance(best, target)))
+				best = c;
+		}
+		cuts.push_back(best);
+	}
+	cuts.push_back(num_pipelines);
+	return cuts;
+}
+
+static vector<Partition> compute_partitions(const Graph &graph, const vector<size_t> &graphics_cuts,
+                                            const vector<size_t> &compute_cuts, unsigned num_threads)
+{
+	vector<Partition> partitions(graphics_cuts.size() - 1);
+	run_threaded(partitions.size(), num_threads, [&](unsigned, size_t i) {
+		auto &partition = partitions[i];
+		partition.graphics_begin = graphics_cuts[i];
+		partition.graphics_end = graphics_cuts[i + 1];
+		partition.compute_begin = compute_cuts[i];
+		partition.compute_end = compute_cuts[i + 1];
+		partition.cache = compute_cache_requirement(graph, partition.graphics_begin, partition.graphics_end,
+		                                            partition.compute_begin, partition.compute_end);
+	});
+	return partitions;
+}
+
+static uint64_t total_working_set(const vector<Partition> &partitions)
+{
+	uint64_t total = 0;
+	for (auto &partition : partitions)
+		total += partition.cache.working_set_size;
+	return total;
+}
+
+static unsigned shader_cache_size_mb(uint64_t size)
+{
+	return max(1u, unsigned((size + 1024 * 1024 - 1) / (1024 * 1024)));
+}
+
+static bool write_partitions(const string &path, const vector<Partition> &partitions)
+{
+	FILE *file = fopen(path.c_str(), "w");
+	if (!file)
+	{
+		LOGE("Failed to open %s for writing.\n", path.c_str());
+		return false;
+	}
+
+	// One set of arguments per line, e.g. for xargs -L 1 fossilize-replay --master-process database.foz.
+	// Each partition is meant to be its own master process, so the cache size is not split further.
+	for (auto &partition : partitions)
+	{
+		fprintf(file, "--num-threads 1 --graphics-pipeline-range %" PRIu64 " %" PRIu64
+		              " --compute-pipeline-range %" PRIu64 " %" PRIu64 " --shader-cache-size %u\n",
+		        uint64_t(partition.graphics_begin), uint64_t(partition.graphics_end),
+		        uint64_t(partition.compute_begin), uint64_t(partition.compute_end),
+		        shader_cache_size_mb(partition.cache.no_reload_size));
+	}
+
+	bool ret = ferror(file) == 0;
+	if (fclose(file) != 0)
+		ret = false;
+	if (!ret)
+		LOGE("Failed to write %s.\n", path.c_str());
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	vector<const char *> databases;
+	unsigned num_threads = thread::hardware_concurrency();
+	unsigned num_partitions = 0;
+	unsigned slack_percent = 10;
+	unsigned top = 10;
+	string partition_output;
+
+	CLICallbacks cbs;
+	cbs.default_handler = [&](const char *arg) { databases.push_back(arg); };
+	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
+	cbs.add("--num-threads", [&](CLIParser &parser) { num_threads = parser.next_uint(); });
+	cbs.add("--top", [&](CLIParser &parser) { top = parser.next_uint(); });
+	cbs.add("--partitions", [&](CLIParser &parser) { num_partitions = parser.next_uint(); });
+	cbs.add("--partition-slack", [&](CLIParser &parser) { slack_percent = parser.next_uint(); });
+	cbs.add("--partition-output", [&](CLIParser &parser) { partition_output = parser.next_string(); });
+	cbs.error_handler = [] { print_help(); };
+
+	CLIParser parser(move(cbs), argc - 1, argv + 1);
+	if (!parser.parse())
+		return EXIT_FAILURE;
+	if (parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+	if (databases.empty())
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+
+	if (num_threads < 1)
+		num_threads = 1;
+	if (!partition_output.empty() && num_partitions == 0)
+		num_partitions = num_threads;
+
+	// Open the archives the same way fossilize-replay does, so pipeline indices match.
+	unique_ptr<DatabaseInterface> db;
+	if (databases.size() == 1)
+		db.reset(create_database(databases.front(), DatabaseMode::ReadOnly));
+	else
+		db.reset(create_concurrent_database(nullptr, DatabaseMode::ReadOnly, databases.data(), databases.size()));
+
+	if (!db || !db->prepare())
+	{
+		LOGE("Failed to open database.\n");
+		return EXIT_FAILURE;
+	}
+
+	Graph graph;
+	if (!build_graph(*db, num_threads, graph))
+		return EXIT_FAILURE;
+
+	report_clusters(graph, top);
+
+	size_t num_compute_pipelines = graph.pipelines.size() - graph.num_graphics_pipelines;
+	auto whole = compute_cache_requirement(graph, 0, graph.num_graphics_pipelines, 0, num_compute_pipelines);
+	printf("=== Shader module cache (replay order) ===\n");
+	printf("  Referenced modules: %.3f MiB\n", size_in_mib(whole.working_set_size));
+	printf("  Smallest cache without reloading modules: %.3f MiB (--shader-cache-size %u)\n",
+	       size_in_mib(whole.no_reload_size), shader_cache_size_mb(whole.no_reload_size));
+
+	if (num_partitions == 0)
+		return EXIT_SUCCESS;
+
+	// What --master-process does on its own: equally sized ranges.
+	vector<size_t> even_graphics_cuts, even_compute_cuts;
+	for (unsigned i = 0; i <= num_partitions; i++)
+	{
+		even_graphics_cuts.push_back((i * graph.num_graphics_pipelines) / num_partitions);
+		even_compute_cuts.push_back((i * num_compute_pipelines) / num_partitions);
+	}
+	auto even = compute_partitions(graph, even_graphics_cuts, even_compute_cuts, num_threads);
+
+	auto partitions = compute_partitions(graph,
+	                                     choose_cuts(graph, 0, graph.num_graphics_pipelines, num_partitions, slack_percent),
+	                                     choose_cuts(graph, graph.num_graphics_pipelines, num_compute_pipelines,
+	                                                 num_partitions, slack_percent),
+	                                     num_threads);
+
+	printf("=== Recommended partitions ===\n");
+	for (size_t i = 0; i < partitions.size(); i++)
+	{
+		auto &partition = partitions[i];
+		printf("  #%" PRIu64 ": graphics [%" PRIu64 ", %" PRIu64 "), compute [%" PRIu64 ", %" PRIu64 "), "
+		       "%.3f MiB of modules, cache without reloads: %.3f MiB\n",
+		       uint64_t(i),
+		       uint64_t(partition.graphics_begin), uint64_t(partition.graphics_end),
+		       uint64_t(partition.compute_begin), uint64_t(partition.compute_end),
+		       size_in_mib(partition.cache.working_set_size), size_in_mib(partition.cache.no_reload_size));
+	}
+
+	printf("  Module compilation across partitions: %.3f MiB (even split: %.3f MiB, no split: %.3f MiB)\n",
+	       size_in_mib(total_working_set(partitions)), size_in_mib(total_working_set(even)),
+	       size_in_mib(whole.working_set_size));
+
+	if (!partition_output.empty())
+	{
+		if (!write_partitions(partition_output, partitions))
+			return EXIT_FAILURE;
+		LOGI("Wrote %u partitions to %s.\n", num_partitions, partition_output.c_str());
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -24,8 +24,16 @@
 #include "fossilize_db.hpp"
 #include "cli_parser.hpp"
 #include "layer/utils.hpp"
+#include "fossilize.hpp"
+#include "concurrent_read_database.hpp"
 #include <memory>
 #include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <atomic>
+#include <mutex>
 
 using namespace Fossilize;
 using namespace std;
@@ -34,7 +42,454 @@ static void print_help()
 {
 	LOGI("Usage: fossilize-list\n"
 	     "\t<database path>\n"
-	     "\t[--tag index]\n");
+	     "\t[--tag index]\n"
+	     "\t[--stats]\n"
+	     "\t[--top <count>]\n"
+	     "\t[--references]\n"
+	     "\t[--per-application]\n"
+	     "\t[--num-threads <count>]\n");
+}
+
+static const char *tag_names[] = {
+	"AppInfo",
+	"Sampler",
+	"Descriptor Set Layout",
+	"Pipeline Layout",
+	"Shader Module",
+	"Render Pass",
+	"Graphics Pipeline",
+	"Compute Pipeline",
+	"Application Blob Link",
+};
+
+template <typename T>
+static inline T fake_handle(uint64_t v)
+{
+	return (T)v;
+}
+
+struct EntrySize
+{
+	Hash hash;
+	uint64_t stored_size;
+	uint64_t uncompressed_size;
+};
+
+// Only queries sizes, which the stream archive knows from its index, so no payload is read.
+static bool get_entry_sizes(DatabaseInterface &db, ResourceTag tag, vector<EntrySize> &sizes)
+{
+	size_t hash_count = 0;
+	if (!db.get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
+		return false;
+	vector<Hash> hashes(hash_count);
+	if (!db.get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
+		return false;
+
+	sizes.clear();
+	sizes.reserve(hash_count);
+	for (auto hash : hashes)
+	{
+		EntrySize size = { hash, 0, 0 };
+		size_t blob_size = 0;
+		if (!db.read_entry(tag, hash, &blob_size, nullptr, PAYLOAD_READ_NO_FLAGS))
+			return false;
+		size.uncompressed_size = blob_size;
+
+		// Not all backends support raw reads, the payload is stored as-is in that case.
+		if (db.read_entry(tag, hash, &blob_size, nullptr, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+			size.stored_size = blob_size;
+		else
+			size.stored_size = size.uncompressed_size;
+
+		sizes.push_back(size);
+	}
+
+	return true;
+}
+
+static uint64_t get_percentile(const vector<uint64_t> &sorted_values, unsigned percentile)
+{
+	if (sorted_values.empty())
+		return 0;
+	size_t index = (sorted_values.size() - 1) * percentile / 100;
+	return sorted_values[index];
+}
+
+static void print_tag_stats(ResourceTag tag, vector<EntrySize> &sizes, unsigned top_count)
+{
+	uint64_t total_stored = 0;
+	uint64_t total_uncompressed = 0;
+	vector<uint64_t> stored_sizes;
+	stored_sizes.reserve(sizes.size());
+	for (auto &size : sizes)
+	{
+		total_stored += size.stored_size;
+		total_uncompressed += size.uncompressed_size;
+		stored_sizes.push_back(size.stored_size);
+	}
+	sort(begin(stored_sizes), end(stored_sizes));
+
+	printf("%s (tag %d):\n", tag_names[tag], int(tag));
+	printf("  entries: %" PRIu64 "\n", uint64_t(sizes.size()));
+	printf("  stored bytes: %" PRIu64 "\n", total_stored);
+	printf("  uncompressed bytes: %" PRIu64 "\n", total_uncompressed);
+	if (total_stored != 0)
+		printf("  compression ratio: %.3f\n", double(total_uncompressed) / double(total_stored));
+
+	if (sizes.empty())
+		return;
+
+	printf("  stored size p50 / p90 / p99 / max: %" PRIu64 " / %" PRIu64 " / %" PRIu64 " / %" PRIu64 "\n",
+	       get_percentile(stored_sizes, 50), get_percentile(stored_sizes, 90),
+	       get_percentile(stored_sizes, 99), stored_sizes.back());
+
+	unsigned count = unsigned(std::min<size_t>(top_count, sizes.size()));
+	if (count == 0)
+		return;
+
+	partial_sort(begin(sizes), begin(sizes) + count, end(sizes), [](const EntrySize &a, const EntrySize &b) {
+		if (a.stored_size != b.stored_size)
+			return a.stored_size > b.stored_size;
+		return a.hash < b.hash;
+	});
+
+	printf("  largest entries (hash, stored bytes, uncompressed bytes):\n");
+	for (unsigned i = 0; i < count; i++)
+	{
+		printf("    %016" PRIx64 " %" PRIu64 " %" PRIu64 "\n",
+		       sizes[i].hash, sizes[i].stored_size, sizes[i].uncompressed_size);
+	}
+}
+
+// Collects shader module references of pipelines and application links.
+// Other objects are only resolved as dependencies, and are not interesting.
+struct StatsReplayer : StateCreatorInterface
+{
+	unordered_map<Hash, unsigned> module_references;
+	vector<Hash> pipeline_modules;
+	struct Link
+	{
+		Hash application_hash;
+		ResourceTag tag;
+		Hash hash;
+	};
+	vector<Link> links;
+
+	void notify_application_info_link(Hash, Hash application_hash, ResourceTag tag, Hash hash) override
+	{
+		links.push_back({ application_hash, tag, hash });
+	}
+
+	bool enqueue_create_sampler(Hash hash, const VkSamplerCreateInfo *, VkSampler *sampler) override
+	{
+		*sampler = fake_handle<VkSampler>(hash);
+		return true;
+	}
+
+	bool enqueue_create_descriptor_set_layout(Hash hash, const VkDescriptorSetLayoutCreateInfo *, VkDescriptorSetLayout *layout) override
+	{
+		*layout = fake_handle<VkDescriptorSetLayout>(hash);
+		return true;
+	}
+
+	bool enqueue_create_pipeline_layout(Hash hash, const VkPipelineLayoutCreateInfo *, VkPipelineLayout *layout) override
+	{
+		*layout = fake_handle<VkPipelineLayout>(hash);
+		return true;
+	}
+
+	bool enqueue_create_shader_module(Hash hash, const VkShaderModuleCreateInfo *, VkShaderModule *module) override
+	{
+		*module = fake_handle<VkShaderModule>(hash);
+		return true;
+	}
+
+	bool enqueue_create_render_pass(Hash hash, const VkRenderPassCreateInfo *, VkRenderPass *render_pass) override
+	{
+		*render_pass = fake_handle<VkRenderPass>(hash);
+		return true;
+	}
+
+	// A module used by several stages of a pipeline is only counted once.
+	void add_pipeline_module(Hash module)
+	{
+		if (find(begin(pipeline_modules), end(pipeline_modules), module) == end(pipeline_modules))
+		{
+			pipeline_modules.push_back(module);
+			module_references[module]++;
+		}
+	}
+
+	bool enqueue_create_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(hash);
+		pipeline_modules.clear();
+		add_pipeline_module((Hash)create_info->stage.module);
+		return true;
+	}
+
+	bool enqueue_create_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(hash);
+		pipeline_modules.clear();
+		for (uint32_t i = 0; i < create_info->stageCount; i++)
+			add_pipeline_module((Hash)create_info->pStages[i].module);
+		return true;
+	}
+};
+
+// Decodes all blobs of a tag on multiple threads, each with its own replayer.
+static bool parse_blobs_threaded(DatabaseInterface &db, ResourceTag tag, unsigned num_threads,
+                                 vector<unique_ptr<StatsReplayer>> &stats_replayers)
+{
+	size_t hash_count = 0;
+	if (!db.get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
+		return false;
+	vector<Hash> hashes(hash_count);
+	if (!db.get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
+		return false;
+
+	ConcurrentReadDatabase resolver(db);
+	atomic<size_t> next_index(0);
+	atomic<bool> failed(false);
+	vector<thread> threads;
+
+	while (stats_replayers.size() < num_threads)
+		stats_replayers.emplace_back(new StatsReplayer);
+
+	for (unsigned i = 0; i < num_threads; i++)
+	{
+		threads.emplace_back([&, i]() {
+			auto &stats_replayer = *stats_replayers[i];
+			StateReplayer replayer;
+			replayer.set_resolve_shader_module_handles(false);
+			replayer.set_resolve_derivative_pipeline_handles(false);
+			vector<uint8_t> blob;
+
+			size_t index;
+			while ((index = next_index.fetch_add(1, memory_order_relaxed)) < hashes.size() && !failed)
+			{
+				size_t blob_size = 0;
+				if (!db.read_entry(tag, hashes[index], &blob_size, nullptr, PAYLOAD_READ_CONCURRENT_BIT))
+				{
+					failed = true;
+					break;
+				}
+				blob.resize(blob_size);
+				if (!db.read_entry(tag, hashes[index], &blob_size, blob.data(), PAYLOAD_READ_CONCURRENT_BIT))
+				{
+					failed = true;
+					break;
+				}
+
+				if (!replayer.parse(stats_replayer, &resolver, blob.data(), blob.size()))
+					LOGE("Failed to parse blob (tag: %d, hash: 0x%" PRIx64 ").\n", tag, hashes[index]);
+			}
+		});
+	}
+
+	for (auto &t : threads)
+		t.join();
+
+	if (failed)
+		LOGE("Failed to load blob from database.\n");
+	return !failed;
+}
+
+static bool print_reference_stats(DatabaseInterface &db, const vector<EntrySize> &module_sizes,
+                                  unsigned top_count, unsigned num_threads)
+{
+	vector<unique_ptr<StatsReplayer>> stats_replayers;
+	if (!parse_blobs_threaded(db, RESOURCE_GRAPHICS_PIPELINE, num_threads, stats_replayers))
+		return false;
+	if (!parse_blobs_threaded(db, RESOURCE_COMPUTE_PIPELINE, num_threads, stats_replayers))
+		return false;
+
+	unordered_map<Hash, unsigned> module_references;
+	for (auto &stats_replayer : stats_replayers)
+		for (auto &ref : stats_replayer->module_references)
+			module_references[ref.first] += ref.second;
+
+	// Buckets of how many pipelines reference a module.
+	static const unsigned bucket_limits[] = { 0, 1, 9, 99, ~0u };
+	static const char *bucket_names[] = { "0", "1", "2-9", "10-99", "100+" };
+	unsigned bucket_counts[5] = {};
+	uint64_t unreferenced_bytes = 0;
+
+	for (auto &module : module_sizes)
+	{
+		auto itr = module_references.find(module.hash);
+		unsigned count = itr != end(module_references) ? itr->second : 0;
+		if (count == 0)
+			unreferenced_bytes += module.stored_size;
+		for (unsigned i = 0; i < 5; i++)
+		{
+			if (count <= bucket_limits[i])
+			{
+				bucket_counts[i]++;
+				break;
+			}
+		}
+	}
+
+	printf("Shader module reuse:\n");
+	for (unsigned i = 0; i < 5; i++)
+		printf("  referenced by %s pipelines: %u modules\n", bucket_names[i], bucket_counts[i]);
+	printf("  unreferenced stored bytes: %" PRIu64 "\n", unreferenced_bytes);
+
+	vector<pair<Hash, unsigned>> sorted_references(begin(module_references), end(module_references));
+	unsigned count = unsigned(std::min<size_t>(top_count, sorted_references.size()));
+	partial_sort(begin(sorted_references), begin(sorted_references) + count, end(sorted_references),
+	             [](const pair<Hash, unsigned> &a, const pair<Hash, unsigned> &b) {
+		             if (a.second != b.second)
+			             return a.second > b.second;
+		             return a.first < b.first;
+	             });
+
+	if (count != 0)
+	{
+		printf("  most referenced modules (hash, pipelines):\n");
+		for (unsigned i = 0; i < count; i++)
+			printf("    %016" PRIx64 " %u\n", sorted_references[i].first, sorted_references[i].second);
+	}
+
+	return true;
+}
+
+struct ApplicationInfoReplayer : StateCreatorInterface
+{
+	unordered_map<Hash, string> names;
+
+	void set_application_info(Hash hash, const VkApplicationInfo *app, const VkPhysicalDeviceFeatures2 *) override
+	{
+		string name;
+		if (app)
+		{
+			name = app->pApplicationName ? app->pApplicationName : "N/A";
+			name += " / ";
+			name += app->pEngineName ? app->pEngineName : "N/A";
+		}
+		else
+			name = "N/A";
+		names[hash] = name;
+	}
+
+	bool enqueue_create_sampler(Hash, const VkSamplerCreateInfo *, VkSampler *) override { return true; }
+	bool enqueue_create_descriptor_set_layout(Hash, const VkDescriptorSetLayoutCreateInfo *, VkDescriptorSetLayout *) override { return true; }
+	bool enqueue_create_pipeline_layout(Hash, const VkPipelineLayoutCreateInfo *, VkPipelineLayout *) override { return true; }
+	bool enqueue_create_shader_module(Hash, const VkShaderModuleCreateInfo *, VkShaderModule *) override { return true; }
+	bool enqueue_create_render_pass(Hash, const VkRenderPassCreateInfo *, VkRenderPass *) override { return true; }
+	bool enqueue_create_compute_pipeline(Hash, const VkComputePipelineCreateInfo *, VkPipeline *) override { return true; }
+	bool enqueue_create_graphics_pipeline(Hash, const VkGraphicsPipelineCreateInfo *, VkPipeline *) override { return true; }
+};
+
+static bool print_application_stats(DatabaseInterface &db, const vector<EntrySize> *tag_sizes, unsigned num_threads)
+{
+	ApplicationInfoReplayer app_replayer;
+	{
+		size_t hash_count = 0;
+		if (!db.get_hash_list_for_resource_tag(RESOURCE_APPLICATION_INFO, &hash_count, nullptr))
+			return false;
+		vector<Hash> hashes(hash_count);
+		if (!db.get_hash_list_for_resource_tag(RESOURCE_APPLICATION_INFO, &hash_count, hashes.data()))
+			return false;
+
+		StateReplayer replayer;
+		vector<uint8_t> blob;
+		for (auto hash : hashes)
+		{
+			size_t blob_size = 0;
+			if (!db.read_entry(RESOURCE_APPLICATION_INFO, hash, &blob_size, nullptr, PAYLOAD_READ_NO_FLAGS))
+				return false;
+			blob.resize(blob_size);
+			if (!db.read_entry(RESOURCE_APPLICATION_INFO, hash, &blob_size, blob.data(), PAYLOAD_READ_NO_FLAGS))
+				return false;
+			if (!replayer.parse(app_replayer, nullptr, blob.data(), blob.size()))
+				LOGE("Failed to parse application info %016" PRIx64 ".\n", hash);
+		}
+	}
+
+	vector<unique_ptr<StatsReplayer>> stats_replayers;
+	if (!parse_blobs_threaded(db, RESOURCE_APPLICATION_BLOB_LINK, num_threads, stats_replayers))
+		return false;
+
+	unordered_map<Hash, uint64_t> stored_sizes[RESOURCE_COUNT];
+	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+		for (auto &size : tag_sizes[i])
+			stored_sizes[i][size.hash] = size.stored_size;
+
+	struct ApplicationStats
+	{
+		unsigned entries[RESOURCE_COUNT];
+		uint64_t stored_bytes[RESOURCE_COUNT];
+	};
+	unordered_map<Hash, ApplicationStats> applications;
+
+	for (auto &stats_replayer : stats_replayers)
+	{
+		for (auto &link : stats_replayer->links)
+		{
+			if (link.tag >= RESOURCE_COUNT)
+				continue;
+			auto &app = applications[link.application_hash];
+			app.entries[link.tag]++;
+			auto itr = stored_sizes[link.tag].find(link.hash);
+			if (itr != end(stored_sizes[link.tag]))
+				app.stored_bytes[link.tag] += itr->second;
+		}
+	}
+
+	vector<Hash> application_hashes;
+	for (auto &app : applications)
+		application_hashes.push_back(app.first);
+	sort(begin(application_hashes), end(application_hashes));
+
+	for (auto hash : application_hashes)
+	{
+		auto &app = applications[hash];
+		auto name_itr = app_replayer.names.find(hash);
+		printf("Application %016" PRIx64 " (%s):\n", hash,
+		       name_itr != end(app_replayer.names) ? name_itr->second.c_str() : "unknown");
+
+		for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+		{
+			if (app.entries[i] == 0)
+				continue;
+			printf("  %s: %u entries, %" PRIu64 " stored bytes\n", tag_names[i], app.entries[i], app.stored_bytes[i]);
+		}
+	}
+
+	return true;
+}
+
+static int print_stats(DatabaseInterface &db, unsigned top_count, bool references, bool per_application,
+                       unsigned num_threads)
+{
+	vector<EntrySize> tag_sizes[RESOURCE_COUNT];
+	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+	{
+		auto tag = static_cast<ResourceTag>(i);
+		if (!get_entry_sizes(db, tag, tag_sizes[i]))
+		{
+			LOGE("Failed to get entry sizes for tag %u.\n", i);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+	{
+		// print_tag_stats reorders entries, so work on a copy.
+		auto sizes = tag_sizes[i];
+		print_tag_stats(static_cast<ResourceTag>(i), sizes, top_count);
+	}
+
+	if (references && !print_reference_stats(db, tag_sizes[RESOURCE_SHADER_MODULE], top_count, num_threads))
+		return EXIT_FAILURE;
+
+	if (per_application && !print_application_stats(db, tag_sizes, num_threads))
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
 }
 
 int main(int argc, char **argv)
@@ -42,9 +497,19 @@ int main(int argc, char **argv)
 	CLICallbacks cbs;
 	string db_path;
 	unsigned tag_uint = 0;
+	bool stats = false;
+	bool references = false;
+	bool per_application = false;
+	unsigned top_count = 10;
+	unsigned num_threads = thread::hardware_concurrency();
 	cbs.default_handler = [&](const char *path) { db_path = path; };
 	cbs.add("--help", [&](CLIParser &parser) { print_help(); parser.end(); });
 	cbs.add("--tag", [&](CLIParser &parser) { tag_uint = parser.next_uint(); });
+	cbs.add("--stats", [&](CLIParser &) { stats = true; });
+	cbs.add("--top", [&](CLIParser &parser) { top_count = parser.next_uint(); });
+	cbs.add("--references", [&](CLIParser &) { references = true; });
+	cbs.add("--per-application", [&](CLIParser &) { per_application = true; });
+	cbs.add("--num-threads", [&](CLIParser &parser) { num_threads = parser.next_uint(); });
 	cbs.error_handler = [] { print_help(); };
 	CLIParser parser(move(cbs), argc - 1, argv + 1);
 
@@ -66,6 +531,12 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if (num_threads < 1)
+		num_threads = 1;
+
+	if (stats)
+		return print_stats(*input_db, top_count, references, per_application, num_threads);
+
 	if (tag_uint >= RESOURCE_COUNT)
 	{
 		LOGE("--tag (%u) is out of range.\n", tag_uint);
@@ -27,6 +27,13 @@
 #include "fossilize_db.hpp"
 #include "file.hpp"
 #include "spirv-tools/optimizer.hpp"
+#include "spirv-tools/libspirv.h"
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 using namespace std;
 using namespace Fossilize;
@@ -37,10 +44,11 @@ static inline T fake_handle(uint64_t v)
 	return (T)v;
 }
 
+static const spv_target_env optimizer_target_env = SPV_ENV_VULKAN_1_1;
+
 struct OptimizeReplayer : StateCreatorInterface
 {
 	StateRecorder recorder;
-	bool optimize_size = false;
 
 	bool enqueue_create_sampler(Hash hash, const VkSamplerCreateInfo *create_info, VkSampler *sampler) override
 	{
@@ -62,29 +70,8 @@ struct OptimizeReplayer : StateCreatorInterface
 
 	bool enqueue_create_shader_module(Hash hash, const VkShaderModuleCreateInfo *create_info, VkShaderModule *module) override
 	{
-		vector<uint32_t> compiled_spirv;
-		spvtools::Optimizer optimizer(SPV_ENV_VULKAN_1_1);
-
-		if (optimize_size)
-			optimizer.RegisterSizePasses();
-		else
-			optimizer.RegisterPerformancePasses();
-
-		if (!optimizer.Run(create_info->pCode, create_info->codeSize / sizeof(uint32_t), &compiled_spirv))
-		{
-			LOGE("Failed to optimize shader module %016" PRIx64 ". Using original module.\n", hash);
-			*module = fake_handle<VkShaderModule>(hash);
-			return recorder.record_shader_module(*module, *create_info, hash);
-		}
-		else
-		{
-			auto info = *create_info;
-			info.pCode = compiled_spirv.data();
-			info.codeSize = compiled_spirv.size() * sizeof(uint32_t);
-
-			*module = fake_handle<VkShaderModule>(hash);
-			return recorder.record_shader_module(*module, info, hash);
-		}
+		*module = fake_handle<VkShaderModule>(hash);
+		return recorder.record_shader_module(*module, *create_info, hash);
 	}
 
 	bool enqueue_create_render_pass(Hash hash, const VkRenderPassCreateInfo *create_info, VkRenderPass *render_pass) override
@@ -106,13 +93,397 @@ struct OptimizeReplayer : StateCreatorInterface
 	}
 };
 
+// Captures the shader module of a RESOURCE_SHADER_MODULE blob.
+struct ModuleCapture : StateCreatorInterface
+{
+	VkShaderModuleCreateFlags flags = 0;
+	vector<uint32_t> code;
+	bool has_module = false;
+
+	bool enqueue_create_sampler(Hash hash, const VkSamplerCreateInfo *, VkSampler *sampler) override
+	{
+		*sampler = fake_handle<VkSampler>(hash);
+		return true;
+	}
+
+	bool enqueue_create_descriptor_set_layout(Hash hash, const VkDescriptorSetLayoutCreateInfo *, VkDescriptorSetLayout *layout) override
+	{
+		*layout = fake_handle<VkDescriptorSetLayout>(hash);
+		return true;
+	}
+
+	bool enqueue_create_pipeline_layout(Hash hash, const VkPipelineLayoutCreateInfo *, VkPipelineLayout *layout) override
+	{
+		*layout = fake_handle<VkPipelineLayout>(hash);
+		return true;
+	}
+
+	bool enqueue_create_shader_module(Hash hash, const VkShaderModuleCreateInfo *create_info, VkShaderModule *module) override
+	{
+		*module = fake_handle<VkShaderModule>(hash);
+		flags = create_info->flags;
+		code.assign(create_info->pCode, create_info->pCode + create_info->codeSize / sizeof(uint32_t));
+		has_module = true;
+		return true;
+	}
+
+	bool enqueue_create_render_pass(Hash hash, const VkRenderPassCreateInfo *, VkRenderPass *render_pass) override
+	{
+		*render_pass = fake_handle<VkRenderPass>(hash);
+		return true;
+	}
+
+	bool enqueue_create_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo *, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(hash);
+		return true;
+	}
+
+	bool enqueue_create_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo *, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(hash);
+		return true;
+	}
+};
+
+// Optimizes shader modules on a pool of worker threads, each with its own spvtools::Optimizer.
+// Results are consumed in the order of the input hashes, so the output is deterministic.
+struct ModuleOptimizer
+{
+	struct Module
+	{
+		VkShaderModuleCreateFlags flags = 0;
+		vector<uint32_t> original;
+		vector<uint32_t> optimized;
+		chrono::steady_clock::time_point optimize_start;
+		bool parsed = false;
+		bool optimizing = false;
+		bool optimized_ok = false;
+		bool from_cache = false;
+		bool abandoned = false;
+		bool done = false;
+	};
+
+	// Limits how far workers can run ahead of the consumer.
+	enum { MaxModulesInFlight = 256 };
+
+	DatabaseInterface *input_db = nullptr;
+	DatabaseInterface *cache_db = nullptr;
+	// Cache entries are looked up with get_cache_key().
+	Hash cache_identity = 0;
+	vector<Hash> hashes;
+	bool optimize_size = false;
+
+	mutex lock;
+	condition_variable cond;
+	vector<Module> modules;
+	size_t next_index = 0;
+	size_t consumed_index = 0;
+	unsigned busy_abandoned_workers = 0;
+	vector<thread> workers;
+
+	void start(unsigned num_threads)
+	{
+		modules.resize(hashes.size());
+		for (unsigned i = 0; i < num_threads; i++)
+			workers.emplace_back(&ModuleOptimizer::worker_loop, this);
+	}
+
+	Hash get_cache_key(Hash hash) const
+	{
+		Hash h = cache_identity;
+		for (unsigned i = 0; i < 8; i++)
+			h = (h ^ ((hash >> (8 * i)) & 0xff)) * 0x100000001b3ull;
+		return h;
+	}
+
+	bool read_module(Hash hash, vector<uint8_t> &blob, StateReplayer &replayer, ModuleCapture &capture)
+	{
+		size_t blob_size = 0;
+		if (!input_db->read_entry(RESOURCE_SHADER_MODULE, hash, &blob_size, nullptr, PAYLOAD_READ_CONCURRENT_BIT))
+			return false;
+		blob.resize(blob_size);
+		if (!input_db->read_entry(RESOURCE_SHADER_MODULE, hash, &blob_size, blob.data(), PAYLOAD_READ_CONCURRENT_BIT))
+			return false;
+
+		capture.has_module = false;
+		if (!replayer.parse(capture, nullptr, blob.data(), blob.size()))
+			return false;
+		return capture.has_module;
+	}
+
+	// A cached empty entry means the optimizer failed on this module before.
+	bool read_cache(Hash hash, vector<uint32_t> &code, bool &optimized_ok)
+	{
+		if (!cache_db)
+			return false;
+
+		Hash key = get_cache_key(hash);
+		size_t size = 0;
+		if (!cache_db->read_entry(RESOURCE_SHADER_MODULE, key, &size, nullptr, PAYLOAD_READ_CONCURRENT_BIT))
+			return false;
+
+		code.resize(size / sizeof(uint32_t));
+		if (size != 0 && !cache_db->read_entry(RESOURCE_SHADER_MODULE, key, &size, code.data(), PAYLOAD_READ_CONCURRENT_BIT))
+			return false;
+
+		optimized_ok = size != 0;
+		return true;
+	}
+
+	void worker_loop()
+	{
+		spvtools::Optimizer optimizer(optimizer_target_env);
+		if (optimize_size)
+			optimizer.RegisterSizePasses();
+		else
+			optimizer.RegisterPerformancePasses();
+
+		StateReplayer replayer;
+		ModuleCapture capture;
+		vector<uint8_t> blob;
+
+		for (;;)
+		{
+			size_t index;
+			{
+				unique_lock<mutex> holder(lock);
+				cond.wait(holder, [&]() {
+					return next_index >= modules.size() || next_index < consumed_index + MaxModulesInFlight;
+				});
+				if (next_index >= modules.size())
+					break;
+				index = next_index++;
+			}
+
+			Hash hash = hashes[index];
+			bool parsed = read_module(hash, blob, replayer, capture);
+			replayer.forget_handle_references();
+			replayer.get_allocator().reset();
+			if (!parsed)
+				LOGE("Failed to parse shader module %016" PRIx64 ".\n", hash);
+
+			vector<uint32_t> cached;
+			bool cached_ok = false;
+			bool from_cache = parsed && read_cache(hash, cached, cached_ok);
+
+			{
+				lock_guard<mutex> holder(lock);
+				auto &module = modules[index];
+				module.parsed = parsed;
+				module.flags = capture.flags;
+				module.original = move(capture.code);
+				if (from_cache)
+				{
+					module.from_cache = true;
+					module.optimized_ok = cached_ok;
+					module.optimized = move(cached);
+				}
+
+				if (!parsed || from_cache)
+				{
+					module.done = true;
+					cond.notify_all();
+					continue;
+				}
+
+				module.optimizing = true;
+				module.optimize_start = chrono::steady_clock::now();
+				cond.notify_all();
+			}
+
+			// The module is only written to by this worker until it is done, or abandoned by the consumer.
+			auto &original = modules[index].original;
+			vector<uint32_t> compiled_spirv;
+			bool optimized_ok = optimizer.Run(original.data(), original.size(), &compiled_spirv);
+
+			lock_guard<mutex> holder(lock);
+			auto &module = modules[index];
+			if (module.abandoned)
+			{
+				// A replacement worker took over, so don't oversubscribe.
+				busy_abandoned_workers--;
+				cond.notify_all();
+				break;
+			}
+
+			module.optimized_ok = optimized_ok;
+			module.optimized = move(compiled_spirv);
+			module.done = true;
+			cond.notify_all();
+		}
+	}
+
+	// Waits until the module at index is done, or until it has spent more than time_limit_seconds
+	// in the optimizer. The optimizer cannot be interrupted, so timed out modules are abandoned
+	// and the original module is used instead. A new worker takes the place of the abandoned one,
+	// which exits once the optimizer returns.
+	Module &wait_for_module(size_t index, double time_limit_seconds, bool &timed_out)
+	{
+		unique_lock<mutex> holder(lock);
+		auto &module = modules[index];
+		timed_out = false;
+
+		while (!module.done)
+		{
+			if (time_limit_seconds > 0.0 && module.optimizing)
+			{
+				auto deadline = module.optimize_start +
+				                chrono::duration_cast<chrono::steady_clock::duration>(
+						                chrono::duration<double>(time_limit_seconds));
+				if (cond.wait_until(holder, deadline) == cv_status::timeout && !module.done)
+				{
+					module.abandoned = true;
+					busy_abandoned_workers++;
+					workers.emplace_back(&ModuleOptimizer::worker_loop, this);
+					timed_out = true;
+					break;
+				}
+			}
+			else
+				cond.wait(holder);
+		}
+
+		return module;
+	}
+
+	void release_module(size_t index)
+	{
+		lock_guard<mutex> holder(lock);
+		auto &module = modules[index];
+		if (!module.abandoned)
+		{
+			// The abandoned module's original code is still being read by its worker.
+			vector<uint32_t>().swap(module.original);
+		}
+		vector<uint32_t>().swap(module.optimized);
+		consumed_index = index + 1;
+		cond.notify_all();
+	}
+
+	// Returns false if some workers are still stuck in modules which timed out.
+	bool join()
+	{
+		{
+			lock_guard<mutex> holder(lock);
+			if (busy_abandoned_workers != 0)
+			{
+				for (auto &worker : workers)
+					worker.detach();
+				workers.clear();
+				return false;
+			}
+		}
+
+		for (auto &worker : workers)
+			worker.join();
+		workers.clear();
+		return true;
+	}
+};
+
+static bool optimize_shader_modules(OptimizeReplayer &optimize_replayer, ModuleOptimizer &module_optimizer,
+                                    DatabaseInterface *cache_write_db, unsigned num_threads, double time_limit_seconds)
+{
+	auto &hashes = module_optimizer.hashes;
+	module_optimizer.start(num_threads);
+
+	unsigned num_optimized = 0;
+	unsigned num_cached = 0;
+	unsigned num_failed = 0;
+	unsigned num_timed_out = 0;
+	auto last_progress = chrono::steady_clock::now();
+
+	for (size_t i = 0; i < hashes.size(); i++)
+	{
+		Hash hash = hashes[i];
+		bool timed_out = false;
+		auto &module = module_optimizer.wait_for_module(i, time_limit_seconds, timed_out);
+
+		// After abandoning a module, only the original code can be accessed.
+		if (module.parsed)
+		{
+			VkShaderModuleCreateInfo info = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+			info.flags = module.flags;
+
+			if (timed_out)
+			{
+				LOGE("Optimizing shader module %016" PRIx64 " timed out. Using original module.\n", hash);
+				num_timed_out++;
+			}
+			else if (!module.optimized_ok)
+			{
+				if (!module.from_cache)
+					LOGE("Failed to optimize shader module %016" PRIx64 ". Using original module.\n", hash);
+				num_failed++;
+			}
+
+			bool use_optimized = !timed_out && module.optimized_ok;
+			auto &code = use_optimized ? module.optimized : module.original;
+			info.pCode = code.data();
+			info.codeSize = code.size() * sizeof(uint32_t);
+
+			VkShaderModule shader_module = fake_handle<VkShaderModule>(hash);
+			if (!optimize_replayer.recorder.record_shader_module(shader_module, info, hash))
+				LOGE("Failed to record shader module %016" PRIx64 ".\n", hash);
+
+			if (!timed_out && module.from_cache)
+				num_cached++;
+			else if (use_optimized)
+				num_optimized++;
+
+			// Failures are cached too, so they are not retried until the cache identity changes.
+			// Time-outs depend on the options, so they are not.
+			if (cache_write_db && !timed_out && !module.from_cache)
+			{
+				size_t size = module.optimized_ok ? module.optimized.size() * sizeof(uint32_t) : 0;
+				if (!cache_write_db->write_entry(RESOURCE_SHADER_MODULE, module_optimizer.get_cache_key(hash),
+				                                 module.optimized.data(), size,
+				                                 PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT))
+					LOGE("Failed to write shader module %016" PRIx64 " to cache.\n", hash);
+			}
+		}
+
+		module_optimizer.release_module(i);
+
+		auto now = chrono::steady_clock::now();
+		if (now - last_progress >= chrono::seconds(1) || i + 1 == hashes.size())
+		{
+			LOGI("Shader modules: %u / %u (%u optimized, %u cached, %u failed, %u timed out).\n",
+			     unsigned(i + 1), unsigned(hashes.size()), num_optimized, num_cached, num_failed, num_timed_out);
+			last_progress = now;
+		}
+	}
+
+	return module_optimizer.join();
+}
+
+// Optimized modules depend on the passes, the SPIRV-Tools version and the target environment.
+// All of them are part of the cache key, so stale entries, including cached failures, are never reused.
+static Hash compute_cache_identity(bool optimize_size)
+{
+	string identity = optimize_size ? "size" : "performance";
+	identity += '\0';
+	identity += spvSoftwareVersionDetailsString();
+	identity += '\0';
+	identity += spvTargetEnvDescription(optimizer_target_env);
+
+	Hash h = 0xcbf29ce484222325ull;
+	for (char c : identity)
+		h = (h ^ uint8_t(c)) * 0x100000001b3ull;
+	return h;
+}
+
 static void print_help()
 {
 	LOGI("fossilize-opt\n"
 	     "\t[--help]\n"
 	     "\t[--optimize-size]\n"
 	     "\t[--input-db <path>]\n"
-	     "\t[--output-db <path>]\n");
+	     "\t[--output-db <path>]\n"
+	     "\t[--num-threads <count>]\n"
+	     "\t[--module-time-limit <seconds>]\n"
+	     "\t[--cache <path.foz>]\n");
 }
 
 int main(int argc, char *argv[])
@@ -121,11 +492,17 @@ int main(int argc, char *argv[])
 	string output_db_path;
 	CLICallbacks cbs;
 	bool optimize_size = false;
+	unsigned num_threads = thread::hardware_concurrency();
+	double module_time_limit = 0.0;
+	string cache_path;
 
 	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
 	cbs.add("--input-db", [&](CLIParser &parser) { input_db_path = parser.next_string(); });
 	cbs.add("--output-db", [&](CLIParser &parser) { output_db_path = parser.next_string(); });
 	cbs.add("--optimize-size", [&](CLIParser &) { optimize_size = true; });
+	cbs.add("--num-threads", [&](CLIParser &parser) { num_threads = parser.next_uint(); });
+	cbs.add("--module-time-limit", [&](CLIParser &parser) { module_time_limit = parser.next_double(); });
+	cbs.add("--cache", [&](CLIParser &parser) { cache_path = parser.next_string(); });
 	cbs.error_handler = [] { print_help(); };
 
 	CLIParser parser(move(cbs), argc - 1, argv + 1);
@@ -151,10 +528,32 @@ int main(int argc, char *argv[])
 	auto input_db = std::unique_ptr<DatabaseInterface>(create_database(input_db_path.c_str(), DatabaseMode::ReadOnly));
 	auto output_db = std::unique_ptr<DatabaseInterface>(create_database(output_db_path.c_str(), DatabaseMode::OverWrite));
 
+	if (num_threads < 1)
+		num_threads = 1;
+
+	// Both handles refer to the same file. Workers read entries which existed up front,
+	// while new entries are appended through the other handle.
+	unique_ptr<DatabaseInterface> cache_read_db;
+	unique_ptr<DatabaseInterface> cache_write_db;
+	if (!cache_path.empty())
+	{
+		cache_read_db.reset(create_stream_archive_database(cache_path.c_str(), DatabaseMode::ReadOnly));
+		if (!cache_read_db->prepare())
+			cache_read_db.reset();
+
+		cache_write_db.reset(create_stream_archive_database(cache_path.c_str(), DatabaseMode::Append));
+		if (!cache_write_db->prepare())
+		{
+			LOGE("Failed to open cache for writing: %s\n", cache_path.c_str());
+			return EXIT_FAILURE;
+		}
+	}
+
 	OptimizeReplayer optimize_replayer;
-	optimize_replayer.optimize_size = optimize_size;
 
+	// Shader modules are recorded up front, pipelines refer to them by hash.
 	StateReplayer replayer;
+	replayer.set_resolve_shader_module_handles(false);
 	optimize_replayer.recorder.set_database_enable_checksum(true);
 	optimize_replayer.recorder.set_database_enable_compression(true);
 
@@ -183,6 +582,9 @@ int main(int argc, char *argv[])
 		RESOURCE_COMPUTE_PIPELINE,
 	};
 
+	ModuleOptimizer module_optimizer;
+	bool workers_joined = true;
+
 	vector<uint8_t> state_json;
 	for (auto &tag : playback_order)
 	{
@@ -201,6 +603,18 @@ int main(int argc, char *argv[])
 			return EXIT_FAILURE;
 		}
 
+		if (tag == RESOURCE_SHADER_MODULE)
+		{
+			module_optimizer.input_db = input_db.get();
+			module_optimizer.cache_db = cache_read_db.get();
+			module_optimizer.cache_identity = compute_cache_identity(optimize_size);
+			module_optimizer.hashes = move(hashes);
+			module_optimizer.optimize_size = optimize_size;
+			workers_joined = optimize_shader_modules(optimize_replayer, module_optimizer, cache_write_db.get(),
+			                                         num_threads, module_time_limit);
+			continue;
+		}
+
 		for (auto hash : hashes)
 		{
 			size_t state_json_size;
@@ -222,4 +636,18 @@ int main(int argc, char *argv[])
 				LOGE("Failed to parse blob (tag: %d, hash: 0x%" PRIx64 ").\n", tag, hash);
 		}
 	}
+
+	if (!workers_joined)
+	{
+		// Workers stuck in the optimizer cannot be interrupted, and still refer to the module optimizer.
+		// Flush everything and exit without waiting for them.
+		LOGI("Some shader modules are still being optimized after timing out, exiting without waiting for them.\n");
+		optimize_replayer.recorder.tear_down_recording_thread();
+		output_db->flush();
+		if (cache_write_db)
+			cache_write_db->flush();
+		fflush(stdout);
+		fflush(stderr);
+		_Exit(EXIT_SUCCESS);
+	}
 }
@@ -27,8 +27,12 @@
 #include <vector>
 #include <unordered_set>
 #include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <atomic>
 #include "layer/utils.hpp"
 #include "cli_parser.hpp"
+#include "concurrent_read_database.hpp"
 
 using namespace Fossilize;
 using namespace std;
@@ -48,7 +52,8 @@ static void print_help()
 	     "\t[--skip-application-info-links]\n"
 	     "\t[--whitelist whitelist.foz]\n"
 	     "\t[--blacklist blacklist.foz]\n"
-	     "\t[--invert-module-pruning]\n");
+	     "\t[--invert-module-pruning]\n"
+	     "\t[--num-threads <count>]\n");
 }
 
 template <typename T>
@@ -87,6 +92,9 @@ struct PruneReplayer : StateCreatorInterface
 
 	bool skip_application_info_links = false;
 
+	// Set if a pipeline refers to a base pipeline.
+	bool found_derivative_pipeline = false;
+
 	void set_application_info(Hash hash, const VkApplicationInfo *app,
 	                          const VkPhysicalDeviceFeatures2 *) override
 	{
@@ -228,6 +236,8 @@ struct PruneReplayer : StateCreatorInterface
 	bool enqueue_create_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override
 	{
 		*pipeline = fake_handle<VkPipeline>(hash);
+		if (create_info->basePipelineHandle != VK_NULL_HANDLE)
+			found_derivative_pipeline = true;
 
 		if (filter_object(RESOURCE_COMPUTE_PIPELINE, hash))
 		{
@@ -246,6 +256,8 @@ struct PruneReplayer : StateCreatorInterface
 	bool enqueue_create_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo *create_info, VkPipeline *pipeline) override
 	{
 		*pipeline = fake_handle<VkPipeline>(hash);
+		if (create_info->basePipelineHandle != VK_NULL_HANDLE)
+			found_derivative_pipeline = true;
 
 		if (filter_object(RESOURCE_GRAPHICS_PIPELINE, hash))
 		{
@@ -282,6 +294,111 @@ struct PruneReplayer : StateCreatorInterface
 	}
 };
 
+struct PruneWorker
+{
+	StateReplayer replayer;
+	PruneReplayer prune_replayer;
+};
+
+// Parses pipelines of one tag on multiple threads. Every pipeline only depends on state which has already
+// been parsed by base_replayer, so the union of the accessed sets matches a serial parse.
+// The exception is derivative pipelines, where the serial replayer resolves base pipelines recursively in
+// a way which depends on parse order. If any are found, *needs_serial_parse is set and the caller parses serially.
+static bool parse_pipelines_threaded(DatabaseInterface &input_db, StateReplayer &base_replayer,
+                                     PruneReplayer &prune_replayer, ResourceTag tag,
+                                     const vector<Hash> &hashes, unsigned num_threads,
+                                     bool *needs_serial_parse)
+{
+	ConcurrentReadDatabase resolver(input_db);
+	vector<unique_ptr<PruneWorker>> workers;
+	vector<thread> threads;
+	atomic<size_t> next_index(0);
+	atomic<bool> found_derivative_pipeline(false);
+	atomic<bool> failed(false);
+
+	for (unsigned i = 0; i < num_threads; i++)
+	{
+		auto *worker = new PruneWorker;
+		workers.emplace_back(worker);
+		worker->replayer.copy_handle_references(base_replayer);
+		worker->replayer.set_resolve_shader_module_handles(false);
+		worker->replayer.set_resolve_derivative_pipeline_handles(false);
+
+		// Filters and application info links were set up by the serial passes.
+		worker->prune_replayer.filter_graphics = prune_replayer.filter_graphics;
+		worker->prune_replayer.filter_compute = prune_replayer.filter_compute;
+		worker->prune_replayer.filter_modules = prune_replayer.filter_modules;
+		worker->prune_replayer.banned_graphics = prune_replayer.banned_graphics;
+		worker->prune_replayer.banned_compute = prune_replayer.banned_compute;
+		worker->prune_replayer.banned_modules = prune_replayer.banned_modules;
+		worker->prune_replayer.descriptor_sets = prune_replayer.descriptor_sets;
+		worker->prune_replayer.pipeline_layouts = prune_replayer.pipeline_layouts;
+		worker->prune_replayer.filtered_blob_hashes[tag] = prune_replayer.filtered_blob_hashes[tag];
+		worker->prune_replayer.filter_application_hash = prune_replayer.filter_application_hash;
+		worker->prune_replayer.should_filter_application_hash = prune_replayer.should_filter_application_hash;
+		worker->prune_replayer.skip_application_info_links = prune_replayer.skip_application_info_links;
+
+		threads.emplace_back([&, worker]() {
+			vector<uint8_t> state_json;
+			size_t index;
+			while ((index = next_index.fetch_add(1, memory_order_relaxed)) < hashes.size() &&
+			       !found_derivative_pipeline.load(memory_order_relaxed) && !failed.load(memory_order_relaxed))
+			{
+				Hash hash = hashes[index];
+				size_t state_json_size = 0;
+				if (!input_db.read_entry(tag, hash, &state_json_size, nullptr, PAYLOAD_READ_CONCURRENT_BIT))
+				{
+					LOGE("Failed to load blob from cache.\n");
+					failed = true;
+					break;
+				}
+
+				state_json.resize(state_json_size);
+				if (!input_db.read_entry(tag, hash, &state_json_size, state_json.data(), PAYLOAD_READ_CONCURRENT_BIT))
+				{
+					LOGE("Failed to load blob from cache.\n");
+					failed = true;
+					break;
+				}
+
+				worker->prune_replayer.has_application_info_for_blob = false;
+				worker->prune_replayer.blob_belongs_to_application_info = false;
+				if (!worker->replayer.parse(worker->prune_replayer, &resolver, state_json.data(), state_json.size()))
+					LOGE("Failed to parse blob (tag: %d, hash: 0x%" PRIx64 ").\n", tag, hash);
+
+				if (worker->prune_replayer.found_derivative_pipeline)
+					found_derivative_pipeline = true;
+			}
+		});
+	}
+
+	for (auto &t : threads)
+		t.join();
+
+	if (failed)
+		return false;
+
+	*needs_serial_parse = found_derivative_pipeline;
+	if (*needs_serial_parse)
+		return true;
+
+	for (auto &worker : workers)
+	{
+		auto &w = worker->prune_replayer;
+		prune_replayer.accessed_samplers.insert(begin(w.accessed_samplers), end(w.accessed_samplers));
+		prune_replayer.accessed_descriptor_sets.insert(begin(w.accessed_descriptor_sets), end(w.accessed_descriptor_sets));
+		prune_replayer.accessed_pipeline_layouts.insert(begin(w.accessed_pipeline_layouts), end(w.accessed_pipeline_layouts));
+		prune_replayer.accessed_shader_modules.insert(begin(w.accessed_shader_modules), end(w.accessed_shader_modules));
+		prune_replayer.accessed_render_passes.insert(begin(w.accessed_render_passes), end(w.accessed_render_passes));
+		prune_replayer.accessed_graphics_pipelines.insert(begin(w.accessed_graphics_pipelines), end(w.accessed_graphics_pipelines));
+		prune_replayer.accessed_compute_pipelines.insert(begin(w.accessed_compute_pipelines), end(w.accessed_compute_pipelines));
+	}
+
+	return true;
+}
+
+// Entries are copied in the order they appear in the input archive, so the output does not depend
+// on hash set iteration order, and reads are mostly sequential.
 static bool copy_accessed_types(DatabaseInterface &input_db,
                                 DatabaseInterface &output_db,
                                 vector<uint8_t> &state_json,
@@ -289,28 +406,56 @@ static bool copy_accessed_types(DatabaseInterface &input_db,
                                 ResourceTag tag,
                                 unsigned *per_tag_written)
 {
+	static const size_t CopyBatchSize = 64 * 1024 * 1024;
+
+	vector<Hash> hashes(begin(accessed), end(accessed));
+	sort(begin(hashes), end(hashes));
+	input_db.sort_hashes_by_read_order(tag, hashes.data(), hashes.size());
+
 	per_tag_written[tag] = accessed.size();
-	for (auto hash : accessed)
+
+	vector<pair<Hash, size_t>> batch;
+	size_t index = 0;
+	while (index < hashes.size())
 	{
-		size_t compressed_size = 0;
-		if (!input_db.read_entry(tag, hash, &compressed_size, nullptr, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+		// Read a batch of raw payloads back to back, then write them out.
+		batch.clear();
+		size_t batch_size = 0;
+		while (index < hashes.size() && batch_size < CopyBatchSize)
 		{
-			if (tag == RESOURCE_SHADER_MODULE)
+			Hash hash = hashes[index++];
+			size_t compressed_size = 0;
+			if (!input_db.read_entry(tag, hash, &compressed_size, nullptr, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
 			{
-				// We did not resolve shader module references, so we might hit an error here, but that's fine.
-				LOGE("Reference shader module %016" PRIx64 " does not exist in database.\n", hash);
-				continue;
+				if (tag == RESOURCE_SHADER_MODULE)
+				{
+					// We did not resolve shader module references, so we might hit an error here, but that's fine.
+					LOGE("Reference shader module %016" PRIx64 " does not exist in database.\n", hash);
+					continue;
+				}
+				else
+					return false;
 			}
-			else
+
+			if (state_json.size() < batch_size + compressed_size)
+				state_json.resize(batch_size + compressed_size);
+
+			if (!input_db.read_entry(tag, hash, &compressed_size, state_json.data() + batch_size,
+			                         PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
 				return false;
-		}
 
-		state_json.resize(compressed_size);
+			batch.push_back({ hash, compressed_size });
+			batch_size += compressed_size;
+		}
 
-		if (!input_db.read_entry(tag, hash, &compressed_size, state_json.data(), PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
-			return false;
-		if (!output_db.write_entry(tag, hash, state_json.data(), state_json.size(), PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT))
-			return false;
+		size_t offset = 0;
+		for (auto &entry : batch)
+		{
+			if (!output_db.write_entry(tag, entry.first, state_json.data() + offset, entry.second,
+			                           PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT))
+				return false;
+			offset += entry.second;
+		}
 	}
 	return true;
 }
@@ -325,6 +470,7 @@ int main(int argc, char *argv[])
 	bool should_filter_application_hash = false;
 	bool skip_application_info_links = false;
 	bool invert_module_pruning = false;
+	unsigned num_threads = 1;
 
 	unordered_set<Hash> filter_graphics;
 	unordered_set<Hash> filter_compute;
@@ -371,6 +517,9 @@ int main(int argc, char *argv[])
 	cbs.add("--blacklist", [&](CLIParser &parser) {
 		blacklist = parser.next_string();
 	});
+	cbs.add("--num-threads", [&](CLIParser &parser) {
+		num_threads = parser.next_uint();
+	});
 	cbs.error_handler = [] { print_help(); };
 
 	CLIParser parser(move(cbs), argc - 1, argv + 1);
@@ -385,6 +534,9 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	if (num_threads < 1)
+		num_threads = 1;
+
 	auto input_db = std::unique_ptr<DatabaseInterface>(create_database(input_db_path.c_str(), DatabaseMode::ReadOnly));
 	auto output_db = std::unique_ptr<DatabaseInterface>(create_database(output_db_path.c_str(), DatabaseMode::OverWrite));
 
@@ -488,6 +640,19 @@ int main(int argc, char *argv[])
 			return EXIT_FAILURE;
 		}
 
+		// Pipelines make up the bulk of an archive, and can be parsed independently of each other.
+		if (num_threads > 1 && (tag == RESOURCE_GRAPHICS_PIPELINE || tag == RESOURCE_COMPUTE_PIPELINE))
+		{
+			bool needs_serial_parse = false;
+			if (!parse_pipelines_threaded(*input_db, replayer, prune_replayer, tag, hashes, num_threads,
+			                              &needs_serial_parse))
+				return EXIT_FAILURE;
+
+			if (!needs_serial_parse)
+				continue;
+			LOGI("Found derivative pipelines, falling back to serial parsing.\n");
+		}
+
 		for (auto hash : hashes)
 		{
 			size_t state_json_size;
@@ -26,15 +26,23 @@
 #include <vector>
 #include <unordered_set>
 #include <unordered_map>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <stdio.h>
 #include "layer/utils.hpp"
+#include "path.hpp"
 #include "cli_parser.hpp"
+#include "concurrent_read_database.hpp"
+#include "fossilize_normalize.hpp"
 
 using namespace Fossilize;
 using namespace std;
 
 static void print_help()
 {
-	LOGI("Usage: fossilize-rehash [--input-db path] [--output-db path] [--application hash]\n");
+	LOGI("Usage: fossilize-rehash [--input-db path] [--output-db path] [--application hash] [--num-threads <count>] [--normalize-pipelines]\n");
 }
 
 template <typename T>
@@ -48,6 +56,8 @@ static inline T fake_handle(uint64_t value)
 struct RehashReplayer : StateCreatorInterface
 {
 	StateRecorder *recorder = nullptr;
+	const VkApplicationInfo *application_info = nullptr;
+	const VkPhysicalDeviceFeatures2 *physical_device_features = nullptr;
 	Hash filter_application_hash = 0;
 	bool has_set_application_info = false;
 	bool should_filter_application_hash = false;
@@ -60,12 +70,18 @@ struct RehashReplayer : StateCreatorInterface
 		}
 		else if (!has_set_application_info && (!should_filter_application_hash || hash == filter_application_hash))
 		{
-			if (info)
-				if (!recorder->record_application_info(*info))
-					LOGE("Failed to record application info.\n");
-			if (features)
-				if (!recorder->record_physical_device_features(*features))
-					LOGE("Failed to record physical device features.\n");
+			// Kept around for the threaded mode, which records the application info into multiple recorders.
+			application_info = info;
+			physical_device_features = features;
+			if (recorder)
+			{
+				if (info)
+					if (!recorder->record_application_info(*info))
+						LOGE("Failed to record application info.\n");
+				if (features)
+					if (!recorder->record_physical_device_features(*features))
+						LOGE("Failed to record physical device features.\n");
+			}
 			has_set_application_info = true;
 		}
 	}
@@ -113,11 +129,534 @@ struct RehashReplayer : StateCreatorInterface
 	}
 };
 
+// Old hash to new hash for every object which was rehashed so far, per resource tag.
+struct RemapTable
+{
+	vector<pair<Hash, Hash>> remapped[RESOURCE_COUNT];
+};
+
+// Makes a recorder aware of objects rehashed earlier, so it can compute the hashes of, and serialize,
+// objects which refer to them. Only the handle to hash mapping matters,
+// so placeholder create infos are recorded with the new hash as custom hash.
+// The recorder must not have a recording thread, or a database which lacks the objects.
+static bool prime_recorder(StateRecorder &recorder, const RemapTable &table, ResourceTag tag)
+{
+	static const uint32_t placeholder_code = 0;
+
+	for (auto &remap : table.remapped[tag])
+	{
+		bool ret = false;
+		switch (tag)
+		{
+		case RESOURCE_SHADER_MODULE:
+		{
+			VkShaderModuleCreateInfo info = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+			info.codeSize = sizeof(placeholder_code);
+			info.pCode = &placeholder_code;
+			ret = recorder.record_shader_module(fake_handle<VkShaderModule>(remap.first), info, remap.second);
+			break;
+		}
+
+		case RESOURCE_SAMPLER:
+		{
+			VkSamplerCreateInfo info = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+			ret = recorder.record_sampler(fake_handle<VkSampler>(remap.first), info, remap.second);
+			break;
+		}
+
+		case RESOURCE_DESCRIPTOR_SET_LAYOUT:
+		{
+			VkDescriptorSetLayoutCreateInfo info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
+			ret = recorder.record_descriptor_set_layout(fake_handle<VkDescriptorSetLayout>(remap.first), info, remap.second);
+			break;
+		}
+
+		case RESOURCE_PIPELINE_LAYOUT:
+		{
+			VkPipelineLayoutCreateInfo info = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+			ret = recorder.record_pipeline_layout(fake_handle<VkPipelineLayout>(remap.first), info, remap.second);
+			break;
+		}
+
+		case RESOURCE_RENDER_PASS:
+		{
+			VkRenderPassCreateInfo info = { VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO };
+			ret = recorder.record_render_pass(fake_handle<VkRenderPass>(remap.first), info, remap.second);
+			break;
+		}
+
+		default:
+			// Nothing refers to pipelines, except derived pipelines, which are rehashed serially.
+			ret = true;
+			break;
+		}
+
+		if (!ret)
+			return false;
+	}
+
+	return true;
+}
+
+static bool prime_recorder(StateRecorder &recorder, const RemapTable &table)
+{
+	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+		if (!prime_recorder(recorder, table, static_cast<ResourceTag>(i)))
+			return false;
+	return true;
+}
+
+// Writes entries to a private archive and logs the order of the writes, so they can be merged into the output
+// in the order the serial tool would have written them. Objects of earlier tags are reported as existing,
+// since they are only known to the recorder through placeholders.
+struct CaptureDatabase : DatabaseInterface
+{
+	CaptureDatabase(DatabaseInterface &output_db_, const string &path_, ResourceTag tag_)
+		: DatabaseInterface(DatabaseMode::OverWrite), output_db(output_db_), path(path_), tag(tag_),
+		  archive(create_stream_archive_database(path_.c_str(), DatabaseMode::OverWrite))
+	{
+	}
+
+	bool prepare() override
+	{
+		return archive->prepare();
+	}
+
+	bool read_entry(ResourceTag, Hash, size_t *, void *, PayloadReadFlags) override
+	{
+		return false;
+	}
+
+	bool write_entry(ResourceTag write_tag, Hash hash, const void *buffer, size_t size, PayloadWriteFlags flags) override
+	{
+		if (!archive->write_entry(write_tag, hash, buffer, size, flags))
+			return false;
+		writes.push_back({ write_tag, hash });
+		return true;
+	}
+
+	bool has_entry(ResourceTag query_tag, Hash hash) override
+	{
+		if (query_tag != tag && query_tag != RESOURCE_APPLICATION_INFO && query_tag != RESOURCE_APPLICATION_BLOB_LINK)
+			return true;
+
+		// The output is not written to while workers are running.
+		return output_db.has_entry(query_tag, hash);
+	}
+
+	bool get_hash_list_for_resource_tag(ResourceTag, size_t *, Hash *) override
+	{
+		return false;
+	}
+
+	void flush() override
+	{
+		archive->flush();
+	}
+
+	const char *get_db_path_for_hash(ResourceTag, Hash) override
+	{
+		return nullptr;
+	}
+
+	DatabaseInterface &output_db;
+	string path;
+	ResourceTag tag;
+	unique_ptr<DatabaseInterface> archive;
+	vector<pair<ResourceTag, Hash>> writes;
+};
+
+struct RehashWorker : StateCreatorInterface
+{
+	StateRecorder recorder;
+	StateReplayer replayer;
+	unique_ptr<CaptureDatabase> capture;
+	const StateRecorder *remap_recorder = nullptr;
+	ResourceTag tag = RESOURCE_COUNT;
+
+	// If false, the recorder computes hashes itself, and the objects are not added to the remap table.
+	bool compute_hashes = true;
+	bool normalize_pipelines = false;
+	bool found_derivative_pipeline = false;
+	vector<pair<Hash, Hash>> remapped;
+
+	// Dependencies resolved through the database were rehashed by earlier tags.
+	bool enqueue_create_sampler(Hash hash, const VkSamplerCreateInfo *create_info, VkSampler *sampler) override
+	{
+		*sampler = fake_handle<VkSampler>(hash);
+		if (tag != RESOURCE_SAMPLER)
+			return true;
+
+		Hash new_hash = 0;
+		if (!Hashing::compute_hash_sampler(*create_info, &new_hash))
+			return true;
+		remapped.push_back({ hash, new_hash });
+		return recorder.record_sampler(*sampler, *create_info, new_hash);
+	}
+
+	bool enqueue_create_descriptor_set_layout(Hash hash, const VkDescriptorSetLayoutCreateInfo *create_info, VkDescriptorSetLayout *layout) override
+	{
+		*layout = fake_handle<VkDescriptorSetLayout>(hash);
+		if (tag != RESOURCE_DESCRIPTOR_SET_LAYOUT)
+			return true;
+
+		Hash new_hash = 0;
+		if (!Hashing::compute_hash_descriptor_set_layout(*remap_recorder, *create_info, &new_hash))
+			return true;
+		remapped.push_back({ hash, new_hash });
+		return recorder.record_descriptor_set_layout(*layout, *create_info, new_hash);
+	}
+
+	bool enqueue_create_pipeline_layout(Hash hash, const VkPipelineLayoutCreateInfo *create_info, VkPipelineLayout *layout) override
+	{
+		*layout = fake_handle<VkPipelineLayout>(hash);
+		if (tag != RESOURCE_PIPELINE_LAYOUT)
+			return true;
+
+		Hash new_hash = 0;
+		if (!Hashing::compute_hash_pipeline_layout(*remap_recorder, *create_info, &new_hash))
+			return true;
+		remapped.push_back({ hash, new_hash });
+		return recorder.record_pipeline_layout(*layout, *create_info, new_hash);
+	}
+
+	bool enqueue_create_shader_module(Hash hash, const VkShaderModuleCreateInfo *create_info, VkShaderModule *module) override
+	{
+		*module = fake_handle<VkShaderModule>(hash);
+		if (tag != RESOURCE_SHADER_MODULE)
+			return true;
+
+		Hash new_hash = 0;
+		if (!Hashing::compute_hash_shader_module(*create_info, &new_hash))
+			return true;
+		remapped.push_back({ hash, new_hash });
+		return recorder.record_shader_module(*module, *create_info, new_hash);
+	}
+
+	bool enqueue_create_render_pass(Hash hash, const VkRenderPassCreateInfo *create_info, VkRenderPass *render_pass) override
+	{
+		*render_pass = fake_handle<VkRenderPass>(hash);
+		if (tag != RESOURCE_RENDER_PASS)
+			return true;
+
+		Hash new_hash = 0;
+		if (!Hashing::compute_hash_render_pass(*create_info, &new_hash))
+			return true;
+		remapped.push_back({ hash, new_hash });
+		return recorder.record_render_pass(*render_pass, *create_info, new_hash);
+	}
+
+	bool enqueue_create_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(hash);
+		if (tag != RESOURCE_COMPUTE_PIPELINE)
+			return true;
+
+		if (!compute_hashes)
+			return recorder.record_compute_pipeline(*pipeline, *create_info, nullptr, 0);
+
+		// The remap table does not know about pipelines.
+		if (create_info->basePipelineHandle != VK_NULL_HANDLE)
+		{
+			found_derivative_pipeline = true;
+			return true;
+		}
+
+		Hash new_hash = 0;
+		if (!Hashing::compute_hash_compute_pipeline(*remap_recorder, *create_info, &new_hash))
+			return true;
+		return recorder.record_compute_pipeline(*pipeline, *create_info, nullptr, 0, new_hash);
+	}
+
+	bool enqueue_create_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(hash);
+		if (tag != RESOURCE_GRAPHICS_PIPELINE)
+			return true;
+
+		if (!compute_hashes)
+			return recorder.record_graphics_pipeline(*pipeline, *create_info, nullptr, 0);
+
+		VkGraphicsPipelineCreateInfo info = *create_info;
+		if (normalize_pipelines)
+			normalize_graphics_pipeline(replayer.get_allocator(), *create_info, &info);
+
+		if (info.basePipelineHandle != VK_NULL_HANDLE)
+		{
+			found_derivative_pipeline = true;
+			return true;
+		}
+
+		Hash new_hash = 0;
+		if (!Hashing::compute_hash_graphics_pipeline(*remap_recorder, info, &new_hash))
+			return true;
+		return recorder.record_graphics_pipeline(*pipeline, info, nullptr, 0, new_hash);
+	}
+};
+
+static bool copy_captured_entries(DatabaseInterface &output_db, CaptureDatabase &capture)
+{
+	// Close the archive before reading it back.
+	capture.archive.reset();
+	unique_ptr<DatabaseInterface> archive(create_stream_archive_database(capture.path.c_str(), DatabaseMode::ReadOnly));
+	if (!archive->prepare())
+		return false;
+
+	vector<uint8_t> blob;
+	for (auto &write : capture.writes)
+	{
+		if (output_db.has_entry(write.first, write.second))
+			continue;
+
+		size_t size = 0;
+		if (!archive->read_entry(write.first, write.second, &size, nullptr, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+			return false;
+		blob.resize(size);
+		if (!archive->read_entry(write.first, write.second, &size, blob.data(), PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+			return false;
+		if (!output_db.write_entry(write.first, write.second, blob.data(), blob.size(), PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT))
+			return false;
+	}
+
+	return true;
+}
+
+enum class RehashResult
+{
+	Success,
+	Error,
+	NeedsSerial
+};
+
+// Rehashes all objects of one tag. Every worker takes a contiguous range of the sorted hashes and records into
+// its own StateRecorder, so concatenating the writes of all workers gives the order of the serial tool.
+// Duplicate writes are dropped when merging, just like the serial recorder would skip them.
+static RehashResult rehash_tag_threaded(DatabaseInterface &input_db, DatabaseInterface &output_db,
+                                        const string &output_db_path, const RehashReplayer &rehash_replayer,
+                                        StateRecorder &remap_recorder, RemapTable &table,
+                                        ResourceTag tag, const vector<Hash> &hashes,
+                                        unsigned num_threads, bool compute_hashes, bool normalize_pipelines)
+{
+	ConcurrentReadDatabase resolver(input_db);
+
+	// At least one worker, so the application info is written even for empty tags.
+	unsigned num_workers = unsigned(std::max<size_t>(1, std::min<size_t>(num_threads, hashes.size())));
+	vector<unique_ptr<RehashWorker>> workers;
+	bool success = true;
+
+	for (unsigned i = 0; i < num_workers; i++)
+	{
+		auto *worker = new RehashWorker;
+		workers.emplace_back(worker);
+		worker->tag = tag;
+		worker->remap_recorder = &remap_recorder;
+		worker->compute_hashes = compute_hashes;
+		worker->normalize_pipelines = normalize_pipelines;
+		worker->replayer.set_resolve_shader_module_handles(false);
+		worker->replayer.set_resolve_derivative_pipeline_handles(!compute_hashes);
+
+		worker->recorder.set_database_enable_checksum(true);
+		worker->recorder.set_database_enable_compression(true);
+		worker->recorder.set_normalize_pipelines(normalize_pipelines);
+		if (rehash_replayer.application_info)
+			if (!worker->recorder.record_application_info(*rehash_replayer.application_info))
+				LOGE("Failed to record application info.\n");
+		if (rehash_replayer.physical_device_features)
+			if (!worker->recorder.record_physical_device_features(*rehash_replayer.physical_device_features))
+				LOGE("Failed to record physical device features.\n");
+
+		// Primed before the recording thread starts, so placeholders never reach the database.
+		if (!prime_recorder(worker->recorder, table))
+		{
+			LOGE("Failed to prime recorder.\n");
+			return RehashResult::Error;
+		}
+
+		worker->capture.reset(new CaptureDatabase(output_db, output_db_path + ".rehash." + to_string(i) + ".tmp", tag));
+		worker->recorder.init_recording_thread(worker->capture.get());
+	}
+
+	atomic<bool> failed(false);
+	vector<thread> threads;
+	for (unsigned i = 0; i < num_workers; i++)
+	{
+		threads.emplace_back([&, i]() {
+			auto &worker = *workers[i];
+			size_t begin_index = hashes.size() * i / num_workers;
+			size_t end_index = hashes.size() * (i + 1) / num_workers;
+			vector<uint8_t> state_json;
+
+			for (size_t index = begin_index; index < end_index && !failed; index++)
+			{
+				Hash hash = hashes[index];
+				size_t state_json_size = 0;
+				if (!input_db.read_entry(tag, hash, &state_json_size, nullptr, PAYLOAD_READ_CONCURRENT_BIT))
+				{
+					LOGE("Failed to load blob from cache.\n");
+					failed = true;
+					break;
+				}
+
+				state_json.resize(state_json_size);
+				if (!input_db.read_entry(tag, hash, &state_json_size, state_json.data(), PAYLOAD_READ_CONCURRENT_BIT))
+				{
+					LOGE("Failed to load blob from cache.\n");
+					failed = true;
+					break;
+				}
+
+				if (!worker.replayer.parse(worker, &resolver, state_json.data(), state_json.size()))
+					LOGE("Failed to parse blob (tag: %d, hash: 0x%" PRIx64 ").\n", tag, hash);
+
+				if (worker.found_derivative_pipeline)
+					break;
+			}
+		});
+	}
+
+	for (auto &t : threads)
+		t.join();
+
+	bool found_derivative_pipeline = false;
+	for (auto &worker : workers)
+	{
+		worker->recorder.tear_down_recording_thread();
+		found_derivative_pipeline = found_derivative_pipeline || worker->found_derivative_pipeline;
+	}
+
+	if (!failed && !found_derivative_pipeline)
+	{
+		for (auto &worker : workers)
+		{
+			if (!copy_captured_entries(output_db, *worker->capture))
+			{
+				LOGE("Failed to copy rehashed entries to output.\n");
+				success = false;
+				break;
+			}
+		}
+	}
+
+	for (auto &worker : workers)
+	{
+		worker->capture->archive.reset();
+		remove(worker->capture->path.c_str());
+	}
+
+	if (failed || !success)
+		return RehashResult::Error;
+	if (found_derivative_pipeline)
+		return RehashResult::NeedsSerial;
+
+	RemapTable new_entries;
+	for (auto &worker : workers)
+	{
+		auto &remapped = worker->remapped;
+		table.remapped[tag].insert(end(table.remapped[tag]), begin(remapped), end(remapped));
+		new_entries.remapped[tag].insert(end(new_entries.remapped[tag]), begin(remapped), end(remapped));
+	}
+
+	if (!prime_recorder(remap_recorder, new_entries, tag))
+	{
+		LOGE("Failed to prime recorder.\n");
+		return RehashResult::Error;
+	}
+
+	return RehashResult::Success;
+}
+
+static int rehash_threaded(DatabaseInterface &input_db, DatabaseInterface &output_db, const string &output_db_path,
+                           RehashReplayer &rehash_replayer, unsigned num_threads, bool normalize_pipelines)
+{
+	if (!output_db.prepare())
+	{
+		LOGE("Failed to open database for writing: %s\n", output_db_path.c_str());
+		return EXIT_FAILURE;
+	}
+
+	// Serial tag order, which is also a valid dependency order.
+	// Objects within a tag are independent of each other, except for derived pipelines.
+	static const ResourceTag playback_order[] = {
+		RESOURCE_APPLICATION_INFO,
+		RESOURCE_SHADER_MODULE,
+		RESOURCE_SAMPLER,
+		RESOURCE_DESCRIPTOR_SET_LAYOUT,
+		RESOURCE_PIPELINE_LAYOUT,
+		RESOURCE_RENDER_PASS,
+		RESOURCE_GRAPHICS_PIPELINE,
+		RESOURCE_COMPUTE_PIPELINE,
+	};
+
+	// Only read by workers while a tag is processed, and primed in between.
+	StateRecorder remap_recorder;
+	RemapTable table;
+	StateReplayer replayer;
+	vector<uint8_t> state_json;
+
+	for (auto &tag : playback_order)
+	{
+		size_t hash_count = 0;
+		if (!input_db.get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
+		{
+			LOGE("Failed to get hashes.\n");
+			return EXIT_FAILURE;
+		}
+
+		vector<Hash> hashes(hash_count);
+		if (!input_db.get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
+		{
+			LOGE("Failed to get hashes.\n");
+			return EXIT_FAILURE;
+		}
+
+		if (tag == RESOURCE_APPLICATION_INFO)
+		{
+			for (auto hash : hashes)
+			{
+				size_t state_json_size;
+				if (!input_db.read_entry(tag, hash, &state_json_size, nullptr, 0))
+				{
+					LOGE("Failed to load blob from cache.\n");
+					return EXIT_FAILURE;
+				}
+
+				state_json.resize(state_json_size);
+				if (!input_db.read_entry(tag, hash, &state_json_size, state_json.data(), 0))
+				{
+					LOGE("Failed to load blob from cache.\n");
+					return EXIT_FAILURE;
+				}
+
+				if (!replayer.parse(rehash_replayer, &input_db, state_json.data(), state_json.size()))
+					LOGE("Failed to parse blob (tag: %d, hash: 0x%" PRIx64 ").\n", tag, hash);
+			}
+			continue;
+		}
+
+		auto result = rehash_tag_threaded(input_db, output_db, output_db_path, rehash_replayer,
+		                                  remap_recorder, table, tag, hashes, num_threads, true, normalize_pipelines);
+
+		if (result == RehashResult::NeedsSerial)
+		{
+			LOGI("Found derivative pipelines, rehashing tag %d serially.\n", tag);
+			result = rehash_tag_threaded(input_db, output_db, output_db_path, rehash_replayer,
+			                             remap_recorder, table, tag, hashes, 1, false, normalize_pipelines);
+		}
+
+		if (result != RehashResult::Success)
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, char *argv[])
 {
 	CLICallbacks cbs;
 	string input_db_path;
 	string output_db_path;
+	unsigned num_threads = 1;
+	bool normalize_pipelines = false;
 
 	unique_ptr<DatabaseInterface> output_db;
 
@@ -134,6 +673,8 @@ int main(int argc, char *argv[])
 		rehash_replayer.filter_application_hash = strtoull(parser.next_string(), nullptr, 16);
 		rehash_replayer.should_filter_application_hash = true;
 	});
+	cbs.add("--num-threads", [&](CLIParser &parser) { num_threads = parser.next_uint(); });
+	cbs.add("--normalize-pipelines", [&](CLIParser &) { normalize_pipelines = true; });
 
 	cbs.error_handler = [] { print_help(); };
 
@@ -164,6 +705,20 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	// Entries are merged from per-thread archives, which requires raw copies into a stream archive.
+	if (num_threads > 1 && Path::ext(output_db_path) != "foz")
+	{
+		LOGI("Threaded rehashing requires a .foz output database, rehashing serially.\n");
+		num_threads = 1;
+	}
+
+	if (num_threads > 1)
+	{
+		rehash_replayer.recorder = nullptr;
+		return rehash_threaded(*input_db, *output_db, output_db_path, rehash_replayer, num_threads, normalize_pipelines);
+	}
+
+	recorder.set_normalize_pipelines(normalize_pipelines);
 	StateReplayer replayer;
 
 	static const ResourceTag playback_order[] = {
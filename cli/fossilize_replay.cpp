@@ -29,6 +29,9 @@
 #include "volk.h"
 #include "device.hpp"
 #include "fossilize.hpp"
+#include "fossilize_normalize.hpp"
+#include "cpu_topology.hpp"
+#include "blob_prefetcher.hpp"
 #include "cli_parser.hpp"
 #include "logging.hpp"
 #include "file.hpp"
@@ -43,6 +46,7 @@
 #include <unordered_set>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <chrono>	// VALVE
 #include <queue>	// VALVE
 #include <thread>	// VALVE
@@ -54,6 +58,8 @@
 #include <algorithm>
 #include <utility>
 #include <map>
+#include <array>
+#include <limits>
 #include <assert.h>
 
 #ifdef FOSSILIZE_REPLAYER_SPIRV_VAL
@@ -209,18 +215,141 @@ static void on_validation_error(void *userdata);
 static void timeout_handler();
 #endif
 
+// Topology of the CPUs this process may run on, for placing worker threads and child processes.
+static bool query_placement_topology(CPUTopology *topology)
+{
+	if (!query_cpu_topology(topology))
+	{
+		LOGE("Failed to query CPU topology, threads will not be pinned.\n");
+		return false;
+	}
+
+	restrict_cpu_topology_to_affinity(topology);
+	if (topology->cpus.empty())
+	{
+		LOGE("None of the online CPUs are in the affinity mask, threads will not be pinned.\n");
+		return false;
+	}
+
+	LOGI("CPU topology: %u logical CPUs, %u cores, %u L3 domains, %u NUMA nodes.\n",
+	     unsigned(topology->cpus.size()), topology->num_cores, topology->num_l3_domains, topology->num_nodes);
+	return true;
+}
+
+#ifdef FOSSILIZE_REPLAYER_SPIRV_VAL
+// Setting up a SPIRV-Tools context is not free, so each thread keeps one around rather than one per module.
+struct SpirvValidator
+{
+	SpirvValidator(spv_target_env env, bool scalar_block_layout)
+		: context(env)
+	{
+		options.SetScalarBlockLayout(scalar_block_layout);
+		context.SetMessageConsumer([](spv_message_level_t, const char *, const spv_position_t &, const char *message) {
+			LOGE("spirv-val: %s\n", message);
+		});
+	}
+
+	bool validate(const VkShaderModuleCreateInfo *create_info)
+	{
+		return context.Validate(create_info->pCode, create_info->codeSize / 4, options);
+	}
+
+	spvtools::SpirvTools context;
+	spvtools::ValidatorOptions options;
+};
+#endif
+
+// Decodes pipeline blobs without creating any Vulkan objects, only reporting which modules they refer to.
+struct PipelineModuleCollector : StateCreatorInterface
+{
+	vector<Hash> *referenced_modules = nullptr;
+
+	template <typename T>
+	static T fake_handle(Hash hash)
+	{
+		return (T)hash;
+	}
+
+	bool enqueue_create_sampler(Hash hash, const VkSamplerCreateInfo *, VkSampler *sampler) override
+	{
+		*sampler = fake_handle<VkSampler>(hash);
+		return true;
+	}
+
+	bool enqueue_create_descriptor_set_layout(Hash hash, const VkDescriptorSetLayoutCreateInfo *, VkDescriptorSetLayout *layout) override
+	{
+		*layout = fake_handle<VkDescriptorSetLayout>(hash);
+		return true;
+	}
+
+	bool enqueue_create_pipeline_layout(Hash hash, const VkPipelineLayoutCreateInfo *, VkPipelineLayout *layout) override
+	{
+		*layout = fake_handle<VkPipelineLayout>(hash);
+		return true;
+	}
+
+	bool enqueue_create_render_pass(Hash hash, const VkRenderPassCreateInfo *, VkRenderPass *render_pass) override
+	{
+		*render_pass = fake_handle<VkRenderPass>(hash);
+		return true;
+	}
+
+	bool enqueue_create_shader_module(Hash hash, const VkShaderModuleCreateInfo *, VkShaderModule *module) override
+	{
+		*module = fake_handle<VkShaderModule>(hash);
+		return true;
+	}
+
+	bool enqueue_create_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(hash);
+		if (referenced_modules)
+			referenced_modules->push_back((Hash)create_info->stage.module);
+		return true;
+	}
+
+	bool enqueue_create_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(hash);
+		if (referenced_modules)
+			for (uint32_t i = 0; i < create_info->stageCount; i++)
+				referenced_modules->push_back((Hash)create_info->pStages[i].module);
+		return true;
+	}
+};
+
+#ifdef FOSSILIZE_REPLAYER_SPIRV_VAL
+// For the SPIR-V pre-validation pass, modules are validated as they are decoded.
+struct SpirvPrevalidationCollector : PipelineModuleCollector
+{
+	SpirvValidator *validator = nullptr;
+	bool result = false;
+
+	bool enqueue_create_shader_module(Hash hash, const VkShaderModuleCreateInfo *create_info, VkShaderModule *module) override
+	{
+		*module = fake_handle<VkShaderModule>(hash);
+		if (validator)
+			result = validator->validate(create_info);
+		return true;
+	}
+};
+#endif
+
 struct ThreadedReplayer : StateCreatorInterface
 {
 	struct Options
 	{
 		bool pipeline_cache = false;
 		bool spirv_validate = false;
+		bool spirv_validate_prepass = false;
 		bool ignore_derived_pipelines = false;
 		bool pipeline_stats = false;
+		bool normalize_pipelines = false;
 		string on_disk_pipeline_cache_path;
 		string on_disk_validation_cache_path;
 		string on_disk_validation_whitelist_path;
 		string on_disk_validation_blacklist_path;
+		string on_disk_feature_filter_cache_path;
 		string pipeline_stats_path;
 
 		// VALVE: Add multi-threaded pipeline creation
@@ -248,6 +377,18 @@ struct ThreadedReplayer : StateCreatorInterface
 		void (*on_validation_error_callback)(ThreadedReplayer *) = nullptr;
 
 		unsigned timeout_seconds = 0;
+
+		// Worker thread N is pinned to placement slot N.
+		// In multi-process replays, child process N is pinned to slot N instead.
+		ThreadPlacement thread_placement = ThreadPlacement::None;
+
+		// Stop compiling once the deadline hits, and compile the most valuable pipelines first.
+		unsigned time_budget_seconds = 0;
+		string pipeline_usage_path;
+
+		// Blobs are read and inflated this many work items ahead of the worker threads which parse them.
+		unsigned decode_threads = 0;
+		unsigned decode_look_ahead = 64;
 	};
 
 	struct DeferredGraphicsInfo
@@ -278,6 +419,8 @@ struct ThreadedReplayer : StateCreatorInterface
 		unsigned memory_context_index = 0;
 		bool parse_only = false;
 		bool force_outside_range = false;
+		bool prefetched = false;
+		uint64_t prefetch_ticket = 0;
 
 		union
 		{
@@ -314,6 +457,10 @@ struct ThreadedReplayer : StateCreatorInterface
 
 		bool force_outside_range = false;
 		bool triggered_validation_error = false;
+
+#ifdef FOSSILIZE_REPLAYER_SPIRV_VAL
+		std::unique_ptr<SpirvValidator> spirv_validator;
+#endif
 	};
 
 	ThreadedReplayer(const VulkanDevice::Options &device_opts_, const Options &opts_)
@@ -334,6 +481,10 @@ struct ThreadedReplayer : StateCreatorInterface
 		total_peak_memory.store(0);
 		pipeline_cache_hits.store(0);
 		pipeline_cache_misses.store(0);
+		normalized_graphics_duplicate_count.store(0);
+		covered_pipeline_value.store(0);
+		covered_pipeline_count.store(0);
+		deadline_skipped_count.store(0);
 
 		shader_module_total_compressed_size.store(0);
 		shader_module_total_size.store(0);
@@ -373,6 +524,51 @@ struct ThreadedReplayer : StateCreatorInterface
 		}
 	}
 
+	static unique_ptr<DatabaseInterface> open_feature_filter_verdict_db(const string &base_path)
+	{
+		// Archives written by earlier runs and other processes are not merged into <base>.foz,
+		// so read them back directly.
+		vector<string> paths;
+		for (unsigned index = 1; index < 256; index++)
+		{
+			string path = base_path + "." + to_string(index) + ".foz";
+			FILE *file = fopen(path.c_str(), "rb");
+			if (file)
+			{
+				fclose(file);
+				paths.push_back(move(path));
+			}
+		}
+
+		vector<const char *> extra_paths;
+		for (auto &path : paths)
+			extra_paths.push_back(path.c_str());
+
+		unique_ptr<DatabaseInterface> db(create_concurrent_database(base_path.c_str(), DatabaseMode::Append,
+		                                                            extra_paths.data(), extra_paths.size()));
+		if (!db->prepare())
+		{
+			LOGE("Could not open feature filter cache %s. Ignoring.\n", base_path.c_str());
+			db.reset();
+		}
+		return db;
+	}
+
+	void init_feature_filter_cache_db()
+	{
+		if (opts.on_disk_feature_filter_cache_path.empty())
+			return;
+
+		// Each device fingerprint gets its own archives, so a driver update or different
+		// set of enabled features and extensions starts from a clean cache.
+		char fingerprint[17];
+		snprintf(fingerprint, sizeof(fingerprint), "%016" PRIx64, device->get_feature_filter().get_fingerprint());
+		string base_path = opts.on_disk_feature_filter_cache_path + "." + fingerprint;
+
+		feature_filter_supported_db = open_feature_filter_verdict_db(base_path + ".supported");
+		feature_filter_unsupported_db = open_feature_filter_verdict_db(base_path + ".unsupported");
+	}
+
 	void init_blacklist_db()
 	{
 		if (!opts.on_disk_validation_blacklist_path.empty())
@@ -390,6 +586,16 @@ struct ThreadedReplayer : StateCreatorInterface
 	{
 		thread_initialized_count = 0;
 
+		if (opts.thread_placement != ThreadPlacement::None && !query_placement_topology(&cpu_topology))
+			opts.thread_placement = ThreadPlacement::None;
+
+		if (opts.decode_threads != 0)
+		{
+			blob_prefetcher.reset(new BlobPrefetcher(global_database));
+			blob_prefetcher->start(opts.decode_threads, opts.decode_look_ahead,
+			                       opts.on_thread_callback, opts.on_thread_callback_userdata);
+		}
+
 		// Make sure main thread sees degenerate current_*_index. Any crash in main thread is fatal.
 		for (unsigned i = 0; i < num_worker_threads; i++)
 		{
@@ -462,20 +668,35 @@ struct ThreadedReplayer : StateCreatorInterface
 	bool run_parse_work_item(StateReplayer &replayer, vector<uint8_t> &buffer, const PipelineWorkItem &work_item)
 	{
 		size_t json_size = 0;
-		if (!global_database->read_entry(work_item.tag, work_item.hash, &json_size, nullptr, PAYLOAD_READ_CONCURRENT_BIT))
+		if (work_item.prefetched)
 		{
-			LOGE("Failed to read entry (%u: %016" PRIx64 ")\n", unsigned(work_item.tag), work_item.hash);
-			if (work_item.tag == RESOURCE_SHADER_MODULE && opts.control_block)
-				opts.control_block->parsed_module_failures.fetch_add(1, std::memory_order_relaxed);
-			return false;
+			// The decode threads have most likely read and inflated the blob already.
+			if (!blob_prefetcher->acquire(work_item.prefetch_ticket, buffer))
+			{
+				LOGE("Failed to read entry (%u: %016" PRIx64 ")\n", unsigned(work_item.tag), work_item.hash);
+				if (work_item.tag == RESOURCE_SHADER_MODULE && opts.control_block)
+					opts.control_block->parsed_module_failures.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			json_size = buffer.size();
 		}
+		else
+		{
+			if (!global_database->read_entry(work_item.tag, work_item.hash, &json_size, nullptr, PAYLOAD_READ_CONCURRENT_BIT))
+			{
+				LOGE("Failed to read entry (%u: %016" PRIx64 ")\n", unsigned(work_item.tag), work_item.hash);
+				if (work_item.tag == RESOURCE_SHADER_MODULE && opts.control_block)
+					opts.control_block->parsed_module_failures.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
 
-		buffer.resize(json_size);
+			buffer.resize(json_size);
 
-		if (!global_database->read_entry(work_item.tag, work_item.hash, &json_size, buffer.data(), PAYLOAD_READ_CONCURRENT_BIT))
-		{
-			LOGE("Failed to read entry (%u: %016" PRIx64 ")\n", unsigned(work_item.tag), work_item.hash);
-			return false;
+			if (!global_database->read_entry(work_item.tag, work_item.hash, &json_size, buffer.data(), PAYLOAD_READ_CONCURRENT_BIT))
+			{
+				LOGE("Failed to read entry (%u: %016" PRIx64 ")\n", unsigned(work_item.tag), work_item.hash);
+				return false;
+			}
 		}
 
 		auto &per_thread = get_per_thread_data();
@@ -670,6 +891,420 @@ struct ThreadedReplayer : StateCreatorInterface
 			return false;
 	}
 
+	bool parse_collector_blob(StateReplayer &replayer, PipelineModuleCollector &collector,
+	                          ResourceTag tag, Hash hash, vector<uint8_t> &buffer)
+	{
+		size_t json_size = 0;
+		if (!global_database->read_entry(tag, hash, &json_size, nullptr, PAYLOAD_READ_CONCURRENT_BIT))
+			return false;
+		buffer.resize(json_size);
+		if (!global_database->read_entry(tag, hash, &json_size, buffer.data(), PAYLOAD_READ_CONCURRENT_BIT))
+			return false;
+
+		bool ret = replayer.parse(collector, global_database, buffer.data(), buffer.size());
+		replayer.get_allocator().reset();
+		return ret;
+	}
+
+#ifdef FOSSILIZE_REPLAYER_SPIRV_VAL
+	std::unique_ptr<SpirvValidator> create_spirv_validator()
+	{
+		spv_target_env env;
+		if (device->get_api_version() >= VK_VERSION_1_2)
+			env = SPV_ENV_VULKAN_1_2;
+		else if (device->get_api_version() >= VK_VERSION_1_1)
+			env = SPV_ENV_VULKAN_1_1;
+		else
+			env = SPV_ENV_VULKAN_1_0;
+
+		return std::unique_ptr<SpirvValidator>(
+				new SpirvValidator(env, device->get_feature_filter().supports_scalar_block_layout()));
+	}
+
+	// Runs spirv-val over every module this process may need before any pipeline is enqueued,
+	// so worker threads never stall on validation while they should be compiling.
+	// In multi-process replays each child only covers the modules its pipeline range refers to.
+	void prevalidate_shader_modules(const vector<Hash> &graphics_hashes, const vector<Hash> &compute_hashes)
+	{
+		auto start_time = chrono::steady_clock::now();
+		unsigned num_threads = max(num_worker_threads, 1u);
+
+		auto run_threaded = [&](size_t count, const function<void (StateReplayer &, SpirvPrevalidationCollector &,
+		                                                            vector<uint8_t> &, size_t)> &func) {
+			atomic<size_t> next_index(0);
+			vector<thread> threads;
+			for (unsigned i = 0; i < num_threads; i++)
+			{
+				threads.emplace_back([&, i]() {
+					if (opts.on_thread_callback)
+						opts.on_thread_callback(opts.on_thread_callback_userdata);
+
+					StateReplayer replayer;
+					replayer.set_resolve_derivative_pipeline_handles(false);
+					replayer.set_resolve_shader_module_handles(false);
+					replayer.copy_handle_references(*global_replayer);
+
+					SpirvPrevalidationCollector collector;
+					vector<uint8_t> buffer;
+					size_t index;
+					while ((index = next_index.fetch_add(1, memory_order_relaxed)) < count)
+						func(replayer, collector, buffer, index);
+				});
+			}
+
+			for (auto &t : threads)
+				t.join();
+		};
+
+		size_t graphics_count = 0, compute_count = 0, module_count = 0;
+		if (!global_database->get_hash_list_for_resource_tag(RESOURCE_GRAPHICS_PIPELINE, &graphics_count, nullptr) ||
+		    !global_database->get_hash_list_for_resource_tag(RESOURCE_COMPUTE_PIPELINE, &compute_count, nullptr) ||
+		    !global_database->get_hash_list_for_resource_tag(RESOURCE_SHADER_MODULE, &module_count, nullptr))
+		{
+			LOGE("Failed to get list of resource hashes.\n");
+			return;
+		}
+
+		vector<Hash> module_hashes;
+		if (graphics_hashes.size() == graphics_count && compute_hashes.size() == compute_count)
+		{
+			// Replaying everything, so every module in the archive is fair game.
+			module_hashes.resize(module_count);
+			if (!global_database->get_hash_list_for_resource_tag(RESOURCE_SHADER_MODULE, &module_count, module_hashes.data()))
+			{
+				LOGE("Failed to get list of resource hashes.\n");
+				return;
+			}
+		}
+		else
+		{
+			// Only a slice of the pipelines is ours, decode them to find out which modules they use.
+			vector<vector<Hash>> referenced(graphics_hashes.size() + compute_hashes.size());
+			run_threaded(referenced.size(), [&](StateReplayer &replayer, SpirvPrevalidationCollector &collector,
+			                                    vector<uint8_t> &buffer, size_t index) {
+				bool is_graphics = index < graphics_hashes.size();
+				auto tag = is_graphics ? RESOURCE_GRAPHICS_PIPELINE : RESOURCE_COMPUTE_PIPELINE;
+				Hash hash = is_graphics ? graphics_hashes[index] : compute_hashes[index - graphics_hashes.size()];
+
+				collector.referenced_modules = &referenced[index];
+				if (!parse_collector_blob(replayer, collector, tag, hash, buffer))
+					LOGE("Failed to parse blob (tag: %d, hash: %016" PRIx64 ").\n", tag, hash);
+				collector.referenced_modules = nullptr;
+			});
+
+			for (auto &hashes : referenced)
+				module_hashes.insert(end(module_hashes), begin(hashes), end(hashes));
+			sort(begin(module_hashes), end(module_hashes));
+			module_hashes.erase(unique(begin(module_hashes), end(module_hashes)), end(module_hashes));
+		}
+
+		// Modules we have a verdict for already are skipped by the inline path anyways.
+		auto itr = remove_if(begin(module_hashes), end(module_hashes), [&](Hash hash) {
+			return masked_shader_modules.count(hash) ||
+			       resource_is_blacklisted(RESOURCE_SHADER_MODULE, hash) ||
+			       has_resource_in_whitelist(RESOURCE_SHADER_MODULE, hash);
+		});
+		module_hashes.erase(itr, end(module_hashes));
+
+		// 0: not decoded, 1: failed validation, 2: passed validation.
+		vector<uint8_t> results(module_hashes.size());
+		vector<std::unique_ptr<SpirvValidator>> validators(num_threads);
+		atomic<unsigned> validator_count(0);
+
+		run_threaded(module_hashes.size(), [&](StateReplayer &replayer, SpirvPrevalidationCollector &collector,
+		                                       vector<uint8_t> &buffer, size_t index) {
+			if (!collector.validator)
+			{
+				unsigned validator_index = validator_count.fetch_add(1, memory_order_relaxed);
+				validators[validator_index] = create_spirv_validator();
+				collector.validator = validators[validator_index].get();
+			}
+
+			collector.result = false;
+			if (parse_collector_blob(replayer, collector, RESOURCE_SHADER_MODULE, module_hashes[index], buffer))
+				results[index] = collector.result ? 2 : 1;
+		});
+
+		unsigned failed_count = 0;
+		for (size_t i = 0; i < module_hashes.size(); i++)
+		{
+			// Modules which failed to decode are left to the inline path, which deals with missing modules.
+			if (results[i] == 0)
+				continue;
+
+			bool passed = results[i] == 2;
+			spirv_prevalidated_modules[module_hashes[i]] = passed;
+			if (passed)
+			{
+				whitelist_resource(RESOURCE_SHADER_MODULE, module_hashes[i]);
+			}
+			else
+			{
+				// The inline path blacklists the module once a pipeline actually refers to it,
+				// so validation failures are still accounted for in the progress report.
+				LOGE("Failed to validate SPIR-V module: %0" PRIX64 "\n", module_hashes[i]);
+				failed_count++;
+			}
+		}
+
+		auto end_time = chrono::steady_clock::now();
+		auto duration = chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count();
+		LOGI("Pre-validated %u SPIR-V modules on %u threads, %u failed, in %.3f s.\n",
+		     unsigned(spirv_prevalidated_modules.size()), num_threads, failed_count, duration * 1e-9);
+	}
+#endif
+
+	struct PipelineUsage
+	{
+		unsigned rank;
+		uint64_t bind_count;
+	};
+
+	// One pipeline hash per line in first-use order, optionally followed by how often it was bound.
+	bool load_pipeline_usage(unordered_map<Hash, PipelineUsage> &usage, bool &has_bind_counts) const
+	{
+		FILE *file = fopen(opts.pipeline_usage_path.c_str(), "r");
+		if (!file)
+		{
+			LOGE("Failed to open pipeline usage file: %s\n", opts.pipeline_usage_path.c_str());
+			return false;
+		}
+
+		char line[256];
+		unsigned rank = 0;
+		bool ret = true;
+		while (fgets(line, sizeof(line), file))
+		{
+			char *str = line;
+			while (isspace(uint8_t(*str)))
+				str++;
+			if (*str == '\0' || *str == '#')
+				continue;
+
+			char *end;
+			Hash hash = strtoull(str, &end, 16);
+			if (end == str)
+			{
+				LOGE("Invalid pipeline hash in usage file: %s\n", str);
+				ret = false;
+				break;
+			}
+
+			while (*end == ',' || isspace(uint8_t(*end)))
+				end++;
+
+			uint64_t bind_count = 1;
+			if (*end != '\0')
+			{
+				str = end;
+				bind_count = strtoull(str, &end, 10);
+				if (end == str)
+				{
+					LOGE("Invalid bind count in usage file: %s\n", str);
+					ret = false;
+					break;
+				}
+				has_bind_counts = true;
+			}
+
+			auto itr = usage.find(hash);
+			if (itr == usage.end())
+				usage[hash] = { rank++, bind_count };
+			else
+				itr->second.bind_count += bind_count;
+		}
+
+		fclose(file);
+		return ret;
+	}
+
+	// Reorders pipelines so that the most value per estimated compile cost comes first.
+	// Value is the recorded bind count or first-use order if a usage file is provided,
+	// otherwise module sharing centrality, i.e. how many pipeline references its shader modules have in total.
+	// Cost is estimated from the size of the shader modules, which is what drivers spend their time on.
+	bool schedule_for_time_budget(vector<Hash> &graphics_hashes, vector<Hash> &compute_hashes)
+	{
+		auto start_time = chrono::steady_clock::now();
+
+		unordered_map<Hash, PipelineUsage> usage;
+		bool has_bind_counts = false;
+		if (!opts.pipeline_usage_path.empty() && !load_pipeline_usage(usage, has_bind_counts))
+			return false;
+
+		// Decoding is not free, so find out which modules the pipelines use on all threads.
+		size_t count = graphics_hashes.size() + compute_hashes.size();
+		vector<vector<Hash>> referenced(count);
+		atomic<size_t> next_index(0);
+		vector<thread> threads;
+		for (unsigned i = 0; i < max(num_worker_threads, 1u); i++)
+		{
+			threads.emplace_back([&]() {
+				if (opts.on_thread_callback)
+					opts.on_thread_callback(opts.on_thread_callback_userdata);
+
+				StateReplayer replayer;
+				replayer.set_resolve_derivative_pipeline_handles(false);
+				replayer.set_resolve_shader_module_handles(false);
+				replayer.copy_handle_references(*global_replayer);
+
+				PipelineModuleCollector collector;
+				vector<uint8_t> buffer;
+				size_t index;
+				while ((index = next_index.fetch_add(1, memory_order_relaxed)) < count)
+				{
+					bool is_graphics = index < graphics_hashes.size();
+					auto tag = is_graphics ? RESOURCE_GRAPHICS_PIPELINE : RESOURCE_COMPUTE_PIPELINE;
+					Hash hash = is_graphics ? graphics_hashes[index] : compute_hashes[index - graphics_hashes.size()];
+
+					auto &modules = referenced[index];
+					collector.referenced_modules = &modules;
+					if (!parse_collector_blob(replayer, collector, tag, hash, buffer))
+						LOGE("Failed to parse blob (tag: %d, hash: %016" PRIx64 ").\n", tag, hash);
+					collector.referenced_modules = nullptr;
+
+					sort(begin(modules), end(modules));
+					modules.erase(unique(begin(modules), end(modules)), end(modules));
+				}
+			});
+		}
+
+		for (auto &t : threads)
+			t.join();
+
+		struct ModuleInfo
+		{
+			uint32_t pipeline_count = 0;
+			size_t size = 0;
+		};
+
+		unordered_map<Hash, ModuleInfo> modules;
+		for (auto &hashes : referenced)
+			for (auto &hash : hashes)
+				modules[hash].pipeline_count++;
+
+		for (auto &module : modules)
+			if (!global_database->read_entry(RESOURCE_SHADER_MODULE, module.first, &module.second.size, nullptr, 0))
+				module.second.size = 0;
+
+		struct ScheduledPipeline
+		{
+			Hash hash;
+			double value_density;
+			double centrality_density;
+			size_t index;
+		};
+
+		const auto rank_pipelines = [&](ResourceTag tag, vector<Hash> &hashes, size_t offset) {
+			vector<ScheduledPipeline> scheduled;
+			scheduled.reserve(hashes.size());
+
+			for (size_t i = 0; i < hashes.size(); i++)
+			{
+				uint64_t centrality = 0;
+				double cost = 1.0;
+				for (auto &hash : referenced[offset + i])
+				{
+					auto &module = modules[hash];
+					centrality += module.pipeline_count;
+					cost += double(module.size);
+				}
+
+				// Pipelines which were never used while recording have no value,
+				// but centrality still decides their order after everything which was used.
+				uint64_t value = centrality;
+				if (!opts.pipeline_usage_path.empty())
+				{
+					auto itr = usage.find(hashes[i]);
+					if (itr == usage.end())
+						value = 0;
+					else if (has_bind_counts)
+						value = itr->second.bind_count;
+					else
+						value = usage.size() - itr->second.rank;
+				}
+
+				pipeline_values[tag][hashes[i]] = value;
+				total_pipeline_value += value;
+				scheduled.push_back({ hashes[i], double(value) / cost, double(centrality) / cost, i });
+			}
+
+			// Greedy by value density, which is the best we can do without knowing when the deadline hits relative to
+			// actual compile times.
+			sort(begin(scheduled), end(scheduled), [](const ScheduledPipeline &a, const ScheduledPipeline &b) -> bool {
+				if (a.value_density != b.value_density)
+					return a.value_density > b.value_density;
+				if (a.centrality_density != b.centrality_density)
+					return a.centrality_density > b.centrality_density;
+				return a.index < b.index;
+			});
+
+			for (size_t i = 0; i < scheduled.size(); i++)
+				hashes[i] = scheduled[i].hash;
+		};
+
+		rank_pipelines(RESOURCE_GRAPHICS_PIPELINE, graphics_hashes, 0);
+		rank_pipelines(RESOURCE_COMPUTE_PIPELINE, compute_hashes, graphics_hashes.size());
+
+		const char *value_source = "module sharing centrality";
+		if (!opts.pipeline_usage_path.empty())
+			value_source = has_bind_counts ? "recorded bind count" : "recorded first-use order";
+
+		auto end_time = chrono::steady_clock::now();
+		auto duration = chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count();
+		LOGI("Ranked %u pipelines by %s for a time budget of %u s in %.3f s.\n",
+		     unsigned(count), value_source, opts.time_budget_seconds, duration * 1e-9);
+		return true;
+	}
+
+	bool deadline_reached() const
+	{
+		return has_deadline && chrono::steady_clock::now() >= deadline;
+	}
+
+	void account_covered_pipeline(ResourceTag tag, Hash hash)
+	{
+		if (!has_deadline)
+			return;
+
+		auto itr = pipeline_values[tag].find(hash);
+		if (itr != pipeline_values[tag].end())
+			covered_pipeline_value.fetch_add(itr->second, std::memory_order_relaxed);
+		covered_pipeline_count.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// The verdict of the feature filter only depends on the object and the device fingerprint,
+	// so it is memoized per hash, and optionally persisted for future runs.
+	template <typename Func>
+	bool object_is_supported(ResourceTag tag, Hash hash, const Func &filter)
+	{
+		{
+			lock_guard<mutex> holder{feature_filter_mutex};
+			auto itr = feature_filter_verdicts[tag].find(hash);
+			if (itr != feature_filter_verdicts[tag].end())
+				return itr->second;
+
+			for (bool supported : { true, false })
+			{
+				auto &db = supported ? feature_filter_supported_db : feature_filter_unsupported_db;
+				if (db && db->has_entry(tag, hash))
+				{
+					feature_filter_verdicts[tag][hash] = supported;
+					return supported;
+				}
+			}
+		}
+
+		// Filtering can be expensive for shader modules, so don't hold the lock while doing it.
+		bool supported = filter();
+
+		lock_guard<mutex> holder{feature_filter_mutex};
+		feature_filter_verdicts[tag][hash] = supported;
+		auto &db = supported ? feature_filter_supported_db : feature_filter_unsupported_db;
+		if (db)
+			db->write_entry(tag, hash, nullptr, 0, 0);
+		return supported;
+	}
+
 	void run_creation_work_item(const PipelineWorkItem &work_item)
 	{
 		switch (work_item.tag)
@@ -691,6 +1326,14 @@ struct ThreadedReplayer : StateCreatorInterface
 				break;
 			}
 
+			// Whatever is still queued when the deadline hits is dropped, compiles in flight are allowed to finish.
+			if (deadline_reached())
+			{
+				*work_item.output.pipeline = VK_NULL_HANDLE;
+				deadline_skipped_count.fetch_add(1, std::memory_order_relaxed);
+				break;
+			}
+
 			if (robustness)
 			{
 				per_thread.num_failed_module_hashes = work_item.create_info.graphics_create_info->stageCount;
@@ -722,7 +1365,9 @@ struct ThreadedReplayer : StateCreatorInterface
 				break;
 			}
 
-			if (!device->get_feature_filter().graphics_pipeline_is_supported(work_item.create_info.graphics_create_info))
+			if (!object_is_supported(RESOURCE_GRAPHICS_PIPELINE, work_item.hash, [&]() {
+				return device->get_feature_filter().graphics_pipeline_is_supported(work_item.create_info.graphics_create_info);
+			}))
 			{
 				*work_item.output.pipeline = VK_NULL_HANDLE;
 				LOGE("Graphics pipeline %016" PRIx64 " is not supported by current device, skipping.\n", work_item.hash);
@@ -781,6 +1426,9 @@ struct ThreadedReplayer : StateCreatorInterface
 					if (opts.control_block && i == 0)
 						opts.control_block->successful_graphics.fetch_add(1, std::memory_order_relaxed);
 
+					if (i == 0)
+						account_covered_pipeline(RESOURCE_GRAPHICS_PIPELINE, work_item.hash);
+
 					if (opts.pipeline_cache && i == 0 && (primary_feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT_EXT) != 0)
 					{
 						bool cache_hit = (primary_feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT_EXT) != 0;
@@ -835,6 +1483,13 @@ struct ThreadedReplayer : StateCreatorInterface
 				break;
 			}
 
+			if (deadline_reached())
+			{
+				*work_item.output.pipeline = VK_NULL_HANDLE;
+				deadline_skipped_count.fetch_add(1, std::memory_order_relaxed);
+				break;
+			}
+
 			if (robustness)
 			{
 				per_thread.num_failed_module_hashes = 1;
@@ -862,7 +1517,9 @@ struct ThreadedReplayer : StateCreatorInterface
 				break;
 			}
 
-			if (!device->get_feature_filter().compute_pipeline_is_supported(work_item.create_info.compute_create_info))
+			if (!object_is_supported(RESOURCE_COMPUTE_PIPELINE, work_item.hash, [&]() {
+				return device->get_feature_filter().compute_pipeline_is_supported(work_item.create_info.compute_create_info);
+			}))
 			{
 				*work_item.output.pipeline = VK_NULL_HANDLE;
 				LOGE("Compute pipeline %016" PRIx64 " is not supported by current device, skipping.\n", work_item.hash);
@@ -921,6 +1578,9 @@ struct ThreadedReplayer : StateCreatorInterface
 					if (opts.control_block && i == 0)
 						opts.control_block->successful_compute.fetch_add(1, std::memory_order_relaxed);
 
+					if (i == 0)
+						account_covered_pipeline(RESOURCE_COMPUTE_PIPELINE, work_item.hash);
+
 					if (opts.pipeline_cache && i == 0 && (primary_feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT_EXT) != 0)
 					{
 						bool cache_hit = (primary_feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT_EXT) != 0;
@@ -961,6 +1621,15 @@ struct ThreadedReplayer : StateCreatorInterface
 	{
 		Global::worker_thread_index = thread_index;
 
+		// Pin before anything is allocated, so the parse buffers and per-thread allocators are first touched,
+		// and thus backed by memory, on the NUMA node the thread runs on.
+		if (opts.thread_placement != ThreadPlacement::None)
+		{
+			auto cpus = get_placement_cpus(cpu_topology, opts.thread_placement, thread_index - 1);
+			if (!pin_current_thread(cpus))
+				LOGE("Failed to pin worker thread %u.\n", thread_index);
+		}
+
 		if (opts.on_thread_callback)
 			opts.on_thread_callback(opts.on_thread_callback_userdata);
 
@@ -1108,6 +1777,12 @@ struct ThreadedReplayer : StateCreatorInterface
 			if (thread.joinable())
 				thread.join();
 		thread_pool.clear();
+
+		if (blob_prefetcher)
+		{
+			prefetch_statistics = blob_prefetcher->get_statistics();
+			blob_prefetcher.reset();
+		}
 	}
 
 	~ThreadedReplayer()
@@ -1242,6 +1917,8 @@ struct ThreadedReplayer : StateCreatorInterface
 				opts.pipeline_stats = false;
 			}
 
+			init_feature_filter_cache_db();
+
 			if (opts.pipeline_stats)
 			{
 				auto foz_path = opts.pipeline_stats_path + ".__tmp.foz";
@@ -1370,7 +2047,9 @@ struct ThreadedReplayer : StateCreatorInterface
 
 	bool enqueue_create_sampler(Hash index, const VkSamplerCreateInfo *create_info, VkSampler *sampler) override
 	{
-		if (!device->get_feature_filter().sampler_is_supported(create_info))
+		if (!object_is_supported(RESOURCE_SAMPLER, index, [&]() {
+			return device->get_feature_filter().sampler_is_supported(create_info);
+		}))
 		{
 			LOGE("Sampler %016" PRIx64 " is not supported. Skipping.\n", index);
 			return false;
@@ -1388,7 +2067,9 @@ struct ThreadedReplayer : StateCreatorInterface
 
 	bool enqueue_create_descriptor_set_layout(Hash index, const VkDescriptorSetLayoutCreateInfo *create_info, VkDescriptorSetLayout *layout) override
 	{
-		if (!device->get_feature_filter().descriptor_set_layout_is_supported(create_info))
+		if (!object_is_supported(RESOURCE_DESCRIPTOR_SET_LAYOUT, index, [&]() {
+			return device->get_feature_filter().descriptor_set_layout_is_supported(create_info);
+		}))
 		{
 			LOGE("Descriptor set layout %016" PRIx64 " is not supported. Skipping.\n", index);
 			return false;
@@ -1406,7 +2087,9 @@ struct ThreadedReplayer : StateCreatorInterface
 
 	bool enqueue_create_pipeline_layout(Hash index, const VkPipelineLayoutCreateInfo *create_info, VkPipelineLayout *layout) override
 	{
-		if (!device->get_feature_filter().pipeline_layout_is_supported(create_info))
+		if (!object_is_supported(RESOURCE_PIPELINE_LAYOUT, index, [&]() {
+			return device->get_feature_filter().pipeline_layout_is_supported(create_info);
+		}))
 		{
 			LOGE("Pipeline layout %016" PRIx64 " is not supported. Skipping.\n", index);
 			return false;
@@ -1424,7 +2107,9 @@ struct ThreadedReplayer : StateCreatorInterface
 
 	bool enqueue_create_render_pass(Hash index, const VkRenderPassCreateInfo *create_info, VkRenderPass *render_pass) override
 	{
-		if (!device->get_feature_filter().render_pass_is_supported(create_info))
+		if (!object_is_supported(RESOURCE_RENDER_PASS, index, [&]() {
+			return device->get_feature_filter().render_pass_is_supported(create_info);
+		}))
 		{
 			LOGE("Render pass %016" PRIx64 " is not supported. Skipping.\n", index);
 			return false;
@@ -1445,7 +2130,6 @@ struct ThreadedReplayer : StateCreatorInterface
 		*module = VK_NULL_HANDLE;
 		if (masked_shader_modules.count(hash) || resource_is_blacklisted(RESOURCE_SHADER_MODULE, hash))
 		{
-			lock_guard<mutex> lock(internal_enqueue_mutex);
 			//LOGI("Inserting shader module %016llx.\n", static_cast<unsigned long long>(hash));
 			shader_modules.insert_object(hash, *module, 1);
 			if (opts.control_block)
@@ -1457,22 +2141,21 @@ struct ThreadedReplayer : StateCreatorInterface
 		if (opts.spirv_validate && !has_resource_in_whitelist(RESOURCE_SHADER_MODULE, hash))
 		{
 			auto start_time = chrono::steady_clock::now();
-			spv_target_env env;
-			if (device->get_api_version() >= VK_VERSION_1_2)
-				env = SPV_ENV_VULKAN_1_2;
-			else if (device->get_api_version() >= VK_VERSION_1_1)
-				env = SPV_ENV_VULKAN_1_1;
-			else
-				env = SPV_ENV_VULKAN_1_0;
+			bool ret;
 
-			spvtools::SpirvTools context(env);
-			spvtools::ValidatorOptions validation_opts;
-			validation_opts.SetScalarBlockLayout(device->get_feature_filter().supports_scalar_block_layout());
-			context.SetMessageConsumer([](spv_message_level_t, const char *, const spv_position_t &, const char *message) {
-				LOGE("spirv-val: %s\n", message);
-			});
-
-			bool ret = context.Validate(create_info->pCode, create_info->codeSize / 4, validation_opts);
+			// Only written by the main thread before any pipelines are enqueued, no need to lock.
+			auto itr = spirv_prevalidated_modules.find(hash);
+			if (itr != spirv_prevalidated_modules.end())
+			{
+				ret = itr->second;
+			}
+			else
+			{
+				auto &per_thread = get_per_thread_data();
+				if (!per_thread.spirv_validator)
+					per_thread.spirv_validator = create_spirv_validator();
+				ret = per_thread.spirv_validator->validate(create_info);
+			}
 
 			auto end_time = chrono::steady_clock::now();
 			auto duration_ns = chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count();
@@ -1482,7 +2165,6 @@ struct ThreadedReplayer : StateCreatorInterface
 			{
 				LOGE("Failed to validate SPIR-V module: %0" PRIX64 "\n", hash);
 				*module = VK_NULL_HANDLE;
-				lock_guard<mutex> lock(internal_enqueue_mutex);
 				//LOGI("Inserting shader module %016llx.\n", static_cast<unsigned long long>(hash));
 				shader_modules.insert_object(hash, VK_NULL_HANDLE, 1);
 				shader_module_count.fetch_add(1, std::memory_order_relaxed);
@@ -1496,12 +2178,13 @@ struct ThreadedReplayer : StateCreatorInterface
 		}
 #endif
 
-		if (!device->get_feature_filter().shader_module_is_supported(create_info))
+		if (!object_is_supported(RESOURCE_SHADER_MODULE, hash, [&]() {
+			return device->get_feature_filter().shader_module_is_supported(create_info);
+		}))
 		{
 			LOGE("Shader module %0" PRIx64 " is not supported on this device.\n", hash);
 			*module = VK_NULL_HANDLE;
 
-			lock_guard<mutex> lock(internal_enqueue_mutex);
 			//LOGI("Inserting shader module %016llx.\n", static_cast<unsigned long long>(hash));
 			shader_modules.insert_object(hash, VK_NULL_HANDLE, 1);
 			shader_module_count.fetch_add(1, std::memory_order_relaxed);
@@ -1552,11 +2235,8 @@ struct ThreadedReplayer : StateCreatorInterface
 			}
 		}
 
-		{
-			lock_guard<mutex> lock(internal_enqueue_mutex);
-			//LOGI("Inserting shader module %016llx.\n", static_cast<unsigned long long>(hash));
-			shader_modules.insert_object(hash, *module, create_info->codeSize);
-		}
+		//LOGI("Inserting shader module %016llx.\n", static_cast<unsigned long long>(hash));
+		shader_modules.insert_object(hash, *module, create_info->codeSize);
 
 		// vkCreateShaderModule doesn't generally crash anything, so just deal with blacklisting here
 		// rather than in an error callback.
@@ -1672,6 +2352,23 @@ struct ThreadedReplayer : StateCreatorInterface
 		unsigned memory_index = per_thread.memory_context_index;
 		bool force_outside_range = per_thread.force_outside_range;
 
+		// Derived pipelines and their parents refer to each other by hash, so they are always compiled.
+		if (opts.normalize_pipelines && !force_outside_range &&
+		    (create_info->flags & (VK_PIPELINE_CREATE_DERIVATIVE_BIT | VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT)) == 0 &&
+		    is_normalized_graphics_duplicate(hash, *create_info,
+		                                     per_thread.per_thread_replayers[memory_index].get_allocator()))
+		{
+			assert(index < deferred_graphics[memory_index].size());
+			deferred_graphics[memory_index][index] = {};
+			*pipeline = (VkPipeline)hash;
+			if (opts.control_block)
+			{
+				opts.control_block->parsed_graphics.fetch_add(1, std::memory_order_relaxed);
+				opts.control_block->skipped_graphics.fetch_add(1, std::memory_order_relaxed);
+			}
+			return true;
+		}
+
 		if (!force_outside_range)
 		{
 			assert(index < deferred_graphics[memory_index].size());
@@ -1694,6 +2391,28 @@ struct ThreadedReplayer : StateCreatorInterface
 		return true;
 	}
 
+	// Shader modules are still referred to by hash while parsing, and other dependencies are unique per hash,
+	// so handle values identify dependencies just as well as their hashes.
+	bool is_normalized_graphics_duplicate(Hash hash, const VkGraphicsPipelineCreateInfo &create_info,
+	                                      ScratchAllocator &alloc)
+	{
+		VkGraphicsPipelineCreateInfo normalized;
+		Hash normalized_hash = 0;
+		if (!normalize_graphics_pipeline(alloc, create_info, &normalized) ||
+		    !Hashing::compute_hash_graphics_pipeline_by_handles(normalized, &normalized_hash))
+		{
+			return false;
+		}
+
+		lock_guard<mutex> holder(normalized_graphics_lock);
+		auto itr = normalized_graphics_classes.insert({ normalized_hash, hash });
+		if (itr.second || itr.first->second == hash)
+			return false;
+
+		normalized_graphics_duplicate_count.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
 	bool enqueue_pipeline(Hash hash, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline,
 	                      unsigned index, unsigned memory_context_index)
 	{
@@ -2179,7 +2898,8 @@ struct ThreadedReplayer : StateCreatorInterface
 	std::unordered_map<Hash, VkDescriptorSetLayout> layouts;
 	std::unordered_map<Hash, VkPipelineLayout> pipeline_layouts;
 
-	ObjectCache<VkShaderModule> shader_modules;
+	// Many worker threads finish shader modules at once, so this must not serialize on internal_enqueue_mutex.
+	ConcurrentObjectCache<VkShaderModule> shader_modules;
 
 	std::unordered_map<Hash, VkRenderPass> render_passes;
 	std::unordered_map<Hash, VkPipeline> compute_pipelines;
@@ -2194,6 +2914,20 @@ struct ThreadedReplayer : StateCreatorInterface
 
 	void enqueue_work_item(const PipelineWorkItem &item)
 	{
+		// Blobs are decoded in the order they are submitted, which is also the order of the work queue.
+		if (item.parse_only && blob_prefetcher)
+		{
+			auto prefetched_item = item;
+			prefetched_item.prefetched = true;
+			prefetched_item.prefetch_ticket = blob_prefetcher->submit(item.tag, item.hash);
+
+			lock_guard<mutex> lock(pipeline_work_queue_mutex);
+			pipeline_work_queue.push(prefetched_item);
+			work_available_condition.notify_one();
+			queued_count[item.memory_context_index]++;
+			return;
+		}
+
 		lock_guard<mutex> lock(pipeline_work_queue_mutex);
 		pipeline_work_queue.push(item);
 		work_available_condition.notify_one();
@@ -2215,12 +2949,34 @@ struct ThreadedReplayer : StateCreatorInterface
 	std::mutex internal_enqueue_mutex;
 	std::queue<PipelineWorkItem> pipeline_work_queue;
 
+	std::unique_ptr<BlobPrefetcher> blob_prefetcher;
+	BlobPrefetcher::Statistics prefetch_statistics = {};
+
 	std::mutex pipeline_stats_queue_mutex;
 	std::unique_ptr<DatabaseInterface> pipeline_stats_db;
 
 	std::mutex validation_db_mutex;
+	std::mutex feature_filter_mutex;
+	std::unordered_map<Hash, bool> feature_filter_verdicts[RESOURCE_COUNT];
+	std::unique_ptr<DatabaseInterface> feature_filter_supported_db;
+	std::unique_ptr<DatabaseInterface> feature_filter_unsupported_db;
 	std::unique_ptr<DatabaseInterface> validation_whitelist_db;
 	std::unique_ptr<DatabaseInterface> validation_blacklist_db;
+#ifdef FOSSILIZE_REPLAYER_SPIRV_VAL
+	std::unordered_map<Hash, bool> spirv_prevalidated_modules;
+#endif
+
+	// Hash of the normalized create info to the first pipeline which was seen with it.
+	std::mutex normalized_graphics_lock;
+	std::unordered_map<Hash, Hash> normalized_graphics_classes;
+
+	CPUTopology cpu_topology;
+
+	// Written before any pipeline is enqueued, read-only afterwards.
+	std::unordered_map<Hash, uint64_t> pipeline_values[RESOURCE_COUNT];
+	uint64_t total_pipeline_value = 0;
+	chrono::steady_clock::time_point deadline;
+	bool has_deadline = false;
 
 	std::mutex hash_lock;
 	std::unordered_map<Hash, DeferredGraphicsInfo> graphics_parents;
@@ -2240,6 +2996,10 @@ struct ThreadedReplayer : StateCreatorInterface
 	std::atomic<std::uint32_t> shader_module_evicted_count;
 	std::atomic<std::uint32_t> pipeline_cache_hits;
 	std::atomic<std::uint32_t> pipeline_cache_misses;
+	std::atomic<std::uint32_t> normalized_graphics_duplicate_count;
+	std::atomic<std::uint64_t> covered_pipeline_value;
+	std::atomic<std::uint32_t> covered_pipeline_count;
+	std::atomic<std::uint32_t> deadline_skipped_count;
 
 	std::atomic<std::uint64_t> shader_module_total_size;
 	std::atomic<std::uint64_t> shader_module_total_compressed_size;
@@ -2303,22 +3063,32 @@ static void print_help()
 	     "\t[--device-index <index>]\n"
 	     "\t[--enable-validation]\n"
 	     "\t[--enable-pipeline-stats <path>]\n"
+	     "\t[--pipeline-stats-columnar <path>]\n"
 	     "\t[--pipeline-cache]\n"
 	     "\t[--spirv-val]\n"
+	     "\t[--spirv-val-prepass]\n"
 	     "\t[--num-threads <count>]\n"
 	     "\t[--loop <count>]\n"
 	     "\t[--on-disk-pipeline-cache <path>]\n"
 	     "\t[--on-disk-validation-cache <path>]\n"
 	     "\t[--on-disk-validation-whitelist <path>]\n"
 	     "\t[--on-disk-validation-blacklist <path>]\n"
+	     "\t[--on-disk-feature-filter-cache <path>]\n"
 	     "\t[--pipeline-hash <hash>]\n"
 	     "\t[--graphics-pipeline-range <start> <end>]\n"
 	     "\t[--compute-pipeline-range <start> <end>]\n"
 	     "\t[--shader-cache-size <value (MiB)>]\n"
 	     "\t[--ignore-derived-pipelines]\n"
+	     "\t[--normalize-pipelines]\n"
+	     "\t[--pin-threads <none|core|l3|node>]\n"
+	     "\t[--decode-threads <count>]\n"
+	     "\t[--decode-look-ahead <count>]\n"
 	     "\t[--log-memory]\n"
 	     "\t[--null-device]\n"
+	     "\t[--parse-only]\n"
 	     "\t[--timeout-seconds]\n"
+	     "\t[--time-budget <seconds>]\n"
+	     "\t[--pipeline-usage <path>]\n"
 	     EXTRA_OPTIONS
 	     "\t<Database>\n");
 }
@@ -2488,50 +3258,370 @@ static int run_progress_process(const VulkanDevice::Options &device_opts,
 			}
 		}
 
-		std::this_thread::sleep_for(std::chrono::milliseconds(100));
-		ExternalReplayer::Progress progress = {};
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		ExternalReplayer::Progress progress = {};
+
+		if (replayer.is_process_complete(nullptr))
+		{
+			auto result = replayer.poll_progress(progress);
+			if (result != ExternalReplayer::PollResult::ResultNotReady)
+				log_progress(progress);
+			log_faulty_modules(replayer);
+			log_faulty_graphics(replayer);
+			log_faulty_compute(replayer);
+			return replayer.wait();
+		}
+
+		auto result = replayer.poll_progress(progress);
+
+		switch (result)
+		{
+		case ExternalReplayer::PollResult::Error:
+			return EXIT_FAILURE;
+
+		case ExternalReplayer::PollResult::ResultNotReady:
+			break;
+
+		case ExternalReplayer::PollResult::Complete:
+		case ExternalReplayer::PollResult::Running:
+			log_progress(progress);
+			if (result == ExternalReplayer::PollResult::Complete)
+			{
+				log_faulty_modules(replayer);
+				log_faulty_graphics(replayer);
+				log_faulty_compute(replayer);
+				return replayer.wait();
+			}
+			break;
+		}
+	}
+}
+
+static void log_process_memory();
+#endif
+
+struct PipelineStatsExecutable
+{
+	std::string name;
+	uint32_t subgroup_size = 0;
+	std::vector<std::pair<std::string, std::string>> stats;
+};
+
+struct PipelineStatsEntry
+{
+	bool valid = false;
+	std::string db_path;
+	std::string pipeline_type;
+	std::string pipeline;
+	std::vector<PipelineStatsExecutable> executables;
+};
+
+static bool parse_json_stats_entry(const char *json, PipelineStatsEntry &entry)
+{
+	rapidjson::Document doc;
+	doc.Parse(json);
+	if (doc.HasParseError() || !doc.IsObject())
+		return false;
+
+	if (!doc.HasMember("db_path") || !doc.HasMember("pipeline_type") ||
+	    !doc.HasMember("pipeline") || !doc.HasMember("executables"))
+		return false;
+
+	entry.db_path = doc["db_path"].GetString();
+	entry.pipeline_type = doc["pipeline_type"].GetString();
+	entry.pipeline = doc["pipeline"].GetString();
+
+	auto &execs = doc["executables"];
+	entry.executables.resize(execs.Size());
+	for (rapidjson::SizeType i = 0; i < execs.Size(); i++)
+	{
+		auto &exec = execs[i];
+		auto &executable = entry.executables[i];
+		executable.name = exec["executable_name"].GetString();
+		executable.subgroup_size = exec["subgroup_size"].GetUint();
+
+		auto &stats = exec["stats"];
+		executable.stats.reserve(stats.Size());
+		for (auto itr = stats.Begin(); itr != stats.End(); ++itr)
+			executable.stats.emplace_back((*itr)["name"].GetString(), (*itr)["value"].GetString());
+	}
+
+	return true;
+}
+
+// Streams pipeline stats to CSV and an optional columnar binary file.
+// The set of stat columns is only known once every entry has been seen, so CSV rows are first spilled
+// sparsely to a temporary file and expanded to the full header at the end.
+// The columnar file is written as self-describing row groups, one per batch, so nothing needs to be revisited.
+//
+// Columnar layout, all integers little-endian:
+//   "FOZSTATS", u32 version (1), followed by row groups until end of file. Each row group is:
+//   u32 row count, u32 column count, then per column:
+//     u32 name length, name, u32 type (0 = string, 1 = float64), then per row:
+//       string: u32 length (~0u if missing), bytes
+//       float64: value (NaN if missing or not a number, booleans are 0 and 1)
+//   Later row groups may have more columns than earlier ones.
+class PipelineStatsWriter
+{
+public:
+	enum { NumFixedColumns = 5, ColumnarVersion = 1 };
+
+	~PipelineStatsWriter()
+	{
+		if (rows_file)
+		{
+			fclose(rows_file);
+			remove(rows_path.c_str());
+		}
+		if (columnar_file)
+			fclose(columnar_file);
+	}
+
+	bool init(const std::string &csv_path_, const std::string &columnar_path)
+	{
+		csv_path = csv_path_;
+		rows_path = csv_path + ".__rows.tmp";
+
+		header = { "Database", "Pipeline type", "Pipeline hash", "Executable name", "Subgroup size" };
+
+		rows_file = fopen(rows_path.c_str(), "wb+");
+		if (!rows_file)
+		{
+			LOGE("Failed to open %s for writing.\n", rows_path.c_str());
+			return false;
+		}
+
+		if (!columnar_path.empty())
+		{
+			columnar_file = fopen(columnar_path.c_str(), "wb");
+			if (!columnar_file)
+			{
+				LOGE("Failed to open %s for writing.\n", columnar_path.c_str());
+				return false;
+			}
+
+			fwrite("FOZSTATS", 1, 8, columnar_file);
+			write_u32(columnar_file, ColumnarVersion);
+		}
+
+		return true;
+	}
+
+	void write_batch(const std::vector<PipelineStatsEntry> &entries)
+	{
+		group_cells.clear();
+		group_rows = 0;
+
+		for (auto &entry : entries)
+		{
+			if (!entry.valid)
+				continue;
+
+			for (auto &exec : entry.executables)
+			{
+				row.clear();
+				row.emplace_back(0u, &entry.db_path);
+				row.emplace_back(1u, &entry.pipeline_type);
+				row.emplace_back(2u, &entry.pipeline);
+				row.emplace_back(3u, &exec.name);
+
+				subgroup_size = std::to_string(exec.subgroup_size);
+				row.emplace_back(4u, &subgroup_size);
+
+				for (auto &stat : exec.stats)
+					row.emplace_back(get_column(stat.first), &stat.second);
+
+				write_row();
+			}
+		}
+
+		if (columnar_file && group_rows)
+			write_row_group();
+	}
+
+	bool finish()
+	{
+		FILE *fp = fopen(csv_path.c_str(), "w");
+		if (!fp)
+			return false;
+
+		size_t colnumber = 0;
+		for (auto &h : header)
+			fprintf(fp, "%s%s", h.c_str(), ++colnumber < header.size() ? "," : "\n");
+
+		std::vector<std::string> cells(header.size());
+		std::vector<bool> has_cell(header.size());
+		rewind(rows_file);
+
+		uint32_t cell_count;
+		while (read_u32(rows_file, cell_count))
+		{
+			fill(begin(has_cell), end(has_cell), false);
+			for (uint32_t i = 0; i < cell_count; i++)
+			{
+				uint32_t column, length;
+				if (!read_u32(rows_file, column) || !read_u32(rows_file, length) || column >= cells.size())
+				{
+					fclose(fp);
+					return false;
+				}
+
+				cells[column].resize(length);
+				if (length && fread(&cells[column][0], 1, length, rows_file) != length)
+				{
+					fclose(fp);
+					return false;
+				}
+				has_cell[column] = true;
+			}
+
+			for (size_t i = 0; i < header.size(); i++)
+				fprintf(fp, "%s%s", has_cell[i] ? cells[i].c_str() : "", i + 1 < header.size() ? "," : "\n");
+		}
+
+		bool ret = ferror(fp) == 0 && ferror(rows_file) == 0;
+		if (fclose(fp) != 0)
+			ret = false;
+		if (columnar_file)
+		{
+			if (ferror(columnar_file))
+				ret = false;
+			if (fclose(columnar_file) != 0)
+				ret = false;
+			columnar_file = nullptr;
+		}
+		return ret;
+	}
+
+private:
+	std::string csv_path;
+	std::string rows_path;
+	FILE *rows_file = nullptr;
+	FILE *columnar_file = nullptr;
+
+	std::vector<std::string> header;
+	std::unordered_map<std::string, uint32_t> columns;
+
+	std::vector<std::pair<uint32_t, const std::string *>> row;
+	std::string subgroup_size;
+
+	// Cells of the current row group, indexed by column, then row.
+	std::vector<std::vector<std::pair<uint32_t, std::string>>> group_cells;
+	uint32_t group_rows = 0;
+
+	static void write_u32(FILE *file, uint32_t value)
+	{
+		uint8_t bytes[4] = { uint8_t(value), uint8_t(value >> 8), uint8_t(value >> 16), uint8_t(value >> 24) };
+		fwrite(bytes, 1, sizeof(bytes), file);
+	}
+
+	static bool read_u32(FILE *file, uint32_t &value)
+	{
+		uint8_t bytes[4];
+		if (fread(bytes, 1, sizeof(bytes), file) != sizeof(bytes))
+			return false;
+		value = uint32_t(bytes[0]) | (uint32_t(bytes[1]) << 8) | (uint32_t(bytes[2]) << 16) | (uint32_t(bytes[3]) << 24);
+		return true;
+	}
+
+	static void write_string(FILE *file, const std::string &str)
+	{
+		write_u32(file, uint32_t(str.size()));
+		fwrite(str.data(), 1, str.size(), file);
+	}
+
+	uint32_t get_column(const std::string &name)
+	{
+		auto itr = columns.find(name);
+		if (itr != columns.end())
+			return itr->second;
+
+		auto column = uint32_t(header.size());
+		columns[name] = column;
+		header.push_back(name);
+		return column;
+	}
 
-		if (replayer.is_process_complete(nullptr))
+	void write_row()
+	{
+		write_u32(rows_file, uint32_t(row.size()));
+		for (auto &cell : row)
 		{
-			auto result = replayer.poll_progress(progress);
-			if (result != ExternalReplayer::PollResult::ResultNotReady)
-				log_progress(progress);
-			log_faulty_modules(replayer);
-			log_faulty_graphics(replayer);
-			log_faulty_compute(replayer);
-			return replayer.wait();
+			write_u32(rows_file, cell.first);
+			write_string(rows_file, *cell.second);
 		}
 
-		auto result = replayer.poll_progress(progress);
-
-		switch (result)
+		if (columnar_file)
 		{
-		case ExternalReplayer::PollResult::Error:
-			return EXIT_FAILURE;
+			if (group_cells.size() < header.size())
+				group_cells.resize(header.size());
+			for (auto &cell : row)
+				group_cells[cell.first].emplace_back(group_rows, *cell.second);
+			group_rows++;
+		}
+	}
 
-		case ExternalReplayer::PollResult::ResultNotReady:
-			break;
+	static double parse_double(const std::string &str)
+	{
+		if (str == "true")
+			return 1.0;
+		else if (str == "false")
+			return 0.0;
+
+		char *end = nullptr;
+		double value = strtod(str.c_str(), &end);
+		if (str.empty() || *end != '\0')
+			return std::numeric_limits<double>::quiet_NaN();
+		return value;
+	}
 
-		case ExternalReplayer::PollResult::Complete:
-		case ExternalReplayer::PollResult::Running:
-			log_progress(progress);
-			if (result == ExternalReplayer::PollResult::Complete)
+	void write_row_group()
+	{
+		group_cells.resize(header.size());
+		write_u32(columnar_file, group_rows);
+		write_u32(columnar_file, uint32_t(header.size()));
+
+		for (size_t column = 0; column < header.size(); column++)
+		{
+			auto &cells = group_cells[column];
+			bool is_string = column < NumFixedColumns && column != 4;
+			write_string(columnar_file, header[column]);
+			write_u32(columnar_file, is_string ? 0 : 1);
+
+			size_t cell_index = 0;
+			for (uint32_t r = 0; r < group_rows; r++)
 			{
-				log_faulty_modules(replayer);
-				log_faulty_graphics(replayer);
-				log_faulty_compute(replayer);
-				return replayer.wait();
+				// If an executable reports the same stat twice, the last one wins, like in the CSV.
+				const std::string *value = nullptr;
+				while (cell_index < cells.size() && cells[cell_index].first == r)
+					value = &cells[cell_index++].second;
+
+				if (is_string)
+				{
+					if (value)
+						write_string(columnar_file, *value);
+					else
+						write_u32(columnar_file, ~0u);
+				}
+				else
+				{
+					double d = value ? parse_double(*value) : std::numeric_limits<double>::quiet_NaN();
+					uint64_t bits;
+					memcpy(&bits, &d, sizeof(bits));
+					for (unsigned i = 0; i < 8; i++)
+						fputc(int((bits >> (8 * i)) & 0xff), columnar_file);
+				}
 			}
-			break;
 		}
 	}
-}
-
-static void log_process_memory();
-#endif
+};
 
-static bool parse_json_stats(const std::string &foz_path, rapidjson::Document &doc)
+// Entries are decoded in batches on a thread pool and handed to the writer in order,
+// so memory use is bounded by the batch size rather than the size of the archive.
+static bool stream_stats(PipelineStatsWriter &writer, const std::string &foz_path, unsigned num_threads)
 {
+	static const size_t StatsBatchSize = 4096;
+
 	auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(foz_path.c_str(), DatabaseMode::ReadOnly));
 	if (!db)
 		return false;
@@ -2543,9 +3633,7 @@ static bool parse_json_stats(const std::string &foz_path, rapidjson::Document &d
 		RESOURCE_COMPUTE_PIPELINE,
 	};
 
-	doc.SetArray();
-
-	std::vector<char> json_buffer;
+	std::vector<PipelineStatsEntry> entries;
 
 	for (auto &tag : stat_tags)
 	{
@@ -2556,140 +3644,368 @@ static bool parse_json_stats(const std::string &foz_path, rapidjson::Document &d
 		if (!db->get_hash_list_for_resource_tag(tag, &num_hashes, hashes.data()))
 			return false;
 
-		for (auto &hash : hashes)
+		for (size_t base = 0; base < hashes.size(); base += StatsBatchSize)
 		{
-			rapidjson::Document tmp_doc;
-			size_t json_size = 0;
-			if (!db->read_entry(tag, hash, &json_size, nullptr, 0))
-				continue;
-			json_buffer.resize(json_size);
-			if (!db->read_entry(tag, hash, &json_size, json_buffer.data(), 0))
-				continue;
-			json_buffer.push_back('\0');
+			size_t count = std::min(StatsBatchSize, hashes.size() - base);
+			entries.clear();
+			entries.resize(count);
 
-			tmp_doc.Parse(rapidjson::StringRef(json_buffer.data()));
-			if (tmp_doc.HasParseError())
-				continue;
+			std::atomic<size_t> next_index(0);
+			std::vector<std::thread> threads;
+			unsigned thread_count = unsigned(std::min<size_t>(std::max(num_threads, 1u), count));
 
-			rapidjson::Value v;
-			v.CopyFrom(tmp_doc, doc.GetAllocator());
-			doc.PushBack(v, doc.GetAllocator());
+			for (unsigned i = 0; i < thread_count; i++)
+			{
+				threads.emplace_back([&]() {
+					std::vector<char> json_buffer;
+					size_t index;
+					while ((index = next_index.fetch_add(1, std::memory_order_relaxed)) < count)
+					{
+						Hash hash = hashes[base + index];
+						size_t json_size = 0;
+						if (!db->read_entry(tag, hash, &json_size, nullptr, PAYLOAD_READ_CONCURRENT_BIT))
+							continue;
+						json_buffer.resize(json_size + 1);
+						if (!db->read_entry(tag, hash, &json_size, json_buffer.data(), PAYLOAD_READ_CONCURRENT_BIT))
+							continue;
+						json_buffer[json_size] = '\0';
+
+						entries[index].valid = parse_json_stats_entry(json_buffer.data(), entries[index]);
+					}
+				});
+			}
+
+			for (auto &t : threads)
+				t.join();
+
+			writer.write_batch(entries);
 		}
 	}
 
 	return true;
 }
 
-static void stats_to_csv(const std::string &stats_path, rapidjson::Document &doc)
+#ifndef NO_ROBUST_REPLAYER
+static void dump_stats(const std::string &stats_path, const std::string &columnar_path,
+                       const std::vector<std::string> &foz_paths, unsigned num_threads)
+{
+	PipelineStatsWriter writer;
+	if (!writer.init(stats_path, columnar_path))
+		return;
+
+	for (auto &sp : foz_paths)
+	{
+		if (!stream_stats(writer, sp, num_threads))
+			continue;
+		remove(sp.c_str());
+	}
+
+	if (!writer.finish())
+		LOGE("Failed to write pipeline stats to %s.\n", stats_path.c_str());
+}
+#endif
+
+static void dump_stats(const std::string &stats_path, const std::string &columnar_path, unsigned num_threads)
 {
-	std::vector<std::string> header;
-	std::unordered_map<std::string, size_t> columns;
-	std::vector<std::map<size_t, std::string>> rows;
+	PipelineStatsWriter writer;
+	auto foz_path = stats_path + ".__tmp.foz";
 
-	header.push_back("Database");
-	header.push_back("Pipeline type");
-	header.push_back("Pipeline hash");
-	header.push_back("Executable name");
-	header.push_back("Subgroup size");
+	if (!writer.init(stats_path, columnar_path))
+		return;
+	if (!stream_stats(writer, foz_path, num_threads))
+		return;
+	if (!writer.finish())
+		LOGE("Failed to write pipeline stats to %s.\n", stats_path.c_str());
+	remove(foz_path.c_str());
+}
 
-	for (auto itr = doc.Begin(); itr != doc.End(); itr++)
+struct ParseOnlyStats
+{
+	uint64_t count = 0;
+	uint64_t stored_bytes = 0;
+	uint64_t decoded_bytes = 0;
+	uint64_t read_ns = 0;
+	uint64_t inflate_ns = 0;
+	uint64_t parse_ns = 0;
+	uint64_t failed = 0;
+
+	void merge(const ParseOnlyStats &other)
 	{
-		std::map<size_t, std::string> row;
+		count += other.count;
+		stored_bytes += other.stored_bytes;
+		decoded_bytes += other.decoded_bytes;
+		read_ns += other.read_ns;
+		inflate_ns += other.inflate_ns;
+		parse_ns += other.parse_ns;
+		failed += other.failed;
+	}
+};
 
-		auto &st = *itr;
+static uint64_t elapsed_ns(chrono::steady_clock::time_point start, chrono::steady_clock::time_point end)
+{
+	return uint64_t(chrono::duration_cast<chrono::nanoseconds>(end - start).count());
+}
 
-		row[0] = st["db_path"].GetString();
-		row[1] = st["pipeline_type"].GetString();
-		row[2] = st["pipeline"].GetString();
+// Reads, inflates and parses a single blob, timing each stage on its own.
+// The caller is responsible for resetting the replayer allocator.
+static bool parse_only_entry(DatabaseInterface &db, StateReplayer &replayer, StateCreatorInterface &iface,
+                             ResourceTag tag, Hash hash, vector<uint8_t> &raw, vector<uint8_t> &blob,
+                             ParseOnlyStats &stats)
+{
+	auto read_start = chrono::steady_clock::now();
+	size_t raw_size = 0;
+	size_t blob_size = 0;
+	bool is_raw = db.read_entry(tag, hash, &raw_size, nullptr,
+	                            PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT | PAYLOAD_READ_CONCURRENT_BIT);
 
-		auto &execs = st["executables"];
-		for (auto e_itr = execs.Begin(); e_itr != execs.End(); e_itr++)
-		{
-			auto &exec = *e_itr;
-			row[3] = exec["executable_name"].GetString();
-			row[4] = std::to_string(exec["subgroup_size"].GetUint());
-			for (auto st_itr = exec["stats"].Begin(); st_itr != exec["stats"].End(); st_itr++)
-			{
-				auto &stat = *st_itr;
-				std::string key = stat["name"].GetString();
-				size_t insert_at;
+	if (is_raw)
+	{
+		raw.resize(raw_size);
+		if (!db.read_entry(tag, hash, &raw_size, raw.data(),
+		                   PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT | PAYLOAD_READ_CONCURRENT_BIT))
+			return false;
+	}
+	else
+	{
+		// Only stream archives hand out the stored payload, for anything else reading includes inflating.
+		if (!db.read_entry(tag, hash, &blob_size, nullptr, PAYLOAD_READ_CONCURRENT_BIT))
+			return false;
+		blob.resize(blob_size);
+		if (!db.read_entry(tag, hash, &blob_size, blob.data(), PAYLOAD_READ_CONCURRENT_BIT))
+			return false;
+		raw_size = blob_size;
+	}
 
-				auto col = columns.find(key);
-				if (col == columns.end())
-				{
-					insert_at = header.size();
-					columns[key] = insert_at;
-					header.push_back(key);
-				}
-				else
-				{
-					insert_at = col->second;
-				}
+	auto inflate_start = chrono::steady_clock::now();
+	if (is_raw)
+	{
+		if (!decode_raw_fossilize_db_payload(raw.data(), raw.size(), &blob_size, nullptr))
+			return false;
+		blob.resize(blob_size);
+		if (!decode_raw_fossilize_db_payload(raw.data(), raw.size(), &blob_size, blob.data()))
+			return false;
+	}
 
-				row[insert_at] = stat["value"].GetString();
-			}
+	auto parse_start = chrono::steady_clock::now();
+	bool ret = replayer.parse(iface, &db, blob.data(), blob.size());
+	auto parse_end = chrono::steady_clock::now();
 
-			rows.push_back(row);
-		}
-	}
+	stats.count++;
+	stats.stored_bytes += raw_size;
+	stats.decoded_bytes += blob_size;
+	stats.read_ns += elapsed_ns(read_start, inflate_start);
+	stats.inflate_ns += elapsed_ns(inflate_start, parse_start);
+	stats.parse_ns += elapsed_ns(parse_start, parse_end);
+	return ret;
+}
 
-	FILE *fp = fopen(stats_path.c_str(), "w");
-	if (!fp)
-		return;
+static double megabytes_per_second(uint64_t bytes, uint64_t ns)
+{
+	return ns ? (double(bytes) / (1024.0 * 1024.0)) / (double(ns) * 1e-9) : 0.0;
+}
 
-	size_t colnumber = 0;
-	for (auto &h : header)
-		fprintf(fp, "%s%s", h.c_str(), ++colnumber < header.size() ? "," : "\n");
+static void log_parse_only_stats(const ParseOnlyStats (&stats)[RESOURCE_COUNT], const char * const (&tag_names)[RESOURCE_COUNT])
+{
+	ParseOnlyStats total;
+	LOGI("%-22s %9s %11s %11s %9s %9s %9s %11s %11s %11s\n",
+	     "Tag", "Objects", "Stored MiB", "Decoded MiB", "Read s", "Inflate s", "Parse s",
+	     "Read MiB/s", "Infl. MiB/s", "Parse obj/s");
 
-	for (auto &r : rows)
+	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
 	{
-		colnumber = 0;
-		for (size_t i = 0; i < header.size(); i++)
-		{
-			auto col = r.find(i);
-			fprintf(fp, "%s%s", col == r.end() ? "" : col->second.c_str(), ++colnumber < header.size() ? "," : "\n");
-		}
+		auto &s = stats[i];
+		if (!s.count && !s.failed)
+			continue;
+
+		LOGI("%-22s %9" PRIu64 " %11.2f %11.2f %9.3f %9.3f %9.3f %11.1f %11.1f %11.0f\n",
+		     tag_names[i], s.count,
+		     double(s.stored_bytes) / (1024.0 * 1024.0), double(s.decoded_bytes) / (1024.0 * 1024.0),
+		     s.read_ns * 1e-9, s.inflate_ns * 1e-9, s.parse_ns * 1e-9,
+		     megabytes_per_second(s.stored_bytes, s.read_ns),
+		     megabytes_per_second(s.decoded_bytes, s.inflate_ns),
+		     s.parse_ns ? double(s.count) / (s.parse_ns * 1e-9) : 0.0);
+		total.merge(s);
 	}
 
-	fclose(fp);
+	LOGI("Stage times are summed over threads, throughput is per thread.\n");
+	LOGI("Shader module parse time includes varint decoding of SPIR-V.\n");
+	LOGI("Read: %.1f MiB/s stored, inflate: %.1f MiB/s decoded, parse: %.0f objects/s (%.1f MiB/s decoded).\n",
+	     megabytes_per_second(total.stored_bytes, total.read_ns),
+	     megabytes_per_second(total.decoded_bytes, total.inflate_ns),
+	     total.parse_ns ? double(total.count) / (total.parse_ns * 1e-9) : 0.0,
+	     megabytes_per_second(total.decoded_bytes, total.parse_ns));
+
+	if (total.failed)
+		LOGE("Failed to read or parse %" PRIu64 " objects.\n", total.failed);
 }
 
-#ifndef NO_ROBUST_REPLAYER
-static void dump_stats(const std::string &stats_path, const std::vector<std::string> &foz_paths)
+// Measures the front end of the replayer in isolation: reading, inflating and parsing every blob
+// on all worker threads, with a creator interface which does not touch Vulkan.
+// This gives a baseline which is independent of the driver, the object cache and memory context syncing.
+static int run_parse_only_process(const ThreadedReplayer::Options &opts, const vector<const char *> &databases)
 {
-	rapidjson::Document doc;
-	doc.SetArray();
-	auto &alloc = doc.GetAllocator();
+	static const ResourceTag initial_parse_order[] = {
+		RESOURCE_APPLICATION_INFO,
+		RESOURCE_SAMPLER,
+		RESOURCE_DESCRIPTOR_SET_LAYOUT,
+		RESOURCE_PIPELINE_LAYOUT,
+		RESOURCE_RENDER_PASS,
+	};
 
-	for (auto &sp : foz_paths)
+	static const ResourceTag threaded_parse_order[] = {
+		RESOURCE_SHADER_MODULE,
+		RESOURCE_GRAPHICS_PIPELINE,
+		RESOURCE_COMPUTE_PIPELINE,
+	};
+
+	static const char * const tag_names[RESOURCE_COUNT] = {
+		"AppInfo",
+		"Sampler",
+		"Descriptor Set Layout",
+		"Pipeline Layout",
+		"Shader Module",
+		"Render Pass",
+		"Graphics Pipeline",
+		"Compute Pipeline",
+		"Application Blob Link",
+	};
+
+	auto start_time = chrono::steady_clock::now();
+	auto resolver = create_database(databases);
+	if (!resolver || !resolver->prepare())
 	{
-		rapidjson::Document tmp_doc;
-		if (!parse_json_stats(sp, tmp_doc))
-			continue;
+		LOGE("Failed to prepare database.\n");
+		return EXIT_FAILURE;
+	}
+	auto end_prepare = chrono::steady_clock::now();
+	LOGI("Opening archive took %.3f s.\n", elapsed_ns(start_time, end_prepare) * 1e-9);
+
+	ParseOnlyStats stats[RESOURCE_COUNT];
+	vector<uint8_t> raw, blob;
+	vector<Hash> hashes;
+
+	// Trivial objects which pipelines depend on are parsed up front on the main thread, as in a normal replay.
+	StateReplayer global_replayer;
+	global_replayer.set_resolve_derivative_pipeline_handles(false);
+	global_replayer.set_resolve_shader_module_handles(false);
+	PipelineModuleCollector global_collector;
 
-		doc.Reserve(doc.Size() + tmp_doc.Size(), alloc);
-		for (auto itr = tmp_doc.Begin(); itr != tmp_doc.End(); itr++)
+	for (auto &tag : initial_parse_order)
+	{
+		size_t count = 0;
+		if (!resolver->get_hash_list_for_resource_tag(tag, &count, nullptr))
 		{
-			rapidjson::Value v;
-			v.CopyFrom(*itr, alloc);
-			doc.PushBack(v, alloc);
+			LOGE("Failed to get list of resource hashes.\n");
+			return EXIT_FAILURE;
+		}
+		hashes.resize(count);
+		if (!resolver->get_hash_list_for_resource_tag(tag, &count, hashes.data()))
+		{
+			LOGE("Failed to get list of resource hashes.\n");
+			return EXIT_FAILURE;
+		}
+
+		for (auto &hash : hashes)
+		{
+			if (!parse_only_entry(*resolver, global_replayer, global_collector, tag, hash, raw, blob, stats[tag]))
+			{
+				LOGE("Failed to parse blob (tag: %s, hash: %016" PRIx64 ").\n", tag_names[tag], hash);
+				stats[tag].failed++;
+			}
 		}
-		remove(sp.c_str());
 	}
 
-	stats_to_csv(stats_path, doc);
-}
-#endif
+	struct WorkItem
+	{
+		ResourceTag tag;
+		Hash hash;
+	};
+	vector<WorkItem> work;
 
-static void dump_stats(const std::string &stats_path)
-{
-	rapidjson::Document doc;
-	auto foz_path = stats_path + ".__tmp.foz";
+	for (auto &tag : threaded_parse_order)
+	{
+		size_t count = 0;
+		if (!resolver->get_hash_list_for_resource_tag(tag, &count, nullptr))
+		{
+			LOGE("Failed to get list of resource hashes.\n");
+			return EXIT_FAILURE;
+		}
+		hashes.resize(count);
+		if (!resolver->get_hash_list_for_resource_tag(tag, &count, hashes.data()))
+		{
+			LOGE("Failed to get list of resource hashes.\n");
+			return EXIT_FAILURE;
+		}
 
-	if (!parse_json_stats(foz_path, doc))
-		return;
-	stats_to_csv(stats_path, doc);
-	remove(foz_path.c_str());
+		for (auto &hash : hashes)
+			work.push_back({ tag, hash });
+	}
+
+	CPUTopology topology;
+	auto placement = opts.thread_placement;
+	if (placement != ThreadPlacement::None && !query_placement_topology(&topology))
+		placement = ThreadPlacement::None;
+
+	unsigned num_threads = max(opts.num_threads, 1u);
+	vector<array<ParseOnlyStats, RESOURCE_COUNT>> thread_stats(num_threads);
+	atomic<size_t> next_index(0);
+	vector<thread> threads;
+
+	auto threaded_start = chrono::steady_clock::now();
+	for (unsigned i = 0; i < num_threads; i++)
+	{
+		threads.emplace_back([&, i]() {
+			if (placement != ThreadPlacement::None)
+				pin_current_thread(get_placement_cpus(topology, placement, i));
+
+			StateReplayer replayer;
+			replayer.set_resolve_derivative_pipeline_handles(false);
+			replayer.set_resolve_shader_module_handles(false);
+			replayer.copy_handle_references(global_replayer);
+
+			PipelineModuleCollector collector;
+			vector<uint8_t> thread_raw, thread_blob;
+			auto &local_stats = thread_stats[i];
+
+			size_t index;
+			while ((index = next_index.fetch_add(1, memory_order_relaxed)) < work.size())
+			{
+				auto &item = work[index];
+				if (!parse_only_entry(*resolver, replayer, collector, item.tag, item.hash,
+				                      thread_raw, thread_blob, local_stats[item.tag]))
+				{
+					LOGE("Failed to parse blob (tag: %s, hash: %016" PRIx64 ").\n", tag_names[item.tag], item.hash);
+					local_stats[item.tag].failed++;
+				}
+				replayer.get_allocator().reset();
+			}
+		});
+	}
+
+	for (auto &t : threads)
+		t.join();
+	auto end_time = chrono::steady_clock::now();
+
+	for (auto &local_stats : thread_stats)
+		for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+			stats[i].merge(local_stats[i]);
+
+	log_parse_only_stats(stats, tag_names);
+
+	uint64_t threaded_count = 0, threaded_bytes = 0;
+	for (auto &tag : threaded_parse_order)
+	{
+		threaded_count += stats[tag].count;
+		threaded_bytes += stats[tag].decoded_bytes;
+	}
+
+	uint64_t threaded_ns = elapsed_ns(threaded_start, end_time);
+	LOGI("Threaded parse of %" PRIu64 " objects on %u threads took %.3f s wall clock (%.0f objects/s, %.1f MiB/s decoded).\n",
+	     threaded_count, num_threads, threaded_ns * 1e-9,
+	     threaded_ns ? double(threaded_count) / (threaded_ns * 1e-9) : 0.0,
+	     megabytes_per_second(threaded_bytes, threaded_ns));
+	LOGI("Total parse-only time: %.3f s.\n", elapsed_ns(start_time, end_time) * 1e-9);
+	return EXIT_SUCCESS;
 }
 
 #ifndef NO_ROBUST_REPLAYER
@@ -2699,6 +4015,12 @@ static void install_trivial_crash_handlers(ThreadedReplayer &replayer);
 static int run_normal_process(ThreadedReplayer &replayer, const vector<const char *> &databases)
 {
 	auto start_time = chrono::steady_clock::now();
+	if (replayer.opts.time_budget_seconds != 0)
+	{
+		replayer.deadline = start_time + chrono::seconds(replayer.opts.time_budget_seconds);
+		replayer.has_deadline = true;
+	}
+
 	auto start_create_archive = chrono::steady_clock::now();
 	auto resolver = create_database(databases);
 
@@ -2920,6 +4242,15 @@ static int run_normal_process(ThreadedReplayer &replayer, const vector<const cha
 		}
 	}
 
+	if (replayer.has_deadline && replayer.opts.pipeline_hash == 0)
+		if (!replayer.schedule_for_time_budget(graphics_hashes, compute_hashes))
+			return EXIT_FAILURE;
+
+#ifdef FOSSILIZE_REPLAYER_SPIRV_VAL
+	if (replayer.opts.spirv_validate_prepass)
+		replayer.prevalidate_shader_modules(graphics_hashes, compute_hashes);
+#endif
+
 	// Done parsing static objects.
 	state_replayer.get_allocator().reset();
 
@@ -2939,10 +4270,21 @@ static int run_normal_process(ThreadedReplayer &replayer, const vector<const cha
 		return a.order_index < b.order_index;
 	});
 
-	for (auto &work : graphics_workload)
-		work.func();
-	for (auto &work : compute_workload)
-		work.func();
+	// When the deadline hits, stop feeding the worker threads, and let them drain what is in flight,
+	// so the pipeline cache only ever sees completed compiles.
+	bool stopped_at_deadline = false;
+	for (auto *workload : { &graphics_workload, &compute_workload })
+	{
+		for (auto &work : *workload)
+		{
+			if (replayer.deadline_reached())
+			{
+				stopped_at_deadline = true;
+				break;
+			}
+			work.func();
+		}
+	}
 
 	// VALVE: drain all outstanding pipeline compiles
 	replayer.sync_worker_threads();
@@ -2989,6 +4331,45 @@ static int run_normal_process(ThreadedReplayer &replayer, const vector<const cha
 	     replayer.compute_pipeline_count.load(),
 	     replayer.compute_pipeline_ns.load() * 1e-9);
 
+	if (replayer.opts.normalize_pipelines)
+	{
+		unsigned duplicates = replayer.normalized_graphics_duplicate_count.load();
+		unsigned classes = unsigned(replayer.normalized_graphics_classes.size());
+		LOGI("Normalization (version %u) skipped %u of %u graphics pipelines as equivalent to another pipeline.\n",
+		     unsigned(FOSSILIZE_NORMALIZATION_VERSION), duplicates, duplicates + classes);
+		if (replayer.graphics_pipeline_count.load() != 0)
+		{
+			double average_s = replayer.graphics_pipeline_ns.load() * 1e-9 / replayer.graphics_pipeline_count.load();
+			LOGI("Estimated compile time saved by normalization: %.3f s (accumulated time)\n", average_s * duplicates);
+		}
+	}
+
+	if (replayer.has_deadline)
+	{
+		unsigned total_pipelines = unsigned(graphics_hashes.size() + compute_hashes.size());
+		if (stopped_at_deadline || replayer.deadline_skipped_count.load() != 0)
+			LOGI("Time budget of %u s ran out, compiled %u of %u pipelines before the deadline.\n",
+			     replayer.opts.time_budget_seconds, replayer.covered_pipeline_count.load(), total_pipelines);
+		else
+			LOGI("Time budget of %u s was not exhausted, compiled %u of %u pipelines.\n",
+			     replayer.opts.time_budget_seconds, replayer.covered_pipeline_count.load(), total_pipelines);
+
+		if (replayer.total_pipeline_value != 0)
+		{
+			LOGI("Compiled pipelines cover %.1f %% of the total value (%" PRIu64 " of %" PRIu64 ").\n",
+			     100.0 * double(replayer.covered_pipeline_value.load()) / double(replayer.total_pipeline_value),
+			     uint64_t(replayer.covered_pipeline_value.load()), replayer.total_pipeline_value);
+		}
+	}
+
+	if (replayer.opts.decode_threads != 0)
+	{
+		auto &stats = replayer.prefetch_statistics;
+		LOGI("Decode threads had %" PRIu64 " blobs ready in time, workers waited for %" PRIu64
+		     " and decoded %" PRIu64 " themselves.\n",
+		     stats.prefetched, stats.waited, stats.missed);
+	}
+
 	LOGI("Threads were idling in total for %.3f s (accumulated time)\n",
 	     replayer.total_idle_ns.load() * 1e-9);
 
@@ -3043,6 +4424,8 @@ int main(int argc, char *argv[])
 #endif
 
 	bool log_memory = false;
+	bool parse_only = false;
+	string pipeline_stats_columnar_path;
 
 	CLICallbacks cbs;
 	cbs.default_handler = [&](const char *arg) { databases.push_back(arg); };
@@ -3051,6 +4434,10 @@ int main(int argc, char *argv[])
 	cbs.add("--enable-validation", [&](CLIParser &) { opts.enable_validation = true; });
 	cbs.add("--pipeline-cache", [&](CLIParser &) { replayer_opts.pipeline_cache = true; });
 	cbs.add("--spirv-val", [&](CLIParser &) { replayer_opts.spirv_validate = true; });
+	cbs.add("--spirv-val-prepass", [&](CLIParser &) {
+		replayer_opts.spirv_validate = true;
+		replayer_opts.spirv_validate_prepass = true;
+	});
 	cbs.add("--on-disk-pipeline-cache", [&](CLIParser &parser) { replayer_opts.on_disk_pipeline_cache_path = parser.next_string(); });
 	cbs.add("--on-disk-validation-cache", [&](CLIParser &parser) {
 		replayer_opts.on_disk_validation_cache_path = parser.next_string();
@@ -3062,6 +4449,9 @@ int main(int argc, char *argv[])
 	cbs.add("--on-disk-validation-whitelist", [&](CLIParser &parser) {
 		replayer_opts.on_disk_validation_whitelist_path = parser.next_string();
 	});
+	cbs.add("--on-disk-feature-filter-cache", [&](CLIParser &parser) {
+		replayer_opts.on_disk_feature_filter_cache_path = parser.next_string();
+	});
 	cbs.add("--num-threads", [&](CLIParser &parser) { replayer_opts.num_threads = parser.next_uint(); });
 	cbs.add("--loop", [&](CLIParser &parser) { replayer_opts.loop_count = parser.next_uint(); });
 	cbs.add("--pipeline-hash", [&](CLIParser &parser) {
@@ -3083,6 +4473,7 @@ int main(int argc, char *argv[])
 		replayer_opts.end_compute_index = parser.next_uint();
 	});
 	cbs.add("--enable-pipeline-stats", [&](CLIParser &parser) { replayer_opts.pipeline_stats_path = parser.next_string(); });
+	cbs.add("--pipeline-stats-columnar", [&](CLIParser &parser) { pipeline_stats_columnar_path = parser.next_string(); });
 
 #ifndef NO_ROBUST_REPLAYER
 	cbs.add("--quiet-slave", [&](CLIParser &) { quiet_slave = true; });
@@ -3101,9 +4492,23 @@ int main(int argc, char *argv[])
 
 	cbs.add("--shader-cache-size", [&](CLIParser &parser) { replayer_opts.shader_cache_size_mb = parser.next_uint(); });
 	cbs.add("--ignore-derived-pipelines", [&](CLIParser &) { replayer_opts.ignore_derived_pipelines = true; });
+	cbs.add("--normalize-pipelines", [&](CLIParser &) { replayer_opts.normalize_pipelines = true; });
+	cbs.add("--pin-threads", [&](CLIParser &parser) {
+		const char *placement = parser.next_string();
+		if (!parse_thread_placement(placement, &replayer_opts.thread_placement))
+		{
+			LOGE("Unknown thread placement \"%s\", must be none, core, l3 or node.\n", placement);
+			exit(EXIT_FAILURE);
+		}
+	});
+	cbs.add("--decode-threads", [&](CLIParser &parser) { replayer_opts.decode_threads = parser.next_uint(); });
+	cbs.add("--decode-look-ahead", [&](CLIParser &parser) { replayer_opts.decode_look_ahead = parser.next_uint(); });
 	cbs.add("--log-memory", [&](CLIParser &) { log_memory = true; });
 	cbs.add("--null-device", [&](CLIParser &) { opts.null_device = true; });
+	cbs.add("--parse-only", [&](CLIParser &) { parse_only = true; });
 	cbs.add("--timeout-seconds", [&](CLIParser &parser) { replayer_opts.timeout_seconds = parser.next_uint(); });
+	cbs.add("--time-budget", [&](CLIParser &parser) { replayer_opts.time_budget_seconds = parser.next_uint(); });
+	cbs.add("--pipeline-usage", [&](CLIParser &parser) { replayer_opts.pipeline_usage_path = parser.next_string(); });
 
 	cbs.error_handler = [] { print_help(); };
 
@@ -3136,7 +4541,33 @@ int main(int argc, char *argv[])
 		replayer_opts.num_threads = 1;
 	}
 
+	if (!replayer_opts.pipeline_usage_path.empty() && replayer_opts.time_budget_seconds == 0)
+	{
+		LOGE("--pipeline-usage is only meaningful together with --time-budget.\n");
+		print_help();
+		return EXIT_FAILURE;
+	}
+
+#ifndef NO_ROBUST_REPLAYER
+	if (parse_only && (master_process || slave_process || progress))
+	{
+		LOGE("--parse-only cannot be used with multi-process replay.\n");
+		return EXIT_FAILURE;
+	}
+#endif
+
+	// No device is created, so none of the compile related options apply.
+	if (parse_only)
+		return run_parse_only_process(replayer_opts, databases);
+
 #ifndef NO_ROBUST_REPLAYER
+	// Crash recovery resumes replay by archive index, which does not work when pipelines are reordered.
+	if (replayer_opts.time_budget_seconds != 0 && (master_process || slave_process || progress))
+	{
+		LOGE("--time-budget cannot be used with multi-process replay.\n");
+		return EXIT_FAILURE;
+	}
+
 	// We cannot safely deal with multiple threads here, force one thread.
 	if (slave_process)
 	{
@@ -3221,11 +4652,11 @@ int main(int argc, char *argv[])
 				path += ".__tmp.foz";
 				paths.push_back(path);
 			}
-			dump_stats(replayer_opts.pipeline_stats_path, paths);
+			dump_stats(replayer_opts.pipeline_stats_path, pipeline_stats_columnar_path, paths, replayer_opts.num_threads);
 		}
 		else
 #endif
-			dump_stats(replayer_opts.pipeline_stats_path);
+			dump_stats(replayer_opts.pipeline_stats_path, pipeline_stats_columnar_path, replayer_opts.num_threads);
 	}
 
 	return ret;
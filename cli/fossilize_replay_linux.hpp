@@ -70,6 +70,7 @@ static int signal_fd;
 static int epoll_fd;
 static VulkanDevice::Options device_options;
 static bool quiet_slave;
+static CPUTopology cpu_topology;
 
 static SharedControlBlock *control_block;
 }
@@ -366,8 +367,15 @@ bool ProcessProgress::start_child_process()
 			}
 		}
 
+		// Pin the whole process while it is still single threaded, so every thread it spawns inherits the placement.
+		auto placement = Global::base_replayer_options.thread_placement;
+		if (placement != ThreadPlacement::None)
+			if (!pin_current_thread(get_placement_cpus(Global::cpu_topology, placement, index)))
+				LOGE("Failed to pin child process %u.\n", index);
+
 		// Run the slave process.
 		auto copy_opts = Global::base_replayer_options;
+		copy_opts.thread_placement = ThreadPlacement::None;
 		copy_opts.start_graphics_index = start_graphics_index;
 		copy_opts.end_graphics_index = end_graphics_index;
 		copy_opts.start_compute_index = start_compute_index;
@@ -408,6 +416,12 @@ static int run_master_process(const VulkanDevice::Options &opts,
 	Global::databases = databases;
 	unsigned processes = replayer_opts.num_threads;
 
+	if (replayer_opts.thread_placement != ThreadPlacement::None &&
+	    !query_placement_topology(&Global::cpu_topology))
+	{
+		Global::base_replayer_options.thread_placement = ThreadPlacement::None;
+	}
+
 	// Split shader cache overhead across all processes.
 	Global::base_replayer_options.shader_cache_size_mb /= max(Global::base_replayer_options.num_threads, 1u);
 	Global::base_replayer_options.num_threads = 1;
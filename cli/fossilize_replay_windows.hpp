@@ -409,6 +409,8 @@ bool ProcessProgress::start_child_process()
 		cmdline += " --pipeline-cache";
 	if (Global::base_replayer_options.spirv_validate)
 		cmdline += " --spirv-val";
+	if (Global::base_replayer_options.spirv_validate_prepass)
+		cmdline += " --spirv-val-prepass";
 	if (Global::device_options.null_device)
 		cmdline += " --null-device";
 
@@ -457,11 +459,28 @@ bool ProcessProgress::start_child_process()
 		cmdline += "\"";
 	}
 
+	if (!Global::base_replayer_options.on_disk_feature_filter_cache_path.empty())
+	{
+		cmdline += " --on-disk-feature-filter-cache ";
+		cmdline += "\"";
+		cmdline += Global::base_replayer_options.on_disk_feature_filter_cache_path;
+		cmdline += "\"";
+	}
+
 	cmdline += " --shader-cache-size ";
 	cmdline += std::to_string(Global::base_replayer_options.shader_cache_size_mb);
 
 	if (Global::base_replayer_options.ignore_derived_pipelines)
 		cmdline += " --ignore-derived-pipelines";
+	if (Global::base_replayer_options.normalize_pipelines)
+		cmdline += " --normalize-pipelines";
+	if (Global::base_replayer_options.decode_threads != 0)
+	{
+		cmdline += " --decode-threads ";
+		cmdline += std::to_string(Global::base_replayer_options.decode_threads);
+		cmdline += " --decode-look-ahead ";
+		cmdline += std::to_string(Global::base_replayer_options.decode_look_ahead);
+	}
 
 	if (!Global::base_replayer_options.pipeline_stats_path.empty())
 	{
@@ -24,6 +24,8 @@
 #include <mutex>
 #include <condition_variable>
 #include <thread>
+#include <chrono>
+#include <memory>
 #include <stddef.h>
 #include "fossilize_inttypes.h"
 #include "fossilize.hpp"
@@ -37,6 +39,18 @@
 #include "layer/utils.hpp"
 #include "fossilize_errors.hpp"
 #include "fossilize_application_filter.hpp"
+#include "fossilize_normalize.hpp"
+
+#if defined(__linux__)
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#elif defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
 
 #define RAPIDJSON_HAS_STDSTRING 1
 #include "rapidjson/document.h"
@@ -224,6 +238,7 @@ struct WorkItem
 	uint64_t handle;
 	void *create_info;
 	Hash custom_hash;
+	uint64_t listener_cookie;
 };
 
 struct StateRecorder::Impl
@@ -331,8 +346,14 @@ struct StateRecorder::Impl
 
 	bool compression = false;
 	bool checksum = false;
+	bool normalize_pipelines = false;
+	StateRecorderObjectListener *object_listener = nullptr;
+	StateRecorderThreadPriority thread_priority;
+	std::unique_ptr<DatabaseInterface> throttled_database_iface;
 
 	void record_task(StateRecorder *recorder, bool looping);
+	uint64_t notify_object_enqueued(ResourceTag tag, uint64_t handle);
+	void apply_thread_priority();
 
 	template <typename T>
 	T *copy(const T *src, size_t count, ScratchAllocator &alloc);
@@ -690,7 +711,75 @@ static bool hash_pnext_chain(const StateRecorder *recorder, Hasher &h, const voi
 	return true;
 }
 
-bool compute_hash_graphics_pipeline(const StateRecorder &recorder, const VkGraphicsPipelineCreateInfo &create_info, Hash *out_hash)
+// Identifies dependent objects by the hashes they were recorded with.
+struct RecordedHashResolver
+{
+	const StateRecorder &recorder;
+
+	bool get_hash_for_pipeline_layout(VkPipelineLayout layout, Hash *hash) const
+	{
+		return recorder.get_hash_for_pipeline_layout(layout, hash);
+	}
+
+	bool get_hash_for_render_pass(VkRenderPass render_pass, Hash *hash) const
+	{
+		return recorder.get_hash_for_render_pass(render_pass, hash);
+	}
+
+	bool get_hash_for_shader_module(VkShaderModule module, Hash *hash) const
+	{
+		return recorder.get_hash_for_shader_module(module, hash);
+	}
+
+	bool get_hash_for_graphics_pipeline_handle(VkPipeline pipeline, Hash *hash) const
+	{
+		return recorder.get_hash_for_graphics_pipeline_handle(pipeline, hash);
+	}
+
+	const StateRecorder *get_recorder() const
+	{
+		return &recorder;
+	}
+};
+
+// Identifies dependent objects by their handle values.
+struct HandleValueResolver
+{
+	template <typename T>
+	static bool get_handle_value(T handle, Hash *hash)
+	{
+		*hash = api_object_cast<uint64_t>(handle);
+		return true;
+	}
+
+	bool get_hash_for_pipeline_layout(VkPipelineLayout layout, Hash *hash) const
+	{
+		return get_handle_value(layout, hash);
+	}
+
+	bool get_hash_for_render_pass(VkRenderPass render_pass, Hash *hash) const
+	{
+		return get_handle_value(render_pass, hash);
+	}
+
+	bool get_hash_for_shader_module(VkShaderModule module, Hash *hash) const
+	{
+		return get_handle_value(module, hash);
+	}
+
+	bool get_hash_for_graphics_pipeline_handle(VkPipeline pipeline, Hash *hash) const
+	{
+		return get_handle_value(pipeline, hash);
+	}
+
+	const StateRecorder *get_recorder() const
+	{
+		return nullptr;
+	}
+};
+
+template <typename Resolver>
+static bool compute_hash_graphics_pipeline_with_resolver(const Resolver &resolver, const VkGraphicsPipelineCreateInfo &create_info, Hash *out_hash)
 {
 	Hasher h;
 	Hash hash;
@@ -699,17 +788,17 @@ bool compute_hash_graphics_pipeline(const StateRecorder &recorder, const VkGraph
 
 	if (create_info.basePipelineHandle != VK_NULL_HANDLE)
 	{
-		if (!recorder.get_hash_for_graphics_pipeline_handle(create_info.basePipelineHandle, &hash))
+		if (!resolver.get_hash_for_graphics_pipeline_handle(create_info.basePipelineHandle, &hash))
 			return false;
 		h.u64(hash);
 		h.s32(create_info.basePipelineIndex);
 	}
 
-	if (!recorder.get_hash_for_pipeline_layout(create_info.layout, &hash))
+	if (!resolver.get_hash_for_pipeline_layout(create_info.layout, &hash))
 		return false;
 	h.u64(hash);
 
-	if (!recorder.get_hash_for_render_pass(create_info.renderPass, &hash))
+	if (!resolver.get_hash_for_render_pass(create_info.renderPass, &hash))
 		return false;
 	h.u64(hash);
 
@@ -767,7 +856,7 @@ bool compute_hash_graphics_pipeline(const StateRecorder &recorder, const VkGraph
 			}
 		}
 
-		if (!hash_pnext_chain(&recorder, h, state.pNext))
+		if (!hash_pnext_chain(resolver.get_recorder(), h, state.pNext))
 			return false;
 	}
 	else
@@ -818,7 +907,7 @@ bool compute_hash_graphics_pipeline(const StateRecorder &recorder, const VkGraph
 			}
 		}
 
-		if (!hash_pnext_chain(&recorder, h, ds.pNext))
+		if (!hash_pnext_chain(resolver.get_recorder(), h, ds.pNext))
 			return false;
 	}
 	else
@@ -831,7 +920,7 @@ bool compute_hash_graphics_pipeline(const StateRecorder &recorder, const VkGraph
 		h.u32(ia.primitiveRestartEnable);
 		h.u32(ia.topology);
 
-		if (!hash_pnext_chain(&recorder, h, ia.pNext))
+		if (!hash_pnext_chain(resolver.get_recorder(), h, ia.pNext))
 			return false;
 	}
 	else
@@ -858,7 +947,7 @@ bool compute_hash_graphics_pipeline(const StateRecorder &recorder, const VkGraph
 		if (!dynamic_line_width)
 			h.f32(rs.lineWidth);
 
-		if (!hash_pnext_chain(&recorder, h, rs.pNext))
+		if (!hash_pnext_chain(resolver.get_recorder(), h, rs.pNext))
 			return false;
 	}
 	else
@@ -882,7 +971,7 @@ bool compute_hash_graphics_pipeline(const StateRecorder &recorder, const VkGraph
 		else
 			h.u32(0);
 
-		if (!hash_pnext_chain(&recorder, h, ms.pNext))
+		if (!hash_pnext_chain(resolver.get_recorder(), h, ms.pNext))
 			return false;
 	}
 
@@ -916,7 +1005,7 @@ bool compute_hash_graphics_pipeline(const StateRecorder &recorder, const VkGraph
 			}
 		}
 
-		if (!hash_pnext_chain(&recorder, h, vp.pNext))
+		if (!hash_pnext_chain(resolver.get_recorder(), h, vp.pNext))
 			return false;
 	}
 	else
@@ -944,7 +1033,7 @@ bool compute_hash_graphics_pipeline(const StateRecorder &recorder, const VkGraph
 			h.u32(vi.pVertexBindingDescriptions[i].stride);
 		}
 
-		if (!hash_pnext_chain(&recorder, h, vi.pNext))
+		if (!hash_pnext_chain(resolver.get_recorder(), h, vi.pNext))
 			return false;
 	}
 	else
@@ -993,7 +1082,7 @@ bool compute_hash_graphics_pipeline(const StateRecorder &recorder, const VkGraph
 			for (auto &blend_const : b.blendConstants)
 				h.f32(blend_const);
 
-		if (!hash_pnext_chain(&recorder, h, b.pNext))
+		if (!hash_pnext_chain(resolver.get_recorder(), h, b.pNext))
 			return false;
 	}
 	else
@@ -1005,7 +1094,7 @@ bool compute_hash_graphics_pipeline(const StateRecorder &recorder, const VkGraph
 		h.u32(tess.flags);
 		h.u32(tess.patchControlPoints);
 
-		if (!hash_pnext_chain(&recorder, h, tess.pNext))
+		if (!hash_pnext_chain(resolver.get_recorder(), h, tess.pNext))
 			return false;
 	}
 	else
@@ -1018,7 +1107,7 @@ bool compute_hash_graphics_pipeline(const StateRecorder &recorder, const VkGraph
 		h.string(stage.pName);
 		h.u32(stage.stage);
 
-		if (!recorder.get_hash_for_shader_module(stage.module, &hash))
+		if (!resolver.get_hash_for_shader_module(stage.module, &hash))
 			return false;
 		h.u64(hash);
 
@@ -1027,7 +1116,7 @@ bool compute_hash_graphics_pipeline(const StateRecorder &recorder, const VkGraph
 		else
 			h.u32(0);
 
-		if (!hash_pnext_chain(&recorder, h, stage.pNext))
+		if (!hash_pnext_chain(resolver.get_recorder(), h, stage.pNext))
 			return false;
 	}
 
@@ -1035,6 +1124,16 @@ bool compute_hash_graphics_pipeline(const StateRecorder &recorder, const VkGraph
 	return true;
 }
 
+bool compute_hash_graphics_pipeline(const StateRecorder &recorder, const VkGraphicsPipelineCreateInfo &create_info, Hash *out_hash)
+{
+	return compute_hash_graphics_pipeline_with_resolver(RecordedHashResolver{ recorder }, create_info, out_hash);
+}
+
+bool compute_hash_graphics_pipeline_by_handles(const VkGraphicsPipelineCreateInfo &create_info, Hash *out_hash)
+{
+	return compute_hash_graphics_pipeline_with_resolver(HandleValueResolver{}, create_info, out_hash);
+}
+
 bool compute_hash_compute_pipeline(const StateRecorder &recorder, const VkComputePipelineCreateInfo &create_info, Hash *out_hash)
 {
 	Hasher h;
@@ -3215,6 +3314,28 @@ void StateRecorder::set_database_enable_compression(bool enable)
 	impl->compression = enable;
 }
 
+void StateRecorder::set_recording_thread_priority(const StateRecorderThreadPriority &priority)
+{
+	impl->thread_priority = priority;
+}
+
+void StateRecorder::set_normalize_pipelines(bool enable)
+{
+	impl->normalize_pipelines = enable;
+}
+
+void StateRecorder::set_object_listener(StateRecorderObjectListener *listener)
+{
+	impl->object_listener = listener;
+}
+
+uint64_t StateRecorder::Impl::notify_object_enqueued(ResourceTag tag, uint64_t handle)
+{
+	if (!object_listener || handle == 0)
+		return 0;
+	return object_listener->on_object_enqueued(tag, handle);
+}
+
 bool StateRecorder::record_application_info(const VkApplicationInfo &info)
 {
 	if (info.pNext)
@@ -3345,7 +3466,12 @@ bool StateRecorder::record_graphics_pipeline(VkPipeline pipeline, const VkGraphi
 		if (!impl->copy_graphics_pipeline(&create_info, impl->temp_allocator, base_pipelines, base_pipeline_count, &new_info))
 			return false;
 
-		impl->record_queue.push({api_object_cast<uint64_t>(pipeline), new_info, custom_hash});
+		// The copy is owned by us, so it can be normalized in place.
+		if (impl->normalize_pipelines)
+			normalize_graphics_pipeline(impl->temp_allocator, *new_info, new_info);
+
+		uint64_t cookie = impl->notify_object_enqueued(RESOURCE_GRAPHICS_PIPELINE, api_object_cast<uint64_t>(pipeline));
+		impl->record_queue.push({api_object_cast<uint64_t>(pipeline), new_info, custom_hash, cookie});
 		impl->record_cv.notify_one();
 	}
 
@@ -3372,7 +3498,8 @@ bool StateRecorder::record_compute_pipeline(VkPipeline pipeline, const VkCompute
 		if (!impl->copy_compute_pipeline(&create_info, impl->temp_allocator, base_pipelines, base_pipeline_count, &new_info))
 			return false;
 
-		impl->record_queue.push({api_object_cast<uint64_t>(pipeline), new_info, custom_hash});
+		uint64_t cookie = impl->notify_object_enqueued(RESOURCE_COMPUTE_PIPELINE, api_object_cast<uint64_t>(pipeline));
+		impl->record_queue.push({api_object_cast<uint64_t>(pipeline), new_info, custom_hash, cookie});
 		impl->record_cv.notify_one();
 	}
 
@@ -3419,7 +3546,8 @@ bool StateRecorder::record_shader_module(VkShaderModule module, const VkShaderMo
 		if (!impl->copy_shader_module(&create_info, impl->temp_allocator, &new_info))
 			return false;
 
-		impl->record_queue.push({api_object_cast<uint64_t>(module), new_info, custom_hash});
+		uint64_t cookie = impl->notify_object_enqueued(RESOURCE_SHADER_MODULE, api_object_cast<uint64_t>(module));
+		impl->record_queue.push({api_object_cast<uint64_t>(module), new_info, custom_hash, cookie});
 		impl->record_cv.notify_one();
 	}
 
@@ -4076,6 +4204,112 @@ bool StateRecorder::Impl::remap_render_pass_ci(VkRenderPassCreateInfo *)
 	return true;
 }
 
+// Defers writes to the underlying database so that we stay within a write budget.
+struct ThrottledDatabase : DatabaseInterface
+{
+	ThrottledDatabase(DatabaseInterface *iface_, uint64_t bytes_per_second_)
+		: DatabaseInterface(DatabaseMode::Append), iface(iface_), bytes_per_second(bytes_per_second_)
+	{
+	}
+
+	bool prepare() override
+	{
+		return iface->prepare();
+	}
+
+	bool read_entry(ResourceTag tag, Hash hash, size_t *size, void *buffer, PayloadReadFlags flags) override
+	{
+		return iface->read_entry(tag, hash, size, buffer, flags);
+	}
+
+	bool write_entry(ResourceTag tag, Hash hash, const void *buffer, size_t size, PayloadWriteFlags flags) override
+	{
+		auto now = std::chrono::steady_clock::now();
+		if (budget_time < now)
+			budget_time = now;
+		budget_time += std::chrono::nanoseconds(uint64_t(double(size) * 1e9 / double(bytes_per_second)));
+
+		// Allow bursts of up to one second worth of writes before we start deferring.
+		auto limit = now + std::chrono::seconds(1);
+		if (budget_time > limit)
+			std::this_thread::sleep_for(budget_time - limit);
+
+		return iface->write_entry(tag, hash, buffer, size, flags);
+	}
+
+	bool has_entry(ResourceTag tag, Hash hash) override
+	{
+		return iface->has_entry(tag, hash);
+	}
+
+	bool get_hash_list_for_resource_tag(ResourceTag tag, size_t *num_hashes, Hash *hashes) override
+	{
+		return iface->get_hash_list_for_resource_tag(tag, num_hashes, hashes);
+	}
+
+	void flush() override
+	{
+		iface->flush();
+	}
+
+	const char *get_db_path_for_hash(ResourceTag tag, Hash hash) override
+	{
+		return iface->get_db_path_for_hash(tag, hash);
+	}
+
+	DatabaseInterface *iface;
+	uint64_t bytes_per_second;
+	std::chrono::steady_clock::time_point budget_time;
+};
+
+void StateRecorder::Impl::apply_thread_priority()
+{
+#if defined(__linux__)
+	pid_t tid = pid_t(syscall(SYS_gettid));
+
+	if (thread_priority.idle_scheduling)
+	{
+		sched_param param = {};
+		if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0)
+			LOGE("Failed to set SCHED_IDLE for recording thread.\n");
+	}
+
+	// On Linux, the nice value is per-thread when using the thread ID.
+	if (thread_priority.nice_value != 0)
+		if (setpriority(PRIO_PROCESS, id_t(tid), thread_priority.nice_value) < 0)
+			LOGE("Failed to set nice value %d for recording thread.\n", thread_priority.nice_value);
+
+	if (thread_priority.io_priority_class != 0)
+	{
+		// From linux/ioprio.h.
+		const int ioprio_who_process = 1;
+		const int ioprio_class_shift = 13;
+		int ioprio = (thread_priority.io_priority_class << ioprio_class_shift) | thread_priority.io_priority_level;
+		if (syscall(SYS_ioprio_set, ioprio_who_process, int(tid), ioprio) < 0)
+			LOGE("Failed to set I/O priority for recording thread.\n");
+	}
+
+	if (thread_priority.cpu_affinity_mask != 0)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (unsigned i = 0; i < 64 && i < CPU_SETSIZE; i++)
+			if (thread_priority.cpu_affinity_mask & (uint64_t(1) << i))
+				CPU_SET(i, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+			LOGE("Failed to set CPU affinity for recording thread.\n");
+	}
+#elif defined(_WIN32)
+	if (thread_priority.idle_scheduling)
+		if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_IDLE))
+			LOGE("Failed to set idle priority for recording thread.\n");
+
+	if (thread_priority.cpu_affinity_mask != 0)
+		if (!SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(thread_priority.cpu_affinity_mask)))
+			LOGE("Failed to set CPU affinity for recording thread.\n");
+#endif
+}
+
 void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 {
 	PayloadWriteFlags payload_flags = 0;
@@ -4086,6 +4320,9 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 
 	bool write_database_entries = true;
 
+	if (looping)
+		apply_thread_priority();
+
 	// Start by preparing in the thread since we need to parse an archive potentially, and that might block a little bit.
 	if (database_iface)
 	{
@@ -4261,6 +4498,8 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 					break;
 
 			shader_module_to_hash[api_object_cast<VkShaderModule>(record_item.handle)] = hash;
+			if (record_item.listener_cookie)
+				object_listener->on_object_hashed(record_item.listener_cookie, hash);
 
 			if (database_iface)
 			{
@@ -4402,6 +4641,8 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 				break;
 
 			graphics_pipeline_to_hash[api_object_cast<VkPipeline>(record_item.handle)] = hash;
+			if (record_item.listener_cookie)
+				object_listener->on_object_hashed(record_item.listener_cookie, hash);
 
 			if (database_iface)
 			{
@@ -4448,6 +4689,8 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 				break;
 
 			compute_pipeline_to_hash[api_object_cast<VkPipeline>(record_item.handle)] = hash;
+			if (record_item.listener_cookie)
+				object_listener->on_object_hashed(record_item.listener_cookie, hash);
 
 			if (database_iface)
 			{
@@ -5748,6 +5991,12 @@ void StateRecorder::free_serialized(uint8_t *serialized)
 
 void StateRecorder::init_recording_thread(DatabaseInterface *iface)
 {
+	if (iface && impl->thread_priority.max_write_bytes_per_second != 0)
+	{
+		impl->throttled_database_iface.reset(new ThrottledDatabase(iface, impl->thread_priority.max_write_bytes_per_second));
+		iface = impl->throttled_database_iface.get();
+	}
+
 	impl->database_iface = iface;
 	impl->worker_thread = std::thread(&StateRecorder::Impl::record_task, impl, this, true);
 }
@@ -175,6 +175,46 @@ struct StateRecorderApplicationFeatureHash
 	Hash physical_device_features_hash = 0;
 };
 
+// Hints for the recording thread so it competes less with the application.
+// Hints which are not supported on a platform are ignored.
+struct StateRecorderThreadPriority
+{
+	// Lowest possible scheduling priority.
+	// SCHED_IDLE on Linux, THREAD_PRIORITY_IDLE on Windows.
+	bool idle_scheduling = false;
+
+	// Nice value of the recording thread. 0 leaves it unchanged. Linux only.
+	int nice_value = 0;
+
+	// I/O priority class (1 = realtime, 2 = best-effort, 3 = idle) and level (0 - 7) as used by ioprio_set().
+	// Class 0 leaves it unchanged. Linux only.
+	int io_priority_class = 0;
+	int io_priority_level = 0;
+
+	// Mask of CPUs the recording thread may run on. 0 leaves it unchanged.
+	uint64_t cpu_affinity_mask = 0;
+
+	// Upper bound for the number of bytes written to the database per second, 0 means unlimited.
+	// Writes exceeding the budget are deferred, never dropped.
+	uint64_t max_write_bytes_per_second = 0;
+};
+
+// Lets a caller learn the hash of shader modules and pipelines it creates, even if the handle is
+// destroyed and reused before the recording thread gets to it.
+class StateRecorderObjectListener
+{
+public:
+	virtual ~StateRecorderObjectListener() = default;
+
+	// Called from the recording call, with the record lock held, when the object is queued for recording.
+	// The returned cookie is passed back to on_object_hashed(). Returning 0 means not interested.
+	virtual uint64_t on_object_enqueued(ResourceTag tag, uint64_t handle) = 0;
+
+	// Called from the recording thread once the hash of the object is known.
+	// Not called if the object fails to hash.
+	virtual void on_object_hashed(uint64_t cookie, Hash hash) = 0;
+};
+
 class StateRecorder
 {
 public:
@@ -185,6 +225,14 @@ public:
 	// Call before init_recording_thread.
 	void set_database_enable_compression(bool enable);
 	void set_database_enable_checksum(bool enable);
+	void set_recording_thread_priority(const StateRecorderThreadPriority &priority);
+
+	// Default is false. If true, graphics pipelines are normalized with normalize_graphics_pipeline() before they are
+	// hashed and serialized, so pipelines which only differ in ignored state are recorded once.
+	void set_normalize_pipelines(bool enable);
+
+	// Call before init_recording_thread. See StateRecorderObjectListener.
+	void set_object_listener(StateRecorderObjectListener *listener);
 
 	// These methods should only be called at the very beginning of the application lifetime.
 	// It will affect the hash of all create info structures.
@@ -278,6 +326,10 @@ bool compute_hash_descriptor_set_layout(const StateRecorder &recorder, const VkD
 bool compute_hash_pipeline_layout(const StateRecorder &recorder, const VkPipelineLayoutCreateInfo &layout, Hash *hash) FOSSILIZE_WARN_UNUSED;
 bool compute_hash_graphics_pipeline(const StateRecorder &recorder, const VkGraphicsPipelineCreateInfo &create_info, Hash *hash) FOSSILIZE_WARN_UNUSED;
 bool compute_hash_compute_pipeline(const StateRecorder &recorder, const VkComputePipelineCreateInfo &create_info, Hash *hash) FOSSILIZE_WARN_UNUSED;
+
+// Same as compute_hash_graphics_pipeline, but dependent objects are identified by their handle values.
+// Only meaningful for comparing create infos within one process, e.g. to find equivalent pipelines after normalization.
+bool compute_hash_graphics_pipeline_by_handles(const VkGraphicsPipelineCreateInfo &create_info, Hash *hash) FOSSILIZE_WARN_UNUSED;
 }
 
 }
@@ -29,7 +29,20 @@
 #include <vector>
 #include <unordered_set>
 #include <unordered_map>
+#include <map>
+#include <algorithm>
 #include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #define RAPIDJSON_HAS_STDSTRING 1
 #include "rapidjson/document.h"
@@ -40,6 +53,7 @@ using namespace rapidjson;
 namespace Fossilize
 {
 enum { FOSSILIZE_APPLICATION_INFO_FILTER_VERSION = 1 };
+enum { FOSSILIZE_APPLICATION_INFO_FILTER_COMPILED_VERSION = 1 };
 
 struct AppInfo
 {
@@ -48,13 +62,151 @@ struct AppInfo
 	uint32_t minimum_engine_version = 0;
 };
 
+struct FilterEntry
+{
+	bool blacklisted = false;
+	bool has_info = false;
+	AppInfo info;
+};
+
+enum FilterTable
+{
+	APPLICATION_TABLE = 0,
+	ENGINE_TABLE = 1,
+	FILTER_TABLE_COUNT
+};
+
+// Compiled filters are written and mapped on the same machine, so the blob uses native endianness.
+// Every name is placed with a perfect hash (hash and displace): the name picks a bucket,
+// and the bucket's seed picks a slot which no other name maps to. A lookup is two hashes and one compare.
+static const char compiled_filter_magic[8] = { 'F', 'O', 'S', 'S', 'A', 'P', 'P', 'F' };
+
+struct CompiledFilterTable
+{
+	uint32_t bucket_count;
+	uint32_t slot_count;
+	// Byte offsets from the start of the blob. Buckets are one uint32_t seed each.
+	uint32_t buckets_offset;
+	uint32_t slots_offset;
+};
+
+enum CompiledFilterSlotFlagBits
+{
+	COMPILED_SLOT_OCCUPIED_BIT = 1 << 0,
+	COMPILED_SLOT_BLACKLISTED_BIT = 1 << 1,
+	COMPILED_SLOT_HAS_INFO_BIT = 1 << 2
+};
+
+struct CompiledFilterSlot
+{
+	uint32_t name_offset;
+	uint32_t name_length;
+	uint32_t flags;
+	uint32_t minimum_api_version;
+	uint32_t minimum_application_version;
+	uint32_t minimum_engine_version;
+};
+
+struct CompiledFilterHeader
+{
+	char magic[8];
+	uint32_t compiled_version;
+	uint32_t filter_version;
+	// Identifies the JSON the blob was compiled from, so edits to the JSON are never masked by a stale blob.
+	uint64_t source_size;
+	uint64_t source_hash;
+	CompiledFilterTable tables[FILTER_TABLE_COUNT];
+	uint32_t strings_offset;
+	uint32_t strings_size;
+};
+
+static uint64_t hash_bytes(const char *data, size_t size, uint32_t seed)
+{
+	uint64_t h = 0xcbf29ce484222325ull ^ (uint64_t(seed) * 0x9e3779b97f4a7c15ull);
+	for (size_t i = 0; i < size; i++)
+	{
+		h ^= uint8_t(data[i]);
+		h *= 0x100000001b3ull;
+	}
+
+	// FNV-1a alone mixes the upper bits poorly for short names.
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return h;
+}
+
+static const uint8_t *map_file(const char *path, size_t &size)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return nullptr;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return nullptr;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (!mapping)
+		return nullptr;
+
+	// The view keeps the mapping alive.
+	void *mapped = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (!mapped)
+		return nullptr;
+
+	size = size_t(file_size.QuadPart);
+	return static_cast<const uint8_t *>(mapped);
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return nullptr;
+
+	struct stat s;
+	if (fstat(fd, &s) < 0 || s.st_size == 0)
+	{
+		close(fd);
+		return nullptr;
+	}
+
+	void *mapped = mmap(nullptr, size_t(s.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED)
+		return nullptr;
+
+	size = size_t(s.st_size);
+	return static_cast<const uint8_t *>(mapped);
+#endif
+}
+
+static void unmap_file(const uint8_t *mapped, size_t size)
+{
+#ifdef _WIN32
+	(void)size;
+	UnmapViewOfFile(mapped);
+#else
+	munmap(const_cast<uint8_t *>(mapped), size);
+#endif
+}
+
 struct ApplicationInfoFilter::Impl
 {
+	~Impl();
+
 	std::unordered_set<std::string> blacklisted_application_names;
 	std::unordered_set<std::string> blacklisted_engine_names;
 	std::unordered_map<std::string, AppInfo> application_infos;
 	std::unordered_map<std::string, AppInfo> engine_infos;
 
+	const uint8_t *compiled = nullptr;
+	size_t compiled_size = 0;
+
 	bool parsing_done = false;
 	bool parsing_success = false;
 	std::future<void> task;
@@ -63,8 +215,19 @@ struct ApplicationInfoFilter::Impl
 	bool test_application_info(const VkApplicationInfo *info);
 	bool parse(const std::string &path);
 	bool check_success();
+	bool load_compiled(const char *json_path);
+	bool lookup(FilterTable table, const char *name, FilterEntry &entry) const;
+	bool lookup_compiled(FilterTable table, const char *name, FilterEntry &entry) const;
 };
 
+ApplicationInfoFilter::Impl::~Impl()
+{
+	if (task.valid())
+		task.wait();
+	if (compiled)
+		unmap_file(compiled, compiled_size);
+}
+
 bool ApplicationInfoFilter::Impl::check_success()
 {
 	if (task.valid())
@@ -87,60 +250,58 @@ bool ApplicationInfoFilter::Impl::test_application_info(const VkApplicationInfo
 		return true;
 	}
 
+	FilterEntry application, engine;
+	if (info->pApplicationName)
+		lookup(APPLICATION_TABLE, info->pApplicationName, application);
+	if (info->pEngineName)
+		lookup(ENGINE_TABLE, info->pEngineName, engine);
+
 	// First, check for blacklists.
-	if (info->pApplicationName && blacklisted_application_names.count(info->pApplicationName))
+	if (application.blacklisted)
 	{
 		LOGI("pApplicationName %s is blacklisted for recording. Skipping.\n", info->pApplicationName);
 		return false;
 	}
 
-	if (info->pEngineName && blacklisted_engine_names.count(info->pEngineName))
+	if (engine.blacklisted)
 	{
 		LOGI("pEngineName %s is blacklisted for recording. Skipping.\n", info->pEngineName);
 		return false;
 	}
 
 	// Check versioning for applicationName.
-	if (info->pApplicationName)
+	if (application.has_info)
 	{
-		auto itr = application_infos.find(info->pApplicationName);
-		if (itr != application_infos.end())
+		if (info->applicationVersion < application.info.minimum_application_version)
 		{
-			if (info->applicationVersion < itr->second.minimum_application_version)
-			{
-				LOGI("applicationVersion %u is too low for pApplicationName %s. Skipping.\n",
-				     info->applicationVersion, info->pApplicationName);
-				return false;
-			}
+			LOGI("applicationVersion %u is too low for pApplicationName %s. Skipping.\n",
+			     info->applicationVersion, info->pApplicationName);
+			return false;
+		}
 
-			if (info->apiVersion < itr->second.minimum_api_version)
-			{
-				LOGI("apiVersion %u is too low for pApplicationName %s. Skipping.\n",
-				     info->apiVersion, info->pApplicationName);
-				return false;
-			}
+		if (info->apiVersion < application.info.minimum_api_version)
+		{
+			LOGI("apiVersion %u is too low for pApplicationName %s. Skipping.\n",
+			     info->apiVersion, info->pApplicationName);
+			return false;
 		}
 	}
 
 	// Check versioning for engineName.
-	if (info->pEngineName)
+	if (engine.has_info)
 	{
-		auto itr = engine_infos.find(info->pEngineName);
-		if (itr != engine_infos.end())
+		if (info->engineVersion < engine.info.minimum_engine_version)
 		{
-			if (info->engineVersion < itr->second.minimum_engine_version)
-			{
-				LOGI("engineVersion %u is too low for pEngineName %s. Skipping.\n",
-				     info->engineVersion, info->pEngineName);
-				return false;
-			}
+			LOGI("engineVersion %u is too low for pEngineName %s. Skipping.\n",
+			     info->engineVersion, info->pEngineName);
+			return false;
+		}
 
-			if (info->apiVersion < itr->second.minimum_api_version)
-			{
-				LOGI("apiVersion %u is too low for pEngineName %s. Skipping.\n",
-				     info->apiVersion, info->pEngineName);
-				return false;
-			}
+		if (info->apiVersion < engine.info.minimum_api_version)
+		{
+			LOGI("apiVersion %u is too low for pEngineName %s. Skipping.\n",
+			     info->apiVersion, info->pEngineName);
+			return false;
 		}
 	}
 
@@ -148,6 +309,54 @@ bool ApplicationInfoFilter::Impl::test_application_info(const VkApplicationInfo
 	return true;
 }
 
+bool ApplicationInfoFilter::Impl::lookup(FilterTable table, const char *name, FilterEntry &entry) const
+{
+	if (compiled)
+		return lookup_compiled(table, name, entry);
+
+	auto &blacklist = table == APPLICATION_TABLE ? blacklisted_application_names : blacklisted_engine_names;
+	auto &infos = table == APPLICATION_TABLE ? application_infos : engine_infos;
+
+	entry.blacklisted = blacklist.count(name) != 0;
+	auto itr = infos.find(name);
+	if (itr != infos.end())
+	{
+		entry.has_info = true;
+		entry.info = itr->second;
+	}
+
+	return entry.blacklisted || entry.has_info;
+}
+
+bool ApplicationInfoFilter::Impl::lookup_compiled(FilterTable table_index, const char *name, FilterEntry &entry) const
+{
+	auto *header = reinterpret_cast<const CompiledFilterHeader *>(compiled);
+	auto &table = header->tables[table_index];
+	if (table.slot_count == 0)
+		return false;
+
+	size_t name_length = strlen(name);
+	auto *buckets = reinterpret_cast<const uint32_t *>(compiled + table.buckets_offset);
+	auto *slots = reinterpret_cast<const CompiledFilterSlot *>(compiled + table.slots_offset);
+	uint32_t seed = buckets[hash_bytes(name, name_length, 0) % table.bucket_count];
+	auto &slot = slots[hash_bytes(name, name_length, seed) % table.slot_count];
+
+	// Names which are not in the filter still map to some slot.
+	if ((slot.flags & COMPILED_SLOT_OCCUPIED_BIT) == 0 || slot.name_length != name_length)
+		return false;
+	if (uint64_t(slot.name_offset) + slot.name_length > header->strings_size)
+		return false;
+	if (memcmp(compiled + header->strings_offset + slot.name_offset, name, name_length) != 0)
+		return false;
+
+	entry.blacklisted = (slot.flags & COMPILED_SLOT_BLACKLISTED_BIT) != 0;
+	entry.has_info = (slot.flags & COMPILED_SLOT_HAS_INFO_BIT) != 0;
+	entry.info.minimum_api_version = slot.minimum_api_version;
+	entry.info.minimum_application_version = slot.minimum_application_version;
+	entry.info.minimum_engine_version = slot.minimum_engine_version;
+	return true;
+}
+
 static std::vector<char> read_file(const char *path)
 {
 	FILE *file = fopen(path, "rb");
@@ -326,8 +535,64 @@ bool ApplicationInfoFilter::Impl::parse(const std::string &path)
 	return true;
 }
 
+static bool table_is_valid(const CompiledFilterTable &table, size_t size)
+{
+	if (table.slot_count == 0)
+		return true;
+	if (table.bucket_count == 0)
+		return false;
+	if ((table.buckets_offset & 3) != 0 || (table.slots_offset & 3) != 0)
+		return false;
+	if (uint64_t(table.buckets_offset) + uint64_t(table.bucket_count) * sizeof(uint32_t) > size)
+		return false;
+	if (uint64_t(table.slots_offset) + uint64_t(table.slot_count) * sizeof(CompiledFilterSlot) > size)
+		return false;
+	return true;
+}
+
+bool ApplicationInfoFilter::Impl::load_compiled(const char *json_path)
+{
+	auto compiled_path = ApplicationInfoFilter::get_compiled_path(json_path);
+	size_t size = 0;
+	auto *mapped = map_file(compiled_path.c_str(), size);
+	if (!mapped)
+		return false;
+
+	// Hashing the JSON is far cheaper than parsing it, and catches any edit made after compiling.
+	auto source = read_file(json_path);
+	auto *header = reinterpret_cast<const CompiledFilterHeader *>(mapped);
+	bool valid = size >= sizeof(CompiledFilterHeader) &&
+	             memcmp(header->magic, compiled_filter_magic, sizeof(compiled_filter_magic)) == 0 &&
+	             header->compiled_version == FOSSILIZE_APPLICATION_INFO_FILTER_COMPILED_VERSION &&
+	             header->filter_version == FOSSILIZE_APPLICATION_INFO_FILTER_VERSION &&
+	             header->source_size == source.size() &&
+	             header->source_hash == hash_bytes(source.data(), source.size(), 0) &&
+	             uint64_t(header->strings_offset) + header->strings_size <= size;
+
+	for (unsigned i = 0; valid && i < FILTER_TABLE_COUNT; i++)
+		valid = table_is_valid(header->tables[i], size);
+
+	if (!valid)
+	{
+		LOGI("Compiled application info filter %s is stale, falling back to JSON.\n", compiled_path.c_str());
+		unmap_file(mapped, size);
+		return false;
+	}
+
+	compiled = mapped;
+	compiled_size = size;
+	return true;
+}
+
 void ApplicationInfoFilter::Impl::parse_async(const char *path_)
 {
+	if (load_compiled(path_))
+	{
+		parsing_success = true;
+		parsing_done = true;
+		return;
+	}
+
 	std::string path = path_;
 	task = std::async(std::launch::async, [this, path]() {
 		bool ret = parse(path);
@@ -356,6 +621,195 @@ bool ApplicationInfoFilter::check_success()
 	return impl->check_success();
 }
 
+bool ApplicationInfoFilter::is_compiled() const
+{
+	return impl->compiled != nullptr;
+}
+
+std::string ApplicationInfoFilter::get_compiled_path(const char *json_path)
+{
+	return std::string(json_path) + ".compiled";
+}
+
+// Places every name in its own slot. Buckets with the most names are placed first, while the table is still empty.
+static bool build_perfect_hash(const std::vector<std::string> &names,
+                               std::vector<uint32_t> &seeds, std::vector<int> &slot_to_name)
+{
+	seeds.clear();
+	slot_to_name.clear();
+	if (names.empty())
+		return true;
+
+	uint32_t bucket_count = uint32_t((names.size() + 3) / 4);
+	uint32_t slot_count = uint32_t(names.size() + names.size() / 4 + 1);
+
+	std::vector<std::vector<uint32_t>> buckets(bucket_count);
+	for (uint32_t i = 0; i < names.size(); i++)
+		buckets[hash_bytes(names[i].data(), names[i].size(), 0) % bucket_count].push_back(i);
+
+	std::vector<uint32_t> order(bucket_count);
+	for (uint32_t i = 0; i < bucket_count; i++)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+		return buckets[a].size() > buckets[b].size();
+	});
+
+	seeds.resize(bucket_count, 1);
+	slot_to_name.resize(slot_count, -1);
+
+	std::vector<uint32_t> candidate_slots;
+	for (auto bucket_index : order)
+	{
+		auto &bucket = buckets[bucket_index];
+		if (bucket.empty())
+			break;
+
+		bool placed = false;
+		for (uint32_t seed = 1; seed < (1u << 24) && !placed; seed++)
+		{
+			candidate_slots.clear();
+			for (auto name_index : bucket)
+			{
+				auto &name = names[name_index];
+				uint32_t slot = uint32_t(hash_bytes(name.data(), name.size(), seed) % slot_count);
+				if (slot_to_name[slot] >= 0 ||
+				    std::find(candidate_slots.begin(), candidate_slots.end(), slot) != candidate_slots.end())
+				{
+					break;
+				}
+				candidate_slots.push_back(slot);
+			}
+
+			if (candidate_slots.size() == bucket.size())
+			{
+				for (size_t i = 0; i < bucket.size(); i++)
+					slot_to_name[candidate_slots[i]] = int(bucket[i]);
+				seeds[bucket_index] = seed;
+				placed = true;
+			}
+		}
+
+		if (!placed)
+			return false;
+	}
+
+	return true;
+}
+
+template <typename T>
+static uint32_t append_blob(std::vector<uint8_t> &blob, const T *data, size_t count)
+{
+	// Everything in the blob is made of uint32_t, keep it aligned for the mapped reader.
+	blob.resize((blob.size() + 3) & ~size_t(3));
+	auto offset = uint32_t(blob.size());
+	blob.resize(blob.size() + count * sizeof(T));
+	if (count)
+		memcpy(blob.data() + offset, data, count * sizeof(T));
+	return offset;
+}
+
+bool ApplicationInfoFilter::compile(const char *json_path, const char *blob_path)
+{
+	Impl impl;
+	if (!impl.parse(json_path))
+	{
+		LOGE("Failed to parse application info filter %s.\n", json_path);
+		return false;
+	}
+
+	auto source = read_file(json_path);
+	std::string compiled_path = blob_path ? std::string(blob_path) : get_compiled_path(json_path);
+
+	CompiledFilterHeader header = {};
+	memcpy(header.magic, compiled_filter_magic, sizeof(compiled_filter_magic));
+	header.compiled_version = FOSSILIZE_APPLICATION_INFO_FILTER_COMPILED_VERSION;
+	header.filter_version = FOSSILIZE_APPLICATION_INFO_FILTER_VERSION;
+	header.source_size = source.size();
+	header.source_hash = hash_bytes(source.data(), source.size(), 0);
+
+	std::vector<uint8_t> blob(sizeof(header));
+	std::string strings;
+
+	for (unsigned table_index = 0; table_index < FILTER_TABLE_COUNT; table_index++)
+	{
+		auto &blacklist = table_index == APPLICATION_TABLE ? impl.blacklisted_application_names : impl.blacklisted_engine_names;
+		auto &infos = table_index == APPLICATION_TABLE ? impl.application_infos : impl.engine_infos;
+
+		// Sorted, so the same JSON always compiles to the same blob.
+		std::map<std::string, FilterEntry> entries;
+		for (auto &name : blacklist)
+			entries[name].blacklisted = true;
+		for (auto &info : infos)
+		{
+			auto &entry = entries[info.first];
+			entry.has_info = true;
+			entry.info = info.second;
+		}
+
+		std::vector<std::string> names;
+		std::vector<const FilterEntry *> name_entries;
+		for (auto &entry : entries)
+		{
+			names.push_back(entry.first);
+			name_entries.push_back(&entry.second);
+		}
+
+		std::vector<uint32_t> seeds;
+		std::vector<int> slot_to_name;
+		if (!build_perfect_hash(names, seeds, slot_to_name))
+		{
+			LOGE("Failed to build perfect hash for application info filter.\n");
+			return false;
+		}
+
+		std::vector<CompiledFilterSlot> slots(slot_to_name.size());
+		for (size_t i = 0; i < slots.size(); i++)
+		{
+			if (slot_to_name[i] < 0)
+				continue;
+
+			auto &name = names[slot_to_name[i]];
+			auto &entry = *name_entries[slot_to_name[i]];
+			auto &slot = slots[i];
+			slot.name_offset = uint32_t(strings.size());
+			slot.name_length = uint32_t(name.size());
+			slot.flags = COMPILED_SLOT_OCCUPIED_BIT;
+			if (entry.blacklisted)
+				slot.flags |= COMPILED_SLOT_BLACKLISTED_BIT;
+			if (entry.has_info)
+				slot.flags |= COMPILED_SLOT_HAS_INFO_BIT;
+			slot.minimum_api_version = entry.info.minimum_api_version;
+			slot.minimum_application_version = entry.info.minimum_application_version;
+			slot.minimum_engine_version = entry.info.minimum_engine_version;
+			strings += name;
+		}
+
+		auto &table = header.tables[table_index];
+		table.bucket_count = uint32_t(seeds.size());
+		table.slot_count = uint32_t(slots.size());
+		table.buckets_offset = append_blob(blob, seeds.data(), seeds.size());
+		table.slots_offset = append_blob(blob, slots.data(), slots.size());
+	}
+
+	header.strings_offset = append_blob(blob, strings.data(), strings.size());
+	header.strings_size = uint32_t(strings.size());
+	memcpy(blob.data(), &header, sizeof(header));
+
+	FILE *file = fopen(compiled_path.c_str(), "wb");
+	if (!file)
+	{
+		LOGE("Failed to open %s for writing.\n", compiled_path.c_str());
+		return false;
+	}
+
+	bool ret = fwrite(blob.data(), 1, blob.size(), file) == blob.size();
+	if (fclose(file) != 0)
+		ret = false;
+	if (!ret)
+		LOGE("Failed to write %s.\n", compiled_path.c_str());
+	return ret;
+}
+
 ApplicationInfoFilter::~ApplicationInfoFilter()
 {
 	delete impl;
@@ -22,6 +22,8 @@
 
 #pragma once
 
+#include <string>
+
 struct VkApplicationInfo;
 
 // Allows us to blacklist which applications and which app/engine-versions we don't want to capture.
@@ -38,11 +40,23 @@ public:
 	// Path to a JSON file. This is done async to avoid stalling main thread.
 	// Any further query will block.
 	// Called by layer when an instance is created.
+	// If a compiled filter which is up to date with the JSON file exists at get_compiled_path(path),
+	// it is mapped directly instead, and queries never block.
 	void parse_async(const char *path);
 
 	// Checks if we were successful in parsing the JSON file.
 	bool check_success();
 
+	// True if queries are answered from a compiled filter rather than the JSON file.
+	bool is_compiled() const;
+
+	// Compiles the JSON filter at json_path into a binary blob which can be mapped by parse_async().
+	// If blob_path is nullptr, get_compiled_path(json_path) is used.
+	static bool compile(const char *json_path, const char *blob_path = nullptr);
+
+	// Where parse_async() looks for the compiled filter of a JSON file.
+	static std::string get_compiled_path(const char *json_path);
+
 	// Tests if application should be recorded.
 	// Blocks until parsing is complete. Called by recording thread when preparing for recording.
 	bool test_application_info(const VkApplicationInfo *info);
@@ -36,6 +36,8 @@
 #include <algorithm>
 #include <memory>
 #include <mutex>
+#include <thread>
+#include <atomic>
 #include <dirent.h>
 
 #include "fossilize_inttypes.h"
@@ -128,6 +130,10 @@ DatabaseInterface::~DatabaseInterface()
 	delete impl;
 }
 
+void DatabaseInterface::sort_hashes_by_read_order(ResourceTag, Hash *, size_t)
+{
+}
+
 bool DatabaseInterface::test_resource_filter(ResourceTag tag, Hash hash) const
 {
 	if (tag != RESOURCE_SHADER_MODULE && tag != RESOURCE_COMPUTE_PIPELINE && tag != RESOURCE_GRAPHICS_PIPELINE)
@@ -978,6 +984,24 @@ struct StreamArchive : DatabaseInterface
 		return true;
 	}
 
+	void sort_hashes_by_read_order(ResourceTag tag, Hash *hashes, size_t num_hashes) override
+	{
+		vector<pair<uint64_t, Hash>> offsets;
+		offsets.reserve(num_hashes);
+		for (size_t i = 0; i < num_hashes; i++)
+		{
+			auto itr = seen_blobs[tag].find(hashes[i]);
+			offsets.push_back({ itr != end(seen_blobs[tag]) ? itr->second.offset : UINT64_MAX, hashes[i] });
+		}
+
+		stable_sort(begin(offsets), end(offsets), [](const pair<uint64_t, Hash> &a, const pair<uint64_t, Hash> &b) {
+			return a.first < b.first;
+		});
+
+		for (size_t i = 0; i < num_hashes; i++)
+			hashes[i] = offsets[i].second;
+	}
+
 	struct Entry
 	{
 		uint64_t offset;
@@ -1075,6 +1099,55 @@ struct StreamArchive : DatabaseInterface
 		return true;
 	}
 
+	static bool decode_raw_payload(const uint8_t *raw, size_t raw_size, size_t *blob_size, void *blob)
+	{
+		if (raw_size < sizeof(PayloadHeaderRaw))
+			return false;
+
+		PayloadHeader header = {};
+		convert_from_le(header, *reinterpret_cast<const PayloadHeaderRaw *>(raw));
+		if (header.payload_size != raw_size - sizeof(PayloadHeaderRaw))
+			return false;
+
+		if (!blob)
+		{
+			*blob_size = header.uncompressed_size;
+			return true;
+		}
+		else if (*blob_size != header.uncompressed_size)
+			return false;
+
+		const uint8_t *payload = raw + sizeof(PayloadHeaderRaw);
+		if (header.crc != 0) // Verify checksum.
+		{
+			auto disk_crc = uint32_t(mz_crc32(MZ_CRC32_INIT, payload, header.payload_size));
+			if (disk_crc != header.crc)
+			{
+				LOGE("CRC mismatch!\n");
+				return false;
+			}
+		}
+
+		if (header.format == FOSSILIZE_COMPRESSION_NONE)
+		{
+			if (header.payload_size != header.uncompressed_size)
+				return false;
+			memcpy(blob, payload, header.payload_size);
+		}
+		else if (header.format == FOSSILIZE_COMPRESSION_DEFLATE)
+		{
+			mz_ulong zsize = *blob_size;
+			if (mz_uncompress(static_cast<unsigned char *>(blob), &zsize, payload, header.payload_size) != MZ_OK)
+				return false;
+			if (zsize != *blob_size)
+				return false;
+		}
+		else
+			return false;
+
+		return true;
+	}
+
 	bool decode_payload(void *blob, size_t blob_size, const Entry &entry, bool concurrent)
 	{
 		if (entry.header.format == FOSSILIZE_COMPRESSION_NONE)
@@ -1103,6 +1176,11 @@ struct StreamArchive : DatabaseInterface
 	std::mutex read_lock;
 };
 
+bool decode_raw_fossilize_db_payload(const void *raw, size_t raw_size, size_t *blob_size, void *blob)
+{
+	return StreamArchive::decode_raw_payload(static_cast<const uint8_t *>(raw), raw_size, blob_size, blob);
+}
+
 DatabaseInterface *create_stream_archive_database(const char *path, DatabaseMode mode)
 {
 	auto *db = new StreamArchive(path, mode);
@@ -1123,8 +1201,10 @@ DatabaseInterface *create_database(const char *path, DatabaseMode mode)
 struct ConcurrentDatabase : DatabaseInterface
 {
 	explicit ConcurrentDatabase(const char *base_path_, DatabaseMode mode_,
-	                            const char * const *extra_paths, size_t num_extra_paths)
-		: DatabaseInterface(mode_), base_path(base_path_ ? base_path_ : ""), mode(mode_)
+	                            const char * const *extra_paths, size_t num_extra_paths,
+	                            bool lazy_priming_)
+		: DatabaseInterface(mode_), base_path(base_path_ ? base_path_ : ""), mode(mode_),
+		  lazy_priming(lazy_priming_ && mode_ == DatabaseMode::Append)
 	{
 		if (!base_path.empty())
 		{
@@ -1136,6 +1216,13 @@ struct ConcurrentDatabase : DatabaseInterface
 			extra_readonly.emplace_back(create_stream_archive_database(extra_paths[i], DatabaseMode::ReadOnly));
 	}
 
+	~ConcurrentDatabase()
+	{
+		for (auto &t : priming_threads)
+			if (t.joinable())
+				t.join();
+	}
+
 	void flush() override
 	{
 		if (writeonly_interface)
@@ -1167,31 +1254,97 @@ struct ConcurrentDatabase : DatabaseInterface
 
 		if (!has_prepared_readonly)
 		{
-			// It's okay if the database doesn't exist.
-			if (readonly_interface && readonly_interface->prepare())
-				prime_read_only_hashes(*readonly_interface);
+			if (lazy_priming)
+				begin_lazy_priming();
+			else
+				prime_eagerly();
+		}
 
-			if (mode != DatabaseMode::ReadOnly)
-			{
-				// We only need the database for priming purposes.
-				readonly_interface.reset();
-			}
+		has_prepared_readonly = true;
+		return true;
+	}
 
-			for (auto &extra : extra_readonly)
-			{
-				if (extra && extra->prepare())
-					prime_read_only_hashes(*extra);
-			}
+	void prime_eagerly()
+	{
+		std::vector<DatabaseInterface *> archives;
+		if (readonly_interface)
+			archives.push_back(readonly_interface.get());
+		for (auto &extra : extra_readonly)
+			if (extra)
+				archives.push_back(extra.get());
+
+		// Scanning the archives is dominated by I/O, so prepare them all in parallel.
+		// It's okay if the database doesn't exist.
+		std::unique_ptr<bool[]> prepared(new bool[archives.size()]);
+		std::vector<std::thread> threads;
+		threads.reserve(archives.size());
+		for (size_t i = 0; i < archives.size(); i++)
+			threads.emplace_back([&, i]() { prepared[i] = archives[i]->prepare(); });
+		for (auto &t : threads)
+			t.join();
+
+		for (size_t i = 0; i < archives.size(); i++)
+			if (prepared[i])
+				prime_read_only_hashes(*archives[i]);
 
-			if (mode != DatabaseMode::ReadOnly)
-			{
-				// We only need the database for priming purposes.
-				extra_readonly.clear();
-			}
+		if (mode != DatabaseMode::ReadOnly)
+		{
+			// We only need the databases for priming purposes.
+			readonly_interface.reset();
+			extra_readonly.clear();
 		}
+	}
 
-		has_prepared_readonly = true;
-		return true;
+	void begin_lazy_priming()
+	{
+		// Hand the archives over to background threads. They are consulted in has_entry() directly
+		// once they have been prepared. Until then, we might write some duplicate entries,
+		// but that is harmless, and we don't have to stall recording while priming.
+		if (readonly_interface)
+			lazy_archives.push_back(std::move(readonly_interface));
+		for (auto &extra : extra_readonly)
+			if (extra)
+				lazy_archives.push_back(std::move(extra));
+		extra_readonly.clear();
+
+		lazy_archive_ready.reset(new std::atomic<bool>[lazy_archives.size()]);
+		for (size_t i = 0; i < lazy_archives.size(); i++)
+			lazy_archive_ready[i].store(false, std::memory_order_relaxed);
+
+		priming_threads.reserve(lazy_archives.size());
+		for (size_t i = 0; i < lazy_archives.size(); i++)
+		{
+			priming_threads.emplace_back([this, i]() {
+				if (lazy_archives[i]->prepare())
+					lazy_archive_ready[i].store(true, std::memory_order_release);
+			});
+		}
+	}
+
+	void end_lazy_priming()
+	{
+		if (lazy_archives.empty())
+			return;
+
+		for (auto &t : priming_threads)
+			t.join();
+		priming_threads.clear();
+
+		for (size_t i = 0; i < lazy_archives.size(); i++)
+			if (lazy_archive_ready[i].load(std::memory_order_relaxed))
+				prime_read_only_hashes(*lazy_archives[i]);
+
+		lazy_archives.clear();
+		lazy_archive_ready.reset();
+	}
+
+	bool lazy_archives_have_entry(ResourceTag tag, Hash hash) const
+	{
+		// Once an archive is prepared, it is never modified again, so it's safe to query without locking.
+		for (size_t i = 0; i < lazy_archives.size(); i++)
+			if (lazy_archive_ready[i].load(std::memory_order_acquire) && lazy_archives[i]->has_entry(tag, hash))
+				return true;
+		return false;
 	}
 
 	bool read_entry(ResourceTag tag, Hash hash, size_t *blob_size, void *blob, PayloadReadFlags flags) override
@@ -1224,6 +1377,9 @@ struct ConcurrentDatabase : DatabaseInterface
 		if (readonly_interface && readonly_interface->has_entry(tag, hash))
 			return true;
 
+		if (lazy_archives_have_entry(tag, hash))
+			return true;
+
 		if (writeonly_interface && writeonly_interface->has_entry(tag, hash))
 			return true;
 
@@ -1261,11 +1417,17 @@ struct ConcurrentDatabase : DatabaseInterface
 		if (readonly_interface && readonly_interface->has_entry(tag, hash))
 			return true;
 
+		if (lazy_archives_have_entry(tag, hash))
+			return true;
+
 		return writeonly_interface && writeonly_interface->has_entry(tag, hash);
 	}
 
 	bool get_hash_list_for_resource_tag(ResourceTag tag, size_t *num_hashes, Hash *hashes) override
 	{
+		// We need the full picture here, so wait for the archives to be primed.
+		end_lazy_priming();
+
 		size_t readonly_size = primed_hashes[tag].size();
 
 		size_t writeonly_size = 0;
@@ -1320,20 +1482,28 @@ struct ConcurrentDatabase : DatabaseInterface
 	std::unordered_set<Hash> primed_hashes[RESOURCE_COUNT];
 	bool has_prepared_readonly = false;
 	bool need_writeonly_database = true;
+	bool lazy_priming;
+
+	std::vector<std::unique_ptr<DatabaseInterface>> lazy_archives;
+	std::unique_ptr<std::atomic<bool>[]> lazy_archive_ready;
+	std::vector<std::thread> priming_threads;
 };
 
 DatabaseInterface *create_concurrent_database(const char *base_path, DatabaseMode mode,
                                               const char * const *extra_read_only_database_paths,
-                                              size_t num_extra_read_only_database_paths)
+                                              size_t num_extra_read_only_database_paths,
+                                              bool lazy_priming)
 {
-	return new ConcurrentDatabase(base_path, mode, extra_read_only_database_paths, num_extra_read_only_database_paths);
+	return new ConcurrentDatabase(base_path, mode, extra_read_only_database_paths, num_extra_read_only_database_paths,
+	                              lazy_priming);
 }
 
 DatabaseInterface *create_concurrent_database_with_encoded_extra_paths(const char *base_path, DatabaseMode mode,
-                                                                       const char *encoded_extra_paths)
+                                                                       const char *encoded_extra_paths,
+                                                                       bool lazy_priming)
 {
 	if (!encoded_extra_paths)
-		return create_concurrent_database(base_path, mode, nullptr, 0);
+		return create_concurrent_database(base_path, mode, nullptr, 0, lazy_priming);
 
 #ifdef _WIN32
 	auto paths = Path::split_no_empty(encoded_extra_paths, ";");
@@ -1346,7 +1516,7 @@ DatabaseInterface *create_concurrent_database_with_encoded_extra_paths(const cha
 	for (auto &path : paths)
 		char_paths.push_back(path.c_str());
 
-	return create_concurrent_database(base_path, mode, char_paths.data(), char_paths.size());
+	return create_concurrent_database(base_path, mode, char_paths.data(), char_paths.size(), lazy_priming);
 }
 
 bool merge_concurrent_databases(const char *append_archive, const char * const *source_paths, size_t num_source_paths)
@@ -121,6 +121,11 @@ public:
 
 	virtual const char *get_db_path_for_hash(ResourceTag tag, Hash hash) = 0;
 
+	// Reorders hashes so that reading the entries in order is as sequential as possible,
+	// e.g. in file order for stream archives. Hashes which do not exist in the database are moved last.
+	// The relative order of entries is otherwise stable. The default implementation does nothing.
+	virtual void sort_hashes_by_read_order(ResourceTag tag, Hash *hashes, size_t num_hashes);
+
 protected:
 	bool test_resource_filter(ResourceTag tag, Hash hash) const;
 	struct Impl;
@@ -132,6 +137,10 @@ DatabaseInterface *create_zip_archive_database(const char *path, DatabaseMode mo
 DatabaseInterface *create_stream_archive_database(const char *path, DatabaseMode mode);
 DatabaseInterface *create_database(const char *path, DatabaseMode mode);
 
+// Decompresses and verifies a blob which was read from a stream archive with PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT,
+// without going through the archive. Like read_entry(), blob may be nullptr to query blob_size.
+bool decode_raw_fossilize_db_payload(const void *raw, size_t raw_size, size_t *blob_size, void *blob);
+
 // This is a special kind of database which can be used from multiple independent processes and splits out the database
 // into a read-only part and a write-only part, which is unique for each instance of this database.
 // base_path.foz is the read-only database. If it does not exist, it will not be written to either.
@@ -149,9 +158,16 @@ DatabaseInterface *create_database(const char *path, DatabaseMode mode);
 // Similarly, in append mode, the entries in the extra databases are assumed to be part of the base_path.foz database.
 // If any database in extra_read_only_database_paths does not ->prepare() correctly, it is simply ignored.
 // base_path may be nullptr if mode is ReadOnly. In this case, the read-only database from base_path.foz is ignored.
+//
+// The read-only databases are prepared in parallel.
+// If lazy_priming is true and mode is Append, prepare() returns immediately and the read-only databases
+// are prepared in background threads instead. has_entry() and write_entry() consult each read-only database
+// as soon as it has been prepared. Until then, entries which exist in a read-only database
+// might end up being written again to base_path.%d.foz, which is harmless.
 DatabaseInterface *create_concurrent_database(const char *base_path, DatabaseMode mode,
                                               const char * const *extra_read_only_database_paths,
-                                              size_t num_extra_read_only_database_paths);
+                                              size_t num_extra_read_only_database_paths,
+                                              bool lazy_priming = false);
 
 // Like create_concurrent_database, except encoded_read_only_database_paths
 // contains a list of paths delimited by ';'. E.g. "foo;bar;baz". Suitable to use directly with getenv().
@@ -159,7 +175,8 @@ DatabaseInterface *create_concurrent_database(const char *base_path, DatabaseMod
 // On non-Windows systems, ':' can also be used to delimit to match $PATH behavior.
 // base_path may be nullptr if mode is ReadOnly. In this case, the read-only database from base_path.foz is ignored.
 DatabaseInterface *create_concurrent_database_with_encoded_extra_paths(const char *base_path, DatabaseMode mode,
-                                                                       const char *encoded_read_only_database_paths);
+                                                                       const char *encoded_read_only_database_paths,
+                                                                       bool lazy_priming = false);
 
 // Merges stream archives found in source_paths into append_database_path.
 bool merge_concurrent_databases(const char *append_database_path, const char * const *source_paths, size_t num_source_paths);
@@ -0,0 +1,430 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "fossilize_normalize.hpp"
+#include <algorithm>
+#include <string.h>
+
+namespace Fossilize
+{
+// Compares bitwise, so e.g. -0.0f is normalized to 0.0f as well.
+template <typename T>
+static bool canonicalize(T &value, const T &canonical)
+{
+	if (memcmp(&value, &canonical, sizeof(T)) == 0)
+		return false;
+	value = canonical;
+	return true;
+}
+
+template <typename T>
+static const T *copy_state(ScratchAllocator &alloc, const T &state)
+{
+	auto *copy = alloc.allocate<T>();
+	*copy = state;
+	return copy;
+}
+
+static bool is_dynamic(uint32_t dynamic_mask, VkDynamicState state)
+{
+	return (dynamic_mask & (1u << state)) != 0;
+}
+
+static bool blend_factor_reads_constants(VkBlendFactor factor)
+{
+	return factor == VK_BLEND_FACTOR_CONSTANT_COLOR ||
+	       factor == VK_BLEND_FACTOR_ONE_MINUS_CONSTANT_COLOR ||
+	       factor == VK_BLEND_FACTOR_CONSTANT_ALPHA ||
+	       factor == VK_BLEND_FACTOR_ONE_MINUS_CONSTANT_ALPHA;
+}
+
+// Gathers core dynamic state as a bitmask. Fails on dynamic state which the rules are unaware of.
+static bool parse_dynamic_state(const VkPipelineDynamicStateCreateInfo *state, uint32_t *dynamic_mask)
+{
+	*dynamic_mask = 0;
+	if (!state)
+		return true;
+
+	if (state->pNext)
+		return false;
+
+	for (uint32_t i = 0; i < state->dynamicStateCount; i++)
+	{
+		switch (state->pDynamicStates[i])
+		{
+		case VK_DYNAMIC_STATE_VIEWPORT:
+		case VK_DYNAMIC_STATE_SCISSOR:
+		case VK_DYNAMIC_STATE_LINE_WIDTH:
+		case VK_DYNAMIC_STATE_DEPTH_BIAS:
+		case VK_DYNAMIC_STATE_BLEND_CONSTANTS:
+		case VK_DYNAMIC_STATE_DEPTH_BOUNDS:
+		case VK_DYNAMIC_STATE_STENCIL_COMPARE_MASK:
+		case VK_DYNAMIC_STATE_STENCIL_WRITE_MASK:
+		case VK_DYNAMIC_STATE_STENCIL_REFERENCE:
+			*dynamic_mask |= 1u << state->pDynamicStates[i];
+			break;
+
+		// Extension state which does not interact with any rule.
+		case VK_DYNAMIC_STATE_VIEWPORT_W_SCALING_NV:
+		case VK_DYNAMIC_STATE_DISCARD_RECTANGLE_EXT:
+		case VK_DYNAMIC_STATE_SAMPLE_LOCATIONS_EXT:
+		case VK_DYNAMIC_STATE_VIEWPORT_SHADING_RATE_PALETTE_NV:
+		case VK_DYNAMIC_STATE_VIEWPORT_COARSE_SAMPLE_ORDER_NV:
+		case VK_DYNAMIC_STATE_EXCLUSIVE_SCISSOR_NV:
+		case VK_DYNAMIC_STATE_LINE_STIPPLE_EXT:
+			break;
+
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static NormalizationRuleFlags normalize_dynamic_state(ScratchAllocator &alloc, const VkPipelineDynamicStateCreateInfo *&state)
+{
+	if (!state)
+		return 0;
+
+	if (state->dynamicStateCount == 0 && state->flags == 0)
+	{
+		state = nullptr;
+		return NORMALIZATION_RULE_DYNAMIC_STATE_LIST_BIT;
+	}
+
+	bool sorted = true;
+	for (uint32_t i = 1; i < state->dynamicStateCount && sorted; i++)
+		if (state->pDynamicStates[i - 1] >= state->pDynamicStates[i])
+			sorted = false;
+
+	if (sorted)
+		return 0;
+
+	auto *dynamic_states = alloc.allocate_n<VkDynamicState>(state->dynamicStateCount);
+	std::copy(state->pDynamicStates, state->pDynamicStates + state->dynamicStateCount, dynamic_states);
+	std::sort(dynamic_states, dynamic_states + state->dynamicStateCount);
+	auto *end = std::unique(dynamic_states, dynamic_states + state->dynamicStateCount);
+
+	auto dynamic = *state;
+	dynamic.pDynamicStates = dynamic_states;
+	dynamic.dynamicStateCount = uint32_t(end - dynamic_states);
+	state = copy_state(alloc, dynamic);
+	return NORMALIZATION_RULE_DYNAMIC_STATE_LIST_BIT;
+}
+
+static NormalizationRuleFlags normalize_rasterization_state(ScratchAllocator &alloc,
+                                                            const VkPipelineRasterizationStateCreateInfo *&state,
+                                                            uint32_t dynamic_mask)
+{
+	if (!state)
+		return 0;
+
+	auto rs = *state;
+	NormalizationRuleFlags rules = 0;
+
+	if (is_dynamic(dynamic_mask, VK_DYNAMIC_STATE_LINE_WIDTH) && canonicalize(rs.lineWidth, 1.0f))
+		rules |= NORMALIZATION_RULE_LINE_WIDTH_BIT;
+
+	if (!rs.depthBiasEnable || is_dynamic(dynamic_mask, VK_DYNAMIC_STATE_DEPTH_BIAS))
+	{
+		bool changed = false;
+		changed |= canonicalize(rs.depthBiasConstantFactor, 0.0f);
+		changed |= canonicalize(rs.depthBiasClamp, 0.0f);
+		changed |= canonicalize(rs.depthBiasSlopeFactor, 0.0f);
+		if (changed)
+			rules |= NORMALIZATION_RULE_DEPTH_BIAS_BIT;
+	}
+
+	if (rules)
+		state = copy_state(alloc, rs);
+	return rules;
+}
+
+static NormalizationRuleFlags normalize_depth_stencil_state(ScratchAllocator &alloc,
+                                                            const VkPipelineDepthStencilStateCreateInfo *&state,
+                                                            uint32_t dynamic_mask)
+{
+	if (!state)
+		return 0;
+
+	auto ds = *state;
+	NormalizationRuleFlags rules = 0;
+	bool changed;
+
+	// Depth writes are always disabled when the depth test is disabled.
+	if (!ds.depthTestEnable)
+	{
+		changed = false;
+		changed |= canonicalize(ds.depthWriteEnable, VkBool32(VK_FALSE));
+		changed |= canonicalize(ds.depthCompareOp, VK_COMPARE_OP_NEVER);
+		if (changed)
+			rules |= NORMALIZATION_RULE_DEPTH_TEST_BIT;
+	}
+
+	if (!ds.depthBoundsTestEnable || is_dynamic(dynamic_mask, VK_DYNAMIC_STATE_DEPTH_BOUNDS))
+	{
+		changed = false;
+		changed |= canonicalize(ds.minDepthBounds, 0.0f);
+		changed |= canonicalize(ds.maxDepthBounds, 0.0f);
+		if (changed)
+			rules |= NORMALIZATION_RULE_DEPTH_BOUNDS_BIT;
+	}
+
+	changed = false;
+	if (!ds.stencilTestEnable)
+	{
+		changed |= canonicalize(ds.front, VkStencilOpState{});
+		changed |= canonicalize(ds.back, VkStencilOpState{});
+	}
+	else
+	{
+		if (is_dynamic(dynamic_mask, VK_DYNAMIC_STATE_STENCIL_COMPARE_MASK))
+		{
+			changed |= canonicalize(ds.front.compareMask, 0u);
+			changed |= canonicalize(ds.back.compareMask, 0u);
+		}
+
+		if (is_dynamic(dynamic_mask, VK_DYNAMIC_STATE_STENCIL_WRITE_MASK))
+		{
+			changed |= canonicalize(ds.front.writeMask, 0u);
+			changed |= canonicalize(ds.back.writeMask, 0u);
+		}
+
+		if (is_dynamic(dynamic_mask, VK_DYNAMIC_STATE_STENCIL_REFERENCE))
+		{
+			changed |= canonicalize(ds.front.reference, 0u);
+			changed |= canonicalize(ds.back.reference, 0u);
+		}
+	}
+
+	if (changed)
+		rules |= NORMALIZATION_RULE_STENCIL_BIT;
+
+	if (rules)
+		state = copy_state(alloc, ds);
+	return rules;
+}
+
+static NormalizationRuleFlags normalize_multisample_state(ScratchAllocator &alloc,
+                                                          const VkPipelineMultisampleStateCreateInfo *&state)
+{
+	if (!state)
+		return 0;
+
+	auto ms = *state;
+	NormalizationRuleFlags rules = 0;
+
+	if (!ms.sampleShadingEnable && canonicalize(ms.minSampleShading, 0.0f))
+		rules |= NORMALIZATION_RULE_SAMPLE_SHADING_BIT;
+
+	uint32_t word_count = (ms.rasterizationSamples + 31) / 32;
+	if (ms.pSampleMask && word_count)
+	{
+		bool all_ones = true;
+		bool has_ignored_bits = false;
+
+		for (uint32_t i = 0; i < word_count; i++)
+		{
+			uint32_t samples = ms.rasterizationSamples - 32 * i;
+			uint32_t valid = samples >= 32 ? ~0u : ((1u << samples) - 1u);
+			if ((ms.pSampleMask[i] & valid) != valid)
+				all_ones = false;
+			if ((ms.pSampleMask[i] & ~valid) != 0)
+				has_ignored_bits = true;
+		}
+
+		// A NULL mask is treated as if all bits are set.
+		if (all_ones)
+		{
+			ms.pSampleMask = nullptr;
+			rules |= NORMALIZATION_RULE_SAMPLE_MASK_BIT;
+		}
+		else if (has_ignored_bits)
+		{
+			auto *sample_mask = alloc.allocate_n<VkSampleMask>(word_count);
+			for (uint32_t i = 0; i < word_count; i++)
+			{
+				uint32_t samples = ms.rasterizationSamples - 32 * i;
+				sample_mask[i] = ms.pSampleMask[i] & (samples >= 32 ? ~0u : ((1u << samples) - 1u));
+			}
+			ms.pSampleMask = sample_mask;
+			rules |= NORMALIZATION_RULE_SAMPLE_MASK_BIT;
+		}
+	}
+
+	if (rules)
+		state = copy_state(alloc, ms);
+	return rules;
+}
+
+static NormalizationRuleFlags normalize_viewport_state(ScratchAllocator &alloc,
+                                                       const VkPipelineViewportStateCreateInfo *&state,
+                                                       uint32_t dynamic_mask)
+{
+	if (!state)
+		return 0;
+
+	// The counts are still meaningful with dynamic viewports and scissors, only the contents are ignored.
+	auto vp = *state;
+	NormalizationRuleFlags rules = 0;
+
+	if (is_dynamic(dynamic_mask, VK_DYNAMIC_STATE_VIEWPORT) && vp.pViewports)
+	{
+		vp.pViewports = nullptr;
+		rules |= NORMALIZATION_RULE_DYNAMIC_VIEWPORT_BIT;
+	}
+
+	if (is_dynamic(dynamic_mask, VK_DYNAMIC_STATE_SCISSOR) && vp.pScissors)
+	{
+		vp.pScissors = nullptr;
+		rules |= NORMALIZATION_RULE_DYNAMIC_SCISSOR_BIT;
+	}
+
+	if (rules)
+		state = copy_state(alloc, vp);
+	return rules;
+}
+
+static NormalizationRuleFlags normalize_color_blend_state(ScratchAllocator &alloc,
+                                                          const VkPipelineColorBlendStateCreateInfo *&state,
+                                                          uint32_t dynamic_mask)
+{
+	if (!state)
+		return 0;
+
+	auto cb = *state;
+	NormalizationRuleFlags rules = 0;
+
+	if (!cb.logicOpEnable && canonicalize(cb.logicOp, VK_LOGIC_OP_CLEAR))
+		rules |= NORMALIZATION_RULE_LOGIC_OP_BIT;
+
+	bool reads_constants = false;
+	VkPipelineColorBlendAttachmentState *attachments = nullptr;
+
+	for (uint32_t i = 0; i < cb.attachmentCount; i++)
+	{
+		auto &att = cb.pAttachments[i];
+		if (att.blendEnable)
+		{
+			reads_constants = reads_constants ||
+			                  blend_factor_reads_constants(att.srcColorBlendFactor) ||
+			                  blend_factor_reads_constants(att.dstColorBlendFactor) ||
+			                  blend_factor_reads_constants(att.srcAlphaBlendFactor) ||
+			                  blend_factor_reads_constants(att.dstAlphaBlendFactor);
+			continue;
+		}
+
+		// The write mask still applies without blending.
+		VkPipelineColorBlendAttachmentState canonical = {};
+		canonical.colorWriteMask = att.colorWriteMask;
+		if (memcmp(&att, &canonical, sizeof(canonical)) == 0)
+			continue;
+
+		if (!attachments)
+		{
+			attachments = alloc.allocate_n<VkPipelineColorBlendAttachmentState>(cb.attachmentCount);
+			std::copy(cb.pAttachments, cb.pAttachments + cb.attachmentCount, attachments);
+		}
+		attachments[i] = canonical;
+		rules |= NORMALIZATION_RULE_BLEND_ATTACHMENT_BIT;
+	}
+
+	if (attachments)
+		cb.pAttachments = attachments;
+
+	if (!reads_constants || is_dynamic(dynamic_mask, VK_DYNAMIC_STATE_BLEND_CONSTANTS))
+	{
+		bool changed = false;
+		for (auto &blend_constant : cb.blendConstants)
+			changed |= canonicalize(blend_constant, 0.0f);
+		if (changed)
+			rules |= NORMALIZATION_RULE_BLEND_CONSTANTS_BIT;
+	}
+
+	if (rules)
+		state = copy_state(alloc, cb);
+	return rules;
+}
+
+bool normalize_graphics_pipeline(ScratchAllocator &alloc, const VkGraphicsPipelineCreateInfo &create_info,
+                                 VkGraphicsPipelineCreateInfo *normalized, NormalizationRuleFlags *applied_rules)
+{
+	if (applied_rules)
+		*applied_rules = 0;
+
+	// Unknown extension structs or dynamic state might re-enable state which the rules consider ignored.
+	uint32_t dynamic_mask = 0;
+	if (create_info.pNext || !parse_dynamic_state(create_info.pDynamicState, &dynamic_mask))
+	{
+		*normalized = create_info;
+		return false;
+	}
+
+	auto info = create_info;
+	NormalizationRuleFlags rules = 0;
+
+	if ((info.flags & VK_PIPELINE_CREATE_DERIVATIVE_BIT) == 0)
+	{
+		bool changed = false;
+		changed |= canonicalize(info.basePipelineHandle, VkPipeline(VK_NULL_HANDLE));
+		changed |= canonicalize(info.basePipelineIndex, int32_t(-1));
+		if (changed)
+			rules |= NORMALIZATION_RULE_BASE_PIPELINE_BIT;
+	}
+
+	VkShaderStageFlags stages = 0;
+	for (uint32_t i = 0; i < info.stageCount; i++)
+		stages |= info.pStages[i].stage;
+
+	const VkShaderStageFlags tessellation_stages =
+			VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT | VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT;
+	if ((stages & tessellation_stages) != tessellation_stages && info.pTessellationState)
+	{
+		info.pTessellationState = nullptr;
+		rules |= NORMALIZATION_RULE_TESSELLATION_BIT;
+	}
+
+	if (info.pRasterizationState && info.pRasterizationState->rasterizerDiscardEnable)
+	{
+		if (info.pViewportState || info.pMultisampleState || info.pDepthStencilState || info.pColorBlendState)
+			rules |= NORMALIZATION_RULE_RASTERIZER_DISCARD_BIT;
+
+		info.pViewportState = nullptr;
+		info.pMultisampleState = nullptr;
+		info.pDepthStencilState = nullptr;
+		info.pColorBlendState = nullptr;
+	}
+
+	rules |= normalize_rasterization_state(alloc, info.pRasterizationState, dynamic_mask);
+	rules |= normalize_depth_stencil_state(alloc, info.pDepthStencilState, dynamic_mask);
+	rules |= normalize_multisample_state(alloc, info.pMultisampleState);
+	rules |= normalize_viewport_state(alloc, info.pViewportState, dynamic_mask);
+	rules |= normalize_color_blend_state(alloc, info.pColorBlendState, dynamic_mask);
+	rules |= normalize_dynamic_state(alloc, info.pDynamicState);
+
+	*normalized = info;
+	if (applied_rules)
+		*applied_rules = rules;
+	return true;
+}
+}
@@ -0,0 +1,83 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "fossilize.hpp"
+
+// Canonicalizes create infos by resetting state which the specification says is ignored,
+// so that create infos which can only produce the same pipeline also hash the same.
+namespace Fossilize
+{
+enum
+{
+	// Must be bumped whenever a rule is added or changed,
+	// since hashes of normalized create infos are not stable across versions.
+	FOSSILIZE_NORMALIZATION_VERSION = 1
+};
+
+enum NormalizationRuleBits
+{
+	// basePipelineHandle and basePipelineIndex without VK_PIPELINE_CREATE_DERIVATIVE_BIT.
+	NORMALIZATION_RULE_BASE_PIPELINE_BIT = 1 << 0,
+	// Order and duplicates in pDynamicStates, and empty dynamic state.
+	NORMALIZATION_RULE_DYNAMIC_STATE_LIST_BIT = 1 << 1,
+	// pViewports with VK_DYNAMIC_STATE_VIEWPORT.
+	NORMALIZATION_RULE_DYNAMIC_VIEWPORT_BIT = 1 << 2,
+	// pScissors with VK_DYNAMIC_STATE_SCISSOR.
+	NORMALIZATION_RULE_DYNAMIC_SCISSOR_BIT = 1 << 3,
+	// lineWidth with VK_DYNAMIC_STATE_LINE_WIDTH.
+	NORMALIZATION_RULE_LINE_WIDTH_BIT = 1 << 4,
+	// Depth bias factors without depthBiasEnable or with VK_DYNAMIC_STATE_DEPTH_BIAS.
+	NORMALIZATION_RULE_DEPTH_BIAS_BIT = 1 << 5,
+	// depthCompareOp and depthWriteEnable without depthTestEnable.
+	NORMALIZATION_RULE_DEPTH_TEST_BIT = 1 << 6,
+	// Depth bounds without depthBoundsTestEnable or with VK_DYNAMIC_STATE_DEPTH_BOUNDS.
+	NORMALIZATION_RULE_DEPTH_BOUNDS_BIT = 1 << 7,
+	// Stencil state without stencilTestEnable, and dynamic masks and references.
+	NORMALIZATION_RULE_STENCIL_BIT = 1 << 8,
+	// minSampleShading without sampleShadingEnable.
+	NORMALIZATION_RULE_SAMPLE_SHADING_BIT = 1 << 9,
+	// pSampleMask bits beyond rasterizationSamples, and all-ones masks, which are equivalent to NULL.
+	NORMALIZATION_RULE_SAMPLE_MASK_BIT = 1 << 10,
+	// logicOp without logicOpEnable.
+	NORMALIZATION_RULE_LOGIC_OP_BIT = 1 << 11,
+	// Blend factors and operations of attachments without blendEnable.
+	NORMALIZATION_RULE_BLEND_ATTACHMENT_BIT = 1 << 12,
+	// blendConstants if no attachment reads them or with VK_DYNAMIC_STATE_BLEND_CONSTANTS.
+	NORMALIZATION_RULE_BLEND_CONSTANTS_BIT = 1 << 13,
+	// Viewport, multisample, depth-stencil and color blend state with rasterizerDiscardEnable.
+	NORMALIZATION_RULE_RASTERIZER_DISCARD_BIT = 1 << 14,
+	// pTessellationState without tessellation shader stages.
+	NORMALIZATION_RULE_TESSELLATION_BIT = 1 << 15
+};
+using NormalizationRuleFlags = uint32_t;
+
+// Writes a normalized version of create_info to normalized, which may alias create_info.
+// Only sub-state which is modified is copied, using alloc. Everything else still points into create_info.
+// Rules which modified anything are written to applied_rules if not nullptr.
+// Returns false, leaving create_info unmodified, if it contains state the rules are unaware of,
+// e.g. dynamic state which could make the rules unsound.
+bool normalize_graphics_pipeline(ScratchAllocator &alloc, const VkGraphicsPipelineCreateInfo &create_info,
+                                 VkGraphicsPipelineCreateInfo *normalized,
+                                 NormalizationRuleFlags *applied_rules = nullptr);
+}
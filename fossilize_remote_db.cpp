@@ -0,0 +1,382 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "fossilize_remote_db.hpp"
+#include "path.hpp"
+#include "layer/utils.hpp"
+#include <memory>
+#include <vector>
+#include <unordered_set>
+#include <algorithm>
+#include <string.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+namespace Fossilize
+{
+#ifndef _WIN32
+#ifdef MSG_NOSIGNAL
+static const int RemoteSendFlags = MSG_NOSIGNAL;
+#else
+static const int RemoteSendFlags = 0;
+#endif
+
+bool remote_database_send_all(int fd, const void *data, size_t size)
+{
+	auto *ptr = static_cast<const uint8_t *>(data);
+	while (size != 0)
+	{
+		ssize_t ret = ::send(fd, ptr, size, RemoteSendFlags);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+
+		ptr += ret;
+		size -= size_t(ret);
+	}
+
+	return true;
+}
+
+bool remote_database_recv_all(int fd, void *data, size_t size)
+{
+	auto *ptr = static_cast<uint8_t *>(data);
+	while (size != 0)
+	{
+		ssize_t ret = ::recv(fd, ptr, size, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+
+		ptr += ret;
+		size -= size_t(ret);
+	}
+
+	return true;
+}
+#endif
+
+std::string get_default_remote_database_socket_path()
+{
+#ifdef _WIN32
+	return "";
+#else
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if (runtime_dir && *runtime_dir)
+		return Path::join(runtime_dir, "fossilize.sock");
+	else
+		return std::string("/tmp/fossilize-") + std::to_string(getuid()) + ".sock";
+#endif
+}
+
+struct RemoteDatabase : DatabaseInterface
+{
+	RemoteDatabase(const char *socket_path_, const char *base_path_, const char *extra_paths_)
+		: DatabaseInterface(DatabaseMode::Append),
+		  socket_path(socket_path_ ? socket_path_ : ""),
+		  base_path(base_path_ ? base_path_ : ""),
+		  extra_paths(extra_paths_ ? extra_paths_ : "")
+	{
+		// The daemon has its own working directory, so make sure it gets absolute paths.
+		if (!base_path.empty() && !Path::is_abspath(base_path))
+			base_path = Path::join(get_working_directory(), base_path);
+	}
+
+	~RemoteDatabase()
+	{
+		// The daemon flushes by itself when we disconnect.
+		disconnect();
+	}
+
+	static std::string get_working_directory()
+	{
+#ifdef _WIN32
+		return ".";
+#else
+		char buffer[4096];
+		if (!getcwd(buffer, sizeof(buffer)))
+			return ".";
+		return buffer;
+#endif
+	}
+
+	bool connect_to_daemon()
+	{
+#ifdef _WIN32
+		return false;
+#else
+		if (socket_path.empty())
+			return false;
+
+		struct sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		if (socket_path.size() >= sizeof(addr.sun_path))
+		{
+			LOGE("Socket path for recording daemon is too long: %s\n", socket_path.c_str());
+			return false;
+		}
+		memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+		fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			return false;
+
+#if defined(SO_NOSIGPIPE)
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+		if (::connect(fd, reinterpret_cast<const struct sockaddr *>(&addr), sizeof(addr)) < 0)
+		{
+			::close(fd);
+			fd = -1;
+			return false;
+		}
+
+		std::vector<uint8_t> payload;
+		payload.insert(payload.end(), base_path.begin(), base_path.end());
+		payload.push_back('\0');
+		payload.insert(payload.end(), extra_paths.begin(), extra_paths.end());
+		payload.push_back('\0');
+
+		if (!transact(REMOTE_DATABASE_COMMAND_OPEN, RESOURCE_APPLICATION_INFO, 0, 0, payload.data(), payload.size()))
+		{
+			LOGE("Recording daemon at %s refused to open database %s.\n", socket_path.c_str(), base_path.c_str());
+			disconnect();
+			return false;
+		}
+
+		return true;
+#endif
+	}
+
+	void disconnect()
+	{
+#ifndef _WIN32
+		if (fd >= 0)
+			::close(fd);
+		fd = -1;
+#endif
+	}
+
+	// Returns false if the request could not be completed, or the daemon reported a failure.
+	// io_error is set if the connection itself is broken.
+	bool transact(RemoteDatabaseCommand command, ResourceTag tag, Hash hash, PayloadWriteFlags flags,
+	              const void *payload, size_t payload_size, bool *io_error = nullptr)
+	{
+#ifdef _WIN32
+		(void)command;
+		(void)tag;
+		(void)hash;
+		(void)flags;
+		(void)payload;
+		(void)payload_size;
+		if (io_error)
+			*io_error = true;
+		return false;
+#else
+		if (io_error)
+			*io_error = false;
+
+		if (payload_size > RemoteDatabaseMaxPayloadSize)
+			return false;
+
+		RemoteDatabaseMessage msg = {};
+		msg.command = command;
+		msg.tag = tag;
+		msg.hash = hash;
+		msg.flags = flags;
+		msg.payload_size = uint32_t(payload_size);
+
+		uint32_t status = 0;
+		if (!remote_database_send_all(fd, &msg, sizeof(msg)) ||
+		    (payload_size && !remote_database_send_all(fd, payload, payload_size)) ||
+		    !remote_database_recv_all(fd, &status, sizeof(status)))
+		{
+			if (io_error)
+				*io_error = true;
+			return false;
+		}
+
+		return status != 0;
+#endif
+	}
+
+	bool use_fallback()
+	{
+		if (!fallback)
+		{
+			if (is_remote)
+				LOGE("Lost connection to recording daemon, falling back to in-process recording.\n");
+			disconnect();
+			is_remote = false;
+
+			fallback.reset(create_concurrent_database_with_encoded_extra_paths(
+					base_path.c_str(), DatabaseMode::Append, extra_paths.empty() ? nullptr : extra_paths.c_str()));
+			if (!fallback->prepare())
+			{
+				LOGE("Failed to prepare fallback database.\n");
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	bool prepare() override
+	{
+		if (has_prepared)
+			return true;
+		has_prepared = true;
+
+		if (connect_to_daemon())
+		{
+			is_remote = true;
+			return true;
+		}
+		else
+			return use_fallback();
+	}
+
+	bool read_entry(ResourceTag, Hash, size_t *, void *, PayloadReadFlags) override
+	{
+		return false;
+	}
+
+	bool write_entry(ResourceTag tag, Hash hash, const void *blob, size_t blob_size, PayloadWriteFlags flags) override
+	{
+		if (known_hashes[tag].count(hash))
+			return true;
+
+		if (is_remote)
+		{
+			bool io_error;
+			if (transact(REMOTE_DATABASE_COMMAND_WRITE_ENTRY, tag, hash, flags, blob, blob_size, &io_error))
+			{
+				known_hashes[tag].insert(hash);
+				return true;
+			}
+			else if (!io_error)
+				return false;
+		}
+
+		if (!use_fallback())
+			return false;
+
+		if (fallback->write_entry(tag, hash, blob, blob_size, flags))
+		{
+			known_hashes[tag].insert(hash);
+			return true;
+		}
+		else
+			return false;
+	}
+
+	bool has_entry(ResourceTag tag, Hash hash) override
+	{
+		if (!test_resource_filter(tag, hash))
+			return false;
+		if (known_hashes[tag].count(hash))
+			return true;
+
+		if (is_remote)
+		{
+			bool io_error;
+			if (transact(REMOTE_DATABASE_COMMAND_HAS_ENTRY, tag, hash, 0, nullptr, 0, &io_error))
+			{
+				// Another process (or the read-only archive) already provided this entry.
+				known_hashes[tag].insert(hash);
+				return true;
+			}
+			else if (!io_error)
+				return false;
+		}
+
+		return use_fallback() && fallback->has_entry(tag, hash);
+	}
+
+	bool get_hash_list_for_resource_tag(ResourceTag tag, size_t *num_hashes, Hash *hashes) override
+	{
+		if (fallback)
+			return fallback->get_hash_list_for_resource_tag(tag, num_hashes, hashes);
+
+		// We only know about the entries this process has observed.
+		if (hashes)
+		{
+			if (*num_hashes != known_hashes[tag].size())
+				return false;
+			std::copy(known_hashes[tag].begin(), known_hashes[tag].end(), hashes);
+			std::sort(hashes, hashes + *num_hashes);
+		}
+		else
+			*num_hashes = known_hashes[tag].size();
+
+		return true;
+	}
+
+	void flush() override
+	{
+		if (is_remote)
+		{
+			bool io_error;
+			if (!transact(REMOTE_DATABASE_COMMAND_FLUSH, RESOURCE_APPLICATION_INFO, 0, 0, nullptr, 0, &io_error) && io_error)
+				use_fallback();
+		}
+
+		if (fallback)
+			fallback->flush();
+	}
+
+	const char *get_db_path_for_hash(ResourceTag tag, Hash hash) override
+	{
+		if (fallback)
+			return fallback->get_db_path_for_hash(tag, hash);
+		return nullptr;
+	}
+
+	std::string socket_path;
+	std::string base_path;
+	std::string extra_paths;
+	std::unique_ptr<DatabaseInterface> fallback;
+	std::unordered_set<Hash> known_hashes[RESOURCE_COUNT];
+#ifndef _WIN32
+	int fd = -1;
+#endif
+	bool is_remote = false;
+	bool has_prepared = false;
+};
+
+DatabaseInterface *create_remote_database(const char *socket_path, const char *base_path,
+                                          const char *encoded_read_only_database_paths)
+{
+	return new RemoteDatabase(socket_path, base_path, encoded_read_only_database_paths);
+}
+}
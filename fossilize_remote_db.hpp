@@ -0,0 +1,81 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "fossilize_db.hpp"
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+namespace Fossilize
+{
+// Wire protocol used between layer instances and the fossilize-daemon recording service.
+// Every request is a RemoteDatabaseMessage followed by payload_size bytes of payload.
+// Every request is answered with a single uint32_t status, 1 for success, 0 for failure.
+enum RemoteDatabaseCommand
+{
+	// Payload is the NUL-terminated base path for the concurrent database,
+	// followed by the NUL-terminated encoded read-only paths.
+	REMOTE_DATABASE_COMMAND_OPEN = 1,
+	// No payload. Status is 1 if the entry is known to the daemon.
+	REMOTE_DATABASE_COMMAND_HAS_ENTRY = 2,
+	// Payload is the blob. flags is PayloadWriteFlags.
+	REMOTE_DATABASE_COMMAND_WRITE_ENTRY = 3,
+	// No payload.
+	REMOTE_DATABASE_COMMAND_FLUSH = 4,
+	REMOTE_DATABASE_COMMAND_MAX_ENUM = 0x7fffffff
+};
+
+struct RemoteDatabaseMessage
+{
+	uint32_t command;
+	uint32_t tag;
+	uint64_t hash;
+	uint32_t flags;
+	uint32_t payload_size;
+};
+static_assert(sizeof(RemoteDatabaseMessage) == 24, "Unexpected size of RemoteDatabaseMessage.");
+
+// Payloads larger than this are rejected by the daemon.
+static const uint32_t RemoteDatabaseMaxPayloadSize = 256 * 1024 * 1024;
+
+#ifndef _WIN32
+// Helpers to transfer an entire buffer over a socket, retrying on short reads/writes and EINTR.
+bool remote_database_send_all(int fd, const void *data, size_t size);
+bool remote_database_recv_all(int fd, void *data, size_t size);
+#endif
+
+// Returns the socket path used by default, $XDG_RUNTIME_DIR/fossilize.sock,
+// or /tmp/fossilize-$UID.sock if XDG_RUNTIME_DIR is not set.
+std::string get_default_remote_database_socket_path();
+
+// Creates a database which forwards all writes to a fossilize-daemon process listening on socket_path.
+// The daemon deduplicates and writes entries for every process connected to it,
+// so multiple processes recording to the same base_path end up sharing a single base_path.%d.foz.
+// Only hashes are sent until the daemon reports an entry as missing, at which point the payload is sent.
+// If no daemon can be reached in prepare(), or the connection breaks later,
+// the database falls back to an in-process create_concurrent_database_with_encoded_extra_paths().
+// Only DatabaseMode::Append is supported. Not supported on Windows, where the fallback is always used.
+DatabaseInterface *create_remote_database(const char *socket_path, const char *base_path,
+                                          const char *encoded_read_only_database_paths);
+}
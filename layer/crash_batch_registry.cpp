@@ -0,0 +1,121 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "crash_batch_registry.hpp"
+#include <atomic>
+#include <thread>
+
+namespace Fossilize
+{
+// Enough for every application thread to have a batch in flight.
+static const unsigned MaxCrashBatches = 64;
+
+enum CrashBatchState : uint32_t
+{
+	CRASH_BATCH_FREE = 0,
+	CRASH_BATCH_CLAIMED,
+	CRASH_BATCH_PUBLISHED,
+	CRASH_BATCH_RECORDING
+};
+
+struct CrashBatch
+{
+	std::atomic<uint32_t> state;
+	StateRecorder *recorder;
+	const VkGraphicsPipelineCreateInfo *graphicsInfos;
+	const VkComputePipelineCreateInfo *computeInfos;
+	uint32_t count;
+};
+
+// Zero-initialized, so every slot starts out free without any constructor running.
+static CrashBatch crashBatches[MaxCrashBatches];
+
+int registerCrashBatch(StateRecorder *recorder, const VkGraphicsPipelineCreateInfo *graphicsInfos,
+                       const VkComputePipelineCreateInfo *computeInfos, uint32_t count)
+{
+	for (unsigned i = 0; i < MaxCrashBatches; i++)
+	{
+		auto &batch = crashBatches[i];
+		uint32_t expected = CRASH_BATCH_FREE;
+		if (batch.state.compare_exchange_strong(expected, CRASH_BATCH_CLAIMED, std::memory_order_acquire))
+		{
+			batch.recorder = recorder;
+			batch.graphicsInfos = graphicsInfos;
+			batch.computeInfos = computeInfos;
+			batch.count = count;
+			batch.state.store(CRASH_BATCH_PUBLISHED, std::memory_order_release);
+			return int(i);
+		}
+	}
+
+	return -1;
+}
+
+void unregisterCrashBatch(int slot)
+{
+	if (slot < 0)
+		return;
+
+	auto &batch = crashBatches[slot];
+	uint32_t expected = CRASH_BATCH_PUBLISHED;
+	while (!batch.state.compare_exchange_weak(expected, CRASH_BATCH_FREE, std::memory_order_release))
+	{
+		expected = CRASH_BATCH_PUBLISHED;
+		std::this_thread::yield();
+	}
+}
+
+bool recordRegisteredCrashBatches()
+{
+	StateRecorder *recorders[MaxCrashBatches];
+	unsigned recorderCount = 0;
+	bool ret = true;
+
+	for (auto &batch : crashBatches)
+	{
+		uint32_t expected = CRASH_BATCH_PUBLISHED;
+		if (!batch.state.compare_exchange_strong(expected, CRASH_BATCH_RECORDING, std::memory_order_acquire))
+			continue;
+
+		// We cannot know which pipeline in the batch crashed, so record all of them.
+		for (uint32_t i = 0; i < batch.count; i++)
+		{
+			if (batch.graphicsInfos)
+				ret = batch.recorder->record_graphics_pipeline(VK_NULL_HANDLE, batch.graphicsInfos[i], nullptr, 0) && ret;
+			else if (batch.computeInfos)
+				ret = batch.recorder->record_compute_pipeline(VK_NULL_HANDLE, batch.computeInfos[i], nullptr, 0) && ret;
+		}
+
+		bool seen = false;
+		for (unsigned i = 0; i < recorderCount && !seen; i++)
+			seen = recorders[i] == batch.recorder;
+		if (!seen)
+			recorders[recorderCount++] = batch.recorder;
+	}
+
+	// Flush out the recording threads.
+	for (unsigned i = 0; i < recorderCount; i++)
+		recorders[i]->tear_down_recording_thread();
+
+	return recorderCount != 0 && ret;
+}
+}
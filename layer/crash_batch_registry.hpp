@@ -0,0 +1,46 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "fossilize.hpp"
+#include <stdint.h>
+
+namespace Fossilize
+{
+// Pipeline batches which are currently inside vkCreate*Pipelines.
+// Drivers may compile a batch on their own threads, so a crash can happen on a thread which knows nothing
+// about the batch. The registry is a fixed array of atomically claimed slots, so it can be read from a signal handler.
+
+// Exactly one of graphicsInfos and computeInfos is non-null.
+// Returns the claimed slot, or -1 if every slot is in use.
+int registerCrashBatch(StateRecorder *recorder, const VkGraphicsPipelineCreateInfo *graphicsInfos,
+                       const VkComputePipelineCreateInfo *computeInfos, uint32_t count);
+
+// If a crash handler is serializing the batch, this blocks until the process is terminated,
+// so the create infos stay valid for the handler.
+void unregisterCrashBatch(int slot);
+
+// Only to be called when crashing. Serializes every registered batch and flushes their recorders.
+// Returns false if nothing was registered, or serialization failed.
+bool recordRegisteredCrashBatches();
+}
@@ -28,6 +28,7 @@ namespace Fossilize
 {
 class Instance;
 class StateRecorder;
+class HitchProfiler;
 class Device
 {
 public:
@@ -56,6 +57,12 @@ public:
 		return pInstance;
 	}
 
+	// nullptr unless hitch profiling is enabled.
+	HitchProfiler *getHitchProfiler()
+	{
+		return hitchProfiler;
+	}
+
 private:
 	VkPhysicalDevice gpu = VK_NULL_HANDLE;
 	VkDevice device = VK_NULL_HANDLE;
@@ -63,5 +70,6 @@ private:
 	VkLayerDispatchTable *pTable = nullptr;
 	StateRecorder *recorder = nullptr;
 	Instance *pInstance = nullptr;
+	HitchProfiler *hitchProfiler = nullptr;
 };
 }
@@ -24,6 +24,7 @@
 #include "utils.hpp"
 #include "device.hpp"
 #include "instance.hpp"
+#include "hitch_profiler.hpp"
 #include <mutex>
 
 // VALVE: do exports without .def file, see vk_layer.h for definition on non-Windows platforms
@@ -64,6 +65,13 @@ static Device *get_device_layer(VkDevice device)
 	return layer;
 }
 
+static Device *get_device_layer(VkQueue queue)
+{
+	// Queues share the dispatch key of their parent device.
+	lock_guard<mutex> holder{ globalLock };
+	return getLayerData(getDispatchKey(queue), deviceData);
+}
+
 static Instance *get_instance_layer(VkPhysicalDevice gpu)
 {
 	lock_guard<mutex> holder{ globalLock };
@@ -187,7 +195,7 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateGraphicsPipelinesParanoid(Device *la
 
 		// Have to create all pipelines here, in case the application makes use of basePipelineIndex.
 		// Write arguments in TLS in-case we crash here.
-		Instance::braceForGraphicsPipelineCrash(&layer->getRecorder(), &info);
+		Instance::braceForGraphicsPipelineCrash(&layer->getRecorder(), &info, 1);
 		auto res = layer->getTable()->CreateGraphicsPipelines(device, pipelineCache, 1, &info,
 		                                                      pAllocator, &pPipelines[i]);
 		Instance::completedPipelineCompilation();
@@ -206,6 +214,50 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateGraphicsPipelinesParanoid(Device *la
 
 	return VK_SUCCESS;
 }
+
+static bool usesGraphicsBasePipelineIndex(uint32_t createInfoCount, const VkGraphicsPipelineCreateInfo *pCreateInfos)
+{
+	for (uint32_t i = 0; i < createInfoCount; i++)
+	{
+		if ((pCreateInfos[i].flags & VK_PIPELINE_CREATE_DERIVATIVE_BIT) != 0 &&
+		    pCreateInfos[i].basePipelineHandle == VK_NULL_HANDLE &&
+		    pCreateInfos[i].basePipelineIndex >= 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL CreateGraphicsPipelinesBatched(Device *layer,
+                                                                     VkDevice device, VkPipelineCache pipelineCache,
+                                                                     uint32_t createInfoCount,
+                                                                     const VkGraphicsPipelineCreateInfo *pCreateInfos,
+                                                                     const VkAllocationCallbacks *pAllocator,
+                                                                     VkPipeline *pPipelines)
+{
+	// If the application relies on basePipelineIndex, we cannot record the batch without valid handles
+	// in the crash handler, so fall back to unrolling the batch.
+	if (usesGraphicsBasePipelineIndex(createInfoCount, pCreateInfos))
+		return CreateGraphicsPipelinesParanoid(layer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
+
+	// Submit the batch as-is to retain any parallelism in the driver.
+	// If we crash, every create info in the batch is serialized.
+	Instance::braceForGraphicsPipelineCrash(&layer->getRecorder(), pCreateInfos, createInfoCount);
+	auto res = layer->getTable()->CreateGraphicsPipelines(device, pipelineCache, createInfoCount, pCreateInfos,
+	                                                      pAllocator, pPipelines);
+	Instance::completedPipelineCompilation();
+
+	// Record failing pipelines for repro.
+	for (uint32_t i = 0; i < createInfoCount; i++)
+	{
+		if (!layer->getRecorder().record_graphics_pipeline(res == VK_SUCCESS ? pPipelines[i] : VK_NULL_HANDLE, pCreateInfos[i], nullptr, 0))
+			LOGE("Failed to record graphics pipeline.\n");
+	}
+
+	return res;
+}
 #endif
 
 static VKAPI_ATTR VkResult VKAPI_CALL CreateGraphicsPipelines(VkDevice device, VkPipelineCache pipelineCache,
@@ -215,9 +267,13 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateGraphicsPipelines(VkDevice device, V
                                                               VkPipeline *pPipelines)
 {
 	auto *layer = get_device_layer(device);
+	auto *hitchProfiler = layer->getHitchProfiler();
+	uint64_t startNs = hitchProfiler ? HitchProfiler::getTimeNs() : 0;
 
 #ifdef FOSSILIZE_LAYER_CAPTURE_SIGSEGV
-	if (layer->getInstance()->capturesCrashes())
+	if (layer->getInstance()->capturesCrashesBatched())
+		CreateGraphicsPipelinesBatched(layer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
+	else if (layer->getInstance()->capturesCrashes())
 		CreateGraphicsPipelinesParanoid(layer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
 	else
 		CreateGraphicsPipelinesNormal(layer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
@@ -225,6 +281,9 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateGraphicsPipelines(VkDevice device, V
 	CreateGraphicsPipelinesNormal(layer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
 #endif
 
+	if (hitchProfiler)
+		hitchProfiler->endGraphicsPipelineCreation(pCreateInfos, pPipelines, createInfoCount, startNs);
+
 	return VK_SUCCESS;
 }
 
@@ -271,7 +330,7 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateComputePipelinesParanoid(Device *lay
 
 		// Have to create all pipelines here, in case the application makes use of basePipelineIndex.
 		// Write arguments in TLS in-case we crash here.
-		Instance::braceForComputePipelineCrash(&layer->getRecorder(), &info);
+		Instance::braceForComputePipelineCrash(&layer->getRecorder(), &info, 1);
 		auto res = layer->getTable()->CreateComputePipelines(device, pipelineCache, 1, &info,
 		                                                     pAllocator, &pPipelines[i]);
 		Instance::completedPipelineCompilation();
@@ -290,6 +349,50 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateComputePipelinesParanoid(Device *lay
 
 	return VK_SUCCESS;
 }
+
+static bool usesComputeBasePipelineIndex(uint32_t createInfoCount, const VkComputePipelineCreateInfo *pCreateInfos)
+{
+	for (uint32_t i = 0; i < createInfoCount; i++)
+	{
+		if ((pCreateInfos[i].flags & VK_PIPELINE_CREATE_DERIVATIVE_BIT) != 0 &&
+		    pCreateInfos[i].basePipelineHandle == VK_NULL_HANDLE &&
+		    pCreateInfos[i].basePipelineIndex >= 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL CreateComputePipelinesBatched(Device *layer,
+                                                                    VkDevice device, VkPipelineCache pipelineCache,
+                                                                    uint32_t createInfoCount,
+                                                                    const VkComputePipelineCreateInfo *pCreateInfos,
+                                                                    const VkAllocationCallbacks *pAllocator,
+                                                                    VkPipeline *pPipelines)
+{
+	// If the application relies on basePipelineIndex, we cannot record the batch without valid handles
+	// in the crash handler, so fall back to unrolling the batch.
+	if (usesComputeBasePipelineIndex(createInfoCount, pCreateInfos))
+		return CreateComputePipelinesParanoid(layer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
+
+	// Submit the batch as-is to retain any parallelism in the driver.
+	// If we crash, every create info in the batch is serialized.
+	Instance::braceForComputePipelineCrash(&layer->getRecorder(), pCreateInfos, createInfoCount);
+	auto res = layer->getTable()->CreateComputePipelines(device, pipelineCache, createInfoCount, pCreateInfos,
+	                                                     pAllocator, pPipelines);
+	Instance::completedPipelineCompilation();
+
+	// Record failing pipelines for repro.
+	for (uint32_t i = 0; i < createInfoCount; i++)
+	{
+		if (!layer->getRecorder().record_compute_pipeline(res == VK_SUCCESS ? pPipelines[i] : VK_NULL_HANDLE, pCreateInfos[i], nullptr, 0))
+			LOGE("Failed to record compute pipeline.\n");
+	}
+
+	return res;
+}
 #endif
 
 static VKAPI_ATTR VkResult VKAPI_CALL CreateComputePipelines(VkDevice device, VkPipelineCache pipelineCache,
@@ -299,9 +402,13 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateComputePipelines(VkDevice device, Vk
                                                              VkPipeline *pPipelines)
 {
 	auto *layer = get_device_layer(device);
+	auto *hitchProfiler = layer->getHitchProfiler();
+	uint64_t startNs = hitchProfiler ? HitchProfiler::getTimeNs() : 0;
 
 #ifdef FOSSILIZE_LAYER_CAPTURE_SIGSEGV
-	if (layer->getInstance()->capturesCrashes())
+	if (layer->getInstance()->capturesCrashesBatched())
+		CreateComputePipelinesBatched(layer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
+	else if (layer->getInstance()->capturesCrashes())
 		CreateComputePipelinesParanoid(layer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
 	else
 		CreateComputePipelinesNormal(layer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
@@ -309,6 +416,9 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateComputePipelines(VkDevice device, Vk
 	CreateComputePipelinesNormal(layer, device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
 #endif
 
+	if (hitchProfiler)
+		hitchProfiler->endComputePipelineCreation(pCreateInfos, pPipelines, createInfoCount, startNs);
+
 	return VK_SUCCESS;
 }
 
@@ -367,15 +477,27 @@ static PFN_vkVoidFunction interceptCoreInstanceCommand(const char *pName)
 
 static VKAPI_ATTR void VKAPI_CALL DestroyDevice(VkDevice device, const VkAllocationCallbacks *pAllocator)
 {
+	// Don't hold the global lock while writing the report.
+	auto *hitchProfiler = get_device_layer(device)->getHitchProfiler();
+	if (hitchProfiler)
+		hitchProfiler->writeReport();
+
 	lock_guard<mutex> holder{ globalLock };
 
 	void *key = getDispatchKey(device);
 	auto *layer = getLayerData(key, deviceData);
-
 	layer->getTable()->DestroyDevice(device, pAllocator);
 	destroyLayerData(key, deviceData);
 }
 
+// Only returned from vkGetDeviceProcAddr when hitch profiling is enabled for the device.
+static VKAPI_ATTR VkResult VKAPI_CALL QueuePresentKHR(VkQueue queue, const VkPresentInfoKHR *pPresentInfo)
+{
+	auto *layer = get_device_layer(queue);
+	layer->getHitchProfiler()->notifyPresent();
+	return layer->getTable()->QueuePresentKHR(queue, pPresentInfo);
+}
+
 static VKAPI_ATTR VkResult VKAPI_CALL CreateSampler(VkDevice device, const VkSamplerCreateInfo *pCreateInfo,
                                                     const VkAllocationCallbacks *pCallbacks, VkSampler *pSampler)
 {
@@ -399,12 +521,17 @@ static VKAPI_ATTR VkResult VKAPI_CALL CreateShaderModule(VkDevice device, const
 
 	*pShaderModule = VK_NULL_HANDLE;
 
+	auto *hitchProfiler = layer->getHitchProfiler();
+	uint64_t startNs = hitchProfiler ? HitchProfiler::getTimeNs() : 0;
+
 	auto res = layer->getTable()->CreateShaderModule(device, pCreateInfo, pCallbacks, pShaderModule);
 
 	if (res == VK_SUCCESS)
 	{
 		if (!layer->getRecorder().record_shader_module(*pShaderModule, *pCreateInfo))
 			LOGE("Failed to record shader module.\n");
+		if (hitchProfiler)
+			hitchProfiler->endShaderModuleCreation(*pShaderModule, startNs);
 	}
 
 	return res;
@@ -467,6 +594,10 @@ VK_LAYER_EXPORT VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL VK_LAYER_fossilize_GetD
 		layer = getLayerData(getDispatchKey(device), deviceData);
 	}
 
+	// Avoid the overhead on every present unless we need it.
+	if (layer->getHitchProfiler() && strcmp(pName, "vkQueuePresentKHR") == 0)
+		return reinterpret_cast<PFN_vkVoidFunction>(QueuePresentKHR);
+
 	return layer->getTable()->GetDeviceProcAddr(device, pName);
 }
 
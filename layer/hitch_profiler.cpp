@@ -0,0 +1,391 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "hitch_profiler.hpp"
+#include "fossilize_db.hpp"
+#include "fossilize_inttypes.h"
+#include "utils.hpp"
+#include <chrono>
+#include <memory>
+#include <unordered_set>
+#include <stdio.h>
+
+namespace Fossilize
+{
+// Don't grow without bounds if the application never presents.
+static const size_t MaxEventsPerFrame = 4096;
+// Keep the report compact over long sessions.
+static const size_t MaxHitches = 4096;
+// Relative hitch detection needs a stable average first.
+static const uint64_t WarmupFrames = 16;
+// Don't rewrite the report more often than this.
+static const uint64_t ReportIntervalNs = 5000000000ull;
+// Same limit as for concurrent databases.
+static const unsigned MaxReportIndex = 256;
+
+template <typename T>
+static inline uint64_t handleToU64(T handle)
+{
+	// reinterpret_cast does not work reliably on MSVC 2013 for Vulkan objects.
+	return (uint64_t)handle;
+}
+
+HitchProfiler::HitchProfiler(std::string reportBasePath_, double thresholdMs)
+	: reportBasePath(std::move(reportBasePath_)), thresholdNs(uint64_t(thresholdMs * 1e6))
+{
+	reportThread = std::thread(&HitchProfiler::reportThreadMain, this);
+}
+
+HitchProfiler::~HitchProfiler()
+{
+	{
+		std::lock_guard<std::mutex> holder(reportLock);
+		stopping = true;
+		reportCond.notify_one();
+	}
+
+	if (reportThread.joinable())
+		reportThread.join();
+
+	// The recorder is gone by now, so every object which could be hashed has been.
+	writeReport();
+}
+
+uint64_t HitchProfiler::getTimeNs()
+{
+	auto t = std::chrono::steady_clock::now();
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count());
+}
+
+uint64_t HitchProfiler::on_object_enqueued(ResourceTag tag, uint64_t handle)
+{
+	if (tag != RESOURCE_SHADER_MODULE && tag != RESOURCE_GRAPHICS_PIPELINE && tag != RESOURCE_COMPUTE_PIPELINE)
+		return 0;
+
+	std::lock_guard<std::mutex> holder(lock);
+	uint64_t cookie = ++nextCookie;
+	cookieToHash[cookie] = { 0, 1 };
+
+	// A handle can only be reused once the previous object is destroyed, so the latest cookie is the live one.
+	// Failed pipelines all share VK_NULL_HANDLE, so the previous cookie is dropped here as well.
+	auto &slot = tag == RESOURCE_SHADER_MODULE ? shaderModuleCookies[handle] : pendingPipelineCookies[handle];
+	releaseCookie(slot);
+	slot = cookie;
+
+	return cookie;
+}
+
+void HitchProfiler::on_object_hashed(uint64_t cookie, Hash hash)
+{
+	std::lock_guard<std::mutex> holder(lock);
+	// Pipelines created outside of hitches are forgotten.
+	auto itr = cookieToHash.find(cookie);
+	if (itr != end(cookieToHash))
+		itr->second.hash = hash;
+}
+
+uint64_t HitchProfiler::retainCookie(uint64_t cookie)
+{
+	auto itr = cookieToHash.find(cookie);
+	if (itr != end(cookieToHash))
+		itr->second.refCount++;
+	return cookie;
+}
+
+void HitchProfiler::releaseCookie(uint64_t cookie)
+{
+	auto itr = cookieToHash.find(cookie);
+	if (itr != end(cookieToHash) && --itr->second.refCount == 0)
+		cookieToHash.erase(itr);
+}
+
+// The reference held by pendingPipelineCookies is transferred to the caller.
+uint64_t HitchProfiler::takePipelineCookie(VkPipeline pipeline)
+{
+	auto itr = pendingPipelineCookies.find(handleToU64(pipeline));
+	if (itr == end(pendingPipelineCookies))
+		return 0;
+
+	uint64_t cookie = itr->second;
+	pendingPipelineCookies.erase(itr);
+	return cookie;
+}
+
+uint64_t HitchProfiler::getShaderModuleCookie(VkShaderModule module)
+{
+	auto itr = shaderModuleCookies.find(handleToU64(module));
+	return itr != end(shaderModuleCookies) ? itr->second : 0;
+}
+
+void HitchProfiler::releaseEvent(const CreationEvent &event)
+{
+	// Shader module cookies survive as long as the module is live, since later pipelines can refer to it.
+	releaseCookie(event.cookie);
+	for (auto &moduleCookie : event.moduleCookies)
+		releaseCookie(moduleCookie);
+}
+
+void HitchProfiler::releaseEvents(const std::vector<CreationEvent> &events)
+{
+	for (auto &event : events)
+		releaseEvent(event);
+}
+
+void HitchProfiler::addEvent(CreationEvent event)
+{
+	if (currentFrameEvents.size() < MaxEventsPerFrame)
+		currentFrameEvents.push_back(std::move(event));
+	else
+		releaseEvent(event);
+}
+
+void HitchProfiler::endShaderModuleCreation(VkShaderModule module, uint64_t startNs)
+{
+	uint64_t duration = getTimeNs() - startNs;
+	std::lock_guard<std::mutex> holder(lock);
+	addEvent({ RESOURCE_SHADER_MODULE, retainCookie(getShaderModuleCookie(module)), duration, {} });
+}
+
+void HitchProfiler::endGraphicsPipelineCreation(const VkGraphicsPipelineCreateInfo *infos, const VkPipeline *pipelines,
+                                                uint32_t count, uint64_t startNs)
+{
+	uint64_t duration = getTimeNs() - startNs;
+	std::lock_guard<std::mutex> holder(lock);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		// Failed pipelines are not reported, but were still recorded.
+		if (pipelines[i] == VK_NULL_HANDLE)
+		{
+			releaseCookie(takePipelineCookie(VK_NULL_HANDLE));
+			continue;
+		}
+
+		CreationEvent event = { RESOURCE_GRAPHICS_PIPELINE, takePipelineCookie(pipelines[i]), duration, {} };
+		for (uint32_t stage = 0; stage < infos[i].stageCount; stage++)
+			event.moduleCookies.push_back(retainCookie(getShaderModuleCookie(infos[i].pStages[stage].module)));
+		addEvent(std::move(event));
+	}
+}
+
+void HitchProfiler::endComputePipelineCreation(const VkComputePipelineCreateInfo *infos, const VkPipeline *pipelines,
+                                               uint32_t count, uint64_t startNs)
+{
+	uint64_t duration = getTimeNs() - startNs;
+	std::lock_guard<std::mutex> holder(lock);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (pipelines[i] == VK_NULL_HANDLE)
+		{
+			releaseCookie(takePipelineCookie(VK_NULL_HANDLE));
+			continue;
+		}
+
+		CreationEvent event = { RESOURCE_COMPUTE_PIPELINE, takePipelineCookie(pipelines[i]), duration, {} };
+		event.moduleCookies.push_back(retainCookie(getShaderModuleCookie(infos[i].stage.module)));
+		addEvent(std::move(event));
+	}
+}
+
+void HitchProfiler::notifyPresent()
+{
+	uint64_t now = getTimeNs();
+	bool requestReport = false;
+
+	{
+		std::lock_guard<std::mutex> holder(lock);
+
+		bool keepEvents = false;
+		if (lastPresentNs != 0)
+		{
+			uint64_t frameTimeNs = now - lastPresentNs;
+
+			bool isHitch;
+			if (thresholdNs != 0)
+				isHitch = frameTimeNs > thresholdNs;
+			else
+				isHitch = frameIndex > WarmupFrames && double(frameTimeNs) > 2.0 * averageFrameTimeNs;
+
+			// Hitches are not included in the average, or a burst of hitches would hide itself.
+			if (!isHitch)
+			{
+				if (averageFrameTimeNs == 0.0)
+					averageFrameTimeNs = double(frameTimeNs);
+				else
+					averageFrameTimeNs = 0.95 * averageFrameTimeNs + 0.05 * double(frameTimeNs);
+			}
+
+			// We only care about hitches where we created something, other hitches are not our business.
+			if (isHitch && !currentFrameEvents.empty() && hitches.size() < MaxHitches)
+			{
+				hitches.push_back({ frameIndex, frameTimeNs, std::move(currentFrameEvents) });
+				hasNewHitches = true;
+				keepEvents = true;
+			}
+		}
+
+		if (!keepEvents)
+			releaseEvents(currentFrameEvents);
+		currentFrameEvents.clear();
+		lastPresentNs = now;
+		frameIndex++;
+
+		if (hasNewHitches && now - lastReportNs > ReportIntervalNs)
+		{
+			requestReport = true;
+			lastReportNs = now;
+		}
+	}
+
+	if (requestReport)
+	{
+		std::lock_guard<std::mutex> holder(reportLock);
+		reportRequested = true;
+		reportCond.notify_one();
+	}
+}
+
+void HitchProfiler::reportThreadMain()
+{
+	std::unique_lock<std::mutex> holder(reportLock);
+	for (;;)
+	{
+		reportCond.wait(holder, [this]() -> bool {
+			return stopping || reportRequested;
+		});
+
+		if (stopping)
+			break;
+
+		reportRequested = false;
+		holder.unlock();
+		writeReport();
+		holder.lock();
+	}
+}
+
+bool HitchProfiler::openReport()
+{
+	if (!reportPath.empty())
+		return true;
+
+	// Claim an index nobody else uses, so reports from earlier sessions are kept.
+	for (unsigned index = 1; index < MaxReportIndex; index++)
+	{
+		std::string path = reportBasePath + "." + std::to_string(index);
+		std::string fozPath = path + ".foz";
+		auto db = std::unique_ptr<DatabaseInterface>(
+				create_stream_archive_database(fozPath.c_str(), DatabaseMode::ExclusiveOverWrite));
+		if (db && db->prepare())
+		{
+			reportPath = path;
+			LOGI("Writing hitch report to \"%s.csv\".\n", reportPath.c_str());
+			return true;
+		}
+	}
+
+	LOGE("Failed to find a free hitch report path for \"%s\".\n", reportBasePath.c_str());
+	return false;
+}
+
+void HitchProfiler::writeReport()
+{
+	struct Row
+	{
+		uint64_t frameIndex;
+		uint64_t frameTimeNs;
+		ResourceTag tag;
+		Hash hash;
+		uint64_t durationNs;
+	};
+
+	std::lock_guard<std::mutex> writeHolder(writeLock);
+
+	// Only copy what we need under the lock, the file I/O happens outside of it.
+	std::vector<Row> rows;
+	std::unordered_set<Hash> whitelist[RESOURCE_COUNT];
+	{
+		std::lock_guard<std::mutex> holder(lock);
+		if (hitches.empty())
+			return;
+
+		for (auto &hitch : hitches)
+		{
+			for (auto &event : hitch.events)
+			{
+				auto itr = cookieToHash.find(event.cookie);
+				Hash hash = itr != end(cookieToHash) ? itr->second.hash : 0;
+				// Failed to record, or not hashed yet, in which case a later report picks it up,
+				// at the latest on teardown.
+				if (hash == 0)
+					continue;
+
+				rows.push_back({ hitch.frameIndex, hitch.frameTimeNs, event.tag, hash, event.durationNs });
+				whitelist[event.tag].insert(hash);
+
+				for (auto &moduleCookie : event.moduleCookies)
+				{
+					auto moduleItr = cookieToHash.find(moduleCookie);
+					if (moduleItr != end(cookieToHash) && moduleItr->second.hash != 0)
+						whitelist[RESOURCE_SHADER_MODULE].insert(moduleItr->second.hash);
+				}
+			}
+		}
+
+		hasNewHitches = false;
+	}
+
+	if (!openReport())
+		return;
+
+	std::string csvPath = reportPath + ".csv";
+	FILE *file = fopen(csvPath.c_str(), "w");
+	if (!file)
+	{
+		LOGE("Failed to open hitch report: %s\n", csvPath.c_str());
+		return;
+	}
+
+	fprintf(file, "frame,frame_time_ms,type,hash,creation_time_ms\n");
+	for (auto &row : rows)
+	{
+		const char *type = row.tag == RESOURCE_SHADER_MODULE ? "shader_module" :
+		                   (row.tag == RESOURCE_GRAPHICS_PIPELINE ? "graphics_pipeline" : "compute_pipeline");
+		fprintf(file, "%" PRIu64 ",%.3f,%s,%016" PRIx64 ",%.3f\n",
+		        row.frameIndex, double(row.frameTimeNs) * 1e-6,
+		        type, row.hash, double(row.durationNs) * 1e-6);
+	}
+	fclose(file);
+
+	std::string fozPath = reportPath + ".foz";
+	auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(fozPath.c_str(), DatabaseMode::OverWrite));
+	if (!db || !db->prepare())
+	{
+		LOGE("Failed to open hitch whitelist: %s\n", fozPath.c_str());
+		return;
+	}
+
+	for (unsigned tag = 0; tag < RESOURCE_COUNT; tag++)
+		for (auto &hash : whitelist[tag])
+			if (!db->write_entry(static_cast<ResourceTag>(tag), hash, nullptr, 0, 0))
+				LOGE("Failed to write hitch whitelist entry.\n");
+}
+}
@@ -0,0 +1,134 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "fossilize.hpp"
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace Fossilize
+{
+// Tracks frame times through vkQueuePresentKHR and attributes long frames
+// to the pipelines and shader modules which were created during that frame.
+// Must be registered with StateRecorder::set_object_listener() and outlive the recorder,
+// so hashes are tied to the creation call rather than to handles which may be reused later.
+class HitchProfiler : public StateRecorderObjectListener
+{
+public:
+	// Frames longer than thresholdMs are considered hitches.
+	// If thresholdMs is 0, frames longer than twice the running average frame time are considered hitches.
+	// Reports are written to reportBasePath.N.csv and reportBasePath.N.foz, where N is unique for this session.
+	HitchProfiler(std::string reportBasePath, double thresholdMs);
+	~HitchProfiler();
+
+	static uint64_t getTimeNs();
+
+	uint64_t on_object_enqueued(ResourceTag tag, uint64_t handle) override;
+	void on_object_hashed(uint64_t cookie, Hash hash) override;
+
+	// Called after a creation call completed and the object was passed to the StateRecorder.
+	// For batched pipeline creation, every pipeline is attributed with the duration of the entire batch.
+	void endShaderModuleCreation(VkShaderModule module, uint64_t startNs);
+	void endGraphicsPipelineCreation(const VkGraphicsPipelineCreateInfo *infos, const VkPipeline *pipelines,
+	                                 uint32_t count, uint64_t startNs);
+	void endComputePipelineCreation(const VkComputePipelineCreateInfo *infos, const VkPipeline *pipelines,
+	                                uint32_t count, uint64_t startNs);
+
+	// Only bookkeeping, reports are written on a separate thread.
+	void notifyPresent();
+
+	// Writes the .csv with every hitch and the objects created during the frame,
+	// and the .foz which can be used directly as a --whitelist for fossilize-replay and fossilize-prune.
+	void writeReport();
+
+private:
+	struct CreationEvent
+	{
+		ResourceTag tag;
+		uint64_t cookie;
+		uint64_t durationNs;
+		// Shader modules used by a pipeline, so the whitelist is usable on its own.
+		std::vector<uint64_t> moduleCookies;
+	};
+
+	struct Hitch
+	{
+		uint64_t frameIndex;
+		uint64_t frameTimeNs;
+		std::vector<CreationEvent> events;
+	};
+
+	std::string reportBasePath;
+	std::string reportPath;
+	uint64_t thresholdNs;
+
+	std::mutex lock;
+	std::vector<CreationEvent> currentFrameEvents;
+	std::vector<Hitch> hitches;
+	uint64_t frameIndex = 0;
+	uint64_t lastPresentNs = 0;
+	uint64_t lastReportNs = 0;
+	double averageFrameTimeNs = 0.0;
+	bool hasNewHitches = false;
+
+	struct CookieState
+	{
+		// A hash of 0 means the recording thread has not hashed the object yet.
+		Hash hash;
+		// Held by the handle maps below and by events which are still queued or part of a hitch.
+		uint32_t refCount;
+	};
+
+	// Hashes are computed asynchronously by the recording thread, so objects are tracked by cookie.
+	uint64_t nextCookie = 0;
+	std::unordered_map<uint64_t, CookieState> cookieToHash;
+	// Cookies of pipelines which are recorded, but not consumed by end*PipelineCreation() yet.
+	std::unordered_map<uint64_t, uint64_t> pendingPipelineCookies;
+	// Cookie of the most recent shader module created with a given handle.
+	std::unordered_map<uint64_t, uint64_t> shaderModuleCookies;
+
+	// Serializes report writers, so the present thread never waits for file I/O.
+	std::mutex writeLock;
+
+	std::mutex reportLock;
+	std::condition_variable reportCond;
+	std::thread reportThread;
+	bool reportRequested = false;
+	bool stopping = false;
+
+	uint64_t retainCookie(uint64_t cookie);
+	void releaseCookie(uint64_t cookie);
+	uint64_t takePipelineCookie(VkPipeline pipeline);
+	uint64_t getShaderModuleCookie(VkShaderModule module);
+	void addEvent(CreationEvent event);
+	void releaseEvent(const CreationEvent &event);
+	void releaseEvents(const std::vector<CreationEvent> &events);
+	void reportThreadMain();
+	bool openReport();
+};
+}
@@ -26,6 +26,9 @@
 #include <unordered_map>
 #include <memory>
 #include "fossilize_application_filter.hpp"
+#include "fossilize_remote_db.hpp"
+#include "hitch_profiler.hpp"
+#include "crash_batch_registry.hpp"
 
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
@@ -34,6 +37,7 @@
 #include <unistd.h>
 #endif
 #include <signal.h>
+#include <string.h>
 #include "fossilize_inttypes.h"
 
 namespace Fossilize
@@ -76,6 +80,8 @@ struct Recorder
 {
 	std::unique_ptr<ApplicationInfoFilter> filter;
 	std::unique_ptr<DatabaseInterface> interface;
+	// Declared before the recorder, since the recording thread calls into it until the recorder is destroyed.
+	std::unique_ptr<HitchProfiler> hitchProfiler;
 	std::unique_ptr<StateRecorder> recorder;
 };
 static std::unordered_map<Hash, Recorder> globalRecorders;
@@ -119,25 +125,119 @@ static std::string getSystemProperty(const char *key)
 #define FOSSILIZE_APPLICATION_INFO_FILTER_PATH_ENV "FOSSILIZE_APPLICATION_INFO_FILTER_PATH"
 #endif
 
+#ifndef FOSSILIZE_DUMP_LAZY_PRIMING_ENV
+#define FOSSILIZE_DUMP_LAZY_PRIMING_ENV "FOSSILIZE_DUMP_LAZY_PRIMING"
+#endif
+
+#ifndef FOSSILIZE_DUMP_NORMALIZE_PIPELINES_ENV
+#define FOSSILIZE_DUMP_NORMALIZE_PIPELINES_ENV "FOSSILIZE_DUMP_NORMALIZE_PIPELINES"
+#endif
+
+#ifndef FOSSILIZE_HITCH_PROFILE_ENV
+#define FOSSILIZE_HITCH_PROFILE_ENV "FOSSILIZE_HITCH_PROFILE"
+#endif
+
+#ifndef FOSSILIZE_HITCH_PROFILE_THRESHOLD_MS_ENV
+#define FOSSILIZE_HITCH_PROFILE_THRESHOLD_MS_ENV "FOSSILIZE_HITCH_PROFILE_THRESHOLD_MS"
+#endif
+
+#ifndef FOSSILIZE_DAEMON_SOCKET_ENV
+#define FOSSILIZE_DAEMON_SOCKET_ENV "FOSSILIZE_DAEMON_SOCKET"
+#endif
+
+#ifndef FOSSILIZE_RECORDING_THREAD_IDLE_ENV
+#define FOSSILIZE_RECORDING_THREAD_IDLE_ENV "FOSSILIZE_RECORDING_THREAD_IDLE"
+#endif
+
+#ifndef FOSSILIZE_RECORDING_THREAD_NICE_ENV
+#define FOSSILIZE_RECORDING_THREAD_NICE_ENV "FOSSILIZE_RECORDING_THREAD_NICE"
+#endif
+
+#ifndef FOSSILIZE_RECORDING_THREAD_IO_PRIORITY_ENV
+#define FOSSILIZE_RECORDING_THREAD_IO_PRIORITY_ENV "FOSSILIZE_RECORDING_THREAD_IO_PRIORITY"
+#endif
+
+#ifndef FOSSILIZE_RECORDING_THREAD_CPU_MASK_ENV
+#define FOSSILIZE_RECORDING_THREAD_CPU_MASK_ENV "FOSSILIZE_RECORDING_THREAD_CPU_MASK"
+#endif
+
+#ifndef FOSSILIZE_RECORDING_MAX_WRITE_BYTES_PER_SECOND_ENV
+#define FOSSILIZE_RECORDING_MAX_WRITE_BYTES_PER_SECOND_ENV "FOSSILIZE_RECORDING_MAX_WRITE_BYTES_PER_SECOND"
+#endif
+
+#ifndef ANDROID
+static StateRecorderThreadPriority getRecordingThreadPriority()
+{
+	StateRecorderThreadPriority priority;
+
+	const char *idle = getenv(FOSSILIZE_RECORDING_THREAD_IDLE_ENV);
+	if (idle && strtoul(idle, nullptr, 0) != 0)
+		priority.idle_scheduling = true;
+
+	const char *nice = getenv(FOSSILIZE_RECORDING_THREAD_NICE_ENV);
+	if (nice)
+		priority.nice_value = int(strtol(nice, nullptr, 0));
+
+	// Either "idle", or "best-effort" with an optional level, e.g. "best-effort:7".
+	const char *io = getenv(FOSSILIZE_RECORDING_THREAD_IO_PRIORITY_ENV);
+	if (io)
+	{
+		if (strcmp(io, "idle") == 0)
+			priority.io_priority_class = 3;
+		else if (strncmp(io, "best-effort", 11) == 0)
+		{
+			priority.io_priority_class = 2;
+			priority.io_priority_level = io[11] == ':' ? int(strtol(io + 12, nullptr, 0)) : 7;
+		}
+		else
+			LOGE("Unrecognized I/O priority \"%s\", ignoring.\n", io);
+	}
+
+	const char *mask = getenv(FOSSILIZE_RECORDING_THREAD_CPU_MASK_ENV);
+	if (mask)
+		priority.cpu_affinity_mask = strtoull(mask, nullptr, 0);
+
+	const char *throughput = getenv(FOSSILIZE_RECORDING_MAX_WRITE_BYTES_PER_SECOND_ENV);
+	if (throughput)
+		priority.max_write_bytes_per_second = strtoull(throughput, nullptr, 0);
+
+	return priority;
+}
+#endif
+
 #ifdef FOSSILIZE_LAYER_CAPTURE_SIGSEGV
 static thread_local const VkComputePipelineCreateInfo *tls_compute_create_info = nullptr;
 static thread_local const VkGraphicsPipelineCreateInfo *tls_graphics_create_info = nullptr;
+static thread_local uint32_t tls_create_info_count = 0;
 static thread_local StateRecorder *tls_recorder = nullptr;
+// The batch is also published globally, in case the driver crashes on one of its own threads.
+static thread_local int tls_crash_batch = -1;
 
 static bool emergencyRecord()
 {
 	if (tls_recorder)
 	{
-		if (tls_graphics_create_info)
-			return tls_recorder->record_graphics_pipeline(VK_NULL_HANDLE, *tls_graphics_create_info, nullptr, 0);
-		if (tls_compute_create_info)
-			return tls_recorder->record_compute_pipeline(VK_NULL_HANDLE, *tls_compute_create_info, nullptr, 0);
+		// In batched mode we cannot know which pipeline in the batch crashed, so record all of them.
+		if (tls_create_info_count != 0)
+		{
+			bool ret = true;
+			for (uint32_t i = 0; i < tls_create_info_count; i++)
+			{
+				if (tls_graphics_create_info)
+					ret = tls_recorder->record_graphics_pipeline(VK_NULL_HANDLE, tls_graphics_create_info[i], nullptr, 0) && ret;
+				else if (tls_compute_create_info)
+					ret = tls_recorder->record_compute_pipeline(VK_NULL_HANDLE, tls_compute_create_info[i], nullptr, 0) && ret;
+			}
+			return ret;
+		}
 
 		// Flush out the recording thread.
 		tls_recorder->tear_down_recording_thread();
+		return false;
 	}
 
-	return false;
+	// Not crashing in a thread which called into the driver, so it's likely one of the driver's threads.
+	return recordRegisteredCrashBatches();
 }
 
 #ifdef _WIN32
@@ -191,26 +291,33 @@ static void installSegfaultHandler()
 #endif
 
 void Instance::braceForGraphicsPipelineCrash(StateRecorder *recorder,
-                                             const VkGraphicsPipelineCreateInfo *info)
+                                             const VkGraphicsPipelineCreateInfo *infos, uint32_t count)
 {
 	tls_recorder = recorder;
-	tls_graphics_create_info = info;
+	tls_graphics_create_info = infos;
 	tls_compute_create_info = nullptr;
+	tls_create_info_count = count;
+	tls_crash_batch = registerCrashBatch(recorder, infos, nullptr, count);
 }
 
 void Instance::braceForComputePipelineCrash(StateRecorder *recorder,
-                                            const VkComputePipelineCreateInfo *info)
+                                            const VkComputePipelineCreateInfo *infos, uint32_t count)
 {
 	tls_recorder = recorder;
-	tls_compute_create_info = info;
+	tls_compute_create_info = infos;
 	tls_graphics_create_info = nullptr;
+	tls_create_info_count = count;
+	tls_crash_batch = registerCrashBatch(recorder, nullptr, infos, count);
 }
 
 void Instance::completedPipelineCompilation()
 {
+	unregisterCrashBatch(tls_crash_batch);
+	tls_crash_batch = -1;
 	tls_recorder = nullptr;
 	tls_graphics_create_info = nullptr;
 	tls_compute_create_info = nullptr;
+	tls_create_info_count = 0;
 }
 #endif
 
@@ -219,14 +326,28 @@ Instance::Instance()
 #ifdef FOSSILIZE_LAYER_CAPTURE_SIGSEGV
 #ifdef ANDROID
 	auto sigsegv = getSystemProperty("debug.fossilize.dump_sigsegv");
-	if (!sigsegv.empty() && strtoul(sigsegv.c_str(), nullptr, 0) != 0)
+	auto sigsegv_batched = getSystemProperty("debug.fossilize.dump_sigsegv_batched");
+	if (!sigsegv_batched.empty() && strtoul(sigsegv_batched.c_str(), nullptr, 0) != 0)
+	{
+		installSegfaultHandler();
+		enableCrashHandler = true;
+		enableBatchedCrashHandler = true;
+	}
+	else if (!sigsegv.empty() && strtoul(sigsegv.c_str(), nullptr, 0) != 0)
 	{
 		installSegfaultHandler();
 		enableCrashHandler = true;
 	}
 #else
 	const char *sigsegv = getenv("FOSSILIZE_DUMP_SIGSEGV");
-	if (sigsegv && strtoul(sigsegv, nullptr, 0) != 0)
+	const char *sigsegv_batched = getenv("FOSSILIZE_DUMP_SIGSEGV_BATCHED");
+	if (sigsegv_batched && strtoul(sigsegv_batched, nullptr, 0) != 0)
+	{
+		installSegfaultHandler();
+		enableCrashHandler = true;
+		enableBatchedCrashHandler = true;
+	}
+	else if (sigsegv && strtoul(sigsegv, nullptr, 0) != 0)
 	{
 		installSegfaultHandler();
 		enableCrashHandler = true;
@@ -235,7 +356,8 @@ Instance::Instance()
 #endif
 }
 
-StateRecorder *Instance::getStateRecorderForDevice(const VkApplicationInfo *appInfo, const VkPhysicalDeviceFeatures2 *features)
+StateRecorder *Instance::getStateRecorderForDevice(const VkApplicationInfo *appInfo, const VkPhysicalDeviceFeatures2 *features,
+                                                   HitchProfiler **hitchProfiler)
 {
 	auto appInfoFeatureHash = Hashing::compute_application_feature_hash(appInfo, features);
 	auto hash = Hashing::compute_combined_application_feature_hash(appInfoFeatureHash);
@@ -243,7 +365,10 @@ StateRecorder *Instance::getStateRecorderForDevice(const VkApplicationInfo *appI
 	std::lock_guard<std::mutex> lock(recorderLock);
 	auto itr = globalRecorders.find(hash);
 	if (itr != end(globalRecorders))
+	{
+		*hitchProfiler = itr->second.hitchProfiler.get();
 		return itr->second.recorder.get();
+	}
 
 	auto &entry = globalRecorders[hash];
 
@@ -258,6 +383,13 @@ StateRecorder *Instance::getStateRecorderForDevice(const VkApplicationInfo *appI
 		LOGI("Overriding serialization path: \"%s\".\n", logPath.c_str());
 	}
 	const char *filterPath = nullptr;
+	bool lazyPriming = false;
+	auto normalizePipelinesProp = getSystemProperty("debug.fossilize.normalize_pipelines");
+	bool normalizePipelines = !normalizePipelinesProp.empty() && strtoul(normalizePipelinesProp.c_str(), nullptr, 0) != 0;
+	auto hitchProfile = getSystemProperty("debug.fossilize.hitch_profile");
+	bool enableHitchProfile = !hitchProfile.empty() && strtoul(hitchProfile.c_str(), nullptr, 0) != 0;
+	auto hitchThreshold = getSystemProperty("debug.fossilize.hitch_profile_threshold_ms");
+	double hitchThresholdMs = hitchThreshold.empty() ? 0.0 : strtod(hitchThreshold.c_str(), nullptr);
 #else
 	serializationPath = "fossilize";
 	const char *path = getenv(FOSSILIZE_DUMP_PATH_ENV);
@@ -268,6 +400,15 @@ StateRecorder *Instance::getStateRecorderForDevice(const VkApplicationInfo *appI
 	}
 	extraPaths = getenv(FOSSILIZE_DUMP_PATH_READ_ONLY_ENV);
 	const char *filterPath = getenv(FOSSILIZE_APPLICATION_INFO_FILTER_PATH_ENV);
+	const char *daemonSocket = getenv(FOSSILIZE_DAEMON_SOCKET_ENV);
+	const char *lazyPrimingEnv = getenv(FOSSILIZE_DUMP_LAZY_PRIMING_ENV);
+	bool lazyPriming = lazyPrimingEnv && strtoul(lazyPrimingEnv, nullptr, 0) != 0;
+	const char *normalizePipelinesEnv = getenv(FOSSILIZE_DUMP_NORMALIZE_PIPELINES_ENV);
+	bool normalizePipelines = normalizePipelinesEnv && strtoul(normalizePipelinesEnv, nullptr, 0) != 0;
+	const char *hitchProfile = getenv(FOSSILIZE_HITCH_PROFILE_ENV);
+	bool enableHitchProfile = hitchProfile && strtoul(hitchProfile, nullptr, 0) != 0;
+	const char *hitchThreshold = getenv(FOSSILIZE_HITCH_PROFILE_THRESHOLD_MS_ENV);
+	double hitchThresholdMs = hitchThreshold ? strtod(hitchThreshold, nullptr) : 0.0;
 #endif
 
 	if (filterPath)
@@ -281,21 +422,47 @@ StateRecorder *Instance::getStateRecorderForDevice(const VkApplicationInfo *appI
 	if (!serializationPath.empty())
 		serializationPath += ".";
 	serializationPath += hashString;
-	entry.interface.reset(create_concurrent_database_with_encoded_extra_paths(serializationPath.c_str(),
-	                                                                          DatabaseMode::Append,
-	                                                                          extraPaths));
+
+#ifndef ANDROID
+	if (daemonSocket)
+	{
+		// Falls back to in-process recording if the daemon cannot be reached.
+		std::string socketPath = *daemonSocket != '\0' ? daemonSocket : get_default_remote_database_socket_path();
+		LOGI("Recording through daemon at \"%s\".\n", socketPath.c_str());
+		entry.interface.reset(create_remote_database(socketPath.c_str(), serializationPath.c_str(), extraPaths));
+	}
+	else
+#endif
+	{
+		entry.interface.reset(create_concurrent_database_with_encoded_extra_paths(serializationPath.c_str(),
+		                                                                          DatabaseMode::Append,
+		                                                                          extraPaths, lazyPriming));
+	}
 
 	auto *recorder = new StateRecorder;
 	entry.recorder.reset(recorder);
 	recorder->set_database_enable_compression(true);
 	recorder->set_database_enable_checksum(true);
 	recorder->set_application_info_filter(entry.filter.get());
+	recorder->set_normalize_pipelines(normalizePipelines);
+#ifndef ANDROID
+	recorder->set_recording_thread_priority(getRecordingThreadPriority());
+#endif
 	if (appInfo)
 		if (!recorder->record_application_info(*appInfo))
 			LOGE("Failed to record application info.\n");
 	if (features)
 		if (!recorder->record_physical_device_features(*features))
 			LOGE("Failed to record physical device features.\n");
+
+	if (enableHitchProfile)
+	{
+		LOGI("Enabling hitch profiler, writing reports to \"%s.hitches.*.csv\".\n", serializationPath.c_str());
+		entry.hitchProfiler.reset(new HitchProfiler(serializationPath + ".hitches", hitchThresholdMs));
+		recorder->set_object_listener(entry.hitchProfiler.get());
+	}
+	*hitchProfiler = entry.hitchProfiler.get();
+
 	recorder->init_recording_thread(entry.interface.get());
 
 	return recorder;
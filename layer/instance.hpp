@@ -29,6 +29,7 @@
 
 namespace Fossilize
 {
+class HitchProfiler;
 class Instance
 {
 public:
@@ -55,7 +56,9 @@ public:
 		return pAppInfo;
 	}
 
-	static StateRecorder *getStateRecorderForDevice(const VkApplicationInfo *appInfo, const VkPhysicalDeviceFeatures2 *features);
+	// If hitch profiling is enabled, *hitchProfiler is set to the profiler shared by all devices using the same recorder.
+	static StateRecorder *getStateRecorderForDevice(const VkApplicationInfo *appInfo, const VkPhysicalDeviceFeatures2 *features,
+	                                                HitchProfiler **hitchProfiler);
 
 #ifdef FOSSILIZE_LAYER_CAPTURE_SIGSEGV
 	bool capturesCrashes() const
@@ -63,8 +66,14 @@ public:
 		return enableCrashHandler;
 	}
 
-	static void braceForGraphicsPipelineCrash(StateRecorder *recorder, const VkGraphicsPipelineCreateInfo *info);
-	static void braceForComputePipelineCrash(StateRecorder *recorder, const VkComputePipelineCreateInfo *info);
+	// Batches are submitted to the driver as-is, and the entire batch is serialized on a crash.
+	bool capturesCrashesBatched() const
+	{
+		return enableBatchedCrashHandler;
+	}
+
+	static void braceForGraphicsPipelineCrash(StateRecorder *recorder, const VkGraphicsPipelineCreateInfo *infos, uint32_t count);
+	static void braceForComputePipelineCrash(StateRecorder *recorder, const VkComputePipelineCreateInfo *infos, uint32_t count);
 	static void completedPipelineCompilation();
 #endif
 
@@ -76,6 +85,7 @@ private:
 	PFN_vkGetInstanceProcAddr gpa = nullptr;
 #ifdef FOSSILIZE_LAYER_CAPTURE_SIGSEGV
 	bool enableCrashHandler = false;
+	bool enableBatchedCrashHandler = false;
 #endif
 };
 }
@@ -25,6 +25,7 @@
 #include "vulkan.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string>
 
 static bool write_string_to_file(const char *path, const char *str)
 {
@@ -37,110 +38,202 @@ static bool write_string_to_file(const char *path, const char *str)
 	return true;
 }
 
-int main()
-{
-	const char *test_json =
-R"delim(
+static bool run_filter_checks(Fossilize::ApplicationInfoFilter &filter)
 {
-	"asset": "FossilizeApplicationInfoFilter",
-	"version" : 1,
-	"blacklistedApplicationNames" : [ "A",  "B", "C" ],
-	"blacklistedEngineNames" : [ "D", "E", "F" ],
-	"applicationFilters" : {
-		"test1" : { "minimumApplicationVersion" : 10 },
-		"test2" : { "minimumApplicationVersion" : 10, "minimumEngineVersion" : 1000 },
-		"test3" : { "minimumApiVersion" : 50 }
-	},
-	"engineFilters" : {
-		"test1" : { "minimumEngineVersion" : 10 },
-		"test2" : { "minimumEngineVersion" : 10, "minimumApplicationVersion" : 1000 },
-		"test3" : { "minimumApiVersion" : 50 }
-	}
-}
-)delim";
-
-	if (!write_string_to_file(".__test_appinfo.json", test_json))
-		return EXIT_FAILURE;
-
-	Fossilize::ApplicationInfoFilter filter;
-	filter.parse_async(".__test_appinfo.json");
-
-	if (!filter.check_success())
-	{
-		LOGE("Parsing did not complete successfully.\n");
-		return EXIT_FAILURE;
-	}
-
 	VkApplicationInfo appinfo = { VK_STRUCTURE_TYPE_APPLICATION_INFO };
 
 	if (!filter.test_application_info(nullptr))
-		return EXIT_FAILURE;
+		return false;
 
 	// Test blacklists
 	appinfo.pApplicationName = "A";
 	appinfo.pEngineName = "G";
 	if (filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	appinfo.pApplicationName = "D";
 	appinfo.pEngineName = "A";
 	if (!filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	appinfo.pApplicationName = "H";
 	appinfo.pEngineName = "E";
 	if (filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	// Test application version filtering
 	appinfo.pApplicationName = "test1";
 	appinfo.pEngineName = nullptr;
 	appinfo.applicationVersion = 9;
 	if (filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 	appinfo.applicationVersion = 10;
 	if (!filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	// Engine version should be ignored for appinfo filters.
 	appinfo.pApplicationName = "test2";
 	if (!filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	appinfo.pApplicationName = "test3";
 	appinfo.applicationVersion = 0;
 	appinfo.apiVersion = 49;
 	if (filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	appinfo.apiVersion = 50;
 	if (!filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	// Test engine version filtering
 	appinfo.pApplicationName = nullptr;
 	appinfo.pEngineName = "test1";
 	appinfo.engineVersion = 9;
 	if (filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 	appinfo.engineVersion = 10;
 	if (!filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	// Engine version should be ignored for appinfo filters.
 	appinfo.pEngineName = "test2";
 	if (!filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	appinfo.pEngineName = "test3";
 	appinfo.engineVersion = 0;
 	appinfo.apiVersion = 49;
 	if (filter.test_application_info(&appinfo))
-		return EXIT_FAILURE;
+		return false;
 
 	appinfo.apiVersion = 50;
 	if (!filter.test_application_info(&appinfo))
+		return false;
+
+	return true;
+}
+
+// Enough names that the perfect hash has to displace plenty of buckets.
+static bool test_large_compiled_filter()
+{
+	const unsigned name_count = 2000;
+	std::string json = "{ \"asset\": \"FossilizeApplicationInfoFilter\", \"version\": 1, \"blacklistedApplicationNames\": [";
+	for (unsigned i = 0; i < name_count; i++)
+		json += (i ? ", \"app" : "\"app") + std::to_string(i) + "\"";
+	json += "], \"engineFilters\": {";
+	for (unsigned i = 0; i < name_count; i++)
+		json += (i ? ", \"engine" : "\"engine") + std::to_string(i) + "\": { \"minimumEngineVersion\": " + std::to_string(i + 1) + " }";
+	json += "} }";
+
+	if (!write_string_to_file(".__test_appinfo_large.json", json.c_str()))
+		return false;
+	if (!Fossilize::ApplicationInfoFilter::compile(".__test_appinfo_large.json"))
+		return false;
+
+	Fossilize::ApplicationInfoFilter filter;
+	filter.parse_async(".__test_appinfo_large.json");
+	if (!filter.check_success() || !filter.is_compiled())
+		return false;
+
+	VkApplicationInfo appinfo = { VK_STRUCTURE_TYPE_APPLICATION_INFO };
+	for (unsigned i = 0; i < name_count; i++)
+	{
+		std::string app = "app" + std::to_string(i);
+		std::string other_app = "app" + std::to_string(i + name_count);
+		std::string engine = "engine" + std::to_string(i);
+
+		appinfo.pApplicationName = app.c_str();
+		appinfo.pEngineName = nullptr;
+		if (filter.test_application_info(&appinfo))
+			return false;
+
+		appinfo.pApplicationName = other_app.c_str();
+		if (!filter.test_application_info(&appinfo))
+			return false;
+
+		appinfo.pApplicationName = nullptr;
+		appinfo.pEngineName = engine.c_str();
+		appinfo.engineVersion = i;
+		if (filter.test_application_info(&appinfo))
+			return false;
+		appinfo.engineVersion = i + 1;
+		if (!filter.test_application_info(&appinfo))
+			return false;
+	}
+
+	remove(".__test_appinfo_large.json");
+	remove(Fossilize::ApplicationInfoFilter::get_compiled_path(".__test_appinfo_large.json").c_str());
+	return true;
+}
+
+int main()
+{
+	const char *test_json =
+R"delim(
+{
+	"asset": "FossilizeApplicationInfoFilter",
+	"version" : 1,
+	"blacklistedApplicationNames" : [ "A",  "B", "C" ],
+	"blacklistedEngineNames" : [ "D", "E", "F" ],
+	"applicationFilters" : {
+		"test1" : { "minimumApplicationVersion" : 10 },
+		"test2" : { "minimumApplicationVersion" : 10, "minimumEngineVersion" : 1000 },
+		"test3" : { "minimumApiVersion" : 50 }
+	},
+	"engineFilters" : {
+		"test1" : { "minimumEngineVersion" : 10 },
+		"test2" : { "minimumEngineVersion" : 10, "minimumApplicationVersion" : 1000 },
+		"test3" : { "minimumApiVersion" : 50 }
+	}
+}
+)delim";
+
+	auto compiled_path = Fossilize::ApplicationInfoFilter::get_compiled_path(".__test_appinfo.json");
+	remove(compiled_path.c_str());
+
+	if (!write_string_to_file(".__test_appinfo.json", test_json))
+		return EXIT_FAILURE;
+
+	{
+		Fossilize::ApplicationInfoFilter filter;
+		filter.parse_async(".__test_appinfo.json");
+
+		if (!filter.check_success())
+		{
+			LOGE("Parsing did not complete successfully.\n");
+			return EXIT_FAILURE;
+		}
+
+		if (filter.is_compiled() || !run_filter_checks(filter))
+			return EXIT_FAILURE;
+	}
+
+	if (!Fossilize::ApplicationInfoFilter::compile(".__test_appinfo.json"))
+		return EXIT_FAILURE;
+
+	{
+		Fossilize::ApplicationInfoFilter filter;
+		filter.parse_async(".__test_appinfo.json");
+		if (!filter.check_success() || !filter.is_compiled() || !run_filter_checks(filter))
+			return EXIT_FAILURE;
+	}
+
+	// Any change to the JSON makes the compiled filter stale.
+	std::string edited_json = std::string(test_json) + " ";
+	if (!write_string_to_file(".__test_appinfo.json", edited_json.c_str()))
+		return EXIT_FAILURE;
+
+	{
+		Fossilize::ApplicationInfoFilter filter;
+		filter.parse_async(".__test_appinfo.json");
+		if (!filter.check_success() || filter.is_compiled() || !run_filter_checks(filter))
+			return EXIT_FAILURE;
+	}
+
+	if (!test_large_compiled_filter())
 		return EXIT_FAILURE;
 
 	remove(".__test_appinfo.json");
+	remove(compiled_path.c_str());
 }
@@ -0,0 +1,129 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "blob_prefetcher.hpp"
+#include "layer/utils.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace Fossilize;
+
+static const char *db_path = ".__test_blob_prefetcher.foz";
+static const unsigned NumBlobs = 2000;
+
+static std::vector<uint8_t> make_blob(Hash hash)
+{
+	// Compressible, and of varying size so recycled buffers need to be resized.
+	std::vector<uint8_t> blob(100 + (hash * 37) % 3000);
+	for (size_t i = 0; i < blob.size(); i++)
+		blob[i] = uint8_t((hash + i / 16) & 0xff);
+	return blob;
+}
+
+static void write_database()
+{
+	remove(db_path);
+	std::unique_ptr<DatabaseInterface> db(create_stream_archive_database(db_path, DatabaseMode::OverWrite));
+	if (!db || !db->prepare())
+		abort();
+
+	for (Hash hash = 1; hash <= NumBlobs; hash++)
+	{
+		auto blob = make_blob(hash);
+		if (!db->write_entry(RESOURCE_SHADER_MODULE, hash, blob.data(), blob.size(),
+		                     PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT))
+			abort();
+	}
+}
+
+// Consumers take tickets roughly in order, like worker threads pulling from the replayer work queue.
+static void test_prefetch(DatabaseInterface &db, unsigned num_prefetch_threads, unsigned look_ahead, unsigned num_consumers)
+{
+	BlobPrefetcher prefetcher(&db);
+	if (num_prefetch_threads && !prefetcher.start(num_prefetch_threads, look_ahead))
+		abort();
+
+	std::vector<uint64_t> tickets;
+	for (Hash hash = 1; hash <= NumBlobs; hash++)
+		tickets.push_back(prefetcher.submit(RESOURCE_SHADER_MODULE, hash));
+
+	// Missing blobs fail in the consumer, not in the prefetcher.
+	uint64_t missing_ticket = prefetcher.submit(RESOURCE_SHADER_MODULE, NumBlobs + 1);
+
+	std::atomic<unsigned> next_index(0);
+	std::atomic<bool> failed(false);
+	std::vector<std::thread> consumers;
+	for (unsigned i = 0; i < num_consumers; i++)
+	{
+		consumers.emplace_back([&]() {
+			std::vector<uint8_t> blob;
+			unsigned index;
+			while ((index = next_index.fetch_add(1, std::memory_order_relaxed)) < NumBlobs)
+			{
+				if (!prefetcher.acquire(tickets[index], blob) || blob != make_blob(index + 1))
+					failed = true;
+			}
+		});
+	}
+
+	for (auto &t : consumers)
+		t.join();
+
+	if (failed)
+		abort();
+
+	std::vector<uint8_t> blob;
+	if (prefetcher.acquire(missing_ticket, blob))
+		abort();
+
+	auto stats = prefetcher.get_statistics();
+	LOGI("%u prefetch threads, look-ahead %u, %u consumers: %u prefetched, %u waited, %u missed.\n",
+	     num_prefetch_threads, look_ahead, num_consumers,
+	     unsigned(stats.prefetched), unsigned(stats.waited), unsigned(stats.missed));
+
+	if (stats.prefetched + stats.waited + stats.missed != NumBlobs + 1)
+		abort();
+	if (!num_prefetch_threads && stats.missed != NumBlobs + 1)
+		abort();
+}
+
+int main()
+{
+	write_database();
+
+	std::unique_ptr<DatabaseInterface> db(create_stream_archive_database(db_path, DatabaseMode::ReadOnly));
+	if (!db || !db->prepare())
+		return EXIT_FAILURE;
+
+	test_prefetch(*db, 0, 0, 1);
+	test_prefetch(*db, 1, 1, 1);
+	test_prefetch(*db, 2, 16, 1);
+	test_prefetch(*db, 2, 4, 4);
+	test_prefetch(*db, 4, 256, 8);
+
+	db.reset();
+	remove(db_path);
+}
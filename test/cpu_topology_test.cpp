@@ -0,0 +1,185 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "cpu_topology.hpp"
+#include "file.hpp"
+#include "layer/utils.hpp"
+#include <string>
+#include <vector>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace Fossilize;
+
+static void make_dirs(const std::string &path)
+{
+	for (size_t i = 1; i <= path.size(); i++)
+		if (i == path.size() || path[i] == '/')
+			mkdir(path.substr(0, i).c_str(), 0755);
+}
+
+static void write_file(const std::string &path, const std::string &text)
+{
+	make_dirs(path.substr(0, path.find_last_of('/')));
+	if (!write_string_to_file(path.c_str(), (text + "\n").c_str()))
+		abort();
+}
+
+static int remove_entry(const char *path, const struct stat *, int, struct FTW *)
+{
+	return remove(path);
+}
+
+static bool equal(const std::vector<unsigned> &a, const std::vector<unsigned> &b)
+{
+	return a == b;
+}
+
+static void test_cpu_list()
+{
+	std::vector<unsigned> cpus;
+	if (!parse_cpu_list("0-3,8,10-11\n", &cpus) || !equal(cpus, { 0, 1, 2, 3, 8, 10, 11 }))
+		abort();
+	if (!parse_cpu_list("", &cpus) || !cpus.empty())
+		abort();
+	if (parse_cpu_list("3-1", &cpus))
+		abort();
+	if (parse_cpu_list("x", &cpus))
+		abort();
+	if (parse_cpu_list("1;2", &cpus))
+		abort();
+}
+
+// Two nodes with two L3 domains each, two cores per L3 domain and two SMT threads per core.
+// Like on real machines, the SMT siblings of CPU n are numbered n + 8.
+static void test_multi_socket(const std::string &root)
+{
+	write_file(root + "/cpu/online", "0-15");
+	for (unsigned core = 0; core < 8; core++)
+	{
+		unsigned domain = core / 2;
+		for (unsigned cpu : { core, core + 8 })
+		{
+			std::string cpu_path = root + "/cpu/cpu" + std::to_string(cpu);
+			write_file(cpu_path + "/topology/thread_siblings_list", std::to_string(core) + "," + std::to_string(core + 8));
+			write_file(cpu_path + "/cache/index0/level", "1");
+			write_file(cpu_path + "/cache/index0/shared_cpu_list", std::to_string(core) + "," + std::to_string(core + 8));
+			write_file(cpu_path + "/cache/index1/level", "2");
+			write_file(cpu_path + "/cache/index1/shared_cpu_list", std::to_string(core) + "," + std::to_string(core + 8));
+			write_file(cpu_path + "/cache/index2/level", "3");
+			write_file(cpu_path + "/cache/index2/shared_cpu_list",
+			           std::to_string(domain * 2) + "-" + std::to_string(domain * 2 + 1) + "," +
+			           std::to_string(domain * 2 + 8) + "-" + std::to_string(domain * 2 + 9));
+		}
+	}
+	write_file(root + "/node/online", "0-1");
+	write_file(root + "/node/node0/cpulist", "0-3,8-11");
+	write_file(root + "/node/node1/cpulist", "4-7,12-15");
+
+	CPUTopology topology;
+	if (!query_cpu_topology(&topology, root))
+		abort();
+
+	if (topology.cpus.size() != 16 || topology.num_cores != 8 || topology.num_l3_domains != 4 || topology.num_nodes != 2)
+		abort();
+
+	if (topology.cpus[9].core != topology.cpus[1].core)
+		abort();
+	if (topology.cpus[3].l3_domain != topology.cpus[10].l3_domain)
+		abort();
+	if (topology.cpus[12].node != 1)
+		abort();
+
+	// First SMT thread of every core, round-robin over L3 domains, then the second SMT threads.
+	static const unsigned expected_core_order[] = { 0, 2, 4, 6, 1, 3, 5, 7, 8, 10, 12, 14, 9, 11, 13, 15, 0 };
+	for (unsigned slot = 0; slot < sizeof(expected_core_order) / sizeof(expected_core_order[0]); slot++)
+		if (!equal(get_placement_cpus(topology, ThreadPlacement::Core, slot), { expected_core_order[slot] }))
+			abort();
+
+	if (!equal(get_placement_cpus(topology, ThreadPlacement::L3, 1), { 2, 3, 10, 11 }))
+		abort();
+	if (!equal(get_placement_cpus(topology, ThreadPlacement::L3, 5), { 2, 3, 10, 11 }))
+		abort();
+	if (!equal(get_placement_cpus(topology, ThreadPlacement::Node, 1), { 4, 5, 6, 7, 12, 13, 14, 15 }))
+		abort();
+	if (!get_placement_cpus(topology, ThreadPlacement::None, 0).empty())
+		abort();
+}
+
+// Minimal sysfs, e.g. in containers or VMs without cache information or NUMA.
+static void test_minimal(const std::string &root)
+{
+	write_file(root + "/cpu/online", "0-3");
+
+	CPUTopology topology;
+	if (!query_cpu_topology(&topology, root))
+		abort();
+
+	if (topology.cpus.size() != 4 || topology.num_cores != 4 || topology.num_l3_domains != 4 || topology.num_nodes != 1)
+		abort();
+
+	if (!equal(get_placement_cpus(topology, ThreadPlacement::Node, 3), { 0, 1, 2, 3 }))
+		abort();
+}
+
+static void test_missing(const std::string &root)
+{
+	CPUTopology topology;
+	if (query_cpu_topology(&topology, root + "/does-not-exist"))
+		abort();
+}
+
+int main()
+{
+	char root[] = "/tmp/fossilize-topology-XXXXXX";
+	if (!mkdtemp(root))
+		return EXIT_FAILURE;
+
+	test_cpu_list();
+	test_multi_socket(std::string(root) + "/multi-socket");
+	test_minimal(std::string(root) + "/minimal");
+	test_missing(root);
+
+	// Whatever the host looks like, placement must never come up empty.
+	CPUTopology topology;
+	if (query_cpu_topology(&topology))
+	{
+		restrict_cpu_topology_to_affinity(&topology);
+		if (topology.cpus.empty())
+			abort();
+		LOGI("Host has %u CPUs, %u cores, %u L3 domains, %u nodes.\n",
+		     unsigned(topology.cpus.size()), topology.num_cores, topology.num_l3_domains, topology.num_nodes);
+
+		for (auto placement : { ThreadPlacement::Core, ThreadPlacement::L3, ThreadPlacement::Node })
+			for (unsigned slot = 0; slot < 2 * unsigned(topology.cpus.size()); slot++)
+				if (get_placement_cpus(topology, placement, slot).empty())
+					abort();
+
+		if (!pin_current_thread(get_placement_cpus(topology, ThreadPlacement::Core, 0)))
+			abort();
+	}
+
+	nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
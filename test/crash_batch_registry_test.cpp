@@ -0,0 +1,155 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "layer/crash_batch_registry.hpp"
+#include "fossilize_db.hpp"
+#include "layer/utils.hpp"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <memory>
+#include <thread>
+
+using namespace Fossilize;
+
+static const char *db_path = ".__test_crash_batch_registry.foz";
+static const unsigned NumPipelines = 4;
+
+template <typename T>
+static inline T fake_handle(uint64_t v)
+{
+	return (T)v;
+}
+
+static void crash_handler(int)
+{
+	_exit(recordRegisteredCrashBatches() ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+// Mimics a driver which compiles a batch on its own thread, and crashes there.
+static void run_crashing_child()
+{
+	auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(db_path, DatabaseMode::OverWrite));
+	StateRecorder recorder;
+	recorder.init_recording_thread(db.get());
+
+	VkPipelineLayoutCreateInfo layout_info = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+	if (!recorder.record_pipeline_layout(fake_handle<VkPipelineLayout>(1), layout_info))
+		_exit(EXIT_FAILURE);
+
+	uint32_t code[NumPipelines][8];
+	VkComputePipelineCreateInfo infos[NumPipelines];
+	for (unsigned i = 0; i < NumPipelines; i++)
+	{
+		for (unsigned j = 0; j < 8; j++)
+			code[i][j] = i * 8 + j;
+
+		VkShaderModuleCreateInfo module_info = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+		module_info.codeSize = sizeof(code[i]);
+		module_info.pCode = code[i];
+		if (!recorder.record_shader_module(fake_handle<VkShaderModule>(i + 1), module_info))
+			_exit(EXIT_FAILURE);
+
+		infos[i] = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+		infos[i].layout = fake_handle<VkPipelineLayout>(1);
+		infos[i].stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+		infos[i].stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+		infos[i].stage.module = fake_handle<VkShaderModule>(i + 1);
+		infos[i].stage.pName = "main";
+	}
+
+	struct sigaction sa = {};
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = crash_handler;
+	sigaction(SIGSEGV, &sa, nullptr);
+
+	if (registerCrashBatch(&recorder, nullptr, infos, NumPipelines) < 0)
+		_exit(EXIT_FAILURE);
+
+	// raise() delivers the signal to the calling thread, which has no knowledge of the batch.
+	std::thread driver_thread([]() { raise(SIGSEGV); });
+	driver_thread.join();
+	_exit(EXIT_FAILURE);
+}
+
+static bool test_unregistered_batches_are_not_recorded()
+{
+	StateRecorder recorder;
+	VkComputePipelineCreateInfo info = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+
+	int slots[2];
+	for (auto &slot : slots)
+		if ((slot = registerCrashBatch(&recorder, nullptr, &info, 1)) < 0)
+			return false;
+	if (slots[0] == slots[1])
+		return false;
+	for (auto &slot : slots)
+		unregisterCrashBatch(slot);
+
+	return !recordRegisteredCrashBatches();
+}
+
+static bool test_crash_on_other_thread()
+{
+	remove(db_path);
+
+	pid_t pid = fork();
+	if (pid < 0)
+		return false;
+	if (pid == 0)
+		run_crashing_child();
+
+	int status = 0;
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+	{
+		LOGE("Crashing child did not record the batch.\n");
+		return false;
+	}
+
+	auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(db_path, DatabaseMode::ReadOnly));
+	if (!db->prepare())
+		return false;
+
+	size_t count = 0;
+	if (!db->get_hash_list_for_resource_tag(RESOURCE_COMPUTE_PIPELINE, &count, nullptr))
+		return false;
+	if (count != NumPipelines)
+	{
+		LOGE("Expected %u compute pipelines, got %u.\n", NumPipelines, unsigned(count));
+		return false;
+	}
+
+	db.reset();
+	remove(db_path);
+	return true;
+}
+
+int main()
+{
+	if (!test_unregistered_batches_are_not_recorded())
+		return EXIT_FAILURE;
+	if (!test_crash_on_other_thread())
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
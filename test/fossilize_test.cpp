@@ -27,6 +27,8 @@
 #include <memory>
 #include <vector>
 #include <string>
+#include <thread>
+#include <chrono>
 #include "layer/utils.hpp"
 
 using namespace Fossilize;
@@ -858,6 +860,70 @@ static bool test_concurrent_database_extra_paths()
 	return true;
 }
 
+static bool test_concurrent_database_lazy_priming()
+{
+	// Reuses the archives written by test_concurrent_database_extra_paths().
+	remove(".__test_concurrent.4.foz");
+	static const char *extra_paths = ".__test_concurrent.1.foz;.__test_concurrent.2.foz;.__test_concurrent.3.foz";
+	static const uint8_t blob[] = {1, 2, 3};
+
+	auto append_db = std::unique_ptr<DatabaseInterface>(
+			create_concurrent_database_with_encoded_extra_paths(".__test_concurrent",
+			                                                    DatabaseMode::Append, extra_paths, true));
+	if (!append_db->prepare())
+		return false;
+
+	// Nothing has forced priming to complete yet, so the archives are only visible through
+	// has_entry() once their background thread has prepared them.
+	for (Hash i = 1; i <= 4; i++)
+	{
+		unsigned attempts = 0;
+		while (!append_db->has_entry(RESOURCE_SAMPLER, i))
+		{
+			if (++attempts > 10000)
+				return false;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+	if (append_db->has_entry(RESOURCE_SAMPLER, 5))
+		return false;
+	if (append_db->has_entry(RESOURCE_DESCRIPTOR_SET_LAYOUT, 4))
+		return false;
+
+	// Reading is not supported in append mode, primed or not.
+	size_t blob_size;
+	if (append_db->read_entry(RESOURCE_SAMPLER, 1, &blob_size, nullptr, 0))
+		return false;
+
+	if (!append_db->write_entry(RESOURCE_SAMPLER, 4, blob, sizeof(blob), 0))
+		return false;
+
+	// This should not be written.
+	if (file_exists(".__test_concurrent.4.foz"))
+		return false;
+
+	// Waits for priming to complete.
+	size_t num_samplers;
+	if (!append_db->get_hash_list_for_resource_tag(RESOURCE_SAMPLER, &num_samplers, nullptr))
+		return false;
+	if (num_samplers != 4)
+		return false;
+
+	for (Hash i = 1; i <= 4; i++)
+		if (!append_db->has_entry(RESOURCE_SAMPLER, i))
+			return false;
+
+	if (!append_db->write_entry(RESOURCE_DESCRIPTOR_SET_LAYOUT, 4, blob, sizeof(blob), 0))
+		return false;
+
+	// .. but now it should exist.
+	if (!file_exists(".__test_concurrent.4.foz"))
+		return false;
+
+	return true;
+}
+
 static bool test_concurrent_database()
 {
 	// Test a normal flow. First time we don't have the read-only database.
@@ -1090,6 +1156,8 @@ int main()
 {
 	if (!test_concurrent_database_extra_paths())
 		return EXIT_FAILURE;
+	if (!test_concurrent_database_lazy_priming())
+		return EXIT_FAILURE;
 	if (!test_concurrent_database())
 		return EXIT_FAILURE;
 	if (!test_database())
@@ -23,12 +23,14 @@
 #include "util/object_cache.hpp"
 #include "layer/utils.hpp"
 #include <stdlib.h>
+#include <thread>
+#include <vector>
 
 using namespace Fossilize;
 
-int main()
+template <typename Cache>
+static void test_basic(Cache &cache)
 {
-	ObjectCache<int> cache;
 	cache.set_target_size(0);
 
 	// Trivial test, insert two objects and delete the cache.
@@ -81,3 +83,81 @@ int main()
 	if (cache.get_current_object_count() != 0)
 		abort();
 }
+
+static void test_concurrent_stress()
+{
+	ConcurrentObjectCache<int> cache;
+	cache.set_target_size(1000);
+
+	// Each thread owns a disjoint range of keys, but they all hit the same shards.
+	const unsigned num_threads = 8;
+	const unsigned objects_per_thread = 20000;
+	std::vector<std::thread> threads;
+	for (unsigned t = 0; t < num_threads; t++)
+	{
+		threads.emplace_back([&cache, t]() {
+			for (unsigned i = 0; i < objects_per_thread; i++)
+			{
+				Hash hash = Hash(t) * objects_per_thread + i + 1;
+				cache.insert_object(hash, int(hash), 1);
+				auto result = cache.find_object(hash);
+				if (!result.second || result.first != int(hash))
+					abort();
+
+				// Lookups of other threads' keys may or may not hit, but must never return the wrong object.
+				Hash other = Hash((t + 1) % num_threads) * objects_per_thread + i + 1;
+				result = cache.find_object(other);
+				if (result.second && result.first != int(other))
+					abort();
+			}
+		});
+	}
+
+	for (auto &t : threads)
+		t.join();
+
+	if (cache.get_current_object_count() != num_threads * objects_per_thread)
+		abort();
+	if (cache.get_current_total_size() != num_threads * objects_per_thread)
+		abort();
+
+	// Prune while other threads keep inserting. The budget only holds at the prune point.
+	std::thread inserter([&cache]() {
+		for (unsigned i = 0; i < objects_per_thread; i++)
+			cache.insert_object(Hash(num_threads) * objects_per_thread + i + 1, 0, 1);
+	});
+
+	unsigned evicted = 0;
+	for (unsigned i = 0; i < 100; i++)
+		cache.prune_cache([&](Hash, int) { evicted++; });
+	inserter.join();
+
+	cache.prune_cache([&](Hash, int) { evicted++; });
+	if (cache.get_current_total_size() != 1000)
+		abort();
+	if (cache.get_current_object_count() != 1000)
+		abort();
+	if (evicted != (num_threads + 1) * objects_per_thread - 1000)
+		abort();
+
+	// The most recently inserted objects are the ones which survive.
+	if (!cache.find_object(Hash(num_threads + 1) * objects_per_thread).second)
+		abort();
+
+	cache.delete_cache([](Hash, int) {});
+	if (cache.get_current_total_size() != 0)
+		abort();
+	if (cache.get_current_object_count() != 0)
+		abort();
+}
+
+int main()
+{
+	ObjectCache<int> cache;
+	test_basic(cache);
+
+	ConcurrentObjectCache<int> concurrent_cache;
+	test_basic(concurrent_cache);
+
+	test_concurrent_stress();
+}
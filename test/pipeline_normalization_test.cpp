@@ -0,0 +1,490 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "fossilize_normalize.hpp"
+#include "layer/utils.hpp"
+#include "fossilize_inttypes.h"
+#include <functional>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace Fossilize;
+
+template <typename T>
+static inline T fake_handle(uint64_t value)
+{
+	static_assert(sizeof(T) == sizeof(uint64_t), "Handle size is not 64-bit.");
+	return (T)value;
+}
+
+// Owns all state of a graphics pipeline, so tests can modify individual fields.
+struct PipelineState
+{
+	PipelineState()
+	{
+		static const VkShaderStageFlagBits stage_bits[] = {
+			VK_SHADER_STAGE_VERTEX_BIT,
+			VK_SHADER_STAGE_FRAGMENT_BIT,
+			VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT,
+			VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT,
+		};
+
+		for (unsigned i = 0; i < 4; i++)
+		{
+			stages[i] = { VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO };
+			stages[i].stage = stage_bits[i];
+			stages[i].module = fake_handle<VkShaderModule>(0x100 + i);
+			stages[i].pName = "main";
+		}
+
+		vi = { VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
+		ia = { VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO };
+		ia.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+		tess = { VK_STRUCTURE_TYPE_PIPELINE_TESSELLATION_STATE_CREATE_INFO };
+		tess.patchControlPoints = 3;
+
+		viewports[0] = { 0.0f, 0.0f, 1920.0f, 1080.0f, 0.0f, 1.0f };
+		scissors[0] = { { 0, 0 }, { 1920, 1080 } };
+		vp = { VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO };
+		vp.viewportCount = 1;
+		vp.pViewports = viewports;
+		vp.scissorCount = 1;
+		vp.pScissors = scissors;
+
+		rs = { VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO };
+		rs.polygonMode = VK_POLYGON_MODE_FILL;
+		rs.cullMode = VK_CULL_MODE_BACK_BIT;
+		rs.lineWidth = 1.0f;
+
+		ms = { VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO };
+		ms.rasterizationSamples = VK_SAMPLE_COUNT_4_BIT;
+
+		ds = { VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO };
+		ds.depthTestEnable = VK_TRUE;
+		ds.depthWriteEnable = VK_TRUE;
+		ds.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+
+		for (auto &att : attachments)
+		{
+			att = {};
+			att.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+			                     VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+		}
+
+		attachments[0].blendEnable = VK_TRUE;
+		attachments[0].srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+		attachments[0].dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+		attachments[0].colorBlendOp = VK_BLEND_OP_ADD;
+		attachments[0].srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+		attachments[0].dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+		attachments[0].alphaBlendOp = VK_BLEND_OP_ADD;
+
+		cb = { VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO };
+		cb.attachmentCount = 2;
+		cb.pAttachments = attachments;
+
+		dynamic = { VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO };
+		dynamic.pDynamicStates = dynamic_states;
+
+		info = { VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
+		info.stageCount = 2;
+		info.pStages = stages;
+		info.pVertexInputState = &vi;
+		info.pInputAssemblyState = &ia;
+		info.pViewportState = &vp;
+		info.pRasterizationState = &rs;
+		info.pMultisampleState = &ms;
+		info.pDepthStencilState = &ds;
+		info.pColorBlendState = &cb;
+		info.layout = fake_handle<VkPipelineLayout>(0x200);
+		info.renderPass = fake_handle<VkRenderPass>(0x300);
+		info.basePipelineIndex = -1;
+	}
+
+	void add_dynamic_state(VkDynamicState state)
+	{
+		dynamic_states[dynamic.dynamicStateCount++] = state;
+		info.pDynamicState = &dynamic;
+	}
+
+	// Pointers refer to members.
+	PipelineState(const PipelineState &) = delete;
+	void operator=(const PipelineState &) = delete;
+
+	VkPipelineShaderStageCreateInfo stages[4];
+	VkPipelineVertexInputStateCreateInfo vi;
+	VkPipelineInputAssemblyStateCreateInfo ia;
+	VkPipelineTessellationStateCreateInfo tess;
+	VkViewport viewports[1];
+	VkRect2D scissors[1];
+	VkPipelineViewportStateCreateInfo vp;
+	VkPipelineRasterizationStateCreateInfo rs;
+	VkSampleMask sample_mask[1] = {};
+	VkPipelineMultisampleStateCreateInfo ms;
+	VkPipelineDepthStencilStateCreateInfo ds;
+	VkPipelineColorBlendAttachmentState attachments[2];
+	VkPipelineColorBlendStateCreateInfo cb;
+	VkDynamicState dynamic_states[16] = {};
+	VkPipelineDynamicStateCreateInfo dynamic;
+	VkGraphicsPipelineCreateInfo info;
+};
+
+using Mutator = std::function<void (PipelineState &)>;
+
+static bool normalized_hash(const VkGraphicsPipelineCreateInfo &info, Hash *hash, NormalizationRuleFlags *rules)
+{
+	ScratchAllocator alloc;
+	VkGraphicsPipelineCreateInfo normalized;
+	if (!normalize_graphics_pipeline(alloc, info, &normalized, rules))
+		return false;
+
+	// Normalizing twice must not change anything.
+	NormalizationRuleFlags second_rules = 0;
+	if (!normalize_graphics_pipeline(alloc, normalized, &normalized, &second_rules) || second_rules != 0)
+	{
+		LOGE("Normalization is not idempotent, rules 0x%x applied twice.\n", second_rules);
+		return false;
+	}
+
+	return Hashing::compute_hash_graphics_pipeline_by_handles(normalized, hash);
+}
+
+// setup is applied to both pipelines, and ignored_change only to the second.
+// If expect_equivalent, both must normalize to the same hash and rule must have been applied to the second.
+// Otherwise, the hashes must differ.
+static bool test_rule(const char *what, NormalizationRuleFlags rule, bool expect_equivalent,
+                      const Mutator &setup, const Mutator &ignored_change)
+{
+	PipelineState a, b;
+	setup(a);
+	setup(b);
+	ignored_change(b);
+
+	Hash hash_a = 0, hash_b = 0;
+	NormalizationRuleFlags rules_a = 0, rules_b = 0;
+	if (!normalized_hash(a.info, &hash_a, &rules_a) || !normalized_hash(b.info, &hash_b, &rules_b))
+	{
+		LOGE("%s: Failed to normalize.\n", what);
+		return false;
+	}
+
+	if (expect_equivalent)
+	{
+		if (hash_a != hash_b)
+		{
+			LOGE("%s: Expected equivalent pipelines, got %016" PRIx64 " and %016" PRIx64 ".\n", what, hash_a, hash_b);
+			return false;
+		}
+
+		if ((rules_b & rule) == 0)
+		{
+			LOGE("%s: Expected rule 0x%x to be applied, got 0x%x.\n", what, rule, rules_b);
+			return false;
+		}
+	}
+	else if (hash_a == hash_b)
+	{
+		LOGE("%s: Expected distinct pipelines.\n", what);
+		return false;
+	}
+
+	return true;
+}
+
+static bool test_rules()
+{
+	static const Mutator none = [](PipelineState &) {};
+
+	struct Case
+	{
+		const char *what;
+		NormalizationRuleFlags rule;
+		bool expect_equivalent;
+		Mutator setup;
+		Mutator ignored_change;
+	};
+
+	const Case cases[] = {
+		{ "Non-derivative base pipeline", NORMALIZATION_RULE_BASE_PIPELINE_BIT, true, none,
+		  [](PipelineState &p) { p.info.basePipelineHandle = fake_handle<VkPipeline>(0x400); p.info.basePipelineIndex = 0; } },
+		{ "Derivative base pipeline", NORMALIZATION_RULE_BASE_PIPELINE_BIT, false,
+		  [](PipelineState &p) { p.info.flags = VK_PIPELINE_CREATE_DERIVATIVE_BIT; p.info.basePipelineHandle = fake_handle<VkPipeline>(0x400); },
+		  [](PipelineState &p) { p.info.basePipelineHandle = fake_handle<VkPipeline>(0x401); } },
+
+		{ "Dynamic state order", NORMALIZATION_RULE_DYNAMIC_STATE_LIST_BIT, true,
+		  [](PipelineState &p) { p.add_dynamic_state(VK_DYNAMIC_STATE_VIEWPORT); p.add_dynamic_state(VK_DYNAMIC_STATE_SCISSOR); },
+		  [](PipelineState &p) {
+			  p.dynamic_states[0] = VK_DYNAMIC_STATE_SCISSOR;
+			  p.dynamic_states[1] = VK_DYNAMIC_STATE_VIEWPORT;
+			  p.add_dynamic_state(VK_DYNAMIC_STATE_SCISSOR);
+		  } },
+		{ "Empty dynamic state", NORMALIZATION_RULE_DYNAMIC_STATE_LIST_BIT, true, none,
+		  [](PipelineState &p) { p.info.pDynamicState = &p.dynamic; } },
+
+		{ "Dynamic viewport", NORMALIZATION_RULE_DYNAMIC_VIEWPORT_BIT, true,
+		  [](PipelineState &p) { p.add_dynamic_state(VK_DYNAMIC_STATE_VIEWPORT); },
+		  [](PipelineState &p) { p.viewports[0].width = 1280.0f; } },
+		{ "Static viewport", NORMALIZATION_RULE_DYNAMIC_VIEWPORT_BIT, false, none,
+		  [](PipelineState &p) { p.viewports[0].width = 1280.0f; } },
+		{ "Dynamic viewport count", NORMALIZATION_RULE_DYNAMIC_VIEWPORT_BIT, false,
+		  [](PipelineState &p) { p.add_dynamic_state(VK_DYNAMIC_STATE_VIEWPORT); },
+		  [](PipelineState &p) { p.vp.viewportCount = 2; p.vp.pViewports = nullptr; } },
+		{ "Dynamic scissor", NORMALIZATION_RULE_DYNAMIC_SCISSOR_BIT, true,
+		  [](PipelineState &p) { p.add_dynamic_state(VK_DYNAMIC_STATE_SCISSOR); },
+		  [](PipelineState &p) { p.scissors[0].offset.x = 16; } },
+		{ "Static scissor", NORMALIZATION_RULE_DYNAMIC_SCISSOR_BIT, false, none,
+		  [](PipelineState &p) { p.scissors[0].offset.x = 16; } },
+
+		{ "Dynamic line width", NORMALIZATION_RULE_LINE_WIDTH_BIT, true,
+		  [](PipelineState &p) { p.add_dynamic_state(VK_DYNAMIC_STATE_LINE_WIDTH); },
+		  [](PipelineState &p) { p.rs.lineWidth = 4.0f; } },
+		{ "Static line width", NORMALIZATION_RULE_LINE_WIDTH_BIT, false, none,
+		  [](PipelineState &p) { p.rs.lineWidth = 4.0f; } },
+
+		{ "Disabled depth bias", NORMALIZATION_RULE_DEPTH_BIAS_BIT, true, none,
+		  [](PipelineState &p) { p.rs.depthBiasConstantFactor = 2.0f; p.rs.depthBiasSlopeFactor = -0.0f; } },
+		{ "Dynamic depth bias", NORMALIZATION_RULE_DEPTH_BIAS_BIT, true,
+		  [](PipelineState &p) { p.rs.depthBiasEnable = VK_TRUE; p.add_dynamic_state(VK_DYNAMIC_STATE_DEPTH_BIAS); },
+		  [](PipelineState &p) { p.rs.depthBiasClamp = 1.0f; } },
+		{ "Static depth bias", NORMALIZATION_RULE_DEPTH_BIAS_BIT, false,
+		  [](PipelineState &p) { p.rs.depthBiasEnable = VK_TRUE; },
+		  [](PipelineState &p) { p.rs.depthBiasConstantFactor = 2.0f; } },
+
+		{ "Disabled depth test", NORMALIZATION_RULE_DEPTH_TEST_BIT, true,
+		  [](PipelineState &p) { p.ds.depthTestEnable = VK_FALSE; },
+		  [](PipelineState &p) { p.ds.depthCompareOp = VK_COMPARE_OP_GREATER; } },
+		{ "Depth writes without depth test", NORMALIZATION_RULE_DEPTH_TEST_BIT, true,
+		  [](PipelineState &p) { p.ds.depthTestEnable = VK_FALSE; p.ds.depthWriteEnable = VK_FALSE; },
+		  [](PipelineState &p) { p.ds.depthWriteEnable = VK_TRUE; } },
+		{ "Enabled depth test", NORMALIZATION_RULE_DEPTH_TEST_BIT, false, none,
+		  [](PipelineState &p) { p.ds.depthCompareOp = VK_COMPARE_OP_GREATER; } },
+
+		{ "Disabled depth bounds", NORMALIZATION_RULE_DEPTH_BOUNDS_BIT, true, none,
+		  [](PipelineState &p) { p.ds.maxDepthBounds = 0.5f; } },
+		{ "Dynamic depth bounds", NORMALIZATION_RULE_DEPTH_BOUNDS_BIT, true,
+		  [](PipelineState &p) { p.ds.depthBoundsTestEnable = VK_TRUE; p.add_dynamic_state(VK_DYNAMIC_STATE_DEPTH_BOUNDS); },
+		  [](PipelineState &p) { p.ds.maxDepthBounds = 0.5f; } },
+		{ "Static depth bounds", NORMALIZATION_RULE_DEPTH_BOUNDS_BIT, false,
+		  [](PipelineState &p) { p.ds.depthBoundsTestEnable = VK_TRUE; },
+		  [](PipelineState &p) { p.ds.maxDepthBounds = 0.5f; } },
+
+		{ "Disabled stencil test", NORMALIZATION_RULE_STENCIL_BIT, true, none,
+		  [](PipelineState &p) { p.ds.front.failOp = VK_STENCIL_OP_REPLACE; p.ds.back.reference = 7; } },
+		{ "Dynamic stencil reference", NORMALIZATION_RULE_STENCIL_BIT, true,
+		  [](PipelineState &p) { p.ds.stencilTestEnable = VK_TRUE; p.add_dynamic_state(VK_DYNAMIC_STATE_STENCIL_REFERENCE); },
+		  [](PipelineState &p) { p.ds.front.reference = 0x80; } },
+		{ "Dynamic stencil masks", NORMALIZATION_RULE_STENCIL_BIT, true,
+		  [](PipelineState &p) {
+			  p.ds.stencilTestEnable = VK_TRUE;
+			  p.add_dynamic_state(VK_DYNAMIC_STATE_STENCIL_COMPARE_MASK);
+			  p.add_dynamic_state(VK_DYNAMIC_STATE_STENCIL_WRITE_MASK);
+		  },
+		  [](PipelineState &p) { p.ds.back.compareMask = 0xff; p.ds.front.writeMask = 0x0f; } },
+		{ "Static stencil reference", NORMALIZATION_RULE_STENCIL_BIT, false,
+		  [](PipelineState &p) { p.ds.stencilTestEnable = VK_TRUE; },
+		  [](PipelineState &p) { p.ds.front.reference = 0x80; } },
+		{ "Enabled stencil ops", NORMALIZATION_RULE_STENCIL_BIT, false,
+		  [](PipelineState &p) { p.ds.stencilTestEnable = VK_TRUE; p.add_dynamic_state(VK_DYNAMIC_STATE_STENCIL_REFERENCE); },
+		  [](PipelineState &p) { p.ds.front.failOp = VK_STENCIL_OP_REPLACE; } },
+
+		{ "Disabled sample shading", NORMALIZATION_RULE_SAMPLE_SHADING_BIT, true, none,
+		  [](PipelineState &p) { p.ms.minSampleShading = 0.5f; } },
+		{ "Enabled sample shading", NORMALIZATION_RULE_SAMPLE_SHADING_BIT, false,
+		  [](PipelineState &p) { p.ms.sampleShadingEnable = VK_TRUE; },
+		  [](PipelineState &p) { p.ms.minSampleShading = 0.5f; } },
+
+		{ "All-ones sample mask", NORMALIZATION_RULE_SAMPLE_MASK_BIT, true, none,
+		  [](PipelineState &p) { p.sample_mask[0] = 0xf; p.ms.pSampleMask = p.sample_mask; } },
+		{ "Sample mask bits beyond sample count", NORMALIZATION_RULE_SAMPLE_MASK_BIT, true,
+		  [](PipelineState &p) { p.sample_mask[0] = 0x5; p.ms.pSampleMask = p.sample_mask; },
+		  [](PipelineState &p) { p.sample_mask[0] = 0xfff5; } },
+		{ "Partial sample mask", NORMALIZATION_RULE_SAMPLE_MASK_BIT, false, none,
+		  [](PipelineState &p) { p.sample_mask[0] = 0x5; p.ms.pSampleMask = p.sample_mask; } },
+
+		{ "Disabled logic op", NORMALIZATION_RULE_LOGIC_OP_BIT, true, none,
+		  [](PipelineState &p) { p.cb.logicOp = VK_LOGIC_OP_XOR; } },
+		{ "Enabled logic op", NORMALIZATION_RULE_LOGIC_OP_BIT, false,
+		  [](PipelineState &p) { p.cb.logicOpEnable = VK_TRUE; },
+		  [](PipelineState &p) { p.cb.logicOp = VK_LOGIC_OP_XOR; } },
+
+		{ "Disabled blending", NORMALIZATION_RULE_BLEND_ATTACHMENT_BIT, true, none,
+		  [](PipelineState &p) { p.attachments[1].srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA; p.attachments[1].alphaBlendOp = VK_BLEND_OP_MAX; } },
+		{ "Enabled blending", NORMALIZATION_RULE_BLEND_ATTACHMENT_BIT, false, none,
+		  [](PipelineState &p) { p.attachments[0].srcColorBlendFactor = VK_BLEND_FACTOR_ONE; } },
+
+		{ "Unused blend constants", NORMALIZATION_RULE_BLEND_CONSTANTS_BIT, true, none,
+		  [](PipelineState &p) { p.cb.blendConstants[2] = 0.5f; } },
+		{ "Dynamic blend constants", NORMALIZATION_RULE_BLEND_CONSTANTS_BIT, true,
+		  [](PipelineState &p) { p.attachments[0].dstColorBlendFactor = VK_BLEND_FACTOR_CONSTANT_COLOR; p.add_dynamic_state(VK_DYNAMIC_STATE_BLEND_CONSTANTS); },
+		  [](PipelineState &p) { p.cb.blendConstants[2] = 0.5f; } },
+		{ "Static blend constants", NORMALIZATION_RULE_BLEND_CONSTANTS_BIT, false,
+		  [](PipelineState &p) { p.attachments[0].dstColorBlendFactor = VK_BLEND_FACTOR_CONSTANT_COLOR; },
+		  [](PipelineState &p) { p.cb.blendConstants[2] = 0.5f; } },
+
+		{ "Rasterizer discard", NORMALIZATION_RULE_RASTERIZER_DISCARD_BIT, true,
+		  [](PipelineState &p) { p.rs.rasterizerDiscardEnable = VK_TRUE; },
+		  [](PipelineState &p) {
+			  p.viewports[0].width = 1280.0f;
+			  p.ms.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+			  p.ds.depthBoundsTestEnable = VK_TRUE;
+			  p.attachments[0].colorWriteMask = 0;
+		  } },
+		{ "Rasterization enabled", NORMALIZATION_RULE_RASTERIZER_DISCARD_BIT, false, none,
+		  [](PipelineState &p) { p.ms.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT; } },
+
+		{ "Tessellation state without tessellation", NORMALIZATION_RULE_TESSELLATION_BIT, true, none,
+		  [](PipelineState &p) { p.info.pTessellationState = &p.tess; } },
+		{ "Tessellation state with tessellation", NORMALIZATION_RULE_TESSELLATION_BIT, false,
+		  [](PipelineState &p) { p.info.stageCount = 4; p.info.pTessellationState = &p.tess; },
+		  [](PipelineState &p) { p.tess.patchControlPoints = 4; } },
+	};
+
+	for (auto &c : cases)
+		if (!test_rule(c.what, c.rule, c.expect_equivalent, c.setup, c.ignored_change))
+			return false;
+
+	return true;
+}
+
+static bool test_preserved_state()
+{
+	ScratchAllocator alloc;
+	PipelineState p;
+	p.attachments[1].colorWriteMask = VK_COLOR_COMPONENT_R_BIT;
+	p.attachments[1].srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+	p.attachments[0].dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_CONSTANT_ALPHA;
+	p.cb.blendConstants[3] = 0.25f;
+
+	VkGraphicsPipelineCreateInfo normalized;
+	NormalizationRuleFlags rules = 0;
+	if (!normalize_graphics_pipeline(alloc, p.info, &normalized, &rules))
+		return false;
+
+	// The write mask applies even without blending.
+	if (normalized.pColorBlendState->pAttachments[1].colorWriteMask != VK_COLOR_COMPONENT_R_BIT ||
+	    normalized.pColorBlendState->pAttachments[1].srcColorBlendFactor != VK_BLEND_FACTOR_ZERO)
+	{
+		LOGE("Blend attachment was not normalized correctly.\n");
+		return false;
+	}
+
+	// ONE_MINUS_CONSTANT_* factors read the blend constants as well.
+	if (normalized.pColorBlendState->blendConstants[3] != 0.25f || (rules & NORMALIZATION_RULE_BLEND_CONSTANTS_BIT) != 0)
+	{
+		LOGE("Blend constants were normalized, but they are in use.\n");
+		return false;
+	}
+
+	// The input must never be modified.
+	if (p.attachments[1].srcColorBlendFactor != VK_BLEND_FACTOR_SRC_ALPHA || normalized.pColorBlendState == &p.cb)
+	{
+		LOGE("Input was modified.\n");
+		return false;
+	}
+
+	// Untouched state is not copied.
+	if (normalized.pDepthStencilState != &p.ds || normalized.pVertexInputState != &p.vi)
+	{
+		LOGE("Unmodified state was copied.\n");
+		return false;
+	}
+
+	return true;
+}
+
+static bool test_unknown_dynamic_state()
+{
+	ScratchAllocator alloc;
+	PipelineState p;
+
+	// Any dynamic state which is not known to the rules, e.g. VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE_EXT,
+	// might make state which looks ignored relevant again.
+	p.add_dynamic_state(VK_DYNAMIC_STATE_VIEWPORT);
+	p.add_dynamic_state(VkDynamicState(1000267006));
+
+	VkGraphicsPipelineCreateInfo normalized;
+	NormalizationRuleFlags rules = ~0u;
+	if (normalize_graphics_pipeline(alloc, p.info, &normalized, &rules))
+	{
+		LOGE("Normalized pipeline with unknown dynamic state.\n");
+		return false;
+	}
+
+	if (rules != 0 || normalized.pViewportState != &p.vp || normalized.pDepthStencilState != &p.ds)
+	{
+		LOGE("Pipeline with unknown dynamic state was modified.\n");
+		return false;
+	}
+
+	return true;
+}
+
+// Normalized hashes end up in archives, so the rules must not change without bumping the version.
+static bool test_version()
+{
+	static_assert(FOSSILIZE_NORMALIZATION_VERSION == 1, "Update the reference hash for the new normalization version.");
+	const Hash reference_hash = 0x0c89f9229b9f2fc6ull;
+
+	PipelineState p;
+	p.add_dynamic_state(VK_DYNAMIC_STATE_SCISSOR);
+	p.add_dynamic_state(VK_DYNAMIC_STATE_VIEWPORT);
+	p.add_dynamic_state(VK_DYNAMIC_STATE_LINE_WIDTH);
+	p.rs.lineWidth = 2.0f;
+	p.rs.depthBiasClamp = 1.0f;
+	p.ds.depthTestEnable = VK_FALSE;
+	p.ds.depthBoundsTestEnable = VK_FALSE;
+	p.ds.maxDepthBounds = 0.5f;
+	p.ds.front.reference = 3;
+	p.ms.minSampleShading = 0.5f;
+	p.cb.logicOp = VK_LOGIC_OP_XOR;
+	p.cb.blendConstants[0] = 1.0f;
+	p.attachments[1].dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
+	p.info.pTessellationState = &p.tess;
+	p.info.basePipelineIndex = 0;
+
+	Hash hash = 0;
+	NormalizationRuleFlags rules = 0;
+	if (!normalized_hash(p.info, &hash, &rules))
+		return false;
+
+	if (hash != reference_hash)
+	{
+		LOGE("Normalized hash changed to %016" PRIx64 ", but FOSSILIZE_NORMALIZATION_VERSION did not.\n", hash);
+		return false;
+	}
+
+	return true;
+}
+
+int main()
+{
+	if (!test_rules())
+		return EXIT_FAILURE;
+	if (!test_preserved_state())
+		return EXIT_FAILURE;
+	if (!test_unknown_dynamic_state())
+		return EXIT_FAILURE;
+	if (!test_version())
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
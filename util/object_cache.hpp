@@ -23,6 +23,8 @@
 #pragma once
 
 #include <unordered_map>
+#include <mutex>
+#include <atomic>
 #include "fossilize_types.hpp"
 #include "object_pool.hpp"
 #include "intrusive_list.hpp"
@@ -133,4 +135,196 @@ private:
 	std::unordered_map<Hash, CacheEntry *> hash_to_objects;
 	IntrusiveList<CacheEntry> lru_cache;
 };
+
+// Same interface as ObjectCache, but safe to use from any number of threads.
+// Objects are spread over NumShards independently locked LRU lists, so threads only contend
+// when they touch the same shard. Every access is stamped from a global clock, which lets
+// prune_cache() evict in global LRU order by always picking the shard with the oldest tail.
+// The byte budget is only enforced in prune_cache(), so the cache may overshoot between prunes.
+template <typename T, unsigned NumShards = 16>
+class ConcurrentObjectCache
+{
+public:
+	static_assert((NumShards & (NumShards - 1)) == 0, "NumShards must be a power of two.");
+
+	ConcurrentObjectCache()
+	{
+		total_size.store(0);
+		object_count.store(0);
+		clock.store(0);
+	}
+
+	ConcurrentObjectCache(const ConcurrentObjectCache &) = delete;
+	void operator=(const ConcurrentObjectCache &) = delete;
+
+	~ConcurrentObjectCache()
+	{
+		for (auto &shard : shards)
+		{
+			(void)shard;
+			assert(shard.lru_cache.empty());
+		}
+	}
+
+	void set_target_size(size_t size)
+	{
+		target_size = size;
+	}
+
+	std::pair<T, bool> find_object(Hash hash)
+	{
+		auto &shard = get_shard(hash);
+		std::lock_guard<std::mutex> holder{shard.lock};
+
+		auto itr = shard.hash_to_objects.find(hash);
+		if (itr == std::end(shard.hash_to_objects))
+			return { static_cast<T>(0), false };
+
+		itr->second->timestamp = clock.fetch_add(1, std::memory_order_relaxed);
+		shard.lru_cache.move_to_front(shard.lru_cache, itr->second);
+		return { itr->second->object, true };
+	}
+
+	// All shards are locked while pruning, so the deleter must not call back into the cache.
+	template <typename Deleter>
+	void prune_cache(const Deleter &deleter)
+	{
+		lock_all_shards();
+
+		while (total_size.load(std::memory_order_relaxed) > target_size)
+		{
+			Shard *oldest_shard = nullptr;
+			uint64_t oldest_timestamp = 0;
+			for (auto &shard : shards)
+			{
+				if (shard.lru_cache.empty())
+					continue;
+
+				uint64_t timestamp = shard.lru_cache.rbegin()->timestamp;
+				if (!oldest_shard || timestamp < oldest_timestamp)
+				{
+					oldest_shard = &shard;
+					oldest_timestamp = timestamp;
+				}
+			}
+
+			assert(oldest_shard);
+			auto last_used_entry = oldest_shard->lru_cache.rbegin();
+			assert(last_used_entry->size <= total_size.load(std::memory_order_relaxed));
+			total_size.fetch_sub(last_used_entry->size, std::memory_order_relaxed);
+			object_count.fetch_sub(1, std::memory_order_relaxed);
+			oldest_shard->lru_cache.erase(last_used_entry);
+
+			deleter(last_used_entry->hash, last_used_entry->object);
+			oldest_shard->hash_to_objects.erase(last_used_entry->hash);
+			pool.free(last_used_entry.get());
+		}
+
+		unlock_all_shards();
+	}
+
+	template <typename Deleter>
+	void delete_cache(const Deleter &deleter)
+	{
+		lock_all_shards();
+
+		for (auto &shard : shards)
+		{
+			auto itr = shard.lru_cache.begin();
+			while (itr != std::end(shard.lru_cache))
+			{
+				auto entry = itr;
+				itr = shard.lru_cache.erase(entry);
+				deleter(entry->hash, entry->object);
+				assert(entry->size <= total_size.load(std::memory_order_relaxed));
+				total_size.fetch_sub(entry->size, std::memory_order_relaxed);
+				object_count.fetch_sub(1, std::memory_order_relaxed);
+				pool.free(entry.get());
+			}
+
+			shard.lru_cache.clear();
+			shard.hash_to_objects.clear();
+		}
+
+		assert(total_size.load(std::memory_order_relaxed) == 0);
+		unlock_all_shards();
+		pool.trim();
+	}
+
+	void insert_object(Hash hash, T object, size_t object_size)
+	{
+		auto &shard = get_shard(hash);
+
+		{
+			std::lock_guard<std::mutex> holder{shard.lock};
+			auto *entry = pool.allocate();
+			entry->hash = hash;
+			entry->object = object;
+			entry->size = object_size;
+			entry->timestamp = clock.fetch_add(1, std::memory_order_relaxed);
+			shard.lru_cache.insert_front(entry);
+			auto map_itr = shard.hash_to_objects.insert({ hash, entry });
+			(void)map_itr;
+			assert(map_itr.second);
+		}
+
+		total_size.fetch_add(object_size, std::memory_order_relaxed);
+		object_count.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	size_t get_current_total_size() const
+	{
+		return total_size.load(std::memory_order_relaxed);
+	}
+
+	size_t get_current_object_count() const
+	{
+		return object_count.load(std::memory_order_relaxed);
+	}
+
+private:
+	size_t target_size = 0;
+	std::atomic<size_t> total_size;
+	std::atomic<size_t> object_count;
+	std::atomic<uint64_t> clock;
+
+	struct CacheEntry : IntrusiveListEnabled<CacheEntry>
+	{
+		T object = static_cast<T>(0);
+		Hash hash = 0;
+		size_t size = 0;
+		uint64_t timestamp = 0;
+	};
+
+	// Shared by all shards, entries are allocated and freed from whichever thread touches them.
+	ConcurrentObjectPool<CacheEntry> pool;
+
+	struct Shard
+	{
+		std::mutex lock;
+		std::unordered_map<Hash, CacheEntry *> hash_to_objects;
+		IntrusiveList<CacheEntry> lru_cache;
+	};
+
+	Shard shards[NumShards];
+
+	Shard &get_shard(Hash hash)
+	{
+		// Hashes are well distributed, but tests and tools like to use small sequential keys.
+		return shards[((hash * 0x9e3779b97f4a7c15ull) >> 32) & (NumShards - 1)];
+	}
+
+	// Always in the same order, so concurrent prunes cannot deadlock.
+	void lock_all_shards()
+	{
+		for (auto &shard : shards)
+			shard.lock.lock();
+	}
+
+	void unlock_all_shards()
+	{
+		for (auto &shard : shards)
+			shard.lock.unlock();
+	}
+};
 }
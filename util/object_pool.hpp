@@ -26,7 +26,19 @@
 #include <mutex>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <unordered_set>
+#include <type_traits>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include "intrusive_list.hpp"
+
+#ifdef _WIN32
+#include <malloc.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#endif
 
 namespace Fossilize
 {
@@ -81,4 +93,311 @@ protected:
 
 	std::vector<std::unique_ptr<T, MallocDeleter>> memory;
 };
+
+// Thread-safe pool for objects which are allocated and freed from many threads.
+// Memory is carved out of fixed size, size aligned slabs, so the owning slab of any object is found by masking its address.
+// Each thread allocates from and frees into one of NumMagazines small caches, and only touches the shared slabs
+// under the pool lock when its magazine runs empty or full. Slabs track how many of their objects are handed out,
+// and a slab which becomes completely free is released, except for one which is kept around to avoid thrashing.
+template<typename T>
+class ConcurrentObjectPool
+{
+public:
+	enum
+	{
+		SlabSize = 64 * 1024,
+		HugeSlabSize = 2 * 1024 * 1024,
+		MagazineSize = 32,
+		NumMagazines = 16,
+		MaxCachedEmptySlabs = 1
+	};
+
+	// With use_hugepages, slabs are 2 MiB and transparent hugepages are requested for them where supported.
+	explicit ConcurrentObjectPool(bool use_hugepages_ = false)
+		: use_hugepages(use_hugepages_), slab_size(use_hugepages_ ? HugeSlabSize : SlabSize)
+	{
+	}
+
+	ConcurrentObjectPool(const ConcurrentObjectPool &) = delete;
+	void operator=(const ConcurrentObjectPool &) = delete;
+
+	~ConcurrentObjectPool()
+	{
+		clear();
+	}
+
+	template<typename... P>
+	T *allocate(P &&... p)
+	{
+		auto &magazine = get_magazine();
+		void *ptr;
+
+		{
+			std::lock_guard<std::mutex> holder{magazine.lock};
+			if (magazine.count == 0)
+				magazine.count = refill(magazine.objects, MagazineSize / 2);
+			if (magazine.count == 0)
+				return nullptr;
+			ptr = magazine.objects[--magazine.count];
+		}
+
+		return new(ptr) T(std::forward<P>(p)...);
+	}
+
+	void free(T *ptr)
+	{
+		ptr->~T();
+		auto &magazine = get_magazine();
+		std::lock_guard<std::mutex> holder{magazine.lock};
+
+		if (magazine.count == MagazineSize)
+		{
+			// Hand the oldest half back to the slabs, so the rest stays hot in this thread.
+			release(magazine.objects, MagazineSize / 2);
+			memmove(magazine.objects, magazine.objects + MagazineSize / 2, (MagazineSize / 2) * sizeof(void *));
+			magazine.count -= MagazineSize / 2;
+		}
+
+		magazine.objects[magazine.count++] = ptr;
+	}
+
+	// Returns all objects cached in magazines to their slabs, and releases every slab which ends up empty.
+	void trim()
+	{
+		for (auto &magazine : magazines)
+		{
+			std::lock_guard<std::mutex> holder{magazine.lock};
+			release(magazine.objects, magazine.count);
+			magazine.count = 0;
+		}
+
+		std::lock_guard<std::mutex> holder{lock};
+		auto itr = partial_slabs.begin();
+		while (itr != partial_slabs.end())
+		{
+			auto slab = itr;
+			++itr;
+			if (slab->live_count == 0)
+			{
+				partial_slabs.erase(slab);
+				free_slab(slab.get());
+			}
+		}
+		cached_empty_slabs = 0;
+	}
+
+	// Like ObjectPool::clear(), releases all memory without running destructors.
+	void clear()
+	{
+		for (auto &magazine : magazines)
+		{
+			std::lock_guard<std::mutex> holder{magazine.lock};
+			magazine.count = 0;
+		}
+
+		std::lock_guard<std::mutex> holder{lock};
+		for (auto *slab : slabs)
+			free_aligned(slab);
+		slabs.clear();
+		partial_slabs.clear();
+		cached_empty_slabs = 0;
+	}
+
+	size_t get_slab_count() const
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		return slabs.size();
+	}
+
+	size_t get_reserved_size() const
+	{
+		return get_slab_count() * slab_size;
+	}
+
+private:
+	typedef typename std::aligned_storage<
+			sizeof(T) < sizeof(void *) ? sizeof(void *) : sizeof(T),
+			std::alignment_of<T>::value < std::alignment_of<void *>::value ?
+			std::alignment_of<void *>::value : std::alignment_of<T>::value>::type Slot;
+
+	struct Slab : IntrusiveListEnabled<Slab>
+	{
+		void *free_list = nullptr;
+		Slot *slots = nullptr;
+		// Slots past this index have never been handed out, so fresh slabs are not touched up front.
+		unsigned bump_index = 0;
+		unsigned capacity = 0;
+		// Objects handed out to magazines or callers.
+		unsigned live_count = 0;
+
+		bool has_free() const
+		{
+			return free_list || bump_index < capacity;
+		}
+
+		void *pop()
+		{
+			live_count++;
+			if (free_list)
+			{
+				void *ptr = free_list;
+				memcpy(&free_list, ptr, sizeof(void *));
+				return ptr;
+			}
+			else
+				return &slots[bump_index++];
+		}
+
+		void push(void *ptr)
+		{
+			live_count--;
+			memcpy(ptr, &free_list, sizeof(void *));
+			free_list = ptr;
+		}
+	};
+
+	// The slab header and at least one object must fit in a slab, or capacity would underflow.
+	static_assert(((sizeof(Slab) + sizeof(Slot) - 1) / sizeof(Slot) + 1) * sizeof(Slot) <= SlabSize,
+	              "Object type is too large for ConcurrentObjectPool.");
+
+	struct Magazine
+	{
+		std::mutex lock;
+		void *objects[MagazineSize];
+		unsigned count = 0;
+	};
+
+	bool use_hugepages;
+	size_t slab_size;
+
+	Magazine magazines[NumMagazines];
+
+	mutable std::mutex lock;
+	std::unordered_set<Slab *> slabs;
+	// Slabs with at least one free slot.
+	IntrusiveList<Slab> partial_slabs;
+	unsigned cached_empty_slabs = 0;
+
+	static unsigned get_thread_ordinal()
+	{
+		static std::atomic<unsigned> counter{0};
+		static thread_local unsigned ordinal = counter.fetch_add(1, std::memory_order_relaxed);
+		return ordinal;
+	}
+
+	Magazine &get_magazine()
+	{
+		return magazines[get_thread_ordinal() % NumMagazines];
+	}
+
+	Slab *get_slab(void *ptr) const
+	{
+		return reinterpret_cast<Slab *>(reinterpret_cast<uintptr_t>(ptr) & ~uintptr_t(slab_size - 1));
+	}
+
+	static void *allocate_aligned(size_t size)
+	{
+#ifdef _WIN32
+		return _aligned_malloc(size, size);
+#else
+		void *ptr = nullptr;
+		if (posix_memalign(&ptr, size, size) != 0)
+			return nullptr;
+		return ptr;
+#endif
+	}
+
+	static void free_aligned(void *ptr)
+	{
+#ifdef _WIN32
+		_aligned_free(ptr);
+#else
+		::free(ptr);
+#endif
+	}
+
+	Slab *allocate_slab()
+	{
+		void *memory = allocate_aligned(slab_size);
+		if (!memory)
+			return nullptr;
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+		if (use_hugepages)
+			madvise(memory, slab_size, MADV_HUGEPAGE);
+#endif
+
+		auto *slab = new(memory) Slab;
+		size_t header_size = (sizeof(Slab) + sizeof(Slot) - 1) / sizeof(Slot);
+		slab->slots = static_cast<Slot *>(memory) + header_size;
+		slab->capacity = unsigned(slab_size / sizeof(Slot) - header_size);
+		slabs.insert(slab);
+		return slab;
+	}
+
+	void free_slab(Slab *slab)
+	{
+		slabs.erase(slab);
+		slab->~Slab();
+		free_aligned(slab);
+	}
+
+	unsigned refill(void **objects, unsigned count)
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		unsigned filled = 0;
+
+		while (filled < count)
+		{
+			Slab *slab;
+			if (partial_slabs.empty())
+			{
+				slab = allocate_slab();
+				if (!slab)
+					break;
+				partial_slabs.insert_front(slab);
+			}
+			else
+				slab = partial_slabs.begin().get();
+
+			if (slab->live_count == 0 && slab->bump_index != 0)
+				cached_empty_slabs--;
+
+			while (filled < count && slab->has_free())
+				objects[filled++] = slab->pop();
+
+			if (!slab->has_free())
+				partial_slabs.erase(slab);
+		}
+
+		return filled;
+	}
+
+	void release(void **objects, unsigned count)
+	{
+		std::lock_guard<std::mutex> holder{lock};
+
+		for (unsigned i = 0; i < count; i++)
+		{
+			auto *slab = get_slab(objects[i]);
+			bool was_full = !slab->has_free();
+			slab->push(objects[i]);
+			if (was_full)
+				partial_slabs.insert_front(slab);
+
+			if (slab->live_count == 0)
+			{
+				if (cached_empty_slabs < MaxCachedEmptySlabs)
+				{
+					cached_empty_slabs++;
+				}
+				else
+				{
+					partial_slabs.erase(slab);
+					free_slab(slab);
+				}
+			}
+		}
+	}
+};
 }